@@ -0,0 +1,19 @@
+
+#pragma once
+
+#include <string>
+#include <string_view>
+
+
+// JSON output shared by the text/HTML session layer and the binary session tools: neither needs the other's
+// headers for it.
+
+namespace diagnostics {
+
+	// The viewer pages load their data (search index, image sequences) from script sidecars with a `<script>`
+	// tag, which works from `file://` URLs, and the columnar export describes its columns in `schema.json`:
+	// these append a JSON string literal, which never holds "</script>", and the base64 of binary data.
+	void append_json_string(std::string &out, std::string_view s);
+	void append_base64(std::string &out, std::string_view data);
+
+}
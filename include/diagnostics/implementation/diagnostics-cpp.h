@@ -8,14 +8,1937 @@
 #include <spdlog/spdlog.h>
 #include <fmt/format.h>
 
+#include <array>
+#include <atomic>
+#include <algorithm>
+#include <bit>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstdint>
+#include <cstddef>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <initializer_list>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <span>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#if __has_include(<mdspan>)
+#include <mdspan>
+#endif
+
 
 #include <diagnostics/implementation/diagnostics-common.h>
+#include <diagnostics/implementation/core-json.h>
+#include <diagnostics/logging.h>
+
+#if defined(HAVE_SQLITE)
+// the handles of sqlite3.h, which the users of this header need not include.
+struct sqlite3;
+struct sqlite3_stmt;
+#endif
 
 
 namespace diagnostics {
 
+	// A fixed-size pool of background threads with a bounded job queue. `submit()` blocks while the queue is
+	// full, which puts back-pressure on the producer instead of having the backlog eat all memory.
+	class worker_pool {
+	public:
+		// `thread_count` 0: use all available cores.
+		explicit worker_pool(unsigned int thread_count = 0, size_t max_queue_depth = 64);
+		// Finishes all pending jobs before returning.
+		~worker_pool();
+
+		worker_pool(const worker_pool &) = delete;
+		worker_pool &operator=(const worker_pool &) = delete;
+
+		void submit(std::function<void()> job);
+		// Blocks until the queue is empty and all workers are idle.
+		void wait_idle();
+
+		unsigned int thread_count() const {
+			return static_cast<unsigned int>(threads_.size());
+		}
+		size_t max_queue_depth() const {
+			return max_queue_depth_;
+		}
+
+	private:
+		void run();
+
+		std::vector<std::thread> threads_;
+		std::deque<std::function<void()>> queue_;
+		size_t max_queue_depth_;
+		size_t busy_ = 0;
+		bool stopping_ = false;
+		std::mutex mutex_;
+		std::condition_variable job_available_;
+		std::condition_variable slot_available_;
+		std::condition_variable idle_;
+	};
+
+
+	namespace driver {
+
+		namespace image {
+
+			// A view of 8-bit-per-channel pixel data: 1 (gray), 2 (gray + alpha), 3 (RGB) or 4 (RGBA) channels.
+			// This is the common currency between the image drivers and the shared encoding / thumbnailing code.
+			struct raster {
+				const uint8_t *data = nullptr;
+				int width = 0;
+				int height = 0;
+				int channels = 0;
+				size_t stride = 0;          // bytes per row
+
+				bool empty() const {
+					return data == nullptr || width <= 0 || height <= 0;
+				}
+				const uint8_t *row(int y) const {
+					return data + y * stride;
+				}
+			};
+
+			// A raster which owns its pixels.
+			struct raster_buffer {
+				std::vector<uint8_t> pixels;
+				int width = 0;
+				int height = 0;
+				int channels = 0;
+
+				raster_buffer() = default;
+				raster_buffer(int w, int h, int c) :
+					pixels(size_t(w) * h * c), width(w), height(h), channels(c) {
+				}
+
+				raster view() const {
+					return {pixels.data(), width, height, channels, size_t(width) * channels};
+				}
+				uint8_t *row(int y) {
+					return pixels.data() + size_t(y) * width * channels;
+				}
+			};
+
+			// An image which is delivered one row at a time, top to bottom, in the same 8-bit format as a raster:
+			// `row(y)` returns row `y`, which stays valid until the next call. This lets the encoders consume
+			// pixels which are converted on the fly (see `pix_row_converter`) instead of a converted copy of the
+			// whole image. A raster converts implicitly.
+			struct scanline_source {
+				int width = 0;
+				int height = 0;
+				int channels = 0;
+				std::function<const uint8_t *(int y)> row;
+
+				scanline_source() = default;
+				scanline_source(int w, int h, int c, std::function<const uint8_t *(int y)> rows) :
+					width(w), height(h), channels(c), row(std::move(rows)) {
+				}
+				scanline_source(const raster &img) :
+					width(img.width), height(img.height), channels(img.channels) {
+					if (!img.empty())
+						row = [img](int y) {
+							return img.row(y);
+						};
+				}
+
+				bool empty() const {
+					return !row || width <= 0 || height <= 0;
+				}
+			};
+
+			// Encodes the image as PNG. `compression_level` is the zlib level: we default to favoring speed over size.
+			bool encode_png(const scanline_source &img, std::vector<uint8_t> &out, int compression_level = 1);
+			bool write_png(const std::string &path, const scanline_source &img, int compression_level = 1);
+
+			// Bilevel (1 bpp) images: binarized pages and masks are written as 1-bit grayscale PNG, 8 pixels per
+			// byte, which is both far smaller and far cheaper to compress than the 8-bit expansion. Each row is
+			// filtered with None or Up, whichever leaves fewer byte-value changes for deflate to encode. Large
+			// images are cut into strips of rows which are deflated in parallel and joined into one zlib stream.
+
+			// Produces row `y` of a bilevel image: `(width + 7) / 8` bytes, MSB-first, 1 = white (the PNG
+			// convention). Called from several threads at once, for different rows.
+			using bilevel_row_function = std::function<void(int y, uint8_t *out)>;
+
+			struct bilevel_encode_stats {
+				uint64_t input_bytes = 0;               // packed pixel data
+				uint64_t output_bytes = 0;
+				unsigned int strips = 0;
+				double seconds = 0;
+
+				double megabytes_per_second() const {
+					return seconds > 0 ? input_bytes / seconds / 1e6 : 0;
+				}
+			};
+
+			// `threads`: the most strips to cut the image into; 0: one per core. Images of less than 512 rows are a
+			// single strip. The strips are deflated by the calling thread together with a pool of workers which is
+			// shared by all callers: no threads are started per image, and calling from a pool worker is fine, as
+			// the caller deflates whatever strips no worker has taken yet.
+			bool encode_bilevel_png(int width, int height, const bilevel_row_function &rows, std::vector<uint8_t> &out, bilevel_encode_stats *stats = nullptr, unsigned int threads = 0, int compression_level = 1);
+			bool write_bilevel_png(const std::string &path, int width, int height, const bilevel_row_function &rows, bilevel_encode_stats *stats = nullptr, unsigned int threads = 0, int compression_level = 1);
+
+			// Row functions for an 8-bit mask, where nonzero pixels are white. The pixel data must outlive the
+			// row function.
+			bilevel_row_function mask_bilevel_rows(const uint8_t *data, size_t stride, int width);
+			// True when all pixels of the 8-bit image are either 0 or 255, i.e. it is a mask.
+			bool is_bilevel_mask(const uint8_t *data, size_t stride, int width, int height);
+
+			// Caller-owned pixels of any of the sample types the OpenImageIO and libvips drivers write, in a layout
+			// described by strides, so regions and single channels of larger images need no copy.
+			enum class pixel_type {
+				uint8,
+				uint16,
+				half,
+				float32,
+			};
+
+			struct strided_image {
+				const void *data = nullptr;
+				int width = 0;
+				int height = 0;
+				int channels = 0;
+				pixel_type type = pixel_type::float32;
+				ptrdiff_t x_stride = 0;                 // bytes from one pixel to the next; 0: `channels` values
+				ptrdiff_t y_stride = 0;                 // bytes from one row to the next; 0: `width` pixels
+			};
+
+			// Image deduplication
+			// -------------------
+			//
+			// Iterative stages dump the same unchanged mask or page again and again. The image drivers hash the raw
+			// pixels on the caller's thread, before anything is snapshot or encoded, and an image which was logged
+			// before in the cycle is not encoded again: the HTML and text output link to the file written the first
+			// time. The hash runs at memory speed: an XXH3-style accumulation of 64-byte stripes, in SSE2, or AVX2
+			// when the CPU has it, fed row by row, so padded and strided rows need no copy. The image geometry and
+			// pixel format are hashed as well, so equal bytes in another layout are a different image.
+
+			struct content_hash {
+				uint64_t lo = 0;
+				uint64_t hi = 0;
+
+				// no hash: not deduplicated
+				bool empty() const {
+					return lo == 0 && hi == 0;
+				}
+				bool operator==(const content_hash &other) const = default;
+			};
+
+			// The loops which take the data in: they give the same hashes. `best` is the fastest the CPU has; the
+			// others are for tests, and fall back to `best` where they are not available.
+			enum class content_hash_path {
+				best,
+				avx2,
+				sse2,
+				portable,
+			};
+			bool content_hash_path_available(content_hash_path path);
+
+			// A 128-bit hash of the bytes passed to `update()`, in pieces of any size. Not cryptographic.
+			class content_hasher {
+			public:
+				using accumulate_function = void (*)(uint64_t *acc, const uint8_t *data, size_t stripes);
+
+				explicit content_hasher(content_hash_path path = content_hash_path::best);
+
+				void update(const void *data, size_t size);
+				// Never empty.
+				content_hash finish() const;
+
+			private:
+				void consume(const uint8_t *data, size_t stripes);
+
+				alignas(32) uint64_t acc_[8];
+				accumulate_function accumulate_;
+				uint8_t buffer_[64];
+				size_t buffered_ = 0;
+				uint64_t total_ = 0;
+				size_t stripes_ = 0;                    // since the last scrambling of the accumulators
+			};
+
+			// Hashes `height` rows of `row_bytes`, `stride` bytes apart, after the values describing the image
+			// format (its dimensions, pixel type, ...).
+			content_hash hash_image_rows(const void *data, size_t row_bytes, int height, ptrdiff_t stride, std::initializer_list<uint64_t> format);
+			// Empty for pixels which are not adjacent, like a single channel of an interleaved image.
+			content_hash hash_strided_image(const strided_image &img);
+
+			// Images which are not 8-bit (depth maps, float debugging images, ...) are scaled to 0..255 for display,
+			// using the range of their finite values.
+			struct value_range {
+				double min = 0;
+				double max = 0;
+				size_t count = 0;                       // finite values seen; the range is only valid when nonzero
+
+				void merge(const value_range &other);
+			};
+
+			// The range of the finite values: NaN and infinities are skipped.
+			value_range find_value_range(const float *data, size_t n);
+			value_range find_value_range(const uint16_t *data, size_t n);
+			value_range find_value_range(const uint8_t *data, size_t n);
+			value_range find_value_range(const int16_t *data, size_t n);
+			value_range find_value_range(const int32_t *data, size_t n);
+			value_range find_value_range(const double *data, size_t n);
+			// Computes the `offset` and `scale` for `scale_to_8bit()` which map `range` onto 0..255. A constant
+			// image comes out black, or white when its value is positive (like a mask). The 8- and 16-bit and float
+			// values take the float version; the wider types need the double one.
+			void scale_for_range(const value_range &range, float &offset, float &scale);
+			void scale_for_range(const value_range &range, double &offset, double &scale);
+			// dst[i] = (src[i] - offset) * scale, rounded and clamped to 0..255. NaN becomes 0, +inf 255.
+			void scale_to_8bit(const float *src, size_t n, uint8_t *dst, float offset, float scale);
+			void scale_to_8bit(const uint16_t *src, size_t n, uint8_t *dst, float offset, float scale);
+			void scale_to_8bit(const uint8_t *src, size_t n, uint8_t *dst, float offset, float scale);
+			void scale_to_8bit(const int16_t *src, size_t n, uint8_t *dst, float offset, float scale);
+			// These subtract the offset in double: float would lose the low bits of large values.
+			void scale_to_8bit(const int32_t *src, size_t n, uint8_t *dst, double offset, double scale);
+			void scale_to_8bit(const double *src, size_t n, uint8_t *dst, double offset, double scale);
+			// histogram[b] += the number of bytes with value b.
+			void byte_histogram(const uint8_t *data, size_t n, uint64_t (&histogram)[256]);
+
+			// Computes the dimensions of a thumbnail which fits in a `max_size` x `max_size` box.
+			void thumbnail_dimensions(int width, int height, int max_size, int &thumb_width, int &thumb_height);
+			// Shrinks `src` into a thumbnail which fits in a `max_size` x `max_size` box, using a box filter. When
+			// `src.row(y)` returns null, as sources which fail to read their pixels do, there is no thumbnail: the
+			// result is empty.
+			raster_buffer make_thumbnail(const scanline_source &src, int max_size);
+
+			struct stored_image {
+				std::string url;                // relative to the HTML output
+				std::string thumbnail_url;
+				int width = 0;
+				int height = 0;
+				int thumbnail_width = 0;
+				int thumbnail_height = 0;
+				std::string viewer_url;         // the tile pyramid in the deep-zoom viewer; empty when there is none
+			};
+
+			// Writes the full-resolution image to `path`, then passes an 8-bit view of the image to `make_thumbnail`,
+			// while its pixel data is still alive. Runs on a worker thread.
+			using encode_function = std::function<bool(const std::string &path, const std::function<void(const scanline_source &)> &make_thumbnail)>;
+
+			// Deep-zoom tile pyramids
+			// -----------------------
+			//
+			// Page-size images are slow to open in a browser, and cannot be inspected at the pixel level from a
+			// thumbnail. An image driver which is asked for a tile pyramid writes one next to the image file, in
+			// the Deep Zoom layout (`vips_dzsave()`): `<base>_files/<level>/<column>_<row>.png`, where `<base>` is
+			// the image path without its extension, level 0 is a single pixel and each next level doubles the
+			// size, up to the full resolution. The HTML output links the thumbnail to `tile-viewer.html` in the
+			// image directory, which only loads the tiles in view.
+
+			std::string tile_pyramid_base(const std::string &image_path);
+			bool write_tile_viewer(const std::string &path);
+
+			// Hands out file names for image dumps and writes them, plus a thumbnail of each, on a worker pool. The
+			// names are known up front, so the HTML output referencing them can be produced immediately.
+			class image_store {
+			public:
+				// Images are stored in `directory`, which is referenced as `url_prefix` from the HTML output.
+				image_store(worker_pool &pool, const std::string &directory, const std::string &url_prefix, int thumbnail_size = 256);
+
+				// `extension` is the file type produced by `encode`, e.g. "png". With `tile_pyramid`, `encode` also
+				// writes a tile pyramid with `tile_size` pixel tiles (see `tile_pyramid_base()`).
+				stored_image submit(std::string_view name, std::string_view extension, int width, int height, encode_function encode, bool tile_pyramid = false, int tile_size = 256);
+				// Stores an 8-bit raster as PNG.
+				stored_image submit(std::string_view name, std::shared_ptr<const raster_buffer> img);
+				// Only hands out the names, for an image which is written by someone else, at some later time (see
+				// `render_pix_pack()`). The file names are relative to `directory()`.
+				stored_image reserve(std::string_view name, std::string_view extension, int width, int height, std::string &file_name, std::string &thumbnail_file_name);
+				// Hands out the name of a file without a thumbnail, like a data file; returns its path, and its
+				// reference from the HTML output in `url`.
+				std::string reserve_file(std::string_view name, std::string_view extension, std::string &url);
+				// Brackets the write of a reserved file on the caller's thread: `wait_idle()` waits for it as well.
+				void begin_write();
+				void end_write();
+				// Runs `job` on the image pool; `wait_idle()` waits for it as well.
+				void submit_job(std::function<void()> job);
+				// Writes an image under the names which `reserve()` handed out, like `submit()`.
+				void submit_reserved(const std::string &file_name, const std::string &thumbnail_file_name, encode_function encode);
+				// Hands out the names of an image sequence file (see `sequence_writer`) and of the thumbnail of its
+				// first frame, and returns their paths; the `url` of the result opens the sequence viewer.
+				stored_image reserve_sequence(std::string_view name, int width, int height, std::string &path, std::string &thumbnail_path);
+
+				// Deduplication (see `content_hash`): the image stored under `hash`, if any.
+				bool find(const content_hash &hash, stored_image &img);
+				void remember(const content_hash &hash, const stored_image &img);
+
+				const std::string &directory() const {
+					return directory_;
+				}
+
+				uint64_t written() const {
+					return written_;
+				}
+				uint64_t failed() const {
+					return failed_;
+				}
+				// Blocks until all images submitted so far have been written.
+				void wait_idle();
+
+			private:
+				std::string file_name(std::string_view name, std::string_view suffix, std::string_view extension, uint64_t seq) const;
+				void job_done();
+
+				struct hash_key {
+					size_t operator()(const content_hash &hash) const {
+						return size_t(hash.lo);
+					}
+				};
+
+				worker_pool &pool_;
+				std::string directory_;
+				std::string url_prefix_;
+				int thumbnail_size_;
+				bool viewer_written_ = false;
+				bool sequence_viewer_written_ = false;
+				std::atomic<uint64_t> sequence_{0};
+				std::atomic<uint64_t> written_{0};
+				std::atomic<uint64_t> failed_{0};
+				size_t pending_ = 0;
+				std::unordered_map<content_hash, stored_image, hash_key> stored_;
+				std::mutex mutex_;
+				std::condition_variable idle_;
+			};
+
+
+			// Raw PIX capture
+			// ---------------
+			//
+			// Even a fast PNG encoder needs milliseconds for a page-size image, while most image dumps are never
+			// looked at. In capture mode, the raw raster of a (leptonica) PIX is appended to a *pack file* instead,
+			// behind a small header, which costs no more than a sequential write. The images are encoded later, by
+			// `render_pix_pack()`, under the file names which were handed out (and referenced by the HTML output)
+			// at capture time.
+			//
+			// Nothing here depends on leptonica: `pix_raster` describes the PIX memory layout, so the pack files
+			// can be rendered by tools which are not linked against leptonica.
+
+			struct pix_raster {
+				int width = 0;
+				int height = 0;
+				int depth = 0;                          // bits per pixel: 1, 2, 4, 8, 16, 24 or 32
+				int wpl = 0;                            // 32-bit words per line
+				int spp = 3;                            // samples per pixel at 32 bpp: 3 (RGB) or 4 (RGBA)
+				// Each line is `wpl` 32-bit words, in native byte order, with the pixels packed MSB-first into
+				// the words (leptonica's layout). 32 bpp pixels are 0xRRGGBBAA words.
+				const uint32_t *data = nullptr;
+				const uint32_t *colormap = nullptr;     // `colormap_size` 0xRRGGBBAA entries, if any
+				int colormap_size = 0;
+			};
+
+			// Converts the rows of a PIX raster to 8-bit gray (1..16 bpp, no colormap), RGB or RGBA scanlines, one
+			// at a time, ready for an encoder: there is no converted copy of the whole image. Without a colormap,
+			// 1 bpp images are rendered as black (1) on white (0), like leptonica does.
+			//
+			// The kernels (byte swapping the words, unpacking 1/2/4 bpp pixels, reducing 16 bpp to 8, colormap
+			// expansion) use SSSE3 when the CPU supports it. Each thread needs its own converter.
+			class pix_row_converter {
+			public:
+				explicit pix_row_converter(const pix_raster &pix);
+
+				// false for an unsupported depth or a raster without pixel data.
+				bool valid() const {
+					return channels_ > 0;
+				}
+				// 1 (gray), 3 (RGB) or 4 (RGBA)
+				int channels() const {
+					return channels_;
+				}
+
+				// Converts row `y` into `out`, which has room for `width * channels()` bytes.
+				void convert(int y, uint8_t *out);
+				// Converts row `y` into an internal buffer, which stays valid until the next call.
+				const uint8_t *row(int y);
+				// The converted image, for the encoders; references this converter.
+				scanline_source scanlines();
+
+			private:
+				pix_raster pix_;
+				int channels_ = 0;
+				std::vector<uint8_t> row_;
+				std::vector<uint8_t> indices_;          // colormap indices of the current row
+				uint8_t palette_[256][4] = {};          // R, G, B, padding
+			};
+
+			// Converts the whole raster, see `pix_row_converter`.
+			raster_buffer pix_raster_to_8bit(const pix_raster &pix);
+
+			// True for a 1 bpp raster without colormap, which `write_bilevel_png()` can take as-is.
+			bool is_bilevel_pix(const pix_raster &pix);
+			// Row function for a 1 bpp raster (1 = black, like leptonica). The raster must outlive the row function.
+			bilevel_row_function pix_bilevel_rows(const pix_raster &pix);
+			// See `content_hash`: the raster words, plus the colormap.
+			content_hash hash_pix_raster(const pix_raster &pix);
+
+			// Appends raw PIX rasters to a pack file: `<pack>` = "LDIAGPIX" signature, then one entry per image:
+			// a 64-byte header, the image and thumbnail file names, the colormap and the raster words.
+			class pix_pack_writer {
+			public:
+				pix_pack_writer() = default;
+				~pix_pack_writer();
+
+				pix_pack_writer(const pix_pack_writer &) = delete;
+				pix_pack_writer &operator=(const pix_pack_writer &) = delete;
+
+				bool open(const std::string &path);
+				bool close();
+
+				// `file_name` and `thumbnail_file_name` are where `render_pix_pack()` will put the PNG files,
+				// relative to the directory of the pack file.
+				bool append(const pix_raster &pix, std::string_view file_name, std::string_view thumbnail_file_name);
+
+				bool is_open() const {
+					return fp_ != nullptr;
+				}
+				uint64_t size() const {
+					return size_;
+				}
+
+			private:
+				FILE *fp_ = nullptr;
+				std::string path_;
+				uint64_t sequence_ = 0;
+				uint64_t size_ = 0;
+			};
+
+			struct pix_pack_render_stats {
+				uint64_t rendered = 0;
+				uint64_t failed = 0;
+				bool truncated = false;                 // the pack ended in a partial entry (e.g. after a crash)
+			};
+
+			// Encodes all images in the pack file as PNG, plus their thumbnails, next to the pack file.
+			// `threads` 0: use all available cores.
+			pix_pack_render_stats render_pix_pack(const std::string &pack_path, int thumbnail_size = 256, unsigned int threads = 0);
+
+			// Vector overlays
+			// ---------------
+			//
+			// Page layout debugging, tesseract's ScrollView style, means drawing boxes, baselines and blob outlines
+			// over the page at every stage: rasterized, that is another page-size image per stage, each one nearly
+			// identical to the last. An `overlay` records the primitives instead, in page pixel coordinates (origin
+			// top left), and is written as an SVG file of a few kilobytes; the HTML output draws it over the page
+			// image logged with `session::log_overlay_background()`, which all overlays of the page share. The SVG
+			// file, opened on its own, shows the overlay over the full-resolution page.
+			//
+			// The primitives of a pen go into a single SVG path, with strokes which do not scale, so the lines stay
+			// visible in the thumbnails.
+			class overlay {
+			public:
+				// Sets the color (CSS, e.g. "red" or "#0a0") and line width, in screen pixels, of the primitives
+				// which follow; like ScrollView's `Pen()`.
+				overlay &pen(std::string_view color, float width = 1);
+				overlay &box(float left, float top, float right, float bottom);
+				overlay &line(float x1, float y1, float x2, float y2);
+				// `xy` holds the x, y pairs of the points.
+				overlay &polyline(std::span<const float> xy, bool closed = false);
+				// Puts `text` with its baseline at `x`, `y`; `height` in page pixels.
+				overlay &text(float x, float y, std::string_view text, float height = 12);
+
+				bool empty() const {
+					return items_.empty();
+				}
+				size_t size() const {
+					return items_.size();
+				}
+				// The extent of all primitives: the SVG size when there's no background.
+				float right() const {
+					return right_;
+				}
+				float bottom() const {
+					return bottom_;
+				}
+
+				// The SVG document, `width` x `height`, over `background_href` (relative to the SVG file) if any.
+				std::string svg(int width, int height, std::string_view background_href = {}) const;
+				bool write(const std::string &path, int width, int height, std::string_view background_href = {}) const;
+
+			private:
+				enum class kind : uint8_t {
+					path,                               // all boxes, lines and polylines of a pen
+					text,
+				};
+				struct item {
+					kind type;
+					uint32_t pen;
+					float x, y, height;                 // text only
+					std::string data;                   // the path data, or the text
+				};
+				struct pen_style {
+					std::string color;
+					float width;
+					int path;                           // its item, once there is one
+				};
+
+				// The path data of the current pen, to append to.
+				std::string &path();
+				void extend(float x, float y);
+
+				std::vector<pen_style> pens_{{"red", 1, -1}};
+				std::vector<item> items_;
+				uint32_t pen_ = 0;
+				float right_ = 0;
+				float bottom_ = 0;
+			};
+
+
+			// Image sequences
+			// ---------------
+			//
+			// Iterative algorithms (binarization, morphological refinement, ...) dump an image of the same size once
+			// per iteration, and each iteration changes only a few percent of the pixels. The frames of a sequence
+			// go to a single file: the first frame in full, each next one as its XOR with the frame before, run-length
+			// encoded, so both the file size and the encoding time follow the number of changed bytes. The frames are
+			// compared with the previous one 16 bytes at a time (SSE2), so unchanged rows cost no more than reading
+			// them. The session only copies the frame on the caller's thread; the comparison, the encoding and the
+			// writes are done on the image pool (see `queued_sequence`).
+			//
+			// The file is a script, `<name>.seq.js`, which `sequence-viewer.html` in the image directory loads with a
+			// `<script>` tag: one `diagnostics_sequence()` call with the frame geometry, then one `diagnostics_frame()`
+			// call per frame, with its caption, the number of changed bytes and the base64 of its delta. A delta which
+			// is XORed in twice cancels out, so the viewer scrubs backwards as cheaply as forwards.
+			//
+			// A delta is a series of LEB128 tokens `n << 2 | kind`, which cover the bytes of the frame in order:
+			// kind 0 skips `n` unchanged bytes, kind 1 is followed by `n` bytes to XOR in, kind 2 by a single byte to
+			// XOR into the next `n` bytes. Bytes past the last token are unchanged. The first frame is the delta
+			// against an all-zero frame.
+
+			// Appends the delta from `previous` to `current`, a piece of `size` bytes of the frame, to `out`, and
+			// copies the changed bytes into `previous`. `skip` carries the unchanged bytes at the end of a piece over
+			// to the next one: start each frame with 0. Returns the number of changed bytes.
+			size_t encode_frame_delta(uint8_t *previous, const uint8_t *current, size_t size, size_t &skip, std::vector<uint8_t> &out);
+			// XORs the delta into `frame`, of `size` bytes. False when the delta is malformed or runs past the frame.
+			bool apply_frame_delta(const uint8_t *delta, size_t delta_size, uint8_t *frame, size_t size);
+
+			class sequence_writer {
+			public:
+				sequence_writer() = default;
+				~sequence_writer();
+
+				sequence_writer(const sequence_writer &) = delete;
+				sequence_writer &operator=(const sequence_writer &) = delete;
+
+				// The frames are `width` x `height`, with 1 (gray), 3 (RGB) or 4 (RGBA) channels.
+				bool open(const std::string &path, int width, int height, int channels);
+				bool close();
+
+				// True when `frame` has the geometry of the sequence.
+				bool accepts(const scanline_source &frame) const {
+					return frame.width == width_ && frame.height == height_ && frame.channels == channels_;
+				}
+				// `changed` receives the number of bytes which differ from the previous frame.
+				bool append(std::string_view caption, const scanline_source &frame, size_t &changed);
+
+				bool is_open() const {
+					return fp_ != nullptr;
+				}
+				int frames() const {
+					return frames_;
+				}
+				// The last frame appended.
+				raster last_frame() const {
+					return {previous_.data(), width_, height_, channels_, size_t(width_) * channels_};
+				}
+				uint64_t size() const {
+					return size_;
+				}
+
+			private:
+				FILE *fp_ = nullptr;
+				std::string path_;
+				int width_ = 0;
+				int height_ = 0;
+				int channels_ = 0;
+				int frames_ = 0;
+				uint64_t size_ = 0;
+				std::vector<uint8_t> previous_;
+				std::vector<uint8_t> delta_;
+				std::string line_;
+			};
+
+			// A `sequence_writer` which is fed from the image pool: `append()` only queues a copy of the frame, and a
+			// job on the pool diffs, encodes and writes the queued frames, one at a time and in order, plus the
+			// thumbnail of the first frame. Once `max_queued` frames are waiting, `append()` blocks until the job
+			// catches up. `close()` is queued behind the frames: the files are complete when the image store is idle.
+			class queued_sequence {
+			public:
+				queued_sequence(image_store &images, std::string path, std::string thumbnail_path, int thumbnail_size, int width, int height, int channels, size_t max_queued = 4);
+				// Queues the close.
+				~queued_sequence();
+
+				queued_sequence(const queued_sequence &) = delete;
+				queued_sequence &operator=(const queued_sequence &) = delete;
+
+				bool accepts(const scanline_source &frame) const {
+					return frame.width == width_ && frame.height == height_ && frame.channels == channels_;
+				}
+				// `frame` must have the geometry of the sequence.
+				bool append(std::string_view caption, raster_buffer frame);
+				void close();
+
+				// The frames appended so far.
+				int frames() const {
+					return frames_;
+				}
+
+			private:
+				struct queue;
+
+				std::shared_ptr<queue> queue_;
+				int width_;
+				int height_;
+				int channels_;
+				int frames_ = 0;
+			};
+
+			// Copies the rows of `frame`.
+			raster_buffer copy_frame(const scanline_source &frame);
+
+			bool write_sequence_viewer(const std::string &path);
+
+			// Animated sequences
+			// ------------------
+			//
+			// With `session_options::sequence_format` set to `apng`, the frames of a sequence are collected instead,
+			// and written as a single animated PNG when the section closes: one file, which any browser plays, in
+			// place of a file per step. Taking a frame is a copy of its rows on the caller's thread; once a sequence
+			// holds `session_options::sequence_frames_in_memory` frames, the next ones go to a spill file in the image
+			// directory, which is removed after encoding. The encoding runs on the image pool, and stores each frame
+			// after the first as the rectangle which changed since the frame before.
+			//
+			// Animated WebP would need libwebp's animation encoder, which the image drivers do not link; the APNG is
+			// written by the PNG encoder here, with zlib only.
+
+			enum class sequence_format {
+				delta,          // `sequence_writer`, for the sequence viewer
+				apng,
+			};
+
+			// The frames of an animation, in memory up to `max_in_memory`, and in a spill file beyond.
+			class frame_store {
+			public:
+				// The frames are `width` x `height`, with 1 (gray), 3 (RGB) or 4 (RGBA) channels. `spill_path` is
+				// created when the first frame is spilled.
+				frame_store(int width, int height, int channels, size_t max_in_memory, std::string spill_path);
+				// Removes the spill file.
+				~frame_store();
+
+				frame_store(const frame_store &) = delete;
+				frame_store &operator=(const frame_store &) = delete;
+
+				// True when `frame` has the geometry of the animation.
+				bool accepts(const scanline_source &frame) const {
+					return frame.width == width_ && frame.height == height_ && frame.channels == channels_;
+				}
+				bool add(const scanline_source &frame);
+				// Frame `i`, which stays valid until the next call; an empty raster when it cannot be read back.
+				// For one thread at a time.
+				raster frame(size_t i);
+				// Drops all frames, and removes the spill file.
+				void clear();
+
+				size_t size() const {
+					return memory_.size() + spilled_;
+				}
+				size_t spilled() const {
+					return spilled_;
+				}
+				int width() const {
+					return width_;
+				}
+				int height() const {
+					return height_;
+				}
+				int channels() const {
+					return channels_;
+				}
+
+			private:
+				int width_;
+				int height_;
+				int channels_;
+				size_t max_in_memory_;
+				std::string spill_path_;
+				std::vector<raster_buffer> memory_;
+				FILE *spill_ = nullptr;
+				size_t spilled_ = 0;
+				raster_buffer buffer_;                  // the spilled frame last read back
+			};
+
+			// Writes `count` frames of `width` x `height`, `channels` each, as an animated PNG which loops forever,
+			// showing each frame for `delay` milliseconds, and the last one a little longer. `frame(i)` returns frame
+			// `i`, which must stay valid until the next call.
+			bool write_apng(const std::string &path, int width, int height, int channels, size_t count, const std::function<raster(size_t i)> &frame, int delay, int compression_level = 1);
+
+		} // namespace image
+
+
+		// HTML text output
+		// ----------------
+		//
+		// Text which goes into an HTML document must have the characters `< > & "` escaped and must be valid
+		// UTF-8. Both are checked in one pass by `html_clean_prefix()`, which uses SSE4.2 or AVX2 when the CPU
+		// supports them, so clean runs of text can be copied in bulk.
+
+		static constexpr std::string_view utf8_replacement_character = "\xEF\xBF\xBD";  // U+FFFD
+
+		// Returns the length of the longest prefix of `text` which can go into an HTML document as-is: no
+		// characters which must be escaped and only complete, valid UTF-8 sequences.
+		size_t html_clean_prefix(std::string_view text);
+		// Returns the length of the valid UTF-8 sequence at the start of `text`, or 0 when it is invalid or incomplete.
+		size_t utf8_sequence_length(std::string_view text);
+		// Returns the HTML entity for `ch`, or an empty string when `ch` needs no escaping.
+		std::string_view html_entity(char ch);
+		// Appends `text` to `out`, HTML-escaped, replacing each byte of invalid UTF-8 with U+FFFD.
+		void escape_html(std::string_view text, std::string &out);
+
+
+		// A diagnostics message, formatted once and shared by all output channels: each channel renders it
+		// straight into its own output buffer (verbatim for text, escaped on the fly for HTML), so adding a
+		// channel does not add another round of message formatting or string allocations.
+		struct log_record {
+			spdlog::level::level_enum level = spdlog::level::info;
+			std::chrono::system_clock::time_point time;
+			std::string_view section;               // title of the innermost open section, if any
+			std::string_view text;
+		};
+
+
+		// Streaming HTML output
+		// ---------------------
+		//
+		// Writes a diagnostics session as a single HTML document, where each (nested) section is rendered as a
+		// collapsible `<details>` block. Output is streamed: the writer only tracks the current section depth and
+		// a fixed-size output buffer, so memory consumption does not depend on the session length.
+		//
+		// The file is kept valid after every flush: each flush appends the closing tags for all currently open
+		// sections plus the document footer (the *trailer*), which is overwritten by the next flush. A session
+		// which was cut short by a crash can therefore still be opened in any browser, showing everything up to
+		// the last flush.
+		class html_writer {
+		public:
+			static constexpr size_t default_buffer_size = 64u << 10;
+
+			explicit html_writer(size_t buffer_size = default_buffer_size);
+			~html_writer();
+
+			html_writer(const html_writer &) = delete;
+			html_writer &operator=(const html_writer &) = delete;
+
+			bool open(const std::string &path, std::string_view title);
+			// Closes all open sections, writes `epilogue` (ready-made HTML), the document footer and closes the file.
+			bool close(std::string_view epilogue = {});
+
+			// `id` optionally sets the element id, so the section can be linked to.
+			bool push_section(std::string_view title, std::string_view id = {});
+			// Pushes a section whose title links to `href`.
+			bool push_linked_section(std::string_view title, std::string_view href);
+			bool pop_section();
+
+			// Writes a line of text, HTML-escaped, with invalid UTF-8 replaced by U+FFFD.
+			bool write_line(spdlog::level::level_enum level, std::string_view text);
+			// `id` optionally sets the element id, so the message can be linked to.
+			bool write_record(const log_record &record, std::string_view id = {});
+			// Writes a chunk of ready-made HTML verbatim.
+			bool write_html(std::string_view html);
+			// Writes text, HTML-escaped, as part of the current element.
+			bool write_line_fragment(std::string_view text);
+
+			bool flush();
+
+			bool is_open() const {
+				return fp_ != nullptr;
+			}
+			size_t depth() const {
+				return depth_;
+			}
+			// Number of bytes written so far, excluding the current trailer and whatever's still buffered.
+			uint64_t committed_size() const {
+				return committed_;
+			}
+			// Size of the document produced so far, including buffered content, excluding the trailer.
+			uint64_t size() const {
+				return committed_ + fill_;
+			}
+
+		private:
+			bool append(std::string_view s);
+			bool append_escaped(std::string_view s);
+			bool write_trailer();
+
+			std::unique_ptr<char[]> buffer_;
+			size_t buffer_size_;
+			size_t fill_ = 0;
+			size_t depth_ = 0;
+			uint64_t committed_ = 0;
+			bool failed_ = false;
+			FILE *fp_ = nullptr;
+			std::string path_;
+		};
+
+
+		// Client-side search for HTML sessions
+		// ------------------------------------
+		//
+		// Builds an inverted index, token -> list of message numbers, while the session is written. The
+		// producer only copies the message text into a batch; tokenizing and updating the postings happens in a
+		// background job on the worker pool (one job at a time, so the batches are indexed in order). Postings
+		// are kept as delta-encoded varints, which typically takes 1-2 bytes per (token, message) pair.
+		//
+		// `write()` saves the index as a JavaScript sidecar file, `<base>.search.js`, which is loaded by the
+		// static viewer page `<base>.search.html` via a `<script>` tag: that works from `file://` URLs, where
+		// `fetch()` does not. Tokens are runs of ASCII letters, digits and underscores plus any non-ASCII
+		// (UTF-8) characters; ASCII is folded to lower case.
+		class search_index_builder {
+		public:
+			// Text is handed to the background job in batches of (about) this size.
+			static constexpr size_t batch_size = 256u << 10;
+
+			explicit search_index_builder(worker_pool &pool);
+			~search_index_builder();
+
+			search_index_builder(const search_index_builder &) = delete;
+			search_index_builder &operator=(const search_index_builder &) = delete;
+
+			// Queues a message for indexing. Message numbers must be increasing.
+			void add(uint64_t record, std::string_view text);
+			// Indexes whatever is still queued and waits until the index is complete.
+			void finish();
+
+			// Writes the sidecar file. `pages` lists the file name and first message number of each page.
+			bool write(const std::string &path, std::string_view title, const std::vector<std::pair<std::string, uint64_t>> &pages, uint64_t record_count);
+
+			size_t token_count() const {
+				return tokens_.size();
+			}
+
+		private:
+			struct batch {
+				std::vector<uint64_t> records;
+				std::vector<size_t> ends;       // end offset of each message's text
+				std::string text;
+			};
+			struct postings {
+				std::string deltas;             // varint-encoded
+				uint64_t last = 0;
+				uint64_t count = 0;
+			};
+
+			void submit_current();
+			void drain();
+			void index(const batch &b);
+			void add_token(const std::string &token, uint64_t record);
+
+			worker_pool &pool_;
+			std::unique_ptr<batch> current_;
+			std::deque<std::unique_ptr<batch>> queue_;
+			bool draining_ = false;
+			std::mutex mutex_;
+			std::condition_variable idle_;
+			// only accessed by the (single) drain job, or after `finish()`:
+			std::unordered_map<std::string, postings> tokens_;
+		};
+
+		// Writes the static search page for the index sidecar `<base>.search.js`.
+		bool write_search_viewer(const std::string &path, std::string_view title, std::string_view index_file_name, std::string_view session_index_file_name);
+
+
+		struct html_channel_options {
+			// Once a page has grown beyond this size, a new page is started at the next section boundary.
+			uint64_t page_size = 4ull << 20;
+			// Pages are cut mid-section when they grow beyond this size, no matter what.
+			uint64_t max_page_size = 32ull << 20;
+			// Sections nested deeper than this are not listed in the index page.
+			size_t index_depth = 3;
+			// Build a search index (requires a worker pool; see `search_index_builder`).
+			bool search_index = true;
+		};
+
+		// Paginated HTML output for (very) large sessions
+		// ------------------------------------------------
+		//
+		// Splits the session into a series of `html_writer` pages, `<base>.pNNNNN.html`, and maintains an index
+		// page, `<base>.html`, which lists the section tree with links into the pages, plus the number of
+		// messages per level for each page and the entire session.
+		//
+		// Both the pages and the index are streamed: a page is finalized and closed as soon as the next one is
+		// started, and the channel only remembers the titles of the currently open sections (these are re-opened
+		// at the top of every new page), so memory consumption does not depend on the session length.
+		class html_channel {
+		public:
+			html_channel() = default;
+			~html_channel();
+
+			html_channel(const html_channel &) = delete;
+			html_channel &operator=(const html_channel &) = delete;
+
+			// `pool` runs the background work, like building the search index; without one, there's no search index.
+			bool open(const std::string &base_path, std::string_view title, const html_channel_options &options = {}, worker_pool *pool = nullptr);
+			bool close();
+
+			bool push_section(std::string_view title);
+			bool pop_section();
+
+			bool write_line(spdlog::level::level_enum level, std::string_view text);
+			bool write_record(const log_record &record);
+			bool write_html(std::string_view html);
+			// Shows the thumbnail, loaded lazily by the browser, linking to the full-resolution image.
+			bool write_image(std::string_view caption, const image::stored_image &img);
+			// A link to a file which the browser cannot show, like a `.npy` array, plus a note on it.
+			bool write_file_link(std::string_view caption, std::string_view url, std::string_view note);
+			// An SVG overlay, `img.url`, shown over the thumbnail of its background, `img.thumbnail_url`.
+			bool write_overlay(std::string_view caption, const image::stored_image &img);
+
+			bool flush();
+
+			bool is_open() const {
+				return page_.is_open();
+			}
+			uint32_t page_index() const {
+				return page_index_;
+			}
+			std::string page_path(uint32_t index) const;
+			const std::string &index_path() const {
+				return index_path_;
+			}
+			std::string search_index_path() const {
+				return base_path_ + ".search.js";
+			}
+			std::string search_viewer_path() const {
+				return base_path_ + ".search.html";
+			}
+
+		private:
+			using level_counts = std::array<uint64_t, spdlog::level::n_levels>;
+
+			bool start_page();
+			// `next_page`: the session continues on another page, which the end of this one links to.
+			bool finish_page(bool next_page);
+			// Starts a new page when the current one has grown too large; `at_boundary` signals a section boundary.
+			bool maybe_break_page(bool at_boundary);
+			std::string level_summary(const level_counts &counts) const;
+
+			html_channel_options options_;
+			std::string base_path_;
+			std::string title_;
+			std::string index_path_;
+			html_writer index_;
+			html_writer page_;
+			uint32_t page_index_ = 0;
+			uint64_t section_seq_ = 0;
+			uint64_t record_count_ = 0;
+			std::vector<std::string> open_sections_;
+			std::unique_ptr<search_index_builder> search_;
+			std::vector<std::pair<std::string, uint64_t>> page_first_records_;
+			level_counts page_counts_{};
+			level_counts total_counts_{};
+		};
+
+
+
+		// Plain text output: one line per message, prefixed with a timestamp and the level, plus marker lines for
+		// the section boundaries. Buffered in a fixed-size buffer, like `html_writer`.
+		class text_writer {
+		public:
+			static constexpr size_t default_buffer_size = 64u << 10;
+
+			explicit text_writer(size_t buffer_size = default_buffer_size);
+			~text_writer();
+
+			text_writer(const text_writer &) = delete;
+			text_writer &operator=(const text_writer &) = delete;
+
+			bool open(const std::string &path);
+			bool close();
+
+			bool push_section(std::string_view title);
+			bool pop_section();
+			bool write_line(spdlog::level::level_enum level, std::string_view text);
+			bool write_record(const log_record &record);
+
+			bool flush();
+
+			bool is_open() const {
+				return fp_ != nullptr;
+			}
+
+		private:
+			bool append(std::string_view s);
+			bool append_indent(size_t depth);
+
+			std::unique_ptr<char[]> buffer_;
+			size_t buffer_size_;
+			size_t fill_ = 0;
+			size_t depth_ = 0;
+			bool failed_ = false;
+			// the "HH:MM:SS" part of the timestamp only changes once a second, so it's formatted once a second.
+			int64_t clock_second_ = -1;
+			char clock_[8] = {};
+			FILE *fp_ = nullptr;
+			std::string path_;
+		};
+
+
+#if defined(HAVE_SQLITE)
+
+		// Stores the messages of one session cycle in an SQLite database (a *shard*), in WAL mode. The inserts are
+		// committed in batches, every few thousand rows or half a second, so readers see the messages while the
+		// cycle runs and a crash loses no more than the last batch.
+		class sqlite_shard {
+		public:
+			sqlite_shard() = default;
+			~sqlite_shard();
+
+			sqlite_shard(const sqlite_shard &) = delete;
+			sqlite_shard &operator=(const sqlite_shard &) = delete;
+
+			bool open(const std::string &path);
+			bool close();
+
+			bool write_line(spdlog::level::level_enum level, std::string_view section, std::string_view text);
+			bool write_record(const log_record &record);
+
+			bool is_open() const {
+				return db_ != nullptr;
+			}
+
+		private:
+			// Commits the open transaction, and starts the next one.
+			bool commit();
+
+			sqlite3 *db_ = nullptr;
+			sqlite3_stmt *insert_ = nullptr;
+			std::string path_;
+			int uncommitted_ = 0;
+			std::chrono::steady_clock::time_point last_commit_;
+		};
+
+#endif
+
+		namespace blob {
+
+			// NumPy arrays
+			// ------------
+			//
+			// Heatmaps show where the values are, not what they are: for analysis, numeric arrays are written as
+			// NumPy `.npy` files as well. A `.npy` file is a short text header with the element type and shape,
+			// padded to a multiple of 64 bytes, followed by the elements in C order; the elements are written
+			// straight from the caller's memory, with a single `writev()` of the header plus the caller's buffer
+			// (one chunk per row when the rows are not adjacent), without any conversion. Python loads them
+			// instantly, memory-mapped, with `np.load(path, mmap_mode='r')`.
+			//
+			// Alternatively, the arrays of a section are appended to one `.npz` file: a zip archive of uncompressed
+			// `.npy` members (`np.load(path)['name']`), each starting at a multiple of 64 bytes in the archive, so
+			// a member's elements can be mapped straight out of the archive, too.
+
+			enum class array_export {
+				none,
+				npy,                                    // one `.npy` file per array
+				npz,                                    // appended to the `.npz` file of the current section
+			};
+
+			// The NumPy type string of T, e.g. "<f4" for a little-endian float.
+			template <typename T>
+			std::string npy_descr() {
+				static_assert(std::is_arithmetic_v<T>, "NumPy arrays hold arithmetic types");
+				static_assert(!std::is_same_v<T, bool> || sizeof(bool) == 1, "NumPy bools are bytes");
+				char order = sizeof(T) == 1 ? '|' : std::endian::native == std::endian::little ? '<' : '>';
+				char kind = std::is_same_v<T, bool> ? 'b' : std::is_floating_point_v<T> ? 'f' : std::is_signed_v<T> ? 'i' : 'u';
+				return fmt::format("{}{}{}", order, kind, sizeof(T));
+			}
+
+			// Describes an array in the caller's memory; nothing is copied.
+			struct npy_array {
+				std::string descr;                      // see `npy_descr()`
+				std::vector<size_t> shape;              // C order: the last dimension varies fastest
+				// The elements, in C order, as runs of contiguous memory: the entire array, or its rows.
+				std::vector<std::span<const std::byte>> chunks;
+
+				size_t size_bytes() const;
+				// False, with an error message, unless the chunks hold the elements of `shape` exactly.
+				bool validate(std::string_view caption) const;
+			};
+
+			// A contiguous array of the given shape; no shape: one dimension.
+			template <typename T>
+			npy_array make_npy_array(std::span<T> data, std::vector<size_t> shape = {}) {
+				npy_array rv;
+				rv.descr = npy_descr<std::remove_cv_t<T>>();
+				rv.shape = shape.empty() ? std::vector<size_t>{data.size()} : std::move(shape);
+				rv.chunks.push_back(std::as_bytes(data));
+				return rv;
+			}
+
+			// The `.npy` header of `a`: magic, version, and the padded dictionary.
+			std::string npy_header(const npy_array &a);
+			bool write_npy(const std::string &path, const npy_array &a);
+
+			// Appends `.npy` members to a zip archive; the central directory is written by `close()`. Archives
+			// beyond 4 GiB or 65535 members use the zip64 extensions.
+			class npz_writer {
+			public:
+				npz_writer() = default;
+				~npz_writer();
+
+				npz_writer(const npz_writer &) = delete;
+				npz_writer &operator=(const npz_writer &) = delete;
+
+				// What it takes to append an array, other than the elements themselves: computed by `prepare()`,
+				// which reads all of them for the CRC, so it can run before taking whatever lock guards the writer.
+				struct prepared_member {
+					std::string header;                 // see `npy_header()`
+					uint32_t crc = 0;                   // of the header and the elements
+					uint64_t size = 0;                  // of the same
+				};
+
+				bool open(const std::string &path);
+				bool close();
+				static prepared_member prepare(const npy_array &a);
+				// The member is named after `name`, made unique within the archive; returns that name.
+				std::string append(std::string_view name, const npy_array &a);
+				// `prepared` must come from `prepare(a)`.
+				std::string append(std::string_view name, const npy_array &a, const prepared_member &prepared);
+
+				bool is_open() const {
+					return fp_ != nullptr;
+				}
+				const std::string &path() const {
+					return path_;
+				}
+
+			private:
+				struct member {
+					std::string name;
+					uint32_t crc = 0;
+					uint64_t size = 0;
+					uint64_t offset = 0;
+				};
+
+				FILE *fp_ = nullptr;
+				std::string path_;
+				uint64_t offset_ = 0;
+				uint16_t dos_time_ = 0;
+				uint16_t dos_date_ = 0;
+				std::vector<member> members_;
+				std::unordered_map<std::string, int> name_counts_;
+			};
+
+		} // namespace blob
+
+	} // namespace driver
+
+
+	struct session_options {
+		std::string directory = ".";
+		std::string name = "diagnostics";       // base name of all output files
+		std::string title = "Diagnostics";
+		driver::html_channel_options html;
+		bool text_output = true;
+#if defined(HAVE_SQLITE)
+		bool sqlite_output = false;
+#endif
+		// Keep (at most) this many cycles' worth of output files on disk; 0: keep all.
+		unsigned int keep_cycles = 0;
+		// Finalizing a cycle occupies a worker until all images of that cycle are encoded: with a single worker,
+		// the background work queued after it (preparing the next cycle's files, finalizing the next cycle) waits
+		// for the image pool to drain, and so may a rapid `cycle()` after the next. Use at least two.
+		unsigned int worker_threads = 0;        // 0: use all available cores
+		size_t worker_queue_depth = 64;
+		// Images are encoded on a pool of their own, so a burst of large images cannot hold up the other
+		// background work. Once `image_queue_depth` images are waiting to be encoded, logging an image blocks.
+		unsigned int image_threads = 0;         // 0: use all available cores
+		size_t image_queue_depth = 16;
+		int thumbnail_size = 256;
+		// Image drivers which support it (leptonica) append the raw rasters to a pack file per cycle, instead
+		// of encoding them; see `driver::image::render_pix_pack()`.
+		bool raw_image_capture = false;
+		// Image drivers which support it (libvips) also write a deep-zoom tile pyramid of the page-size images
+		// logged in the sections this filter accepts; none by default. See `driver::image::tile_pyramid_base()`.
+		section_filter tile_pyramids{false};
+		// Images which are logged again, unchanged, within a cycle are not encoded again: the output links to the
+		// first copy. See `driver::image::content_hash`.
+		bool deduplicate_images = true;
+		// How `session::log_frame()` stores image sequences: delta-encoded, or as one animated PNG per sequence,
+		// written when its section closes; see `driver::image::sequence_format`.
+		driver::image::sequence_format sequence_format = driver::image::sequence_format::delta;
+		// For animated PNG: the frames of a sequence beyond this many wait in a spill file, and each frame is
+		// shown for `sequence_frame_delay` milliseconds.
+		size_t sequence_frames_in_memory = 32;
+		int sequence_frame_delay = 200;
+	};
+
+	// A diagnostics session: routes the diagnostics statements to all configured output channels.
+	//
+	// The session output is organized in *cycles*: `cycle()` finalizes the current set of output files and
+	// starts a new set. The new set is prepared in the background ahead of time, so the caller only pays for
+	// swapping a pointer; the old set is handed off to a background job which closes the HTML pages, writes
+	// the index, fsyncs everything and removes expired cycles per the `keep_cycles` policy.
+	//
+	// All methods are thread-safe.
+	class session {
+	public:
+		session();
+		~session();
+
+		session(const session &) = delete;
+		session &operator=(const session &) = delete;
+
+		bool init(const session_options &options);
+		bool cycle();
+		// Finalizes the current cycle and waits for all background work to complete.
+		bool finish();
+
+		void push_section(std::string_view title);
+		void pop_section();
+		void log(spdlog::level::level_enum level, std::string_view text);
+		// Formats the message once, into a buffer which is reused for every message, and hands the result to
+		// all channels.
+		template <typename... Args>
+		void log(spdlog::level::level_enum level, fmt::format_string<Args...> format, Args &&...args) {
+			std::lock_guard<std::mutex> lock(mutex_);
+			format_buffer_.clear();
+			fmt::format_to(std::back_inserter(format_buffer_), format, std::forward<Args>(args)...);
+			emit(level, std::string_view(format_buffer_.data(), format_buffer_.size()));
+		}
+		void log_image(std::string_view caption, std::shared_ptr<const driver::image::raster_buffer> img);
+		// For image drivers: `encode` writes the image in its native format on a worker thread, plus its tile
+		// pyramid when `tile_pyramid` is set. `hash` is the image's `content_hash`, if any: an image with the same
+		// hash logged in this cycle is linked to instead, checked under the same lock as the hash is remembered.
+		void log_image(std::string_view caption, std::string_view extension, int width, int height, driver::image::encode_function encode, bool tile_pyramid = false, int tile_size = 256, const driver::image::content_hash &hash = {});
+		// For image drivers: adds the stats of a bilevel PNG (see `driver::image::encode_bilevel_png()`) to the
+		// totals which the text and HTML output report, with the throughput, when the cycle is finalized. Takes no
+		// lock: image jobs call it, and they must not wait for `log_image()`, which may be waiting for them.
+		void note_bilevel_encode(const driver::image::bilevel_encode_stats &stats);
+		// For image drivers, before they take a snapshot of the image: when an image with the same (non-empty)
+		// hash was logged in this cycle, links to it and returns true. Only an early-out, which saves the snapshot:
+		// otherwise, the driver passes the hash on to `log_image()`, which checks again and remembers it.
+		bool log_duplicate_image(std::string_view caption, const driver::image::content_hash &hash);
+		// Appends the raw raster to the cycle's pack file, `<cycle>.images/capture.pixpack`; the HTML output
+		// references the PNG files which `render_pix_pack()` produces from it.
+		void log_pix_raster(std::string_view caption, const driver::image::pix_raster &pix);
+		// Writes the array on the caller's thread, straight from its memory, as a `.npy` file in the image
+		// directory, or appends it to the `.npz` file of the current section (one per run of the section: it
+		// is closed by the next section boundary). The HTML output links the file.
+		void log_array(std::string_view caption, const driver::blob::npy_array &array, driver::blob::array_export where = driver::blob::array_export::npy);
+		// Logs the page image which the overlays that follow are drawn over (see `driver::image::overlay`): it's
+		// written like any other image, but only shown under the overlays.
+		void log_overlay_background(std::string_view caption, std::shared_ptr<const driver::image::raster_buffer> img);
+		void log_overlay_background(std::string_view caption, std::string_view extension, int width, int height, driver::image::encode_function encode);
+		// Writes the overlay as an SVG file, on the caller's thread: it's small.
+		void log_overlay(std::string_view caption, const driver::image::overlay &ov);
+		// Appends a frame to the image sequence `sequence` (see `driver::image::sequence_writer`): the frame is
+		// copied on the caller's thread, and diffed and written on the image pool (see
+		// `driver::image::queued_sequence`). A sequence lasts for one run of the current section, like the `.npz`
+		// files, and a frame of another size starts a new one. The HTML output shows the first frame, which opens
+		// the sequence viewer, where each frame shows its change rate; the text output has a line per frame. With
+		// `session_options::sequence_format` set to `apng`, the sequence is written as an animated PNG when it ends.
+		void log_frame(std::string_view sequence, std::string_view caption, const driver::image::scanline_source &frame);
+
+		// The titles of the open sections, outermost first, joined by `separator`.
+		std::string section_path(std::string_view separator = "/");
+
+		struct dedup_stats {
+			uint64_t hits = 0;                  // images linked to an earlier copy instead of being written
+			uint64_t misses = 0;                // images hashed, and written
+		};
+		// For the entire session.
+		dedup_stats image_dedup_stats() const {
+			return {dedup_hits_.load(), dedup_misses_.load()};
+		}
+
+		const session_options &options() const {
+			return options_;
+		}
+
+		uint32_t cycle_index() const {
+			return cycle_index_;
+		}
+		worker_pool *pool() const {
+			return pool_.get();
+		}
+		worker_pool *image_pool() const {
+			return image_pool_.get();
+		}
+
+	private:
+		struct channel_state;
+
+		std::string cycle_base_path(uint32_t index) const;
+		std::unique_ptr<channel_state> create_state(uint32_t index) const;
+		// Submits a job which prepares the channel state for the next cycle.
+		void prepare_standby(uint32_t index);
+		// Closes and fsyncs the channel state. Runs on a worker thread.
+		void finalize_state(channel_state &state);
+		void remove_cycle(uint32_t index) const;
+		// Applies the `keep_cycles` policy once cycle `finalized` is finalized; `newest` is the cycle which was
+		// started when it was handed off. Runs on a worker thread.
+		void expire_cycles(uint32_t finalized, uint32_t newest);
+		// Fans the message out to all channels. Expects `mutex_` to be held.
+		void emit(spdlog::level::level_enum level, std::string_view text);
+		// `log_duplicate_image()`, with `mutex_` held. Only the final check of an image counts a miss.
+		bool link_duplicate(std::string_view caption, const driver::image::content_hash &hash, bool count_miss = true);
+		// `log_frame()` for animated sequences, with `mutex_` held.
+		void add_animation_frame(std::string_view sequence, std::string_view caption, const driver::image::scanline_source &frame);
+
+		session_options options_;
+		std::unique_ptr<worker_pool> pool_;
+		std::unique_ptr<worker_pool> image_pool_;
+		std::unique_ptr<channel_state> state_;
+		std::unique_ptr<channel_state> standby_;
+		std::vector<std::string> sections_;
+		fmt::memory_buffer format_buffer_;
+		uint32_t cycle_index_ = 0;
+		std::atomic<uint64_t> dedup_hits_{0};
+		std::atomic<uint64_t> dedup_misses_{0};
+		// bilevel PNG totals since the last cycle was finalized; see `note_bilevel_encode()`.
+		std::atomic<uint64_t> bilevel_images_{0};
+		std::atomic<uint64_t> bilevel_input_bytes_{0};
+		std::atomic<uint64_t> bilevel_output_bytes_{0};
+		std::atomic<uint64_t> bilevel_strips_{0};
+		std::atomic<uint64_t> bilevel_microseconds_{0};
+		bool standby_pending_ = false;
+		// finalized cycles which have not expired yet, and the most recent cycle started; see `expire_cycles()`.
+		std::set<uint32_t> finalized_cycles_;
+		uint32_t retention_newest_ = 0;
+		std::mutex mutex_;
+		std::mutex standby_mutex_;
+		std::mutex retention_mutex_;
+		std::condition_variable standby_ready_;
+	};
+
+
+	namespace driver {
+
+		namespace image {
+
+			// Raw 2D arrays
+			// -------------
+			//
+			// Projection profiles, distance maps, classifier scores, ...: 2D arrays of any arithmetic type, logged as
+			// false-color heatmaps. The caller's thread maps the values onto 8-bit colormap indices by their range,
+			// with the SIMD kernels above for the common element types; the index image is the only copy taken,
+			// a quarter of the size of a float array. The colormap lookup and the PNG encoding run on the session's
+			// image encoding pool.
+
+			enum class colormap {
+				gray,
+				viridis,
+				inferno,
+				// blue - white - red, with white at zero: for signed values, like score differences.
+				diverging,
+			};
+
+			struct heatmap_options {
+				colormap map = colormap::viridis;
+				// A fixed range, e.g. 0..1 for probabilities; when `min >= max`, the range of the finite values.
+				double min = 0;
+				double max = 0;
+				// Clips this percentage of the values at either end of the range, so a few outliers do not wash
+				// out the rest of the map.
+				double clip_percent = 0;
+				// Also exports the values themselves as a NumPy array, straight from the caller's memory (see
+				// `blob::npy_array`).
+				blob::array_export values = blob::array_export::none;
+			};
+
+			// The element type kernels of the heatmaps, picked at compile time: the types with SIMD kernels are
+			// specialized below, all other arithmetic types get these scalar loops. NaN maps to the first color.
+			template <typename T>
+			struct value_kernels {
+				static_assert(std::is_arithmetic_v<T>, "heatmaps take arrays of arithmetic types");
+
+				static value_range range(const T *data, size_t n) {
+					value_range rv;
+					for (size_t i = 0; i < n; i++) {
+						double x = double(data[i]);
+						if (!std::isfinite(x))
+							continue;
+						rv.min = rv.count ? std::min(rv.min, x) : x;
+						rv.max = rv.count ? std::max(rv.max, x) : x;
+						rv.count++;
+					}
+					return rv;
+				}
+
+				static void to_8bit(const T *src, size_t n, uint8_t *dst, double offset, double scale) {
+					for (size_t i = 0; i < n; i++) {
+						double v = (double(src[i]) - offset) * scale;
+						dst[i] = !(v > 0) ? 0 : !(v < 255) ? 255 : uint8_t(std::lrint(v));
+					}
+				}
+			};
+
+			template <typename T>
+			struct simd_value_kernels {
+				static value_range range(const T *data, size_t n) {
+					return find_value_range(data, n);
+				}
+				// the types with float kernels take float, the others double: see `scale_to_8bit()`.
+				static void to_8bit(const T *src, size_t n, uint8_t *dst, double offset, double scale) {
+					if constexpr (sizeof(T) <= 2 || std::is_same_v<T, float>)
+						scale_to_8bit(src, n, dst, float(offset), float(scale));
+					else
+						scale_to_8bit(src, n, dst, offset, scale);
+				}
+			};
+
+			template <>
+			struct value_kernels<float> : simd_value_kernels<float> {};
+			template <>
+			struct value_kernels<double> : simd_value_kernels<double> {};
+			template <>
+			struct value_kernels<uint8_t> : simd_value_kernels<uint8_t> {};
+			template <>
+			struct value_kernels<uint16_t> : simd_value_kernels<uint16_t> {};
+			template <>
+			struct value_kernels<int16_t> : simd_value_kernels<int16_t> {};
+			template <>
+			struct value_kernels<int32_t> : simd_value_kernels<int32_t> {};
+
+			// A heatmap as colormap indices, ready to be colored and encoded.
+			struct heatmap_indices {
+				raster_buffer indices;                  // one channel
+				value_range range;                      // of the values; `count` 0 when all are NaN or infinite
+				double first = 0;                       // the values which map onto the first and last colors
+				double last = 0;
+				uint64_t histogram[256] = {};           // of the indices
+			};
+
+			// The range which is mapped onto the colormap, before clipping.
+			value_range heatmap_mapped_range(const value_range &values, const heatmap_options &opts);
+			// Narrows `mapped` by `percent` of the values at either end, going by the histogram of their indices;
+			// false when there is nothing to clip. With few bins left between the clipping points, the new range
+			// is a superset, to be narrowed again from the histogram of another pass: `exact` is false then.
+			bool clip_heatmap_range(const uint64_t (&histogram)[256], double percent, value_range &mapped, bool &exact);
+			// Hands the indices to the image pool.
+			void log_heatmap_indices(session &s, std::string_view caption, std::shared_ptr<heatmap_indices> img, const heatmap_options &opts);
+
+			// Exports the rows as a (height, width) NumPy array; adjacent rows are merged into one chunk. The
+			// pointers returned by `rows(y)` must stay valid until all rows have been read.
+			template <typename T, typename Rows>
+			void export_heatmap_values(session &s, std::string_view caption, int width, int height, Rows &&rows, blob::array_export where) {
+				blob::npy_array a;
+				a.descr = blob::npy_descr<T>();
+				a.shape = {size_t(height), size_t(width)};
+				for (int y = 0; y < height; y++) {
+					auto [data, n] = rows(y);
+					if (n != size_t(width)) {
+						s.log(spdlog::level::warn, "{}: the rows differ in length; not exported as a NumPy array", caption);
+						return;
+					}
+					auto row = std::as_bytes(std::span<const T>(data, n));
+					if (!a.chunks.empty() && a.chunks.back().data() + a.chunks.back().size() == row.data())
+						a.chunks.back() = std::span<const std::byte>(a.chunks.back().data(), a.chunks.back().size() + row.size());
+					else
+						a.chunks.push_back(row);
+				}
+				s.log_array(caption, a, where);
+			}
+
+			// `rows(y)` returns a `std::pair<const T *, size_t>`: the values of row `y` and their count. Rows shorter
+			// than `width` are padded with the first color.
+			template <typename T, typename Rows>
+			void log_heatmap_rows(session &s, std::string_view caption, int width, int height, Rows &&rows, const heatmap_options &opts) {
+				if (width <= 0 || height <= 0) {
+					spdlog::error("Cannot log heatmap {}: a {}x{} array", caption, width, height);
+					return;
+				}
+				auto img = std::make_shared<heatmap_indices>();
+				for (int y = 0; y < height; y++) {
+					auto [data, n] = rows(y);
+					img->range.merge(value_kernels<T>::range(data, std::min(n, size_t(width))));
+				}
+				value_range mapped = heatmap_mapped_range(img->range, opts);
+
+				// clipping takes another pass with the clipped range, and more while the histogram is too coarse
+				// to place the clipping points, e.g. when a single outlier squeezes all other values into one bin.
+				img->indices = raster_buffer(width, height, 1);
+				bool settled = opts.clip_percent <= 0 || !img->range.count;
+				for (int pass = 0;; pass++) {
+					double offset, scale;
+					scale_for_range(mapped, offset, scale);
+					std::fill(std::begin(img->histogram), std::end(img->histogram), 0);
+					for (int y = 0; y < height; y++) {
+						auto [data, n] = rows(y);
+						n = std::min(n, size_t(width));
+						uint8_t *out = img->indices.row(y);
+						value_kernels<T>::to_8bit(data, n, out, offset, scale);
+						memset(out + n, 0, size_t(width) - n);
+						// while the row is in the cache:
+						byte_histogram(out, n, img->histogram);
+					}
+					bool exact = false;
+					if (settled || pass == 4 || !clip_heatmap_range(img->histogram, opts.clip_percent, mapped, exact))
+						break;
+					settled = exact;
+				}
+				img->first = mapped.min;
+				img->last = mapped.max;
+				log_heatmap_indices(s, caption, std::move(img), opts);
+				if (opts.values != blob::array_export::none)
+					export_heatmap_values<T>(s, caption, width, height, rows, opts.values);
+			}
+
+			// `stride`: elements from one row to the next; 0: `width`.
+			template <typename T>
+			void log_heatmap(session &s, std::string_view caption, std::span<T> data, int width, int height, size_t stride = 0, const heatmap_options &opts = {}) {
+				using value_type = std::remove_cv_t<T>;
+				stride = stride ? stride : size_t(width);
+				if (width > 0 && height > 0 && (stride < size_t(width) || data.size() < stride * (height - 1) + width)) {
+					spdlog::error("Cannot log heatmap {}: {} values do not hold {} rows of {}, {} apart", caption, data.size(), height, width, stride);
+					return;
+				}
+				log_heatmap_rows<value_type>(s, caption, width, height, [&](int y) {
+					return std::pair<const value_type *, size_t>(data.data() + y * stride, size_t(width));
+				}, opts);
+			}
+
+			// Rows may differ in length: the map is as wide as the longest row.
+			template <typename T>
+			void log_heatmap(session &s, std::string_view caption, const std::vector<std::vector<T>> &rows, const heatmap_options &opts = {}) {
+				size_t width = 0;
+				for (const auto &row : rows)
+					width = std::max(width, row.size());
+				log_heatmap_rows<T>(s, caption, int(width), int(rows.size()), [&](int y) {
+					return std::pair<const T *, size_t>(rows[y].data(), rows[y].size());
+				}, opts);
+			}
+
+			// `std::vector<bool>` packs its bits: the rows are copied into an array of `bool` first.
+			inline void log_heatmap(session &s, std::string_view caption, const std::vector<std::vector<bool>> &rows, const heatmap_options &opts = {}) {
+				size_t width = 0;
+				for (const auto &row : rows)
+					width = std::max(width, row.size());
+				std::unique_ptr<bool[]> values(new bool[width * rows.size()]);
+				for (size_t y = 0; y < rows.size(); y++)
+					std::copy(rows[y].begin(), rows[y].end(), values.get() + y * width);
+				log_heatmap_rows<bool>(s, caption, int(width), int(rows.size()), [&](int y) {
+					return std::pair<const bool *, size_t>(values.get() + size_t(y) * width, rows[y].size());
+				}, opts);
+			}
+
+#if defined(__cpp_lib_mdspan)
+			// Rows with unit stride are read in place; any other layout is copied one row at a time, or entirely
+			// when the values are exported.
+			template <typename T, typename Extents, typename Layout, typename Accessor>
+			void log_heatmap(session &s, std::string_view caption, std::mdspan<T, Extents, Layout, Accessor> m, const heatmap_options &opts = {}) {
+				static_assert(Extents::rank() == 2, "heatmaps take 2D arrays");
+				using value_type = std::remove_cv_t<T>;
+				const int width = int(m.extent(1));
+				const int height = int(m.extent(0));
+				bool in_place = false;
+				if constexpr (std::is_same_v<Accessor, std::default_accessor<T>>)
+					in_place = m.is_strided() && (width <= 1 || m.stride(1) == 1);
+				if (!in_place && opts.values != blob::array_export::none) {
+					std::vector<value_type> copy(size_t(width) * height);
+					for (int y = 0; y < height; y++)
+						for (int x = 0; x < width; x++)
+							copy[size_t(y) * width + x] = m[y, x];
+					log_heatmap(s, caption, std::span<const value_type>(copy), width, height, 0, opts);
+					return;
+				}
+				std::vector<value_type> row(in_place ? 0 : size_t(width));
+				log_heatmap_rows<value_type>(s, caption, width, height, [&](int y) {
+					if constexpr (std::is_same_v<Accessor, std::default_accessor<T>>) {
+						if (in_place)
+							return std::pair<const value_type *, size_t>(&m[y, 0], size_t(width));
+					}
+					for (int x = 0; x < width; x++)
+						row[x] = m[y, x];
+					return std::pair<const value_type *, size_t>(row.data(), size_t(width));
+				}, opts);
+			}
+#endif
+
+		} // namespace image
+
+	} // namespace driver
+
+}
+
+
+#if defined(HAVE_LEPTONICA)
+
+// leptonica's `PIX`
+struct Pix;
+
+namespace diagnostics {
+
+	namespace driver {
+
+		namespace image {
+
+			// Leptonica images
+			// ----------------
+			//
+			// `log_pix()` takes a snapshot of the image and hands it to the session's image encoding pool, so the
+			// (OCR) thread which logs the image does not wait for PNG/TIFF encoding: its cost does not depend on
+			// the image size. The pool's size and queue depth are set by `session_options::image_threads` and
+			// `image_queue_depth`.
+			//
+			// With `session_options::raw_image_capture` set, the raw raster is appended to the cycle's pack file
+			// instead (see `pix_raster`), whatever the `snapshot` and `format` arguments say.
+
+			enum class pix_snapshot {
+				// `pixClone()`: takes another reference to the same pixels. Only use this when the image is not
+				// modified after logging it: the pixels are encoded at some later time.
+				clone,
+				// `pixCopy()`: a private copy, for images which the caller keeps modifying. Costs a memcpy of the
+				// raster, but no encoding.
+				copy,
+			};
+
+			enum class pix_format {
+				png,
+				tiff,           // G4 compressed for 1bpp images, ZIP compressed otherwise
+			};
+
+			void log_pix(session &s, std::string_view caption, struct Pix *pix, pix_snapshot snapshot = pix_snapshot::clone, pix_format format = pix_format::png);
+			// The page image for the overlays which follow (see `overlay`), as PNG, also with `raw_image_capture`:
+			// it's encoded once for all overlays of the page.
+			void log_pix_overlay_background(session &s, std::string_view caption, struct Pix *pix, pix_snapshot snapshot = pix_snapshot::clone);
+			// Appends the image to the image sequence `sequence` (see `sequence_writer`), as 8-bit rows converted on
+			// the fly from the raster: no snapshot, no encoding.
+			void log_pix_frame(session &s, std::string_view sequence, std::string_view caption, struct Pix *pix);
+
+		} // namespace image
+
+	} // namespace driver
+
+}
+
+#endif
+
+
+#if defined(HAVE_TESSERACT)
+
+namespace tesseract {
+	class PageIterator;
+	class TessBaseAPI;
+}
+
+namespace diagnostics {
+
+	namespace driver {
+
+		namespace image {
+
+			// Tesseract layouts
+			// -----------------
+			//
+			// The page layout which tesseract found, drawn as overlays (see `overlay`) over the image tesseract
+			// works on, instead of a rasterized debug page per stage.
+
+			// Adds the elements at `level` (a `tesseract::PageIteratorLevel`, RIL_BLOCK .. RIL_SYMBOL) over which
+			// `it` iterates, from the start of the page, in the current pen: their bounding boxes (the polygons of
+			// non-rectangular blocks), plus the baselines of text lines and words. With a `ResultIterator`, the
+			// words and symbols are labeled with their text.
+			void add_tesseract_layout(overlay &ov, const tesseract::PageIterator &it, int level, bool baselines = true);
+			// Logs the thresholded image of the page `api` works on as the background of the overlays which follow.
+			void log_tesseract_page(session &s, std::string_view caption, tesseract::TessBaseAPI &api);
+			// Logs one overlay with the blocks (blue), text lines (green) and words (red) of the page; after
+			// `Recognize()`, the words are labeled with their text, before it, the layout is analysed for this.
+			void log_tesseract_layout(session &s, std::string_view caption, tesseract::TessBaseAPI &api);
+
+		} // namespace image
+
+	} // namespace driver
+
+}
+
+#endif
+
+
+#if defined(HAVE_OPENCV)
+
+namespace cv {
+	class Mat;
+}
+
+namespace diagnostics {
+
+	namespace driver {
+
+		namespace image {
+
+			// OpenCV images
+			// -------------
+			//
+			// `log_mat()` takes a reference-counted header copy of the `cv::Mat` and hands it to the session's image
+			// encoding pool, where it is encoded with `cv::imencode()`: the caller does not wait for the encoder.
+			//
+			// `cv::imwrite()` only handles 8-bit images (anything else comes out black), so other depths are
+			// scaled to 0..255 first, by the range of their finite values: float debugging images come out
+			// visible, with NaN black and +inf white. Single-channel 8-bit images which only hold 0 and 255 are
+			// masks: they are stored as 1-bit PNG (see `encode_bilevel_png()`).
+
+			enum class mat_snapshot {
+				// shares the pixels: only use this when the image is not modified after logging it.
+				share,
+				// `cv::Mat::clone()`, for images which the caller keeps modifying.
+				copy,
+			};
+
+			// Takes 1, 3 (BGR) or 4 (BGRA) channel images of any depth.
+			void log_mat(session &s, std::string_view caption, const cv::Mat &mat, mat_snapshot snapshot = mat_snapshot::share);
+			// Appends the image to the image sequence `sequence` (see `sequence_writer`), on the caller's thread. Other
+			// depths than 8 bits are scaled by the range of each frame.
+			void log_mat_frame(session &s, std::string_view sequence, std::string_view caption, const cv::Mat &mat);
+
+		} // namespace image
+
+	} // namespace driver
+
+}
+
+#endif
+
+
+#if defined(HAVE_OPENIMAGEIO)
+
+namespace diagnostics {
+
+	namespace driver {
+
+		namespace image {
+
+			// OpenImageIO images
+			// ------------------
+			//
+			// For the images which the 8-bit PNG path cannot represent: float score maps, 16-bit depth maps, ...
+			// stored as EXR or TIFF via OpenImageIO. The pixels are written straight from the caller's buffer,
+			// in a single `write_image()` call (OIIO splits it into scanlines or tiles itself): any layout which
+			// can be described by strides works without an intermediate copy, e.g. a region of a larger image,
+			// or a single channel of an interleaved one.
+
+			struct oiio_write_options {
+				// Half and float images of at least this many pixels are written as tiles (EXR, TIFF): viewers
+				// can load regions of those, and OIIO compresses the tiles in parallel.
+				int64_t tile_threshold = int64_t(2048) * 2048;
+				int tile_size = 256;
+				// empty: the fastest lossless compression of the file format.
+				std::string compression;
+			};
+
+			// The file format follows from the extension of `path`.
+			bool oiio_write(const std::string &path, const strided_image &img, const oiio_write_options &opts = {});
+
+			// Writes the image on the session's image encoding pool. `owner` keeps the pixels alive until then,
+			// so they must not be modified after logging them; `extension` picks the file format.
+			void log_oiio_image(session &s, std::string_view caption, const strided_image &img, std::shared_ptr<const void> owner, std::string_view extension = "exr", const oiio_write_options &opts = {});
+
+			// Collects the maps of one page (layout analysis score maps, ...) as the parts of a single multi-part
+			// EXR, or multi-page TIFF, instead of a file each: dozens of maps per page would otherwise add up to
+			// millions of files. Each part is named after the section which was open when it was appended, plus
+			// its own name, and carries both as metadata.
+			//
+			// OpenEXR needs the headers of all parts before the first pixel is written, so the parts are only
+			// referenced (through `owner`, no copies) until `close()`, which writes the file on the session's
+			// image encoding pool. The pixels must not be modified until then.
+			class oiio_multipart_archive {
+			public:
+				oiio_multipart_archive(session &s, std::string_view caption, std::string_view extension = "exr", const oiio_write_options &opts = {});
+				// Closes the archive.
+				~oiio_multipart_archive();
+
+				oiio_multipart_archive(const oiio_multipart_archive &) = delete;
+				oiio_multipart_archive &operator=(const oiio_multipart_archive &) = delete;
+
+				void append(std::string_view name, const strided_image &img, std::shared_ptr<const void> owner);
+				// Hands the parts to the image pool and logs the archive; appending starts a new archive.
+				void close();
+
+				size_t size() const {
+					return parts_.size();
+				}
+
+			private:
+				struct part {
+					std::string name;
+					std::string section;
+					std::string caption;
+					strided_image img;
+					std::shared_ptr<const void> owner;
+				};
+
+				session &session_;
+				std::string caption_;
+				std::string extension_;
+				oiio_write_options opts_;
+				std::vector<part> parts_;
+				std::unordered_map<std::string, int> name_counts_;
+			};
+
+		} // namespace image
+
+	} // namespace driver
 
 }
 
+#endif
+
+
+#if defined(HAVE_LIBVIPS)
+
+namespace diagnostics {
+
+	namespace driver {
 
+		namespace image {
 
+			// libvips images
+			// --------------
+			//
+			// For the images which are too large to copy: 1200 dpi scans, stitched newspaper pages, ... The
+			// caller's pixels are wrapped with `vips_image_new_from_memory()`, without a copy, and written through
+			// the demand-driven, threaded libvips pipeline, which only ever holds a few strips of the image per
+			// worker thread. The thumbnail is shrunk by `vips_thumbnail_image()` from the same wrapped pixels, so
+			// neither output ever needs the whole image in memory.
+			//
+			// libvips reads interleaved pixels only: `x_stride` must be 0 or the size of a pixel. Row padding
+			// (`y_stride`) is fine.
+
+			struct vips_write_options {
+				// zlib level for PNG and deflate-compressed TIFF: we default to favoring speed over size.
+				int compression_level = 1;
+				// TIFF images of at least this many pixels are written as tiles, and as BigTIFF beyond 4 GB.
+				int64_t tile_threshold = int64_t(4096) * 4096;
+				int tile_size = 256;
+				// `log_vips_image()` adds a tile pyramid for the images of at least this width or height, when the
+				// section is accepted by `session_options::tile_pyramids`.
+				int tile_pyramid_min_size = 2048;
+			};
+
+			// The file format follows from the extension of `path`: PNG takes 8 and 16-bit images, TIFF all
+			// sample types. With a nonzero `thumbnail_size`, `thumbnail` receives an 8-bit thumbnail which fits
+			// in a `thumbnail_size` x `thumbnail_size` box.
+			bool vips_write(const std::string &path, const strided_image &img, const vips_write_options &opts = {}, int thumbnail_size = 0, raster_buffer *thumbnail = nullptr);
+			// Writes the Deep Zoom tile pyramid `<base>.dzi` + `<base>_files/` with `opts.tile_size` pixel PNG
+			// tiles. 16-bit and float images are scaled to 8 bits, like their thumbnails.
+			bool vips_write_tile_pyramid(const std::string &base, const strided_image &img, const vips_write_options &opts = {});
+
+			// Writes the image on the session's image encoding pool. `owner` keeps the pixels alive until then,
+			// so they must not be modified after logging them.
+			void log_vips_image(session &s, std::string_view caption, const strided_image &img, std::shared_ptr<const void> owner, std::string_view extension = "png", const vips_write_options &opts = {});
+			// Appends the image to the image sequence `sequence` (see `sequence_writer`), on the caller's thread: 8-bit
+			// images straight from the caller's rows, 16-bit and float images scaled like the tiles.
+			void log_vips_frame(session &s, std::string_view sequence, std::string_view caption, const strided_image &img);
+
+		} // namespace image
+
+	} // namespace driver
+
+}
+
+#endif
@@ -8,6 +8,9 @@
 #include <spdlog/spdlog.h>
 #include <fmt/format.h>
 #include <ostream>
+#include <string>
+#include <string_view>
+#include <vector>
 
 
 #include <diagnostics/implementation/logging-common.h>
@@ -15,6 +18,40 @@
 
 namespace diagnostics {
 
+	// Selects sections by their path: the titles of the open sections, outermost first, joined by '/' (see
+	// `session::section_path()`). The filter is a list of glob patterns, each of which either includes or
+	// excludes the sections it matches: the last matching pattern decides, and sections which match none get
+	// the default. In a pattern, `*` matches any run of characters within one title, `**` any run including
+	// '/', and `?` a single character other than '/'. A trailing `/**` also matches the section itself.
+	class section_filter {
+	public:
+		explicit section_filter(bool default_match = true) :
+			default_(default_match) {
+		}
+
+		// Parses a comma-separated list of patterns, e.g. "page/**,-page/*/ocr/**": a pattern which starts
+		// with '-' excludes, all others (optionally starting with '+') include.
+		static section_filter parse(std::string_view spec, bool default_match = false);
+
+		section_filter &include(std::string_view pattern);
+		section_filter &exclude(std::string_view pattern);
+
+		bool matches(std::string_view section_path) const;
+		// True when no section can match: lets the callers skip building the section path.
+		bool matches_nothing() const {
+			return !default_ && !has_include_;
+		}
+
+	private:
+		struct rule {
+			std::string pattern;
+			bool include;
+		};
+
+		std::vector<rule> rules_;
+		bool default_;
+		bool has_include_ = false;
+	};
 
 }
 
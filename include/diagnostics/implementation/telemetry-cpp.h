@@ -8,14 +8,339 @@
 #include <spdlog/spdlog.h>
 #include <fmt/format.h>
 
+#include <cstdint>
+#include <cstddef>
+#include <cstdio>
+#include <functional>
+#include <source_location>
+#include <span>
+#include <string>
+#include <string_view>
+#include <vector>
+
 
 #include <diagnostics/implementation/telemetry-common.h>
 
 
 namespace diagnostics {
 
+	// Binary session logs
+	// -------------------
+	//
+	// A binary diagnostics session is stored as a series of *segment* files. Each segment starts with a
+	// `segment_file_header`, followed by a sequence of records. Every record starts with a `record_header`
+	// and is padded to a multiple of 8 bytes, so that all headers (and the numeric arguments following them)
+	// are naturally aligned when the segment is memory-mapped by the reader: the post-mortem tools can then
+	// walk the records in place, without any copying or parsing.
+	//
+	// Every record is framed: it starts with a fixed marker, its size and a CRC32C checksum of its content.
+	// When the application crashes while writing, the reader can thus tell a torn or garbled record from a
+	// sound one and `recover_records()` can resynchronize on the next marker, salvaging every intact record
+	// following the damage.
+	//
+	// All values are stored in native (little-endian) byte order.
+	namespace binlog {
 
-}
+		constexpr uint64_t segment_magic = 0x474553474149444Cull;		// "LDIAGSEG" when read as bytes
+		constexpr uint32_t segment_version = 2;
+
+		constexpr uint32_t record_marker = 0xD1A6C0DEu;
+
+		constexpr size_t record_alignment = 8;
+
+		enum class record_kind : uint16_t {
+			text_line = 1,
+			section_push = 2,
+			section_pop = 3,
+			image_ref = 4,
+			blob_ref = 5,
+		};
+
+		struct segment_file_header {
+			uint64_t magic;
+			uint32_t version;
+			uint32_t segment_index;
+			uint64_t session_id;
+			uint64_t created_ns;
+		};
+		static_assert(sizeof(segment_file_header) == 32);
+
+		// The record payload follows the header, in this order:
+		//
+		//     double   args[arg_count];
+		//     char     file[file_len];
+		//     char     function[function_len];
+		//     char     section[section_len];
+		//     char     message[message_len];
+		//     padding up to the next multiple of `record_alignment`.
+		//
+		// Strings are NOT NUL-terminated.
+		//
+		// The checksum covers the `size` field and everything following the `crc32c` field, up to the end of
+		// the (padded) record.
+		struct record_header {
+			uint32_t marker;            // record_marker
+			uint32_t size;              // total record size, including this header and the trailing padding
+			uint32_t crc32c;
+			uint16_t kind;              // record_kind
+			uint8_t  level;
+			uint8_t  arg_count;
+			uint64_t timestamp_ns;      // since the UNIX epoch
+			uint32_t sequence;          // record number within the segment
+			uint32_t thread_id;
+			uint32_t line;
+			uint32_t message_len;
+			uint16_t file_len;
+			uint16_t function_len;
+			uint16_t section_len;
+			uint16_t reserved;
+		};
+		static_assert(sizeof(record_header) == 48);
+		static_assert(sizeof(record_header) % record_alignment == 0);
+
+		// CRC32C (Castagnoli), continuing from `crc` (pass 0 to start a new checksum). Uses the SSE4.2 / ARMv8
+		// CRC instructions when the CPU supports them.
+		uint32_t crc32c(uint32_t crc, const void *data, size_t size);
+		// The same, always in software (slicing-by-8): what `crc32c()` does on a CPU without the instructions.
+		uint32_t crc32c_portable(uint32_t crc, const void *data, size_t size);
+
+		// Returns TRUE when the checksum stored in the record matches its content. `hdr` MUST point at a record
+		// which fits entirely inside the mapped memory.
+		bool verify_record_checksum(const record_header *hdr);
+
+		// Produces the file name for segment `index` of the session stored at `base_path`, e.g. `base.00003.ldseg`.
+		std::string segment_path(std::string_view base_path, uint32_t index);
+
+
+		// Appends records to a series of segment files, starting a new segment whenever the current one
+		// exceeds `max_segment_size` bytes.
+		//
+		// Not thread-safe: the owner is expected to serialize access.
+		class segment_writer {
+		public:
+			segment_writer() = default;
+			~segment_writer();
+
+			segment_writer(const segment_writer &) = delete;
+			segment_writer &operator=(const segment_writer &) = delete;
+
+			// Buffered records are flushed to disk at least every `flush_interval_ms` milliseconds (checked when
+			// appending), limiting how much of the tail is lost when the application crashes.
+			bool open(std::string_view base_path, uint64_t session_id, uint64_t max_segment_size = 256ull << 20, uint32_t flush_interval_ms = 100);
+			bool append(record_kind kind, int level, std::string_view message, std::string_view section = {}, std::span<const double> args = {}, const std::source_location &where = std::source_location::current());
+			bool flush();
+			void close();
+
+			bool is_open() const {
+				return fp_ != nullptr;
+			}
+			uint32_t segment_index() const {
+				return segment_index_;
+			}
+
+		private:
+			bool open_segment();
+			bool close_segment();
+			bool write_out(const void *data, size_t size);
+
+			std::string base_path_;
+			uint64_t session_id_ = 0;
+			uint64_t max_segment_size_ = 0;
+			uint32_t segment_index_ = 0;
+			uint32_t sequence_ = 0;
+			uint64_t segment_size_ = 0;
+			uint64_t flush_interval_ns_ = 0;
+			uint64_t last_flush_ns_ = 0;
+			FILE *fp_ = nullptr;
+			std::vector<char> buffer_;
+		};
+
+
+		// A lightweight view of a single record inside a memory-mapped segment. All accessors return views into
+		// the mapping, hence they remain valid only as long as the `mapped_segment` stays alive.
+		class record_view {
+		public:
+			explicit record_view(const record_header *hdr) :
+				hdr_(hdr) {
+			}
+
+			const record_header &header() const {
+				return *hdr_;
+			}
+			record_kind kind() const {
+				return static_cast<record_kind>(hdr_->kind);
+			}
+			int level() const {
+				return hdr_->level;
+			}
+			uint64_t timestamp_ns() const {
+				return hdr_->timestamp_ns;
+			}
+			uint32_t sequence() const {
+				return hdr_->sequence;
+			}
+			uint32_t thread_id() const {
+				return hdr_->thread_id;
+			}
+			uint32_t line() const {
+				return hdr_->line;
+			}
+			std::span<const double> args() const {
+				return {reinterpret_cast<const double *>(hdr_ + 1), hdr_->arg_count};
+			}
+			std::string_view file() const {
+				return {strings(), hdr_->file_len};
+			}
+			std::string_view function() const {
+				return {strings() + hdr_->file_len, hdr_->function_len};
+			}
+			std::string_view section() const {
+				return {strings() + hdr_->file_len + hdr_->function_len, hdr_->section_len};
+			}
+			std::string_view message() const {
+				return {strings() + hdr_->file_len + hdr_->function_len + hdr_->section_len, hdr_->message_len};
+			}
+
+		private:
+			const char *strings() const {
+				return reinterpret_cast<const char *>(hdr_ + 1) + hdr_->arg_count * sizeof(double);
+			}
+
+			const record_header *hdr_;
+		};
 
 
+		// Memory-maps a single segment file (read-only) and iterates over its records.
+		//
+		// Iteration stops at the first record which does not fit the mapping or is otherwise malformed, e.g. at
+		// the torn tail of a segment which was being written when the application crashed. Checksums are NOT
+		// verified while iterating, to keep scanning at memory bandwidth; use `recover_records()` for segments
+		// which may be damaged.
+		class mapped_segment {
+		public:
+			mapped_segment() = default;
+			explicit mapped_segment(const std::string &path) {
+				open(path);
+			}
+			~mapped_segment();
+
+			mapped_segment(const mapped_segment &) = delete;
+			mapped_segment &operator=(const mapped_segment &) = delete;
+			mapped_segment(mapped_segment &&other) noexcept;
+			mapped_segment &operator=(mapped_segment &&other) noexcept;
+
+			bool open(const std::string &path);
+			void close();
+
+			bool is_open() const {
+				return data_ != nullptr;
+			}
+			const segment_file_header &header() const {
+				return *reinterpret_cast<const segment_file_header *>(data_);
+			}
+			std::span<const std::byte> bytes() const {
+				return {data_, size_};
+			}
+
+			class iterator {
+			public:
+				using value_type = record_view;
+				using difference_type = std::ptrdiff_t;
+
+				iterator() = default;
+				iterator(const std::byte *pos, const std::byte *end) :
+					pos_(pos), end_(end) {
+					validate();
+				}
+
+				record_view operator*() const {
+					return record_view(reinterpret_cast<const record_header *>(pos_));
+				}
+				iterator &operator++() {
+					pos_ += reinterpret_cast<const record_header *>(pos_)->size;
+					validate();
+					return *this;
+				}
+				iterator operator++(int) {
+					iterator rv = *this;
+					++*this;
+					return rv;
+				}
+				bool operator==(const iterator &other) const {
+					return pos_ == other.pos_;
+				}
+
+			private:
+				// Turns this into the end iterator when the record at the current position is not sound.
+				void validate();
+
+				const std::byte *pos_ = nullptr;
+				const std::byte *end_ = nullptr;
+			};
+
+			iterator begin() const;
+			iterator end() const {
+				return {};
+			}
+
+		private:
+			const std::byte *data_ = nullptr;
+			size_t size_ = 0;
+#if defined(_WIN32)
+			void *file_handle_ = nullptr;
+			void *mapping_handle_ = nullptr;
+#endif
+		};
+
+
+		struct recovery_stats {
+			size_t records = 0;             // intact records delivered to the callback
+			size_t damaged_regions = 0;     // number of times we had to resynchronize
+			size_t skipped_bytes = 0;       // bytes discarded while resynchronizing, including a torn tail
+		};
+
+		// Walks all records of `segment`, verifying each checksum. When a record is torn or corrupt, the scanner
+		// skips ahead to the next aligned record marker which starts a sound record and continues from there, so
+		// every intact record in the segment is passed to `callback`.
+		recovery_stats recover_records(const mapped_segment &segment, const std::function<void(const record_view &record)> &callback);
+
+		// Maps and scans each of the given segment files on a pool of `thread_count` threads (0: use all
+		// available cores). Segments are independent, hence `callback` is invoked concurrently for different
+		// segments and MUST be thread-safe; `segment_index` is the index into `paths`.
+		//
+		// Returns the number of segments which could not be mapped.
+		size_t scan_segments(const std::vector<std::string> &paths, const std::function<void(size_t segment_index, const mapped_segment &segment)> &callback, unsigned int thread_count = 0);
+
+
+		// Columnar export
+		// ---------------
+		//
+		// Converts binary session segments into a set of flat column files which analytical tooling can load
+		// (or memory-map) directly, e.g. using `numpy.fromfile()`. Each segment is exported to its own part
+		// directory `<output_dir>/part-NNNNN/`, in parallel:
+		//
+		//     schema.json                        column names, files, dtypes and row count of this part
+		//     timestamp_ns.i64, sequence.u32, thread_id.u32, line.u32, kind.u8, level.u8
+		//     call_site.codes.u32                dictionary encoded (`file:line function`)
+		//     section.codes.u32                  dictionary encoded
+		//     <name>.dict.offsets.u64            dictionary strings: N+1 offsets into...
+		//     <name>.dict.bytes                  ...the concatenated dictionary strings
+		//     message.offsets.u64                N+1 offsets into...
+		//     message.bytes                      ...the concatenated messages
+		//     args.offsets.u64                   N+1 offsets (in elements) into...
+		//     args.values.f64                    ...the concatenated numeric arguments
+		//
+		// Dictionaries are local to each part.
+		struct columnar_export_options {
+			unsigned int thread_count = 0;      // 0: use all available cores
+			bool recover = false;               // verify checksums and salvage damaged segments (see `recover_records()`)
+		};
+
+		// Returns the number of segments which could not be exported.
+		size_t export_columnar(const std::vector<std::string> &segment_paths, const std::string &output_dir, const columnar_export_options &options = {});
+
+	} // namespace binlog
+
+}
+
 
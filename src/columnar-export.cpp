@@ -0,0 +1,250 @@
+
+#include <diagnostics/telemetry.h>
+#include <diagnostics/implementation/core-json.h>
+
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <filesystem>
+#include <string>
+#include <unordered_map>
+
+
+namespace diagnostics {
+
+	namespace binlog {
+
+		// Buffered, append-only writer for a single column file.
+		class column_file {
+		public:
+			bool open(const std::filesystem::path &path) {
+				fp_ = fopen(path.string().c_str(), "wb");
+				if (!fp_) {
+					spdlog::error("Cannot create column file {}: {}", path.string(), strerror(errno));
+					return false;
+				}
+				buffer_.reserve(buffer_size);
+				return true;
+			}
+
+			~column_file() {
+				close();
+			}
+
+			bool close() {
+				if (!fp_)
+					return true;
+				bool ok = flush();
+				if (fclose(fp_) != 0)
+					ok = false;
+				fp_ = nullptr;
+				return ok && !failed_;
+			}
+
+			void append(const void *data, size_t size) {
+				if (buffer_.size() + size > buffer_size) {
+					flush();
+					if (size >= buffer_size) {
+						if (fwrite(data, 1, size, fp_) != size)
+							failed_ = true;
+						return;
+					}
+				}
+				const char *p = static_cast<const char *>(data);
+				buffer_.insert(buffer_.end(), p, p + size);
+			}
+
+			template <typename T>
+			void append(const T &value) {
+				append(&value, sizeof(value));
+			}
+
+		private:
+			bool flush() {
+				if (!buffer_.empty()) {
+					if (fwrite(buffer_.data(), 1, buffer_.size(), fp_) != buffer_.size())
+						failed_ = true;
+					buffer_.clear();
+				}
+				return !failed_;
+			}
+
+			static constexpr size_t buffer_size = 256u << 10;
+
+			FILE *fp_ = nullptr;
+			std::vector<char> buffer_;
+			bool failed_ = false;
+		};
+
+
+		// Maps each distinct key to a sequential code. Keys are views into the segment mapping, so no string
+		// is ever copied while encoding.
+		template <typename Key, typename Hash = std::hash<Key>>
+		class dictionary {
+		public:
+			uint32_t code(const Key &key) {
+				auto [it, inserted] = codes_.try_emplace(key, static_cast<uint32_t>(values_.size()));
+				if (inserted)
+					values_.push_back(key);
+				return it->second;
+			}
+
+			const std::vector<Key> &values() const {
+				return values_;
+			}
+
+		private:
+			std::unordered_map<Key, uint32_t, Hash> codes_;
+			std::vector<Key> values_;
+		};
+
+		struct call_site {
+			std::string_view file;
+			std::string_view function;
+			uint32_t line;
+
+			bool operator==(const call_site &) const = default;
+		};
+
+		struct call_site_hash {
+			size_t operator()(const call_site &cs) const {
+				std::hash<std::string_view> h;
+				return h(cs.file) ^ (h(cs.function) * 31) ^ (size_t(cs.line) * 0x9E3779B97F4A7C15ull);
+			}
+		};
+
+
+		static bool write_string_dictionary(const std::filesystem::path &dir, const std::string &name, const std::vector<std::string_view> &values) {
+			column_file offsets, bytes;
+			if (!offsets.open(dir / (name + ".dict.offsets.u64")) || !bytes.open(dir / (name + ".dict.bytes")))
+				return false;
+			uint64_t offset = 0;
+			offsets.append(offset);
+			for (auto v : values) {
+				bytes.append(v.data(), v.size());
+				offset += v.size();
+				offsets.append(offset);
+			}
+			bool ok = offsets.close();
+			return bytes.close() && ok;
+		}
+
+		static bool write_schema(const std::filesystem::path &dir, const std::string &segment_path, size_t rows) {
+			// a Windows path has backslashes, and a file name may hold quotes: both need escaping.
+			std::string source;
+			append_json_string(source, segment_path);
+			std::string json = fmt::format(R"({{
+  "source": {},
+  "rows": {},
+  "columns": [
+    {{"name": "timestamp_ns", "file": "timestamp_ns.i64", "dtype": "<i8"}},
+    {{"name": "sequence", "file": "sequence.u32", "dtype": "<u4"}},
+    {{"name": "thread_id", "file": "thread_id.u32", "dtype": "<u4"}},
+    {{"name": "line", "file": "line.u32", "dtype": "<u4"}},
+    {{"name": "kind", "file": "kind.u8", "dtype": "|u1"}},
+    {{"name": "level", "file": "level.u8", "dtype": "|u1"}},
+    {{"name": "call_site", "encoding": "dictionary", "codes": "call_site.codes.u32", "codes_dtype": "<u4", "dictionary_offsets": "call_site.dict.offsets.u64", "dictionary_bytes": "call_site.dict.bytes"}},
+    {{"name": "section", "encoding": "dictionary", "codes": "section.codes.u32", "codes_dtype": "<u4", "dictionary_offsets": "section.dict.offsets.u64", "dictionary_bytes": "section.dict.bytes"}},
+    {{"name": "message", "encoding": "varbinary", "offsets": "message.offsets.u64", "offsets_dtype": "<u8", "bytes": "message.bytes"}},
+    {{"name": "args", "encoding": "list", "offsets": "args.offsets.u64", "offsets_dtype": "<u8", "values": "args.values.f64", "values_dtype": "<f8"}}
+  ]
+}}
+)",
+				source, rows);
+
+			column_file schema;
+			if (!schema.open(dir / "schema.json"))
+				return false;
+			schema.append(json.data(), json.size());
+			return schema.close();
+		}
+
+		static bool export_segment(const mapped_segment &segment, const std::string &segment_path, const std::filesystem::path &dir, bool recover) {
+			std::error_code ec;
+			std::filesystem::create_directories(dir, ec);
+			if (ec) {
+				spdlog::error("Cannot create columnar export directory {}: {}", dir.string(), ec.message());
+				return false;
+			}
+
+			column_file timestamp, sequence, thread_id, line, kind, level, call_site_codes, section_codes, message_offsets, message_bytes, args_offsets, args_values;
+			bool ok = timestamp.open(dir / "timestamp_ns.i64") && sequence.open(dir / "sequence.u32") && thread_id.open(dir / "thread_id.u32") && line.open(dir / "line.u32") && kind.open(dir / "kind.u8") && level.open(dir / "level.u8") && call_site_codes.open(dir / "call_site.codes.u32") && section_codes.open(dir / "section.codes.u32") && message_offsets.open(dir / "message.offsets.u64") && message_bytes.open(dir / "message.bytes") && args_offsets.open(dir / "args.offsets.u64") && args_values.open(dir / "args.values.f64");
+			if (!ok)
+				return false;
+
+			dictionary<call_site, call_site_hash> call_sites;
+			dictionary<std::string_view> sections;
+			uint64_t message_offset = 0;
+			uint64_t args_offset = 0;
+			size_t rows = 0;
+
+			message_offsets.append(message_offset);
+			args_offsets.append(args_offset);
+
+			auto add_row = [&](const record_view &r) {
+				const record_header &h = r.header();
+				timestamp.append(h.timestamp_ns);
+				sequence.append(h.sequence);
+				thread_id.append(h.thread_id);
+				line.append(h.line);
+				kind.append(static_cast<uint8_t>(h.kind));
+				level.append(h.level);
+				call_site_codes.append(call_sites.code({r.file(), r.function(), h.line}));
+				section_codes.append(sections.code(r.section()));
+
+				auto msg = r.message();
+				message_bytes.append(msg.data(), msg.size());
+				message_offset += msg.size();
+				message_offsets.append(message_offset);
+
+				auto args = r.args();
+				args_values.append(args.data(), args.size_bytes());
+				args_offset += args.size();
+				args_offsets.append(args_offset);
+				rows++;
+			};
+
+			if (recover) {
+				recover_records(segment, add_row);
+			} else {
+				for (auto r : segment)
+					add_row(r);
+			}
+
+			for (column_file *col : {&timestamp, &sequence, &thread_id, &line, &kind, &level, &call_site_codes, &section_codes, &message_offsets, &message_bytes, &args_offsets, &args_values}) {
+				if (!col->close())
+					ok = false;
+			}
+
+			std::vector<std::string_view> call_site_strings;
+			std::vector<std::string> call_site_storage;
+			call_site_storage.reserve(call_sites.values().size());
+			for (const auto &cs : call_sites.values()) {
+				call_site_storage.push_back(fmt::format("{}:{} {}", cs.file, cs.line, cs.function));
+				call_site_strings.push_back(call_site_storage.back());
+			}
+			ok = write_string_dictionary(dir, "call_site", call_site_strings) && ok;
+			ok = write_string_dictionary(dir, "section", sections.values()) && ok;
+			ok = write_schema(dir, segment_path, rows) && ok;
+
+			if (!ok)
+				spdlog::error("Columnar export of segment {} to {} failed", segment_path, dir.string());
+			return ok;
+		}
+
+
+		size_t export_columnar(const std::vector<std::string> &segment_paths, const std::string &output_dir, const columnar_export_options &options) {
+			std::atomic<size_t> failures{0};
+
+			failures += scan_segments(segment_paths, [&](size_t index, const mapped_segment &segment) {
+				std::filesystem::path dir = std::filesystem::path(output_dir) / fmt::format("part-{:05}", index);
+				if (!export_segment(segment, segment_paths[index], dir, options.recover))
+					failures++;
+			}, options.thread_count);
+
+			return failures;
+		}
+
+	} // namespace binlog
+
+}
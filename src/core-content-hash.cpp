@@ -0,0 +1,327 @@
+
+#include <diagnostics/diagnostics.h>
+
+#include <cstring>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define LIBDIAG_HAVE_SSE2 1
+#endif
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#define LIBDIAG_CONTENT_HASH_X86 1
+#if defined(__GNUC__) || defined(__clang__)
+#define LIBDIAG_TARGET_AVX2 __attribute__((target("avx2")))
+#else
+#define LIBDIAG_TARGET_AVX2
+#endif
+#endif
+
+
+// Content hashes for image deduplication, after XXH3: eight 64-bit accumulators take a 64-byte stripe at a
+// time, each adding the product of the low and high halves of its word (XORed with a key) plus its neighbour's
+// plain word. That's one 32x32->64 multiply per 8 bytes, which SSE2 and AVX2 do 2 and 4 lanes at a time, so
+// the hash keeps up with memory. Every 16 stripes the accumulators are scrambled, and at the end they are
+// folded into two 64-bit halves with different keys.
+//
+// The hashes only live as long as the process, so they need not match XXH3, nor across byte orders.
+
+namespace diagnostics {
+
+	namespace driver {
+
+		namespace image {
+
+			static constexpr size_t stripes_per_scramble = 16;
+
+			alignas(32) static const uint64_t stripe_key[8] = {
+				0xbe4ba423396cfeb8ull, 0x1cad21f72c81017cull, 0xdb979083e96dd4deull, 0x1f67b3b7a4a44072ull,
+				0x78e5c0cc4ee679cbull, 0x2172ffcc7dd05a82ull, 0x8e2443f7744608b8ull, 0x4c263a81e69035e0ull,
+			};
+			static const uint64_t scramble_key[8] = {
+				0xcb00c391bb52283cull, 0xa32e531b8b65d088ull, 0x4ef90da297486471ull, 0xd8acdea946ef1938ull,
+				0x3f349ce33f76faa8ull, 0x1d4f0bc7c7bbdcf9ull, 0x3159b4cd4be0518aull, 0x647378d9c97e9fc8ull,
+			};
+			static const uint64_t fold_key_lo[8] = {
+				0xc3ebd33483acc5eaull, 0xeb6313faffa081c5ull, 0x49daf0b751dd0d17ull, 0x9e68d429265516d3ull,
+				0xfca1477d58be162bull, 0xce31d07ad1b8f88full, 0x280416958f3acb45ull, 0x7e404bbbcafbd7afull,
+			};
+			static const uint64_t fold_key_hi[8] = {
+				0xb8fe6c3923a44bbeull, 0x7c01812cf721ad1cull, 0xded46de9839097dbull, 0x7240a4a4b7b3671full,
+				0xcb79e64eccc0e578ull, 0x825ad07dccff7221ull, 0xb8084674f743248eull, 0xe03590e6813a264cull,
+			};
+			static constexpr uint64_t prime32_1 = 0x9E3779B1u;
+			static constexpr uint64_t prime64_1 = 0x9E3779B185EBCA87ull;
+			static constexpr uint64_t prime64_2 = 0xC2B2AE3D27D4EB4Full;
+
+			static void accumulate_0(uint64_t *acc, const uint8_t *data, size_t stripes) {
+				for (size_t s = 0; s < stripes; s++, data += 64) {
+					for (int i = 0; i < 8; i++) {
+						uint64_t d;
+						memcpy(&d, data + 8 * i, 8);
+						uint64_t dk = d ^ stripe_key[i];
+						acc[i ^ 1] += d;
+						acc[i] += (dk & 0xFFFFFFFFu) * (dk >> 32);
+					}
+				}
+			}
+
+#if defined(LIBDIAG_HAVE_SSE2)
+			static void accumulate_sse2(uint64_t *acc, const uint8_t *data, size_t stripes) {
+				__m128i *a = reinterpret_cast<__m128i *>(acc);
+				const __m128i *key = reinterpret_cast<const __m128i *>(stripe_key);
+				for (size_t s = 0; s < stripes; s++, data += 64) {
+					for (int k = 0; k < 4; k++) {
+						__m128i d = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data) + k);
+						__m128i dk = _mm_xor_si128(d, _mm_load_si128(key + k));
+						// the high halves moved down, for the multiply of the low halves:
+						__m128i product = _mm_mul_epu32(dk, _mm_shuffle_epi32(dk, _MM_SHUFFLE(0, 3, 0, 1)));
+						__m128i swapped = _mm_shuffle_epi32(d, _MM_SHUFFLE(1, 0, 3, 2));
+						a[k] = _mm_add_epi64(a[k], _mm_add_epi64(product, swapped));
+					}
+				}
+			}
+#endif
+
+#if defined(LIBDIAG_CONTENT_HASH_X86)
+			LIBDIAG_TARGET_AVX2
+			static void accumulate_avx2(uint64_t *acc, const uint8_t *data, size_t stripes) {
+				__m256i *a = reinterpret_cast<__m256i *>(acc);
+				const __m256i *key = reinterpret_cast<const __m256i *>(stripe_key);
+				__m256i a0 = _mm256_load_si256(a);
+				__m256i a1 = _mm256_load_si256(a + 1);
+				const __m256i k0 = _mm256_load_si256(key);
+				const __m256i k1 = _mm256_load_si256(key + 1);
+				for (size_t s = 0; s < stripes; s++, data += 64) {
+					__m256i d0 = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(data));
+					__m256i d1 = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(data) + 1);
+					__m256i dk0 = _mm256_xor_si256(d0, k0);
+					__m256i dk1 = _mm256_xor_si256(d1, k1);
+					__m256i p0 = _mm256_mul_epu32(dk0, _mm256_shuffle_epi32(dk0, _MM_SHUFFLE(0, 3, 0, 1)));
+					__m256i p1 = _mm256_mul_epu32(dk1, _mm256_shuffle_epi32(dk1, _MM_SHUFFLE(0, 3, 0, 1)));
+					a0 = _mm256_add_epi64(a0, _mm256_add_epi64(p0, _mm256_shuffle_epi32(d0, _MM_SHUFFLE(1, 0, 3, 2))));
+					a1 = _mm256_add_epi64(a1, _mm256_add_epi64(p1, _mm256_shuffle_epi32(d1, _MM_SHUFFLE(1, 0, 3, 2))));
+				}
+				_mm256_store_si256(a, a0);
+				_mm256_store_si256(a + 1, a1);
+			}
+#endif
+
+			static bool cpu_has_avx2() {
+#if defined(LIBDIAG_CONTENT_HASH_X86)
+#if defined(_MSC_VER)
+				// AVX2 needs both the CPU and the OS, which must save the YMM registers.
+				int info[4];
+				__cpuid(info, 1);
+				bool avx2 = (info[2] & (1 << 27)) != 0 && (info[2] & (1 << 28)) != 0 && (_xgetbv(0) & 6) == 6;
+				if (avx2) {
+					__cpuidex(info, 7, 0);
+					avx2 = (info[1] & (1 << 5)) != 0;
+				}
+				return avx2;
+#else
+				__builtin_cpu_init();
+				return __builtin_cpu_supports("avx2");
+#endif
+#else
+				return false;
+#endif
+			}
+
+			static bool have_avx2() {
+				static const bool avx2 = cpu_has_avx2();
+				return avx2;
+			}
+
+			static content_hasher::accumulate_function select_accumulate(content_hash_path path) {
+				const bool avx2 = have_avx2();
+				switch (path) {
+#if defined(LIBDIAG_CONTENT_HASH_X86)
+				case content_hash_path::avx2:
+					if (avx2)
+						return accumulate_avx2;
+					break;
+#endif
+#if defined(LIBDIAG_HAVE_SSE2)
+				case content_hash_path::sse2:
+					return accumulate_sse2;
+#endif
+				case content_hash_path::portable:
+					return accumulate_0;
+				default:
+					break;
+				}
+#if defined(LIBDIAG_CONTENT_HASH_X86)
+				if (avx2)
+					return accumulate_avx2;
+#endif
+#if defined(LIBDIAG_HAVE_SSE2)
+				return accumulate_sse2;
+#else
+				return accumulate_0;
+#endif
+			}
+
+			bool content_hash_path_available(content_hash_path path) {
+				switch (path) {
+				case content_hash_path::avx2:
+					return have_avx2();
+				case content_hash_path::sse2:
+#if defined(LIBDIAG_HAVE_SSE2)
+					return true;
+#else
+					return false;
+#endif
+				default:
+					return true;
+				}
+			}
+
+			static void scramble(uint64_t *acc) {
+				for (int i = 0; i < 8; i++) {
+					uint64_t a = acc[i];
+					a ^= a >> 47;
+					a ^= scramble_key[i];
+					acc[i] = a * prime32_1;
+				}
+			}
+
+			// The high and low halves of the 128-bit product, XORed.
+			static uint64_t fold_multiply(uint64_t a, uint64_t b) {
+#if defined(__SIZEOF_INT128__)
+				unsigned __int128 p = static_cast<unsigned __int128>(a) * b;
+				return uint64_t(p) ^ uint64_t(p >> 64);
+#else
+				uint64_t lo_lo = (a & 0xFFFFFFFFu) * (b & 0xFFFFFFFFu);
+				uint64_t hi_lo = (a >> 32) * (b & 0xFFFFFFFFu);
+				uint64_t lo_hi = (a & 0xFFFFFFFFu) * (b >> 32);
+				uint64_t hi_hi = (a >> 32) * (b >> 32);
+				uint64_t cross = (lo_lo >> 32) + (hi_lo & 0xFFFFFFFFu) + lo_hi;
+				uint64_t upper = (hi_lo >> 32) + (cross >> 32) + hi_hi;
+				uint64_t lower = (cross << 32) | (lo_lo & 0xFFFFFFFFu);
+				return upper ^ lower;
+#endif
+			}
+
+			static uint64_t avalanche(uint64_t h) {
+				h ^= h >> 37;
+				h *= 0x165667919E3779F9ull;
+				return h ^ (h >> 32);
+			}
+
+			static uint64_t fold(const uint64_t *acc, const uint64_t (&key)[8], uint64_t start) {
+				uint64_t h = start;
+				for (int i = 0; i < 8; i += 2)
+					h += fold_multiply(acc[i] ^ key[i], acc[i + 1] ^ key[i + 1]);
+				return avalanche(h);
+			}
+
+
+			// --- content_hasher -------------------------------------------------------------------------------
+
+			content_hasher::content_hasher(content_hash_path path)
+				: accumulate_(select_accumulate(path)) {
+				// XXH3's initial accumulators.
+				static const uint64_t init[8] = {0xC2B2AE3Du, prime64_1, prime64_2, 0x165667B19E3779F9ull, 0x85EBCA77C2B2AE63ull, 0x85EBCA77u, 0x27D4EB2F165667C5ull, prime32_1};
+				memcpy(acc_, init, sizeof(acc_));
+			}
+
+			void content_hasher::consume(const uint8_t *data, size_t stripes) {
+				while (stripes) {
+					size_t n = std::min(stripes, stripes_per_scramble - stripes_);
+					accumulate_(acc_, data, n);
+					data += n * 64;
+					stripes -= n;
+					stripes_ += n;
+					if (stripes_ == stripes_per_scramble) {
+						scramble(acc_);
+						stripes_ = 0;
+					}
+				}
+			}
+
+			void content_hasher::update(const void *data, size_t size) {
+				const uint8_t *p = static_cast<const uint8_t *>(data);
+				total_ += size;
+				if (buffered_) {
+					size_t n = std::min(size, sizeof(buffer_) - buffered_);
+					memcpy(buffer_ + buffered_, p, n);
+					buffered_ += n;
+					p += n;
+					size -= n;
+					if (buffered_ < sizeof(buffer_))
+						return;
+					consume(buffer_, 1);
+					buffered_ = 0;
+				}
+				const size_t stripes = size / 64;
+				consume(p, stripes);
+				p += stripes * 64;
+				size -= stripes * 64;
+				memcpy(buffer_, p, size);
+				buffered_ = size;
+			}
+
+			content_hash content_hasher::finish() const {
+				alignas(32) uint64_t acc[8];
+				memcpy(acc, acc_, sizeof(acc));
+				if (buffered_) {
+					uint8_t last[64] = {};
+					memcpy(last, buffer_, buffered_);
+					accumulate_(acc, last, 1);
+				}
+				content_hash rv;
+				rv.lo = fold(acc, fold_key_lo, total_ * prime64_1);
+				rv.hi = fold(acc, fold_key_hi, ~(total_ * prime64_2));
+				// the empty hash means "no hash":
+				if (rv.empty())
+					rv.lo = 1;
+				return rv;
+			}
+
+
+			// --- images ---------------------------------------------------------------------------------------
+
+			content_hash hash_image_rows(const void *data, size_t row_bytes, int height, ptrdiff_t stride, std::initializer_list<uint64_t> format) {
+				content_hasher h;
+				for (uint64_t v : format)
+					h.update(&v, sizeof(v));
+				const uint8_t *rows = static_cast<const uint8_t *>(data);
+				if (stride == ptrdiff_t(row_bytes)) {
+					h.update(rows, row_bytes * size_t(std::max(height, 0)));
+				} else {
+					for (int y = 0; y < height; y++)
+						h.update(rows + y * stride, row_bytes);
+				}
+				return h.finish();
+			}
+
+			content_hash hash_strided_image(const strided_image &img) {
+				static const size_t sample_sizes[] = {1, 2, 2, 4};
+				const size_t pixel = sample_sizes[int(img.type)] * img.channels;
+				if (!img.data || img.width <= 0 || img.height <= 0 || (img.x_stride && img.x_stride != ptrdiff_t(pixel)))
+					return {};
+				const size_t row_bytes = pixel * img.width;
+				return hash_image_rows(img.data, row_bytes, img.height, img.y_stride ? img.y_stride : ptrdiff_t(row_bytes), {uint64_t(img.width), uint64_t(img.height), uint64_t(img.channels), uint64_t(img.type)});
+			}
+
+			content_hash hash_pix_raster(const pix_raster &pix) {
+				// the padding bits at the end of the lines are hashed as well: at worst, that's a missed duplicate.
+				content_hasher h;
+				const uint64_t format[] = {uint64_t(pix.width), uint64_t(pix.height), uint64_t(pix.depth), uint64_t(pix.wpl), uint64_t(pix.spp), uint64_t(pix.colormap ? pix.colormap_size : 0)};
+				h.update(format, sizeof(format));
+				if (pix.colormap)
+					h.update(pix.colormap, size_t(pix.colormap_size) * 4);
+				h.update(pix.data, size_t(pix.wpl) * 4 * size_t(std::max(pix.height, 0)));
+				return h.finish();
+			}
+
+		} // namespace image
+
+	} // namespace driver
+
+}
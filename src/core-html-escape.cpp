@@ -0,0 +1,368 @@
+
+#include <diagnostics/diagnostics.h>
+
+#include <cstring>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#define LIBDIAG_HTML_ESCAPE_X86 1
+#endif
+
+
+// Finds the bytes which cannot go into an HTML document as-is: the characters which must be escaped, plus
+// whatever is not valid UTF-8. Both are checked in a single pass over the text, 16 or 32 bytes at a time.
+//
+// The UTF-8 validation is the lookup-table algorithm by John Keiser and Daniel Lemire, as used by simdjson
+// and simdutf: each byte is classified by the high and low nibble of its predecessor plus its own high nibble,
+// via three 16-entry table lookups, and the bitwise AND of the three classifications is non-zero for every
+// error. Only the check whether the 3rd and 4th bytes of a sequence are continuation bytes needs extra work.
+//
+// See also: https://arxiv.org/abs/2010.03090 ("Validating UTF-8 In Less Than One Instruction Per Byte")
+
+namespace diagnostics {
+
+	namespace driver {
+
+		static inline bool is_html_special(unsigned char ch) {
+			return ch == '<' || ch == '>' || ch == '&' || ch == '"';
+		}
+
+		size_t utf8_sequence_length(std::string_view text) {
+			const unsigned char *p = reinterpret_cast<const unsigned char *>(text.data());
+			const size_t n = text.size();
+			if (n == 0)
+				return 0;
+
+			unsigned char c = p[0];
+			if (c < 0x80)
+				return 1;
+
+			size_t len;
+			unsigned char lo = 0x80, hi = 0xBF;      // valid range of the 2nd byte
+			if (c >= 0xC2 && c <= 0xDF) {
+				len = 2;
+			} else if (c >= 0xE0 && c <= 0xEF) {
+				len = 3;
+				if (c == 0xE0)
+					lo = 0xA0;      // overlong
+				else if (c == 0xED)
+					hi = 0x9F;      // surrogates
+			} else if (c >= 0xF0 && c <= 0xF4) {
+				len = 4;
+				if (c == 0xF0)
+					lo = 0x90;      // overlong
+				else if (c == 0xF4)
+					hi = 0x8F;      // beyond U+10FFFF
+			} else {
+				return 0;
+			}
+
+			if (n < len || p[1] < lo || p[1] > hi)
+				return 0;
+			for (size_t i = 2; i < len; i++) {
+				if ((p[i] & 0xC0) != 0x80)
+					return 0;
+			}
+			return len;
+		}
+
+		static size_t html_clean_prefix_scalar(const unsigned char *s, size_t n) {
+			size_t i = 0;
+			while (i < n) {
+				unsigned char c = s[i];
+				if (c < 0x80) {
+					if (is_html_special(c))
+						return i;
+					i++;
+					continue;
+				}
+				size_t len = utf8_sequence_length(std::string_view(reinterpret_cast<const char *>(s + i), n - i));
+				if (len == 0)
+					return i;
+				i += len;
+			}
+			return n;
+		}
+
+		// Number of bytes at the end of a block which belong to a UTF-8 sequence that continues in the next block.
+		// Only valid for a block which passed validation.
+		static inline size_t incomplete_tail(const unsigned char *block_end) {
+			if (block_end[-1] >= 0xC0)
+				return 1;
+			if (block_end[-2] >= 0xE0)
+				return 2;
+			if (block_end[-3] >= 0xF0)
+				return 3;
+			return 0;
+		}
+
+#if defined(LIBDIAG_HTML_ESCAPE_X86)
+
+		static inline size_t lowest_bit_index(unsigned int mask) {
+#if defined(_MSC_VER)
+			unsigned long index;
+			_BitScanForward(&index, mask);
+			return index;
+#else
+			return static_cast<size_t>(__builtin_ctz(mask));
+#endif
+		}
+
+		// error classes: see the paper referenced above for the details.
+		enum : uint8_t {
+			TOO_SHORT = 1 << 0,                     // 11______ 0_______ or 11______ 11______
+			TOO_LONG = 1 << 1,                      // 0_______ 10______
+			OVERLONG_3 = 1 << 2,                    // 11100000 100_____
+			TOO_LARGE = 1 << 3,                     // 11110100 1001____ (and above)
+			SURROGATE = 1 << 4,                     // 11101101 101_____
+			OVERLONG_2 = 1 << 5,                    // 1100000_ 10______
+			TOO_LARGE_1000 = 1 << 6,                // 11110101 1000____ (and above)
+			OVERLONG_4 = 1 << 6,                    // 11110000 1000____
+			TWO_CONTS = 1 << 7,                     // 10______ 10______
+			CARRY = TOO_SHORT | TOO_LONG | TWO_CONTS,
+		};
+
+		alignas(16) static const uint8_t byte_1_high_table[16] = {
+			// 0_______ ________ : ASCII in byte 1
+			TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG,
+			// 10______ ________ : continuation in byte 1
+			TWO_CONTS, TWO_CONTS, TWO_CONTS, TWO_CONTS,
+			// 1100____ ________ : 2-byte lead in byte 1
+			TOO_SHORT | OVERLONG_2,
+			// 1101____ ________ : 2-byte lead in byte 1
+			TOO_SHORT,
+			// 1110____ ________ : 3-byte lead in byte 1
+			TOO_SHORT | OVERLONG_3 | SURROGATE,
+			// 1111____ ________ : 4-byte lead in byte 1
+			TOO_SHORT | TOO_LARGE | TOO_LARGE_1000 | OVERLONG_4,
+		};
+
+		alignas(16) static const uint8_t byte_1_low_table[16] = {
+			CARRY | OVERLONG_3 | OVERLONG_2 | OVERLONG_4,   // ____0000
+			CARRY | OVERLONG_2,                             // ____0001
+			CARRY,                                          // ____001_
+			CARRY,
+			CARRY | TOO_LARGE,                              // ____0100
+			CARRY | TOO_LARGE | TOO_LARGE_1000,             // ____0101
+			CARRY | TOO_LARGE | TOO_LARGE_1000,             // ____011_
+			CARRY | TOO_LARGE | TOO_LARGE_1000,
+			CARRY | TOO_LARGE | TOO_LARGE_1000,             // ____1___
+			CARRY | TOO_LARGE | TOO_LARGE_1000,
+			CARRY | TOO_LARGE | TOO_LARGE_1000,
+			CARRY | TOO_LARGE | TOO_LARGE_1000,
+			CARRY | TOO_LARGE | TOO_LARGE_1000,
+			CARRY | TOO_LARGE | TOO_LARGE_1000 | SURROGATE, // ____1101
+			CARRY | TOO_LARGE | TOO_LARGE_1000,
+			CARRY | TOO_LARGE | TOO_LARGE_1000,
+		};
+
+		alignas(16) static const uint8_t byte_2_high_table[16] = {
+			// ________ 0_______ : ASCII in byte 2
+			TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT,
+			// ________ 1000____
+			TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE_1000 | OVERLONG_4,
+			// ________ 1001____
+			TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE,
+			// ________ 101_____
+			TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE,
+			TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE,
+			// ________ 11______ : lead byte in byte 2
+			TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT,
+		};
+
+#if defined(__GNUC__) || defined(__clang__)
+		__attribute__((target("sse4.2")))
+#endif
+		static size_t html_clean_prefix_sse42(const unsigned char *s, size_t n) {
+			const __m128i nibble = _mm_set1_epi8(0x0F);
+			const __m128i t1h = _mm_load_si128(reinterpret_cast<const __m128i *>(byte_1_high_table));
+			const __m128i t1l = _mm_load_si128(reinterpret_cast<const __m128i *>(byte_1_low_table));
+			const __m128i t2h = _mm_load_si128(reinterpret_cast<const __m128i *>(byte_2_high_table));
+
+			__m128i prev = _mm_setzero_si128();
+			size_t prev_tail = 0;
+			alignas(16) unsigned char padded[16];
+
+			for (size_t i = 0; i < n; i += 16) {
+				size_t len = n - i;
+				__m128i in;
+				if (len >= 16) {
+					in = _mm_loadu_si128(reinterpret_cast<const __m128i *>(s + i));
+				} else {
+					// the zero padding is plain ASCII, so a sequence which is cut off by the end of the text is
+					// reported as an error, like any other incomplete sequence.
+					memset(padded, 0, sizeof(padded));
+					memcpy(padded, s + i, len);
+					in = _mm_load_si128(reinterpret_cast<const __m128i *>(padded));
+				}
+
+				__m128i special = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(in, _mm_set1_epi8('<')), _mm_cmpeq_epi8(in, _mm_set1_epi8('>'))),
+					_mm_or_si128(_mm_cmpeq_epi8(in, _mm_set1_epi8('&')), _mm_cmpeq_epi8(in, _mm_set1_epi8('"'))));
+				unsigned int special_mask = static_cast<unsigned int>(_mm_movemask_epi8(special));
+
+				// pure ASCII following a complete sequence (the common case) needs no validation.
+				if (_mm_movemask_epi8(in) != 0 || prev_tail != 0) {
+					__m128i prev1 = _mm_alignr_epi8(in, prev, 15);
+					__m128i b1h = _mm_shuffle_epi8(t1h, _mm_and_si128(_mm_srli_epi16(prev1, 4), nibble));
+					__m128i b1l = _mm_shuffle_epi8(t1l, _mm_and_si128(prev1, nibble));
+					__m128i b2h = _mm_shuffle_epi8(t2h, _mm_and_si128(_mm_srli_epi16(in, 4), nibble));
+					__m128i special_cases = _mm_and_si128(_mm_and_si128(b1h, b1l), b2h);
+
+					__m128i prev2 = _mm_alignr_epi8(in, prev, 14);
+					__m128i prev3 = _mm_alignr_epi8(in, prev, 13);
+					__m128i must_be_continuation = _mm_or_si128(_mm_subs_epu8(prev2, _mm_set1_epi8(char(0xE0 - 0x80))), _mm_subs_epu8(prev3, _mm_set1_epi8(char(0xF0 - 0x80))));
+					__m128i error = _mm_xor_si128(_mm_and_si128(must_be_continuation, _mm_set1_epi8(char(0x80))), special_cases);
+
+					if (!_mm_testz_si128(error, error)) {
+						// pinpoint the offending byte: it sits somewhere after the last verified sequence.
+						size_t verified = i - prev_tail;
+						return verified + html_clean_prefix_scalar(s + verified, n - verified);
+					}
+				}
+
+				if (special_mask != 0)
+					return i + lowest_bit_index(special_mask);
+				if (len <= 16)
+					return len == 16 ? n - incomplete_tail(s + n) : n;
+
+				prev = in;
+				prev_tail = incomplete_tail(s + i + 16);
+			}
+			return n;
+		}
+
+#if defined(__GNUC__) || defined(__clang__)
+		__attribute__((target("avx2")))
+#endif
+		static size_t html_clean_prefix_avx2(const unsigned char *s, size_t n) {
+			const __m256i nibble = _mm256_set1_epi8(0x0F);
+			const __m256i t1h = _mm256_broadcastsi128_si256(_mm_load_si128(reinterpret_cast<const __m128i *>(byte_1_high_table)));
+			const __m256i t1l = _mm256_broadcastsi128_si256(_mm_load_si128(reinterpret_cast<const __m128i *>(byte_1_low_table)));
+			const __m256i t2h = _mm256_broadcastsi128_si256(_mm_load_si128(reinterpret_cast<const __m128i *>(byte_2_high_table)));
+
+			__m256i prev = _mm256_setzero_si256();
+			size_t prev_tail = 0;
+			alignas(32) unsigned char padded[32];
+
+			for (size_t i = 0; i < n; i += 32) {
+				size_t len = n - i;
+				__m256i in;
+				if (len >= 32) {
+					in = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(s + i));
+				} else {
+					memset(padded, 0, sizeof(padded));
+					memcpy(padded, s + i, len);
+					in = _mm256_load_si256(reinterpret_cast<const __m256i *>(padded));
+				}
+
+				__m256i special = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(in, _mm256_set1_epi8('<')), _mm256_cmpeq_epi8(in, _mm256_set1_epi8('>'))),
+					_mm256_or_si256(_mm256_cmpeq_epi8(in, _mm256_set1_epi8('&')), _mm256_cmpeq_epi8(in, _mm256_set1_epi8('"'))));
+				unsigned int special_mask = static_cast<unsigned int>(_mm256_movemask_epi8(special));
+
+				if (_mm256_movemask_epi8(in) != 0 || prev_tail != 0) {
+					// the byte shuffles work per 128-bit lane, so the "previous bytes" vectors are assembled from
+					// the upper lane of `prev` plus the lower lane of `in`.
+					__m256i shifted = _mm256_permute2x128_si256(prev, in, 0x21);
+					__m256i prev1 = _mm256_alignr_epi8(in, shifted, 15);
+					__m256i b1h = _mm256_shuffle_epi8(t1h, _mm256_and_si256(_mm256_srli_epi16(prev1, 4), nibble));
+					__m256i b1l = _mm256_shuffle_epi8(t1l, _mm256_and_si256(prev1, nibble));
+					__m256i b2h = _mm256_shuffle_epi8(t2h, _mm256_and_si256(_mm256_srli_epi16(in, 4), nibble));
+					__m256i special_cases = _mm256_and_si256(_mm256_and_si256(b1h, b1l), b2h);
+
+					__m256i prev2 = _mm256_alignr_epi8(in, shifted, 14);
+					__m256i prev3 = _mm256_alignr_epi8(in, shifted, 13);
+					__m256i must_be_continuation = _mm256_or_si256(_mm256_subs_epu8(prev2, _mm256_set1_epi8(char(0xE0 - 0x80))), _mm256_subs_epu8(prev3, _mm256_set1_epi8(char(0xF0 - 0x80))));
+					__m256i error = _mm256_xor_si256(_mm256_and_si256(must_be_continuation, _mm256_set1_epi8(char(0x80))), special_cases);
+
+					if (!_mm256_testz_si256(error, error)) {
+						size_t verified = i - prev_tail;
+						return verified + html_clean_prefix_scalar(s + verified, n - verified);
+					}
+				}
+
+				if (special_mask != 0)
+					return i + lowest_bit_index(special_mask);
+				if (len <= 32)
+					return len == 32 ? n - incomplete_tail(s + n) : n;
+
+				prev = in;
+				prev_tail = incomplete_tail(s + i + 32);
+			}
+			return n;
+		}
+
+		using clean_prefix_function = size_t (*)(const unsigned char *s, size_t n);
+
+		static clean_prefix_function select_clean_prefix() {
+#if defined(_MSC_VER)
+			int info[4];
+			__cpuid(info, 1);
+			bool sse42 = (info[2] & (1 << 20)) != 0;
+			bool os_avx = (info[2] & (1 << 27)) != 0 && (_xgetbv(0) & 6) == 6;
+			__cpuidex(info, 7, 0);
+			bool avx2 = os_avx && (info[1] & (1 << 5)) != 0;
+#else
+			__builtin_cpu_init();
+			bool sse42 = __builtin_cpu_supports("sse4.2");
+			bool avx2 = __builtin_cpu_supports("avx2");
+#endif
+			if (avx2)
+				return html_clean_prefix_avx2;
+			if (sse42)
+				return html_clean_prefix_sse42;
+			return html_clean_prefix_scalar;
+		}
+
+#endif
+
+		size_t html_clean_prefix(std::string_view text) {
+			const unsigned char *s = reinterpret_cast<const unsigned char *>(text.data());
+#if defined(LIBDIAG_HTML_ESCAPE_X86)
+			static const clean_prefix_function clean_prefix = select_clean_prefix();
+			return clean_prefix(s, text.size());
+#else
+			return html_clean_prefix_scalar(s, text.size());
+#endif
+		}
+
+		std::string_view html_entity(char ch) {
+			switch (ch) {
+			case '<':
+				return "&lt;";
+			case '>':
+				return "&gt;";
+			case '&':
+				return "&amp;";
+			case '"':
+				return "&quot;";
+			default:
+				return {};
+			}
+		}
+
+		void escape_html(std::string_view text, std::string &out) {
+			while (!text.empty()) {
+				size_t clean = html_clean_prefix(text);
+				out.append(text.data(), clean);
+				text.remove_prefix(clean);
+				if (text.empty())
+					break;
+
+				std::string_view entity = html_entity(text[0]);
+				if (!entity.empty()) {
+					out += entity;
+					text.remove_prefix(1);
+				} else {
+					// invalid UTF-8: one replacement character per offending byte.
+					out += utf8_replacement_character;
+					text.remove_prefix(1);
+				}
+			}
+		}
+
+	} // namespace driver
+
+}
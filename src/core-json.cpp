@@ -0,0 +1,59 @@
+#include <diagnostics/implementation/core-json.h>
+
+#include <fmt/format.h>
+
+#include <cstdint>
+
+
+namespace diagnostics {
+
+	void append_json_string(std::string &out, std::string_view s) {
+		out += '"';
+		for (char ch : s) {
+			switch (ch) {
+			case '"':
+				out += "\\\"";
+				break;
+			case '\\':
+				out += "\\\\";
+				break;
+			case '<':
+				// keeps "</script>" out of the output, should the data ever be inlined in a page.
+				out += "\\u003c";
+				break;
+			default:
+				if (static_cast<unsigned char>(ch) < 0x20)
+					out += fmt::format("\\u{:04x}", static_cast<unsigned char>(ch));
+				else
+					out += ch;
+				break;
+			}
+		}
+		out += '"';
+	}
+
+	void append_base64(std::string &out, std::string_view data) {
+		static const char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+		size_t i = 0;
+		for (; i + 3 <= data.size(); i += 3) {
+			uint32_t v = (uint32_t(uint8_t(data[i])) << 16) | (uint32_t(uint8_t(data[i + 1])) << 8) | uint8_t(data[i + 2]);
+			out += alphabet[v >> 18];
+			out += alphabet[(v >> 12) & 63];
+			out += alphabet[(v >> 6) & 63];
+			out += alphabet[v & 63];
+		}
+		if (i + 1 == data.size()) {
+			uint32_t v = uint32_t(uint8_t(data[i])) << 16;
+			out += alphabet[v >> 18];
+			out += alphabet[(v >> 12) & 63];
+			out += "==";
+		} else if (i + 2 == data.size()) {
+			uint32_t v = (uint32_t(uint8_t(data[i])) << 16) | (uint32_t(uint8_t(data[i + 1])) << 8);
+			out += alphabet[v >> 18];
+			out += alphabet[(v >> 12) & 63];
+			out += alphabet[(v >> 6) & 63];
+			out += '=';
+		}
+	}
+
+}
@@ -0,0 +1,473 @@
+
+#include <diagnostics/diagnostics.h>
+
+#include <algorithm>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#define LIBDIAG_PIX_CONVERT_X86 1
+#if defined(__GNUC__) || defined(__clang__)
+#define LIBDIAG_TARGET_SSSE3 __attribute__((target("ssse3")))
+#else
+#define LIBDIAG_TARGET_SSSE3
+#endif
+#endif
+
+
+// Converts leptonica PIX rasters to the 8-bit scanlines the encoders take, one row at a time.
+//
+// A PIX line is a run of 32-bit words in native byte order, with the pixels packed MSB-first into each word,
+// so on a little-endian machine every 4-byte group of a line is in reverse order: leptonica itself converts
+// with `pixEndianByteSwapNew()` (a copy of the image) before handing the raster to an encoder, then walks it
+// pixel by pixel. Here the byte swap is a PSHUFB, done on the fly as part of the conversion, and the pixel
+// unpacking is done 16 input bytes (16..128 pixels) at a time: the 1 bpp kernel broadcasts each byte over 8
+// lanes and tests one bit per lane, the 2 and 4 bpp kernels split the bit fields with shifts and interleave
+// them, after which a PSHUFB table lookup maps each value to its gray level (or colormap index).
+//
+// The same kernels produce the rows of bilevel PNG images (see `encode_bilevel_png()`): from 1 bpp PIX, that
+// is the byte-swapped line, inverted; from 8-bit masks, one PMOVMSKB per 16 pixels.
+//
+// The scalar kernels work on the word values, so they are independent of the byte order.
+
+namespace diagnostics {
+
+	namespace driver {
+
+		namespace image {
+
+			// --- scalar kernels -------------------------------------------------------------------------------
+			//
+			// Each kernel converts pixels (or bytes) [begin, end) of a line, so the SIMD kernels can leave the
+			// ragged end of a line to them.
+
+			// Byte `i` of the MSB-first byte stream in a line.
+			static inline uint8_t stream_byte(const uint32_t *line, size_t i) {
+				return uint8_t(line[i >> 2] >> (8 * (3 - (i & 3))));
+			}
+
+			// `flip` is XORed into every byte.
+			static void bytes_scalar(const uint32_t *line, size_t begin, size_t end, uint8_t *dst, uint8_t flip) {
+				for (size_t i = begin; i < end; i++)
+					dst[i] = stream_byte(line, i) ^ flip;
+			}
+
+			// 1 bpp: 0 bits become `zero`, 1 bits become `one`.
+			static void bits_1_scalar(const uint32_t *line, int begin, int end, uint8_t *dst, uint8_t zero, uint8_t one) {
+				for (int x = begin; x < end; x++)
+					dst[x] = ((line[x >> 5] >> (31 - (x & 31))) & 1) ? one : zero;
+			}
+
+			// 2 bpp: values are mapped through `table`.
+			static void bits_2_scalar(const uint32_t *line, int begin, int end, uint8_t *dst, const uint8_t *table) {
+				for (int x = begin; x < end; x++)
+					dst[x] = table[(line[x >> 4] >> (2 * (15 - (x & 15)))) & 3];
+			}
+
+			// 4 bpp: values are mapped through `table`.
+			static void bits_4_scalar(const uint32_t *line, int begin, int end, uint8_t *dst, const uint8_t *table) {
+				for (int x = begin; x < end; x++)
+					dst[x] = table[(line[x >> 3] >> (4 * (7 - (x & 7)))) & 0xF];
+			}
+
+			// 16 bpp: keeps the high byte of each value.
+			static void high_bytes_16_scalar(const uint32_t *line, int begin, int end, uint8_t *dst) {
+				for (int x = begin; x < end; x++)
+					dst[x] = uint8_t(line[x >> 1] >> (x & 1 ? 8 : 24));
+			}
+
+			// 32 bpp: 0xRRGGBBAA words to RGB.
+			static void rgb_32_scalar(const uint32_t *line, int begin, int end, uint8_t *dst) {
+				for (int x = begin; x < end; x++) {
+					uint32_t v = line[x];
+					dst[3 * x + 0] = uint8_t(v >> 24);
+					dst[3 * x + 1] = uint8_t(v >> 16);
+					dst[3 * x + 2] = uint8_t(v >> 8);
+				}
+			}
+
+			// 8-bit mask to bilevel: 8 pixels per byte, MSB-first, nonzero pixels are 1 bits.
+			static void pack_mask_scalar(const uint8_t *src, int begin, int end, uint8_t *dst) {
+				for (int x = begin; x < end; x += 8) {
+					uint8_t bits = 0;
+					for (int i = 0; i < 8 && x + i < end; i++)
+						bits |= uint8_t((src[x + i] != 0) << (7 - i));
+					dst[x / 8] = bits;
+				}
+			}
+
+			static bool is_mask_row_scalar(const uint8_t *src, int begin, int end) {
+				for (int x = begin; x < end; x++) {
+					if (src[x] != 0 && src[x] != 255)
+						return false;
+				}
+				return true;
+			}
+
+			static void bytes_0(const uint32_t *line, size_t n, uint8_t *dst, uint8_t flip) {
+				bytes_scalar(line, 0, n, dst, flip);
+			}
+			static void bits_1_0(const uint32_t *line, int w, uint8_t *dst, uint8_t zero, uint8_t one) {
+				bits_1_scalar(line, 0, w, dst, zero, one);
+			}
+			static void bits_2_0(const uint32_t *line, int w, uint8_t *dst, const uint8_t *table) {
+				bits_2_scalar(line, 0, w, dst, table);
+			}
+			static void bits_4_0(const uint32_t *line, int w, uint8_t *dst, const uint8_t *table) {
+				bits_4_scalar(line, 0, w, dst, table);
+			}
+			static void high_bytes_16_0(const uint32_t *line, int w, uint8_t *dst) {
+				high_bytes_16_scalar(line, 0, w, dst);
+			}
+			static void rgb_32_0(const uint32_t *line, int w, uint8_t *dst) {
+				rgb_32_scalar(line, 0, w, dst);
+			}
+			static void pack_mask_0(const uint8_t *src, int w, uint8_t *dst) {
+				pack_mask_scalar(src, 0, w, dst);
+			}
+			static bool is_mask_row_0(const uint8_t *src, int w) {
+				return is_mask_row_scalar(src, 0, w);
+			}
+
+
+			// --- SSSE3 kernels --------------------------------------------------------------------------------
+			//
+			// x86 is little-endian, so the bytes of each word are in reverse stream order in memory.
+
+#if defined(LIBDIAG_PIX_CONVERT_X86)
+
+			LIBDIAG_TARGET_SSSE3
+			static inline __m128i load_stream_16(const uint32_t *words) {
+				const __m128i swap = _mm_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+				return _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i *>(words)), swap);
+			}
+
+			LIBDIAG_TARGET_SSSE3
+			static void bytes_ssse3(const uint32_t *line, size_t n, uint8_t *dst, uint8_t flip) {
+				const __m128i flip_bits = _mm_set1_epi8(char(flip));
+				size_t i = 0;
+				for (; i + 16 <= n; i += 16)
+					_mm_storeu_si128(reinterpret_cast<__m128i *>(dst + i), _mm_xor_si128(load_stream_16(line + i / 4), flip_bits));
+				bytes_scalar(line, i, n, dst, flip);
+			}
+
+			LIBDIAG_TARGET_SSSE3
+			static void bits_1_ssse3(const uint32_t *line, int w, uint8_t *dst, uint8_t zero, uint8_t one) {
+				const __m128i bits = _mm_setr_epi8(char(0x80), 0x40, 0x20, 0x10, 8, 4, 2, 1, char(0x80), 0x40, 0x20, 0x10, 8, 4, 2, 1);
+				const __m128i zeros = _mm_setzero_si128();
+				const __m128i zero_value = _mm_set1_epi8(char(zero));
+				const __m128i one_value = _mm_set1_epi8(char(one));
+				int x = 0;
+				for (; x + 128 <= w; x += 128) {
+					__m128i v = load_stream_16(line + x / 32);
+					for (int k = 0; k < 8; k++) {
+						// lanes 0..7 get byte 2k, lanes 8..15 byte 2k + 1
+						const __m128i spread = _mm_add_epi8(_mm_setr_epi8(0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1, 1, 1, 1), _mm_set1_epi8(char(2 * k)));
+						__m128i clear = _mm_cmpeq_epi8(_mm_and_si128(_mm_shuffle_epi8(v, spread), bits), zeros);
+						__m128i out = _mm_or_si128(_mm_and_si128(clear, zero_value), _mm_andnot_si128(clear, one_value));
+						_mm_storeu_si128(reinterpret_cast<__m128i *>(dst + x + 16 * k), out);
+					}
+				}
+				bits_1_scalar(line, x, w, dst, zero, one);
+			}
+
+			LIBDIAG_TARGET_SSSE3
+			static void bits_2_ssse3(const uint32_t *line, int w, uint8_t *dst, const uint8_t *table) {
+				const __m128i lut = _mm_setr_epi8(char(table[0]), char(table[1]), char(table[2]), char(table[3]), 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0);
+				const __m128i mask = _mm_set1_epi8(3);
+				int x = 0;
+				for (; x + 64 <= w; x += 64) {
+					__m128i v = load_stream_16(line + x / 16);
+					// the 4 pixels of each byte, from the most significant bits down:
+					__m128i f0 = _mm_and_si128(_mm_srli_epi16(v, 6), mask);
+					__m128i f1 = _mm_and_si128(_mm_srli_epi16(v, 4), mask);
+					__m128i f2 = _mm_and_si128(_mm_srli_epi16(v, 2), mask);
+					__m128i f3 = _mm_and_si128(v, mask);
+					__m128i lo01 = _mm_unpacklo_epi8(f0, f1);
+					__m128i lo23 = _mm_unpacklo_epi8(f2, f3);
+					__m128i hi01 = _mm_unpackhi_epi8(f0, f1);
+					__m128i hi23 = _mm_unpackhi_epi8(f2, f3);
+					__m128i *out = reinterpret_cast<__m128i *>(dst + x);
+					_mm_storeu_si128(out + 0, _mm_shuffle_epi8(lut, _mm_unpacklo_epi16(lo01, lo23)));
+					_mm_storeu_si128(out + 1, _mm_shuffle_epi8(lut, _mm_unpackhi_epi16(lo01, lo23)));
+					_mm_storeu_si128(out + 2, _mm_shuffle_epi8(lut, _mm_unpacklo_epi16(hi01, hi23)));
+					_mm_storeu_si128(out + 3, _mm_shuffle_epi8(lut, _mm_unpackhi_epi16(hi01, hi23)));
+				}
+				bits_2_scalar(line, x, w, dst, table);
+			}
+
+			LIBDIAG_TARGET_SSSE3
+			static void bits_4_ssse3(const uint32_t *line, int w, uint8_t *dst, const uint8_t *table) {
+				const __m128i lut = _mm_loadu_si128(reinterpret_cast<const __m128i *>(table));
+				const __m128i mask = _mm_set1_epi8(0xF);
+				int x = 0;
+				for (; x + 32 <= w; x += 32) {
+					__m128i v = load_stream_16(line + x / 8);
+					__m128i hi = _mm_and_si128(_mm_srli_epi16(v, 4), mask);
+					__m128i lo = _mm_and_si128(v, mask);
+					__m128i *out = reinterpret_cast<__m128i *>(dst + x);
+					_mm_storeu_si128(out + 0, _mm_shuffle_epi8(lut, _mm_unpacklo_epi8(hi, lo)));
+					_mm_storeu_si128(out + 1, _mm_shuffle_epi8(lut, _mm_unpackhi_epi8(hi, lo)));
+				}
+				bits_4_scalar(line, x, w, dst, table);
+			}
+
+			LIBDIAG_TARGET_SSSE3
+			static void high_bytes_16_ssse3(const uint32_t *line, int w, uint8_t *dst) {
+				// pixel 2k is the high half of word k, so its high byte is byte 3 of the word in memory.
+				const __m128i pick = _mm_setr_epi8(3, 1, 7, 5, 11, 9, 15, 13, -1, -1, -1, -1, -1, -1, -1, -1);
+				int x = 0;
+				for (; x + 16 <= w; x += 16) {
+					const __m128i *in = reinterpret_cast<const __m128i *>(line + x / 2);
+					__m128i a = _mm_shuffle_epi8(_mm_loadu_si128(in), pick);
+					__m128i b = _mm_shuffle_epi8(_mm_loadu_si128(in + 1), pick);
+					_mm_storeu_si128(reinterpret_cast<__m128i *>(dst + x), _mm_unpacklo_epi64(a, b));
+				}
+				high_bytes_16_scalar(line, x, w, dst);
+			}
+
+			LIBDIAG_TARGET_SSSE3
+			static void rgb_32_ssse3(const uint32_t *line, int w, uint8_t *dst) {
+				// 4 pixels to 12 bytes, dropping the alpha byte (byte 0 in memory) of each word.
+				const __m128i pick = _mm_setr_epi8(3, 2, 1, 7, 6, 5, 11, 10, 9, 15, 14, 13, -1, -1, -1, -1);
+				int x = 0;
+				for (; x + 16 <= w; x += 16) {
+					const __m128i *in = reinterpret_cast<const __m128i *>(line + x);
+					__m128i a = _mm_shuffle_epi8(_mm_loadu_si128(in + 0), pick);
+					__m128i b = _mm_shuffle_epi8(_mm_loadu_si128(in + 1), pick);
+					__m128i c = _mm_shuffle_epi8(_mm_loadu_si128(in + 2), pick);
+					__m128i d = _mm_shuffle_epi8(_mm_loadu_si128(in + 3), pick);
+					__m128i *out = reinterpret_cast<__m128i *>(dst + 3 * x);
+					_mm_storeu_si128(out + 0, _mm_or_si128(a, _mm_slli_si128(b, 12)));
+					_mm_storeu_si128(out + 1, _mm_or_si128(_mm_srli_si128(b, 4), _mm_slli_si128(c, 8)));
+					_mm_storeu_si128(out + 2, _mm_or_si128(_mm_srli_si128(c, 8), _mm_slli_si128(d, 4)));
+				}
+				rgb_32_scalar(line, x, w, dst);
+			}
+
+			LIBDIAG_TARGET_SSSE3
+			static void pack_mask_ssse3(const uint8_t *src, int w, uint8_t *dst) {
+				// reversing each group of 8 puts the first pixel of the group into the top bit of the movemask byte.
+				const __m128i reverse = _mm_setr_epi8(7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8);
+				const __m128i zeros = _mm_setzero_si128();
+				int x = 0;
+				for (; x + 16 <= w; x += 16) {
+					__m128i v = _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i *>(src + x)), reverse);
+					unsigned int zero_pixels = unsigned(_mm_movemask_epi8(_mm_cmpeq_epi8(v, zeros)));
+					dst[x / 8] = uint8_t(~zero_pixels);
+					dst[x / 8 + 1] = uint8_t(~zero_pixels >> 8);
+				}
+				pack_mask_scalar(src, x, w, dst);
+			}
+
+			LIBDIAG_TARGET_SSSE3
+			static bool is_mask_row_ssse3(const uint8_t *src, int w) {
+				const __m128i zeros = _mm_setzero_si128();
+				const __m128i ones = _mm_set1_epi8(-1);
+				int x = 0;
+				for (; x + 16 <= w; x += 16) {
+					__m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + x));
+					if (_mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, zeros), _mm_cmpeq_epi8(v, ones))) != 0xFFFF)
+						return false;
+				}
+				return is_mask_row_scalar(src, x, w);
+			}
+
+#endif
+
+
+			// --- dispatch -------------------------------------------------------------------------------------
+
+			struct pix_kernels {
+				void (*bytes)(const uint32_t *line, size_t n, uint8_t *dst, uint8_t flip);
+				void (*bits_1)(const uint32_t *line, int w, uint8_t *dst, uint8_t zero, uint8_t one);
+				void (*bits_2)(const uint32_t *line, int w, uint8_t *dst, const uint8_t *table);
+				void (*bits_4)(const uint32_t *line, int w, uint8_t *dst, const uint8_t *table);
+				void (*high_bytes_16)(const uint32_t *line, int w, uint8_t *dst);
+				void (*rgb_32)(const uint32_t *line, int w, uint8_t *dst);
+				void (*pack_mask)(const uint8_t *src, int w, uint8_t *dst);
+				bool (*is_mask_row)(const uint8_t *src, int w);
+			};
+
+			static pix_kernels select_pix_kernels() {
+#if defined(LIBDIAG_PIX_CONVERT_X86)
+#if defined(_MSC_VER)
+				int info[4];
+				__cpuid(info, 1);
+				bool ssse3 = (info[2] & (1 << 9)) != 0;
+#else
+				__builtin_cpu_init();
+				bool ssse3 = __builtin_cpu_supports("ssse3");
+#endif
+				if (ssse3)
+					return {bytes_ssse3, bits_1_ssse3, bits_2_ssse3, bits_4_ssse3, high_bytes_16_ssse3, rgb_32_ssse3, pack_mask_ssse3, is_mask_row_ssse3};
+#endif
+				return {bytes_0, bits_1_0, bits_2_0, bits_4_0, high_bytes_16_0, rgb_32_0, pack_mask_0, is_mask_row_0};
+			}
+
+			static const pix_kernels &kernels() {
+				static const pix_kernels k = select_pix_kernels();
+				return k;
+			}
+
+
+			// --- pix_row_converter ----------------------------------------------------------------------------
+
+			static const uint8_t gray_2[16] = {0, 85, 170, 255};
+			static const uint8_t gray_4[16] = {0, 17, 34, 51, 68, 85, 102, 119, 136, 153, 170, 187, 204, 221, 238, 255};
+			static const uint8_t identity_16[16] = {0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15};
+
+			pix_row_converter::pix_row_converter(const pix_raster &pix) :
+				pix_(pix) {
+				const int depth = pix.depth;
+				if (pix.width <= 0 || pix.height <= 0 || !pix.data || !(depth == 1 || depth == 2 || depth == 4 || depth == 8 || depth == 16 || depth == 24 || depth == 32) ||
+					int64_t(pix.wpl) * 32 < int64_t(pix.width) * depth) {
+					spdlog::error("Cannot convert a {}x{} PIX raster with depth {}", pix.width, pix.height, depth);
+					return;
+				}
+
+				if (pix.colormap && pix.colormap_size > 0 && depth <= 8) {
+					channels_ = 3;
+					// indices beyond the colormap come out black.
+					int n = std::min(pix.colormap_size, 256);
+					for (int i = 0; i < n; i++) {
+						palette_[i][0] = uint8_t(pix.colormap[i] >> 24);
+						palette_[i][1] = uint8_t(pix.colormap[i] >> 16);
+						palette_[i][2] = uint8_t(pix.colormap[i] >> 8);
+					}
+					indices_.resize(size_t(pix.width));
+				} else {
+					pix_.colormap = nullptr;
+					pix_.colormap_size = 0;
+					if (depth == 32)
+						channels_ = pix.spp == 4 ? 4 : 3;
+					else if (depth == 24)
+						channels_ = 3;
+					else
+						channels_ = 1;
+				}
+			}
+
+			void pix_row_converter::convert(int y, uint8_t *out) {
+				const pix_kernels &k = kernels();
+				const uint32_t *line = pix_.data + size_t(y) * pix_.wpl;
+				const int w = pix_.width;
+
+				if (pix_.colormap) {
+					uint8_t *idx = indices_.data();
+					switch (pix_.depth) {
+					case 1:
+						k.bits_1(line, w, idx, 0, 1);
+						break;
+					case 2:
+						k.bits_2(line, w, idx, identity_16);
+						break;
+					case 4:
+						k.bits_4(line, w, idx, identity_16);
+						break;
+					default:
+						k.bytes(line, size_t(w), idx, 0);
+						break;
+					}
+					// 4-byte stores, overlapping by one; the last pixel must not write past the row.
+					int x = 0;
+					for (; x + 1 < w; x++)
+						memcpy(out + 3 * x, palette_[idx[x]], 4);
+					memcpy(out + 3 * x, palette_[idx[x]], 3);
+					return;
+				}
+
+				switch (pix_.depth) {
+				case 1:
+					k.bits_1(line, w, out, 255, 0);
+					break;
+				case 2:
+					k.bits_2(line, w, out, gray_2);
+					break;
+				case 4:
+					k.bits_4(line, w, out, gray_4);
+					break;
+				case 8:
+					k.bytes(line, size_t(w), out, 0);
+					break;
+				case 16:
+					k.high_bytes_16(line, w, out);
+					break;
+				case 24:
+					// 3 bytes per pixel, packed MSB-first into the words like any byte stream.
+					k.bytes(line, size_t(w) * 3, out, 0);
+					break;
+				default:
+					if (channels_ == 4)
+						k.bytes(line, size_t(w) * 4, out, 0);
+					else
+						k.rgb_32(line, w, out);
+					break;
+				}
+			}
+
+			const uint8_t *pix_row_converter::row(int y) {
+				if (row_.empty())
+					row_.resize(size_t(pix_.width) * channels_);
+				convert(y, row_.data());
+				return row_.data();
+			}
+
+			scanline_source pix_row_converter::scanlines() {
+				if (!valid())
+					return {};
+				return scanline_source(pix_.width, pix_.height, channels_, [this](int y) {
+					return row(y);
+				});
+			}
+
+			raster_buffer pix_raster_to_8bit(const pix_raster &pix) {
+				pix_row_converter converter(pix);
+				if (!converter.valid())
+					return {};
+				raster_buffer out(pix.width, pix.height, converter.channels());
+				for (int y = 0; y < pix.height; y++)
+					converter.convert(y, out.row(y));
+				return out;
+			}
+
+
+			// --- bilevel rows ---------------------------------------------------------------------------------
+
+			bool is_bilevel_pix(const pix_raster &pix) {
+				return pix.depth == 1 && !(pix.colormap && pix.colormap_size > 0) && pix.data && pix.width > 0 && pix.height > 0 && int64_t(pix.wpl) * 32 >= pix.width;
+			}
+
+			bilevel_row_function pix_bilevel_rows(const pix_raster &pix) {
+				// a 1 bpp line is the PNG row already, once the words are in stream order and black is 0.
+				const uint32_t *data = pix.data;
+				const size_t wpl = size_t(pix.wpl);
+				const size_t row_bytes = (size_t(pix.width) + 7) / 8;
+				return [data, wpl, row_bytes](int y, uint8_t *out) {
+					kernels().bytes(data + size_t(y) * wpl, row_bytes, out, 0xFF);
+				};
+			}
+
+			bilevel_row_function mask_bilevel_rows(const uint8_t *data, size_t stride, int width) {
+				return [data, stride, width](int y, uint8_t *out) {
+					kernels().pack_mask(data + size_t(y) * stride, width, out);
+				};
+			}
+
+			bool is_bilevel_mask(const uint8_t *data, size_t stride, int width, int height) {
+				const pix_kernels &k = kernels();
+				for (int y = 0; y < height; y++) {
+					if (!k.is_mask_row(data + size_t(y) * stride, width))
+						return false;
+				}
+				return true;
+			}
+
+		} // namespace image
+
+	} // namespace driver
+
+}
@@ -0,0 +1,507 @@
+
+#include <diagnostics/diagnostics.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+
+#include <zlib.h>
+
+
+// A minimal PNG encoder, so the shared image code (thumbnails, raw array renderings, ...) does not depend on
+// any of the optional image libraries.
+//
+// See also: https://www.w3.org/TR/png/
+
+namespace diagnostics {
+
+	namespace driver {
+
+		namespace image {
+
+			static const uint8_t png_signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n'};
+
+			static void put_u32(std::vector<uint8_t> &out, uint32_t v) {
+				out.push_back(uint8_t(v >> 24));
+				out.push_back(uint8_t(v >> 16));
+				out.push_back(uint8_t(v >> 8));
+				out.push_back(uint8_t(v));
+			}
+
+			static void put_chunk(std::vector<uint8_t> &out, const char type[4], const uint8_t *data, size_t size) {
+				put_u32(out, static_cast<uint32_t>(size));
+				size_t start = out.size();
+				out.insert(out.end(), type, type + 4);
+				if (size)
+					out.insert(out.end(), data, data + size);
+				uLong crc = crc32(0, out.data() + start, static_cast<uInt>(out.size() - start));
+				put_u32(out, static_cast<uint32_t>(crc));
+			}
+
+			static int color_type_for(int channels) {
+				switch (channels) {
+				case 1:
+					return 0;       // grayscale
+				case 2:
+					return 4;       // grayscale + alpha
+				case 3:
+					return 2;       // RGB
+				case 4:
+					return 6;       // RGBA
+				default:
+					return -1;
+				}
+			}
+
+			static inline uint32_t sum_abs(const uint8_t *p, size_t n) {
+				uint32_t sum = 0;
+				for (size_t i = 0; i < n; i++)
+					sum += p[i] < 128 ? p[i] : 256 - p[i];
+				return sum;
+			}
+
+			// Filters one scanline, picking the filter type (None, Sub or Up) with the smallest sum of absolute
+			// (signed) residuals: the usual heuristic, restricted to the cheap filters.
+			static void filter_row(const uint8_t *row, const uint8_t *prev, size_t row_bytes, int bpp, uint8_t *out, uint8_t *scratch) {
+				uint8_t *sub = scratch;
+				uint8_t *up = scratch + row_bytes;
+
+				for (size_t i = 0; i < row_bytes; i++) {
+					sub[i] = uint8_t(row[i] - (i >= size_t(bpp) ? row[i - bpp] : 0));
+					up[i] = uint8_t(row[i] - (prev ? prev[i] : 0));
+				}
+
+				uint32_t cost_none = sum_abs(row, row_bytes);
+				uint32_t cost_sub = sum_abs(sub, row_bytes);
+				uint32_t cost_up = prev ? sum_abs(up, row_bytes) : UINT32_MAX;
+
+				if (cost_none <= cost_sub && cost_none <= cost_up) {
+					out[0] = 0;
+					memcpy(out + 1, row, row_bytes);
+				} else if (cost_sub <= cost_up) {
+					out[0] = 1;
+					memcpy(out + 1, sub, row_bytes);
+				} else {
+					out[0] = 2;
+					memcpy(out + 1, up, row_bytes);
+				}
+			}
+
+			// Filters and deflates the rows into one zlib stream, which is handed to `emit` in pieces of up to 64K:
+			// the payload of the IDAT (or fdAT) chunks.
+			static bool deflate_rows(const scanline_source &img, int compression_level, const std::function<void(const uint8_t *data, size_t size)> &emit) {
+				const size_t row_bytes = size_t(img.width) * img.channels;
+				std::vector<uint8_t> filtered(row_bytes + 1);
+				std::vector<uint8_t> prev(row_bytes);  // the rows of the source do not outlive the next `row()` call
+				std::vector<uint8_t> scratch(row_bytes * 2);
+				std::vector<uint8_t> idat(64u << 10);
+
+				z_stream zs{};
+				if (deflateInit(&zs, compression_level) != Z_OK) {
+					spdlog::error("zlib deflateInit failed");
+					return false;
+				}
+
+				// chunks are emitted whenever the output buffer fills up, so they're all 64K except the last one.
+				bool ok = true;
+				zs.next_out = idat.data();
+				zs.avail_out = static_cast<uInt>(idat.size());
+				auto drain = [&](int flush) {
+					int rc;
+					do {
+						rc = deflate(&zs, flush);
+						if (rc == Z_STREAM_ERROR) {
+							ok = false;
+							return;
+						}
+						if (zs.avail_out == 0 || (flush == Z_FINISH && rc == Z_STREAM_END)) {
+							size_t produced = idat.size() - zs.avail_out;
+							if (produced)
+								emit(idat.data(), produced);
+							zs.next_out = idat.data();
+							zs.avail_out = static_cast<uInt>(idat.size());
+						}
+					} while (zs.avail_in > 0 || (flush == Z_FINISH && rc != Z_STREAM_END));
+				};
+
+				for (int y = 0; y < img.height && ok; y++) {
+					const uint8_t *row = img.row(y);
+					filter_row(row, y > 0 ? prev.data() : nullptr, row_bytes, img.channels, filtered.data(), scratch.data());
+					memcpy(prev.data(), row, row_bytes);
+					zs.next_in = filtered.data();
+					zs.avail_in = static_cast<uInt>(filtered.size());
+					drain(Z_NO_FLUSH);
+				}
+				if (ok)
+					drain(Z_FINISH);
+				deflateEnd(&zs);
+
+				if (!ok)
+					spdlog::error("zlib failed to compress PNG image data");
+				return ok;
+			}
+
+			static void put_ihdr(std::vector<uint8_t> &out, uint32_t w, uint32_t h, int bit_depth, int color_type) {
+				const uint8_t ihdr[13] = {uint8_t(w >> 24), uint8_t(w >> 16), uint8_t(w >> 8), uint8_t(w), uint8_t(h >> 24), uint8_t(h >> 16), uint8_t(h >> 8), uint8_t(h), uint8_t(bit_depth), uint8_t(color_type), 0, 0, 0};
+				put_chunk(out, "IHDR", ihdr, sizeof(ihdr));
+			}
+
+			bool encode_png(const scanline_source &img, std::vector<uint8_t> &out, int compression_level) {
+				int color_type = color_type_for(img.channels);
+				if (img.empty() || color_type < 0) {
+					spdlog::error("Cannot encode a {}x{} image with {} channels as PNG", img.width, img.height, img.channels);
+					return false;
+				}
+
+				out.clear();
+				out.insert(out.end(), png_signature, png_signature + sizeof(png_signature));
+				put_ihdr(out, img.width, img.height, 8, color_type);
+				if (!deflate_rows(img, compression_level, [&](const uint8_t *data, size_t size) {
+					put_chunk(out, "IDAT", data, size);
+				}))
+					return false;
+				put_chunk(out, "IEND", nullptr, 0);
+				return true;
+			}
+
+			static bool write_file(const std::string &path, const std::vector<uint8_t> &data) {
+				FILE *fp = fopen(path.c_str(), "wb");
+				if (!fp) {
+					spdlog::error("Cannot create image file {}: {}", path, strerror(errno));
+					return false;
+				}
+				bool ok = fwrite(data.data(), 1, data.size(), fp) == data.size();
+				if (fclose(fp) != 0)
+					ok = false;
+				if (!ok)
+					spdlog::error("Failed to write image file {}", path);
+				return ok;
+			}
+
+			bool write_png(const std::string &path, const scanline_source &img, int compression_level) {
+				std::vector<uint8_t> data;
+				return encode_png(img, data, compression_level) && write_file(path, data);
+			}
+
+
+			// --- animated PNG ---------------------------------------------------------------------------------
+
+			static void put_u16(std::vector<uint8_t> &out, uint16_t v) {
+				out.push_back(uint8_t(v >> 8));
+				out.push_back(uint8_t(v));
+			}
+
+			// The rectangle [x0, x1) x [y0, y1) in which the pixels of `a` and `b` differ; false when there is none.
+			static bool changed_rect(const raster &a, const raster &b, int &x0, int &y0, int &x1, int &y1) {
+				const size_t row_bytes = size_t(a.width) * a.channels;
+				size_t first = row_bytes;
+				size_t last = 0;
+				int top = a.height;
+				int bottom = 0;
+				for (int y = 0; y < a.height; y++) {
+					const uint8_t *pa = a.row(y);
+					const uint8_t *pb = b.row(y);
+					if (memcmp(pa, pb, row_bytes) == 0)
+						continue;
+					size_t i = 0;
+					while (pa[i] == pb[i])
+						i++;
+					size_t j = row_bytes;
+					while (pa[j - 1] == pb[j - 1])
+						j--;
+					first = std::min(first, i);
+					last = std::max(last, j);
+					top = std::min(top, y);
+					bottom = y + 1;
+				}
+				if (bottom == 0)
+					return false;
+				x0 = int(first / a.channels);
+				y0 = top;
+				y1 = bottom;
+				x1 = int((last + a.channels - 1) / a.channels);
+				return true;
+			}
+
+			bool write_apng(const std::string &path, int width, int height, int channels, size_t count, const std::function<raster(size_t i)> &frame, int delay, int compression_level) {
+				int color_type = color_type_for(channels);
+				if (width <= 0 || height <= 0 || color_type < 0 || count == 0 || count > (UINT32_MAX >> 2)) {
+					spdlog::error("Cannot encode {} frames of {}x{} with {} channels as animated PNG {}", count, width, height, channels, path);
+					return false;
+				}
+				FILE *fp = fopen(path.c_str(), "wb");
+				if (!fp) {
+					spdlog::error("Cannot create image file {}: {}", path, strerror(errno));
+					return false;
+				}
+
+				// the chunks go to the file as soon as they are complete: only one frame is ever held in memory.
+				bool ok = true;
+				std::vector<uint8_t> out(png_signature, png_signature + sizeof(png_signature));
+				auto flush = [&]() {
+					ok = ok && fwrite(out.data(), 1, out.size(), fp) == out.size();
+					out.clear();
+				};
+				put_ihdr(out, width, height, 8, color_type);
+				std::vector<uint8_t> chunk;
+				put_u32(chunk, uint32_t(count));
+				put_u32(chunk, 0);                              // loop forever
+				put_chunk(out, "acTL", chunk.data(), chunk.size());
+
+				// each frame after the first replaces the rectangle which changed (APNG_BLEND_OP_SOURCE), over the
+				// frame before (APNG_DISPOSE_OP_NONE).
+				raster_buffer previous(width, height, channels);
+				uint32_t sequence = 0;
+				for (size_t i = 0; i < count && ok; i++) {
+					const raster img = frame(i);
+					if (img.empty() || img.width != width || img.height != height || img.channels != channels) {
+						spdlog::error("Cannot encode frame {} of animated PNG {}", i, path);
+						ok = false;
+						break;
+					}
+					int x0 = 0, y0 = 0, x1 = width, y1 = height;
+					if (i > 0 && !changed_rect(previous.view(), img, x0, y0, x1, y1)) {
+						// unchanged: a frame must have at least one pixel, which is drawn as it was.
+						x1 = 1;
+						y1 = 1;
+					}
+					// the last frame stays a while before the animation starts over.
+					const int frame_delay = std::clamp(i + 1 == count ? std::max(delay, 1000) : delay, 1, 65535);
+
+					chunk.clear();
+					put_u32(chunk, sequence++);
+					put_u32(chunk, uint32_t(x1 - x0));
+					put_u32(chunk, uint32_t(y1 - y0));
+					put_u32(chunk, uint32_t(x0));
+					put_u32(chunk, uint32_t(y0));
+					put_u16(chunk, uint16_t(frame_delay));
+					put_u16(chunk, 1000);
+					chunk.push_back(0);                         // APNG_DISPOSE_OP_NONE
+					chunk.push_back(0);                         // APNG_BLEND_OP_SOURCE
+					put_chunk(out, "fcTL", chunk.data(), chunk.size());
+
+					const size_t offset = size_t(x0) * channels;
+					const scanline_source region(x1 - x0, y1 - y0, channels, [&](int y) {
+						return img.row(y0 + y) + offset;
+					});
+					if (!deflate_rows(region, compression_level, [&](const uint8_t *data, size_t size) {
+						if (i == 0) {
+							put_chunk(out, "IDAT", data, size);
+						} else {
+							chunk.clear();
+							put_u32(chunk, sequence++);
+							chunk.insert(chunk.end(), data, data + size);
+							put_chunk(out, "fdAT", chunk.data(), chunk.size());
+						}
+						flush();
+					}))
+						ok = false;
+					flush();
+
+					const size_t region_bytes = size_t(x1 - x0) * channels;
+					for (int y = y0; y < y1; y++)
+						memcpy(previous.row(y) + offset, img.row(y) + offset, region_bytes);
+				}
+				if (ok) {
+					put_chunk(out, "IEND", nullptr, 0);
+					flush();
+				}
+				if (fclose(fp) != 0)
+					ok = false;
+				if (!ok)
+					spdlog::error("Failed to write animated PNG {}", path);
+				return ok;
+			}
+
+
+			// --- bilevel images -------------------------------------------------------------------------------
+
+			// Counts the bytes which differ from their predecessor: runs of equal bytes are what deflate does
+			// best with, be they white space (None) or the zeros of a row which repeats the previous one (Up).
+			// The usual sum of absolute residuals means nothing for 8 pixels per byte.
+			static size_t value_changes(const uint8_t *p, size_t n) {
+				size_t changes = 0;
+				for (size_t i = 1; i < n; i++)
+					changes += p[i] != p[i - 1];
+				return changes;
+			}
+
+			// Images shorter than two strips of this many rows are deflated as one strip, on the caller's thread.
+			static constexpr int min_strip_rows = 256;
+
+			// A strip of rows, deflated as a raw stream which ends on a byte boundary (Z_SYNC_FLUSH), so the
+			// streams of all strips can be concatenated, pigz-style. Only the last strip ends the stream.
+			struct bilevel_strip {
+				int first_row = 0;
+				int end_row = 0;
+				std::vector<uint8_t> deflated;
+				uLong adler = 0;
+				size_t filtered_bytes = 0;
+				bool ok = false;
+			};
+
+			static void deflate_bilevel_strip(int width, const bilevel_row_function &rows, int compression_level, bool last, bilevel_strip &strip) {
+				const size_t row_bytes = (size_t(width) + 7) / 8;
+				std::vector<uint8_t> prev(row_bytes);
+				std::vector<uint8_t> row(row_bytes);
+				std::vector<uint8_t> up(row_bytes);
+				auto fetch = [&](int y, uint8_t *out) {
+					rows(y, out);
+					// PNG pixel padding must be zero, whatever the row function left there.
+					if (width % 8)
+						out[row_bytes - 1] &= uint8_t(0xFF00u >> (width % 8));
+				};
+				if (strip.first_row > 0)
+					fetch(strip.first_row - 1, prev.data());
+
+				z_stream zs{};
+				if (deflateInit2(&zs, compression_level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+					return;
+				strip.filtered_bytes = size_t(strip.end_row - strip.first_row) * (row_bytes + 1);
+				// the bound covers the whole strip, so every deflate() call finds enough room.
+				strip.deflated.resize(deflateBound(&zs, static_cast<uLong>(strip.filtered_bytes)) + 16);
+				zs.next_out = strip.deflated.data();
+				zs.avail_out = static_cast<uInt>(strip.deflated.size());
+				strip.adler = adler32(0, nullptr, 0);
+
+				bool ok = true;
+				for (int y = strip.first_row; y < strip.end_row && ok; y++) {
+					fetch(y, row.data());
+					for (size_t i = 0; i < row_bytes; i++)
+						up[i] = uint8_t(row[i] - prev[i]);
+
+					uint8_t type = value_changes(up.data(), row_bytes) < value_changes(row.data(), row_bytes) ? 2 : 0;
+					const uint8_t *data = type ? up.data() : row.data();
+					strip.adler = adler32(strip.adler, &type, 1);
+					strip.adler = adler32(strip.adler, data, static_cast<uInt>(row_bytes));
+					zs.next_in = &type;
+					zs.avail_in = 1;
+					ok = deflate(&zs, Z_NO_FLUSH) == Z_OK;
+					zs.next_in = const_cast<uint8_t *>(data);
+					zs.avail_in = static_cast<uInt>(row_bytes);
+					ok = ok && deflate(&zs, Z_NO_FLUSH) == Z_OK;
+					prev.swap(row);
+				}
+				if (ok)
+					ok = deflate(&zs, last ? Z_FINISH : Z_SYNC_FLUSH) == (last ? Z_STREAM_END : Z_OK);
+				strip.deflated.resize(zs.total_out);
+				deflateEnd(&zs);
+				strip.ok = ok;
+			}
+
+			// The strips of one image, shared with the jobs on the strip pool: whichever thread claims a strip first
+			// deflates it, so the caller never waits for a strip which no worker has started yet.
+			struct bilevel_strips {
+				std::vector<bilevel_strip> strips;
+				std::unique_ptr<std::atomic<bool>[]> claimed;
+				const bilevel_row_function *rows = nullptr;
+				int width = 0;
+				int compression_level = 0;
+				size_t remaining = 0;
+				std::mutex mutex;
+				std::condition_variable done;
+
+				void run(size_t i) {
+					if (claimed[i].exchange(true))
+						return;
+					deflate_bilevel_strip(width, *rows, compression_level, i + 1 == strips.size(), strips[i]);
+					std::lock_guard<std::mutex> lock(mutex);
+					if (--remaining == 0)
+						done.notify_all();
+				}
+			};
+
+			// The workers which help with the strips of large images, shared by all callers (the image pools'
+			// workers among them), so no thread is started per image. Never destroyed: a session which finishes
+			// from a static destructor may still encode.
+			static worker_pool &bilevel_strip_pool() {
+				static worker_pool *pool = new worker_pool(0, 256);
+				return *pool;
+			}
+
+			bool encode_bilevel_png(int width, int height, const bilevel_row_function &rows, std::vector<uint8_t> &out, bilevel_encode_stats *stats, unsigned int threads, int compression_level) {
+				if (width <= 0 || height <= 0 || !rows) {
+					spdlog::error("Cannot encode a {}x{} bilevel image as PNG", width, height);
+					return false;
+				}
+				auto t0 = std::chrono::steady_clock::now();
+
+				if (threads == 0)
+					threads = std::max(1u, std::thread::hardware_concurrency());
+				// each strip starts without compression history; keep them large enough for that not to matter.
+				const unsigned int strip_count = std::max(1u, std::min(threads, unsigned(height / min_strip_rows)));
+				auto job = std::make_shared<bilevel_strips>();
+				std::vector<bilevel_strip> &strips = job->strips;
+				strips.resize(strip_count);
+				for (unsigned int i = 0; i < strip_count; i++) {
+					strips[i].first_row = int(int64_t(height) * i / strip_count);
+					strips[i].end_row = int(int64_t(height) * (i + 1) / strip_count);
+				}
+
+				if (strip_count == 1) {
+					deflate_bilevel_strip(width, rows, compression_level, true, strips[0]);
+				} else {
+					job->claimed = std::make_unique<std::atomic<bool>[]>(strip_count);
+					job->rows = &rows;
+					job->width = width;
+					job->compression_level = compression_level;
+					job->remaining = strip_count;
+					// the caller takes the strips in order, and the workers from the end: when they are all busy
+					// with other images, the caller simply does all the work itself.
+					worker_pool &pool = bilevel_strip_pool();
+					for (size_t i = strip_count - 1; i > 0; i--)
+						pool.submit([job, i]() {
+							job->run(i);
+						});
+					for (size_t i = 0; i < strip_count; i++)
+						job->run(i);
+					std::unique_lock<std::mutex> lock(job->mutex);
+					job->done.wait(lock, [&] {
+						return job->remaining == 0;
+					});
+				}
+
+				for (const auto &strip : strips) {
+					if (!strip.ok) {
+						spdlog::error("zlib failed to compress PNG image data");
+						return false;
+					}
+				}
+
+				// zlib header (the FLEVEL bits are informational only), the strips, then the Adler-32 of it all.
+				std::vector<uint8_t> zdata = {0x78, uint8_t(compression_level <= 1 ? 0x01 : compression_level < 6 ? 0x5E : compression_level == 6 ? 0x9C : 0xDA)};
+				uLong adler = adler32(0, nullptr, 0);
+				for (const auto &strip : strips) {
+					zdata.insert(zdata.end(), strip.deflated.begin(), strip.deflated.end());
+					adler = adler32_combine(adler, strip.adler, static_cast<z_off_t>(strip.filtered_bytes));
+				}
+				put_u32(zdata, static_cast<uint32_t>(adler));
+
+				out.clear();
+				out.reserve(zdata.size() + 128);
+				out.insert(out.end(), png_signature, png_signature + sizeof(png_signature));
+				put_ihdr(out, width, height, 1, 0);
+				for (size_t i = 0; i < zdata.size(); i += 1u << 20)
+					put_chunk(out, "IDAT", zdata.data() + i, std::min<size_t>(zdata.size() - i, 1u << 20));
+				put_chunk(out, "IEND", nullptr, 0);
+
+				if (stats) {
+					stats->input_bytes = uint64_t(height) * ((uint64_t(width) + 7) / 8);
+					stats->output_bytes = out.size();
+					stats->strips = strip_count;
+					stats->seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+				}
+				return true;
+			}
+
+			bool write_bilevel_png(const std::string &path, int width, int height, const bilevel_row_function &rows, bilevel_encode_stats *stats, unsigned int threads, int compression_level) {
+				std::vector<uint8_t> data;
+				return encode_bilevel_png(width, height, rows, data, stats, threads, compression_level) && write_file(path, data);
+			}
+
+		} // namespace image
+
+	} // namespace driver
+
+}
@@ -0,0 +1,465 @@
+
+#include <diagnostics/diagnostics.h>
+
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define LIBDIAG_HAVE_SSE2 1
+#endif
+
+
+// Display scaling for images which are not 8-bit: find the range of the finite values, then map that range
+// onto 0..255. Both passes do 8 values per iteration with SSE2, which every x86-64 CPU has.
+//
+// The float kernels test for finite values with `x - x == 0`, which fails for NaN and both infinities, so
+// neither pollutes the range. The integer kernels are there for the heatmaps of raw 2D arrays, which come in
+// all element types (see `value_kernels`).
+//
+// The 8- and 16-bit and float values scale in float. The int32 and double values subtract the offset in
+// double, and only narrow the result: float has 24 bits of mantissa, which would merge neighboring int32
+// values above 2^24, and collapse a narrow range far from zero (1e9..1e9+1) into a bin or two.
+
+namespace diagnostics {
+
+	namespace driver {
+
+		namespace image {
+
+			void value_range::merge(const value_range &other) {
+				if (!other.count)
+					return;
+				if (!count) {
+					*this = other;
+					return;
+				}
+				min = std::min(min, other.min);
+				max = std::max(max, other.max);
+				count += other.count;
+			}
+
+			value_range find_value_range(const float *data, size_t n) {
+				float lo = FLT_MAX;
+				float hi = -FLT_MAX;
+				size_t count = 0;
+				size_t i = 0;
+#if defined(LIBDIAG_HAVE_SSE2)
+				__m128 vlo = _mm_set1_ps(FLT_MAX);
+				__m128 vhi = _mm_set1_ps(-FLT_MAX);
+				__m128i vcount = _mm_setzero_si128();
+				const __m128 zero = _mm_setzero_ps();
+				for (; i + 8 <= n; i += 8) {
+					for (int k = 0; k < 2; k++) {
+						__m128 x = _mm_loadu_ps(data + i + 4 * k);
+						__m128 finite = _mm_cmpeq_ps(_mm_sub_ps(x, x), zero);
+						vlo = _mm_min_ps(vlo, _mm_or_ps(_mm_and_ps(finite, x), _mm_andnot_ps(finite, vlo)));
+						vhi = _mm_max_ps(vhi, _mm_or_ps(_mm_and_ps(finite, x), _mm_andnot_ps(finite, vhi)));
+						// the mask is -1 per finite lane:
+						vcount = _mm_sub_epi32(vcount, _mm_castps_si128(finite));
+					}
+				}
+				alignas(16) float lanes_lo[4], lanes_hi[4];
+				alignas(16) uint32_t lanes_count[4];
+				_mm_store_ps(lanes_lo, vlo);
+				_mm_store_ps(lanes_hi, vhi);
+				_mm_store_si128(reinterpret_cast<__m128i *>(lanes_count), vcount);
+				for (int k = 0; k < 4; k++) {
+					lo = std::min(lo, lanes_lo[k]);
+					hi = std::max(hi, lanes_hi[k]);
+					count += lanes_count[k];
+				}
+#endif
+				for (; i < n; i++) {
+					float x = data[i];
+					if (std::isfinite(x)) {
+						lo = std::min(lo, x);
+						hi = std::max(hi, x);
+						count++;
+					}
+				}
+
+				value_range rv;
+				if (count) {
+					rv.min = lo;
+					rv.max = hi;
+					rv.count = count;
+				}
+				return rv;
+			}
+
+			value_range find_value_range(const uint16_t *data, size_t n) {
+				uint16_t lo = 0xFFFF;
+				uint16_t hi = 0;
+				size_t i = 0;
+#if defined(LIBDIAG_HAVE_SSE2)
+				// SSE2 only has signed 16-bit min/max: flip the sign bit on the way in and out.
+				const __m128i bias = _mm_set1_epi16(short(0x8000));
+				__m128i vlo = _mm_set1_epi16(0x7FFF);
+				__m128i vhi = _mm_set1_epi16(short(0x8000));
+				for (; i + 8 <= n; i += 8) {
+					__m128i x = _mm_xor_si128(_mm_loadu_si128(reinterpret_cast<const __m128i *>(data + i)), bias);
+					vlo = _mm_min_epi16(vlo, x);
+					vhi = _mm_max_epi16(vhi, x);
+				}
+				alignas(16) uint16_t lanes_lo[8], lanes_hi[8];
+				_mm_store_si128(reinterpret_cast<__m128i *>(lanes_lo), _mm_xor_si128(vlo, bias));
+				_mm_store_si128(reinterpret_cast<__m128i *>(lanes_hi), _mm_xor_si128(vhi, bias));
+				for (int k = 0; k < 8; k++) {
+					lo = std::min(lo, lanes_lo[k]);
+					hi = std::max(hi, lanes_hi[k]);
+				}
+#endif
+				for (; i < n; i++) {
+					lo = std::min(lo, data[i]);
+					hi = std::max(hi, data[i]);
+				}
+
+				value_range rv;
+				if (n) {
+					rv.min = lo;
+					rv.max = hi;
+					rv.count = n;
+				}
+				return rv;
+			}
+
+			value_range find_value_range(const uint8_t *data, size_t n) {
+				uint8_t lo = 0xFF;
+				uint8_t hi = 0;
+				size_t i = 0;
+#if defined(LIBDIAG_HAVE_SSE2)
+				__m128i vlo = _mm_set1_epi8(char(0xFF));
+				__m128i vhi = _mm_setzero_si128();
+				for (; i + 16 <= n; i += 16) {
+					__m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + i));
+					vlo = _mm_min_epu8(vlo, x);
+					vhi = _mm_max_epu8(vhi, x);
+				}
+				alignas(16) uint8_t lanes_lo[16], lanes_hi[16];
+				_mm_store_si128(reinterpret_cast<__m128i *>(lanes_lo), vlo);
+				_mm_store_si128(reinterpret_cast<__m128i *>(lanes_hi), vhi);
+				for (int k = 0; k < 16; k++) {
+					lo = std::min(lo, lanes_lo[k]);
+					hi = std::max(hi, lanes_hi[k]);
+				}
+#endif
+				for (; i < n; i++) {
+					lo = std::min(lo, data[i]);
+					hi = std::max(hi, data[i]);
+				}
+
+				value_range rv;
+				if (n) {
+					rv.min = lo;
+					rv.max = hi;
+					rv.count = n;
+				}
+				return rv;
+			}
+
+			value_range find_value_range(const int16_t *data, size_t n) {
+				int16_t lo = INT16_MAX;
+				int16_t hi = INT16_MIN;
+				size_t i = 0;
+#if defined(LIBDIAG_HAVE_SSE2)
+				__m128i vlo = _mm_set1_epi16(INT16_MAX);
+				__m128i vhi = _mm_set1_epi16(INT16_MIN);
+				for (; i + 8 <= n; i += 8) {
+					__m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + i));
+					vlo = _mm_min_epi16(vlo, x);
+					vhi = _mm_max_epi16(vhi, x);
+				}
+				alignas(16) int16_t lanes_lo[8], lanes_hi[8];
+				_mm_store_si128(reinterpret_cast<__m128i *>(lanes_lo), vlo);
+				_mm_store_si128(reinterpret_cast<__m128i *>(lanes_hi), vhi);
+				for (int k = 0; k < 8; k++) {
+					lo = std::min(lo, lanes_lo[k]);
+					hi = std::max(hi, lanes_hi[k]);
+				}
+#endif
+				for (; i < n; i++) {
+					lo = std::min(lo, data[i]);
+					hi = std::max(hi, data[i]);
+				}
+
+				value_range rv;
+				if (n) {
+					rv.min = lo;
+					rv.max = hi;
+					rv.count = n;
+				}
+				return rv;
+			}
+
+			value_range find_value_range(const int32_t *data, size_t n) {
+				int32_t lo = INT32_MAX;
+				int32_t hi = INT32_MIN;
+				size_t i = 0;
+#if defined(LIBDIAG_HAVE_SSE2)
+				// no 32-bit min/max before SSE4.1: select with the compare masks.
+				__m128i vlo = _mm_set1_epi32(INT32_MAX);
+				__m128i vhi = _mm_set1_epi32(INT32_MIN);
+				for (; i + 4 <= n; i += 4) {
+					__m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + i));
+					__m128i below = _mm_cmplt_epi32(x, vlo);
+					__m128i above = _mm_cmpgt_epi32(x, vhi);
+					vlo = _mm_or_si128(_mm_and_si128(below, x), _mm_andnot_si128(below, vlo));
+					vhi = _mm_or_si128(_mm_and_si128(above, x), _mm_andnot_si128(above, vhi));
+				}
+				alignas(16) int32_t lanes_lo[4], lanes_hi[4];
+				_mm_store_si128(reinterpret_cast<__m128i *>(lanes_lo), vlo);
+				_mm_store_si128(reinterpret_cast<__m128i *>(lanes_hi), vhi);
+				for (int k = 0; k < 4; k++) {
+					lo = std::min(lo, lanes_lo[k]);
+					hi = std::max(hi, lanes_hi[k]);
+				}
+#endif
+				for (; i < n; i++) {
+					lo = std::min(lo, data[i]);
+					hi = std::max(hi, data[i]);
+				}
+
+				value_range rv;
+				if (n) {
+					rv.min = lo;
+					rv.max = hi;
+					rv.count = n;
+				}
+				return rv;
+			}
+
+			value_range find_value_range(const double *data, size_t n) {
+				double lo = DBL_MAX;
+				double hi = -DBL_MAX;
+				size_t count = 0;
+				size_t i = 0;
+#if defined(LIBDIAG_HAVE_SSE2)
+				__m128d vlo = _mm_set1_pd(DBL_MAX);
+				__m128d vhi = _mm_set1_pd(-DBL_MAX);
+				__m128i vcount = _mm_setzero_si128();
+				const __m128d zero = _mm_setzero_pd();
+				for (; i + 2 <= n; i += 2) {
+					__m128d x = _mm_loadu_pd(data + i);
+					__m128d finite = _mm_cmpeq_pd(_mm_sub_pd(x, x), zero);
+					vlo = _mm_min_pd(vlo, _mm_or_pd(_mm_and_pd(finite, x), _mm_andnot_pd(finite, vlo)));
+					vhi = _mm_max_pd(vhi, _mm_or_pd(_mm_and_pd(finite, x), _mm_andnot_pd(finite, vhi)));
+					vcount = _mm_sub_epi64(vcount, _mm_castpd_si128(finite));
+				}
+				alignas(16) double lanes_lo[2], lanes_hi[2];
+				alignas(16) uint64_t lanes_count[2];
+				_mm_store_pd(lanes_lo, vlo);
+				_mm_store_pd(lanes_hi, vhi);
+				_mm_store_si128(reinterpret_cast<__m128i *>(lanes_count), vcount);
+				for (int k = 0; k < 2; k++) {
+					lo = std::min(lo, lanes_lo[k]);
+					hi = std::max(hi, lanes_hi[k]);
+					count += lanes_count[k];
+				}
+#endif
+				for (; i < n; i++) {
+					double x = data[i];
+					if (std::isfinite(x)) {
+						lo = std::min(lo, x);
+						hi = std::max(hi, x);
+						count++;
+					}
+				}
+
+				value_range rv;
+				if (count) {
+					rv.min = lo;
+					rv.max = hi;
+					rv.count = count;
+				}
+				return rv;
+			}
+
+			void scale_for_range(const value_range &range, double &offset, double &scale) {
+				if (range.count && range.max > range.min) {
+					// the span of doubles near the limits overflows; half of it does not.
+					const double span = range.max - range.min;
+					offset = range.min;
+					scale = std::isfinite(span) ? 255.0 / span : 127.5 / (range.max / 2 - range.min / 2);
+				} else {
+					// constant (or no finite values): black, or white for a positive constant, like a mask.
+					offset = 0;
+					scale = range.count && range.min > 0 ? DBL_MAX : 0;
+				}
+			}
+
+			void scale_for_range(const value_range &range, float &offset, float &scale) {
+				if (range.count && range.max > range.min) {
+					offset = float(range.min);
+					scale = float(255.0 / (range.max - range.min));
+				} else {
+					offset = 0;
+					scale = range.count && range.min > 0 ? FLT_MAX : 0;
+				}
+			}
+
+			static inline uint8_t scale_value(float x, float offset, float scale) {
+				// written so NaN fails both comparisons and comes out as 0.
+				float v = (x - offset) * scale;
+				if (!(v > 0))
+					return 0;
+				if (!(v < 255))
+					return 255;
+				return uint8_t(std::lrint(v));      // round to nearest even, like the SIMD conversion
+			}
+
+			static inline uint8_t scale_value(double x, double offset, double scale) {
+				double v = (x - offset) * scale;
+				if (!(v > 0))
+					return 0;
+				if (!(v < 255))
+					return 255;
+				return uint8_t(std::lrint(v));
+			}
+
+#if defined(LIBDIAG_HAVE_SSE2)
+			// 8 scaled values to 8 bytes; `_mm_max_ps(v, 0)` returns 0 for NaN, so the conversion only sees 0..255.
+			static inline __m128i clamp_8(__m128 a, __m128 b) {
+				const __m128 zero = _mm_setzero_ps();
+				const __m128 top = _mm_set1_ps(255.0f);
+				a = _mm_min_ps(_mm_max_ps(a, zero), top);
+				b = _mm_min_ps(_mm_max_ps(b, zero), top);
+				__m128i words = _mm_packs_epi32(_mm_cvtps_epi32(a), _mm_cvtps_epi32(b));
+				return _mm_packus_epi16(words, words);
+			}
+
+			static inline __m128i scale_8(__m128 a, __m128 b, __m128 offset, __m128 scale) {
+				return clamp_8(_mm_mul_ps(_mm_sub_ps(a, offset), scale), _mm_mul_ps(_mm_sub_ps(b, offset), scale));
+			}
+
+			// 2 values, scaled in double and narrowed to float: out of range values become +-inf, and clamp.
+			static inline __m128 scale_2(__m128d x, __m128d offset, __m128d scale) {
+				return _mm_cvtpd_ps(_mm_mul_pd(_mm_sub_pd(x, offset), scale));
+			}
+#endif
+
+			void scale_to_8bit(const float *src, size_t n, uint8_t *dst, float offset, float scale) {
+				size_t i = 0;
+#if defined(LIBDIAG_HAVE_SSE2)
+				const __m128 voffset = _mm_set1_ps(offset);
+				const __m128 vscale = _mm_set1_ps(scale);
+				for (; i + 8 <= n; i += 8) {
+					__m128i bytes = scale_8(_mm_loadu_ps(src + i), _mm_loadu_ps(src + i + 4), voffset, vscale);
+					_mm_storel_epi64(reinterpret_cast<__m128i *>(dst + i), bytes);
+				}
+#endif
+				for (; i < n; i++)
+					dst[i] = scale_value(src[i], offset, scale);
+			}
+
+			void scale_to_8bit(const uint16_t *src, size_t n, uint8_t *dst, float offset, float scale) {
+				size_t i = 0;
+#if defined(LIBDIAG_HAVE_SSE2)
+				const __m128 voffset = _mm_set1_ps(offset);
+				const __m128 vscale = _mm_set1_ps(scale);
+				const __m128i zero = _mm_setzero_si128();
+				for (; i + 8 <= n; i += 8) {
+					__m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + i));
+					__m128 a = _mm_cvtepi32_ps(_mm_unpacklo_epi16(x, zero));
+					__m128 b = _mm_cvtepi32_ps(_mm_unpackhi_epi16(x, zero));
+					_mm_storel_epi64(reinterpret_cast<__m128i *>(dst + i), scale_8(a, b, voffset, vscale));
+				}
+#endif
+				for (; i < n; i++)
+					dst[i] = scale_value(float(src[i]), offset, scale);
+			}
+
+			void scale_to_8bit(const uint8_t *src, size_t n, uint8_t *dst, float offset, float scale) {
+				size_t i = 0;
+#if defined(LIBDIAG_HAVE_SSE2)
+				const __m128 voffset = _mm_set1_ps(offset);
+				const __m128 vscale = _mm_set1_ps(scale);
+				const __m128i zero = _mm_setzero_si128();
+				for (; i + 8 <= n; i += 8) {
+					__m128i x = _mm_unpacklo_epi8(_mm_loadl_epi64(reinterpret_cast<const __m128i *>(src + i)), zero);
+					__m128 a = _mm_cvtepi32_ps(_mm_unpacklo_epi16(x, zero));
+					__m128 b = _mm_cvtepi32_ps(_mm_unpackhi_epi16(x, zero));
+					_mm_storel_epi64(reinterpret_cast<__m128i *>(dst + i), scale_8(a, b, voffset, vscale));
+				}
+#endif
+				for (; i < n; i++)
+					dst[i] = scale_value(float(src[i]), offset, scale);
+			}
+
+			void scale_to_8bit(const int16_t *src, size_t n, uint8_t *dst, float offset, float scale) {
+				size_t i = 0;
+#if defined(LIBDIAG_HAVE_SSE2)
+				const __m128 voffset = _mm_set1_ps(offset);
+				const __m128 vscale = _mm_set1_ps(scale);
+				for (; i + 8 <= n; i += 8) {
+					__m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + i));
+					// sign-extend: put each value in the high half of a 32-bit lane, then shift it down.
+					__m128 a = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpacklo_epi16(x, x), 16));
+					__m128 b = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpackhi_epi16(x, x), 16));
+					_mm_storel_epi64(reinterpret_cast<__m128i *>(dst + i), scale_8(a, b, voffset, vscale));
+				}
+#endif
+				for (; i < n; i++)
+					dst[i] = scale_value(float(src[i]), offset, scale);
+			}
+
+			void scale_to_8bit(const int32_t *src, size_t n, uint8_t *dst, double offset, double scale) {
+				size_t i = 0;
+#if defined(LIBDIAG_HAVE_SSE2)
+				const __m128d voffset = _mm_set1_pd(offset);
+				const __m128d vscale = _mm_set1_pd(scale);
+				for (; i + 8 <= n; i += 8) {
+					// int32 converts to double exactly.
+					__m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + i));
+					__m128i y = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + i + 4));
+					__m128 a = _mm_movelh_ps(scale_2(_mm_cvtepi32_pd(x), voffset, vscale), scale_2(_mm_cvtepi32_pd(_mm_srli_si128(x, 8)), voffset, vscale));
+					__m128 b = _mm_movelh_ps(scale_2(_mm_cvtepi32_pd(y), voffset, vscale), scale_2(_mm_cvtepi32_pd(_mm_srli_si128(y, 8)), voffset, vscale));
+					_mm_storel_epi64(reinterpret_cast<__m128i *>(dst + i), clamp_8(a, b));
+				}
+#endif
+				for (; i < n; i++)
+					dst[i] = scale_value(double(src[i]), offset, scale);
+			}
+
+			void scale_to_8bit(const double *src, size_t n, uint8_t *dst, double offset, double scale) {
+				size_t i = 0;
+#if defined(LIBDIAG_HAVE_SSE2)
+				const __m128d voffset = _mm_set1_pd(offset);
+				const __m128d vscale = _mm_set1_pd(scale);
+				for (; i + 8 <= n; i += 8) {
+					__m128 a = _mm_movelh_ps(scale_2(_mm_loadu_pd(src + i), voffset, vscale), scale_2(_mm_loadu_pd(src + i + 2), voffset, vscale));
+					__m128 b = _mm_movelh_ps(scale_2(_mm_loadu_pd(src + i + 4), voffset, vscale), scale_2(_mm_loadu_pd(src + i + 6), voffset, vscale));
+					_mm_storel_epi64(reinterpret_cast<__m128i *>(dst + i), clamp_8(a, b));
+				}
+#endif
+				for (; i < n; i++)
+					dst[i] = scale_value(src[i], offset, scale);
+			}
+
+			void byte_histogram(const uint8_t *data, size_t n, uint64_t (&histogram)[256]) {
+				// four tables, so runs of equal bytes do not serialize on one counter; flushed every GB, well before
+				// the 32-bit counters can overflow.
+				const size_t chunk = size_t(1) << 30;
+				for (size_t begin = 0; begin < n; begin += chunk) {
+					const size_t end = std::min(n, begin + chunk);
+					uint32_t counts[4][256] = {};
+					size_t i = begin;
+					for (; i + 4 <= end; i += 4) {
+						counts[0][data[i]]++;
+						counts[1][data[i + 1]]++;
+						counts[2][data[i + 2]]++;
+						counts[3][data[i + 3]]++;
+					}
+					for (; i < end; i++)
+						counts[0][data[i]]++;
+					for (int k = 0; k < 256; k++)
+						histogram[k] += uint64_t(counts[0][k]) + counts[1][k] + counts[2][k] + counts[3][k];
+				}
+			}
+
+		} // namespace image
+
+	} // namespace driver
+
+}
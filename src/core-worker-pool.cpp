@@ -0,0 +1,78 @@
+
+#include <diagnostics/diagnostics.h>
+
+#include <algorithm>
+
+
+namespace diagnostics {
+
+	worker_pool::worker_pool(unsigned int thread_count, size_t max_queue_depth) :
+		max_queue_depth_(std::max<size_t>(1, max_queue_depth)) {
+		if (thread_count == 0)
+			thread_count = std::max(1u, std::thread::hardware_concurrency());
+		threads_.reserve(thread_count);
+		for (unsigned int i = 0; i < thread_count; i++)
+			threads_.emplace_back(&worker_pool::run, this);
+	}
+
+	worker_pool::~worker_pool() {
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			stopping_ = true;
+		}
+		job_available_.notify_all();
+		for (auto &t : threads_)
+			t.join();
+	}
+
+	void worker_pool::submit(std::function<void()> job) {
+		{
+			std::unique_lock<std::mutex> lock(mutex_);
+			slot_available_.wait(lock, [this] {
+				return queue_.size() < max_queue_depth_;
+			});
+			queue_.push_back(std::move(job));
+		}
+		job_available_.notify_one();
+	}
+
+	void worker_pool::wait_idle() {
+		std::unique_lock<std::mutex> lock(mutex_);
+		idle_.wait(lock, [this] {
+			return queue_.empty() && busy_ == 0;
+		});
+	}
+
+	void worker_pool::run() {
+		for (;;) {
+			std::function<void()> job;
+			{
+				std::unique_lock<std::mutex> lock(mutex_);
+				job_available_.wait(lock, [this] {
+					return stopping_ || !queue_.empty();
+				});
+				// when stopping, we still drain the queue: pending diagnostics output must not get lost.
+				if (queue_.empty())
+					return;
+				job = std::move(queue_.front());
+				queue_.pop_front();
+				busy_++;
+			}
+			slot_available_.notify_one();
+
+			try {
+				job();
+			} catch (const std::exception &ex) {
+				spdlog::error("Background diagnostics job failed: {}", ex.what());
+			}
+
+			{
+				std::lock_guard<std::mutex> lock(mutex_);
+				busy_--;
+				if (queue_.empty() && busy_ == 0)
+					idle_.notify_all();
+			}
+		}
+	}
+
+}
@@ -3,3 +3,231 @@
 
 #include <diagnostics/telemetry.h>
 
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <thread>
+
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+
+namespace diagnostics {
+
+	namespace binlog {
+
+		// Checks the record framing at `pos`: marker, size and field lengths must be consistent and the record
+		// must fit in the remaining bytes. Does NOT verify the checksum.
+		static bool is_sound_frame(const std::byte *pos, const std::byte *end) {
+			size_t remaining = end - pos;
+			if (remaining < sizeof(record_header))
+				return false;
+
+			const record_header *hdr = reinterpret_cast<const record_header *>(pos);
+			if (hdr->marker != record_marker)
+				return false;
+			size_t payload = hdr->arg_count * sizeof(double) + size_t(hdr->file_len) + hdr->function_len + hdr->section_len + hdr->message_len;
+			return hdr->size >= sizeof(record_header) + payload && hdr->size <= remaining && hdr->size % record_alignment == 0;
+		}
+
+		void mapped_segment::iterator::validate() {
+			if (pos_ && !is_sound_frame(pos_, end_))
+				pos_ = nullptr;
+		}
+
+
+		mapped_segment::~mapped_segment() {
+			close();
+		}
+
+		mapped_segment::mapped_segment(mapped_segment &&other) noexcept {
+			*this = std::move(other);
+		}
+
+		mapped_segment &mapped_segment::operator=(mapped_segment &&other) noexcept {
+			if (this != &other) {
+				close();
+				std::swap(data_, other.data_);
+				std::swap(size_, other.size_);
+#if defined(_WIN32)
+				std::swap(file_handle_, other.file_handle_);
+				std::swap(mapping_handle_, other.mapping_handle_);
+#endif
+			}
+			return *this;
+		}
+
+		bool mapped_segment::open(const std::string &path) {
+			close();
+
+#if defined(_WIN32)
+			HANDLE fh = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+			if (fh == INVALID_HANDLE_VALUE) {
+				spdlog::error("Cannot open binary diagnostics segment {}", path);
+				return false;
+			}
+			LARGE_INTEGER size;
+			if (!GetFileSizeEx(fh, &size) || size.QuadPart < (LONGLONG)sizeof(segment_file_header)) {
+				spdlog::error("Binary diagnostics segment {} is too small to be valid", path);
+				CloseHandle(fh);
+				return false;
+			}
+			HANDLE mh = CreateFileMappingA(fh, nullptr, PAGE_READONLY, 0, 0, nullptr);
+			void *view = mh ? MapViewOfFile(mh, FILE_MAP_READ, 0, 0, 0) : nullptr;
+			if (!view) {
+				spdlog::error("Cannot memory-map binary diagnostics segment {}", path);
+				if (mh)
+					CloseHandle(mh);
+				CloseHandle(fh);
+				return false;
+			}
+			file_handle_ = fh;
+			mapping_handle_ = mh;
+			data_ = static_cast<const std::byte *>(view);
+			size_ = static_cast<size_t>(size.QuadPart);
+#else
+			int fd = ::open(path.c_str(), O_RDONLY);
+			if (fd < 0) {
+				spdlog::error("Cannot open binary diagnostics segment {}: {}", path, strerror(errno));
+				return false;
+			}
+			struct stat st;
+			if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(segment_file_header)) {
+				spdlog::error("Binary diagnostics segment {} is too small to be valid", path);
+				::close(fd);
+				return false;
+			}
+			void *view = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+			// the mapping keeps the file referenced; we don't need the descriptor any more.
+			::close(fd);
+			if (view == MAP_FAILED) {
+				spdlog::error("Cannot memory-map binary diagnostics segment {}: {}", path, strerror(errno));
+				return false;
+			}
+			// we walk the records front to back: let the kernel read ahead aggressively.
+			madvise(view, st.st_size, MADV_SEQUENTIAL);
+			data_ = static_cast<const std::byte *>(view);
+			size_ = static_cast<size_t>(st.st_size);
+#endif
+
+			const segment_file_header &hdr = header();
+			if (hdr.magic != segment_magic || hdr.version != segment_version) {
+				spdlog::error("{} is not a binary diagnostics segment (or an unsupported version thereof)", path);
+				close();
+				return false;
+			}
+			return true;
+		}
+
+		void mapped_segment::close() {
+			if (!data_)
+				return;
+#if defined(_WIN32)
+			UnmapViewOfFile(data_);
+			CloseHandle(mapping_handle_);
+			CloseHandle(file_handle_);
+			mapping_handle_ = nullptr;
+			file_handle_ = nullptr;
+#else
+			munmap(const_cast<std::byte *>(data_), size_);
+#endif
+			data_ = nullptr;
+			size_ = 0;
+		}
+
+		mapped_segment::iterator mapped_segment::begin() const {
+			if (!data_)
+				return {};
+			return iterator(data_ + sizeof(segment_file_header), data_ + size_);
+		}
+
+
+		recovery_stats recover_records(const mapped_segment &segment, const std::function<void(const record_view &record)> &callback) {
+			recovery_stats stats;
+			if (!segment.is_open())
+				return stats;
+
+			const std::byte *begin = segment.bytes().data();
+			const std::byte *end = begin + segment.bytes().size();
+			const std::byte *pos = begin + sizeof(segment_file_header);
+			bool in_damage = false;
+
+			while (pos + sizeof(record_header) <= end) {
+				if (is_sound_frame(pos, end)) {
+					const record_header *hdr = reinterpret_cast<const record_header *>(pos);
+					if (verify_record_checksum(hdr)) {
+						callback(record_view(hdr));
+						stats.records++;
+						in_damage = false;
+						pos += hdr->size;
+						continue;
+					}
+				}
+
+				// torn or corrupt record: all records start at aligned offsets, so hunt for the next marker
+				// in `record_alignment` steps.
+				if (!in_damage) {
+					stats.damaged_regions++;
+					in_damage = true;
+				}
+				stats.skipped_bytes += record_alignment;
+				pos += record_alignment;
+			}
+
+			// whatever's left cannot hold a record: that's a torn tail.
+			if (pos < end) {
+				if (!in_damage)
+					stats.damaged_regions++;
+				stats.skipped_bytes += end - pos;
+			}
+			return stats;
+		}
+
+
+		size_t scan_segments(const std::vector<std::string> &paths, const std::function<void(size_t segment_index, const mapped_segment &segment)> &callback, unsigned int thread_count) {
+			if (thread_count == 0)
+				thread_count = std::max(1u, std::thread::hardware_concurrency());
+			thread_count = static_cast<unsigned int>(std::min<size_t>(thread_count, paths.size()));
+
+			std::atomic<size_t> next{0};
+			std::atomic<size_t> failures{0};
+
+			// segments vary wildly in size, so have the workers pick up the next one as they go, rather than
+			// handing out fixed ranges up front.
+			auto worker = [&]() {
+				for (;;) {
+					size_t i = next.fetch_add(1, std::memory_order_relaxed);
+					if (i >= paths.size())
+						break;
+					mapped_segment segment;
+					if (!segment.open(paths[i])) {
+						failures++;
+						continue;
+					}
+					callback(i, segment);
+				}
+			};
+
+			if (thread_count <= 1) {
+				worker();
+			} else {
+				std::vector<std::thread> threads;
+				threads.reserve(thread_count);
+				for (unsigned int t = 0; t < thread_count; t++)
+					threads.emplace_back(worker);
+				for (auto &t : threads)
+					t.join();
+			}
+			return failures;
+		}
+
+	} // namespace binlog
+
+}
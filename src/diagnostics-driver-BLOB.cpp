@@ -4,8 +4,407 @@
 #include <spdlog/spdlog.h>
 #include <fmt/format.h>
 
+#include <cerrno>
+#include <charconv>
+#include <climits>
+#include <ctime>
 
+#include <zlib.h>
+
+#if defined(_WIN32)
+#include <io.h>
+#else
+#include <sys/uio.h>
+#include <unistd.h>
+#if !defined(IOV_MAX)
+#define IOV_MAX 1024
+#endif
+#endif
 
 
 // arbitrary data; NOT image data
+//
+// Numeric arrays are written in the NumPy formats: `.npy` files, and `.npz` archives of them. Both are written
+// from the caller's memory as is: the headers are the only bytes produced here.
+
+namespace diagnostics {
+
+	namespace driver {
+
+		namespace blob {
+
+			// --- npy_array ------------------------------------------------------------------------------------
+
+			size_t npy_array::size_bytes() const {
+				size_t rv = 0;
+				for (const auto &chunk : chunks)
+					rv += chunk.size();
+				return rv;
+			}
+
+			bool npy_array::validate(std::string_view caption) const {
+				// the descr ends in the element size, like "<f4":
+				size_t item_size = 0;
+				auto [end, ec] = descr.size() > 2 ? std::from_chars(descr.data() + 2, descr.data() + descr.size(), item_size) : std::from_chars_result{nullptr, std::errc::invalid_argument};
+				if (ec != std::errc() || end != descr.data() + descr.size() || item_size == 0) {
+					spdlog::error("Cannot write NumPy array {}: invalid type {}", caption, descr);
+					return false;
+				}
+				size_t elements = 1;
+				for (size_t d : shape)
+					elements *= d;
+				if (shape.empty() || elements * item_size != size_bytes()) {
+					spdlog::error("Cannot write NumPy array {}: {} bytes of data for {} elements of {} bytes", caption, size_bytes(), elements, item_size);
+					return false;
+				}
+				return true;
+			}
+
+			std::string npy_header(const npy_array &a) {
+				std::string dict = fmt::format("{{'descr': '{}', 'fortran_order': False, 'shape': (", a.descr);
+				for (size_t i = 0; i < a.shape.size(); i++)
+					dict += fmt::format("{}{}", i ? ", " : "", a.shape[i]);
+				dict += a.shape.size() == 1 ? ",), }" : "), }";
+
+				// version 1.0 has a 16-bit header length, 2.0 a 32-bit one; the header, including the preamble and
+				// the terminating newline, is padded with spaces to a multiple of 64 bytes.
+				size_t preamble = 10;
+				size_t total = (preamble + dict.size() + 1 + 63) / 64 * 64;
+				if (total - preamble > 0xFFFF) {
+					preamble = 12;
+					total = (preamble + dict.size() + 1 + 63) / 64 * 64;
+				}
+				const uint32_t len = uint32_t(total - preamble);
+				std::string rv("\x93NUMPY", 6);
+				rv += char(preamble == 10 ? 1 : 2);
+				rv += '\0';
+				for (size_t i = 0; i < preamble - 8; i++)
+					rv += char((len >> (8 * i)) & 0xFF);
+				rv += dict;
+				rv.append(total - rv.size() - 1, ' ');
+				rv += '\n';
+				return rv;
+			}
+
+			// Writes the pieces at the current position of `fp`, which must be unbuffered. On POSIX systems, this is
+			// a single `writev()`, unless there are more than IOV_MAX pieces or the kernel writes less than asked for.
+			static bool write_pieces(FILE *fp, const std::vector<std::span<const std::byte>> &pieces) {
+#if defined(_WIN32)
+				for (const auto &piece : pieces) {
+					if (fwrite(piece.data(), 1, piece.size(), fp) != piece.size())
+						return false;
+				}
+				return true;
+#else
+				std::vector<iovec> iov;
+				iov.reserve(pieces.size());
+				for (const auto &piece : pieces) {
+					if (!piece.empty())
+						iov.push_back({const_cast<std::byte *>(piece.data()), piece.size()});
+				}
+				const int fd = fileno(fp);
+				size_t i = 0;
+				while (i < iov.size()) {
+					ssize_t written = ::writev(fd, iov.data() + i, int(std::min<size_t>(iov.size() - i, IOV_MAX)));
+					if (written < 0) {
+						if (errno == EINTR)
+							continue;
+						return false;
+					}
+					size_t left = size_t(written);
+					while (i < iov.size() && left >= iov[i].iov_len)
+						left -= iov[i++].iov_len;
+					if (left) {
+						iov[i].iov_base = static_cast<char *>(iov[i].iov_base) + left;
+						iov[i].iov_len -= left;
+					}
+				}
+				return true;
+#endif
+			}
+
+			static bool rewind_to(FILE *fp, uint64_t offset) {
+#if defined(_WIN32)
+				return _fseeki64(fp, static_cast<__int64>(offset), SEEK_SET) == 0;
+#else
+				return lseek(fileno(fp), static_cast<off_t>(offset), SEEK_SET) == static_cast<off_t>(offset);
+#endif
+			}
+
+			// Cuts off whatever a failed write left past `size`.
+			static bool truncate_to(FILE *fp, uint64_t size) {
+#if defined(_WIN32)
+				return _chsize_s(_fileno(fp), static_cast<__int64>(size)) == 0;
+#else
+				return ftruncate(fileno(fp), static_cast<off_t>(size)) == 0;
+#endif
+			}
+
+			static std::span<const std::byte> bytes_of(const std::string &s) {
+				return std::as_bytes(std::span<const char>(s.data(), s.size()));
+			}
+
+			bool write_npy(const std::string &path, const npy_array &a) {
+				if (!a.validate(path))
+					return false;
+				FILE *fp = fopen(path.c_str(), "wb");
+				if (!fp) {
+					spdlog::error("Cannot create NumPy array file {}: {}", path, strerror(errno));
+					return false;
+				}
+				setvbuf(fp, nullptr, _IONBF, 0);
+
+				const std::string header = npy_header(a);
+				std::vector<std::span<const std::byte>> pieces;
+				pieces.reserve(a.chunks.size() + 1);
+				pieces.push_back(bytes_of(header));
+				pieces.insert(pieces.end(), a.chunks.begin(), a.chunks.end());
+				bool ok = write_pieces(fp, pieces);
+				if (!ok)
+					spdlog::error("Failed to write NumPy array file {}: {}", path, strerror(errno));
+				if (fclose(fp) != 0 && ok) {
+					spdlog::error("Failed to write NumPy array file {}", path);
+					ok = false;
+				}
+				return ok;
+			}
+
+
+			// --- npz_writer -----------------------------------------------------------------------------------
+
+			static constexpr uint32_t zip_local_signature = 0x04034b50u;
+			static constexpr uint32_t zip_central_signature = 0x02014b50u;
+			static constexpr uint32_t zip_end_signature = 0x06054b50u;
+			static constexpr uint32_t zip64_end_signature = 0x06064b50u;
+			static constexpr uint32_t zip64_locator_signature = 0x07064b50u;
+			static constexpr uint16_t zip_utf8_names = 0x0800;
+			// the extra field of Android's zipalign, which pads the local headers:
+			static constexpr uint16_t zip_align_extra = 0xD935;
+
+			// zip fields are little-endian.
+			static void put16(std::string &s, uint64_t v) {
+				s += char(v & 0xFF);
+				s += char((v >> 8) & 0xFF);
+			}
+			static void put32(std::string &s, uint64_t v) {
+				put16(s, v);
+				put16(s, v >> 16);
+			}
+			static void put64(std::string &s, uint64_t v) {
+				put32(s, v);
+				put32(s, v >> 32);
+			}
+
+			static uint32_t crc_of(uint32_t crc, std::span<const std::byte> data) {
+				// zlib takes 32-bit lengths:
+				while (!data.empty()) {
+					size_t n = std::min<size_t>(data.size(), size_t(1) << 30);
+					crc = uint32_t(crc32(crc, reinterpret_cast<const Bytef *>(data.data()), uInt(n)));
+					data = data.subspan(n);
+				}
+				return crc;
+			}
+
+			npz_writer::~npz_writer() {
+				close();
+			}
+
+			bool npz_writer::open(const std::string &path) {
+				close();
+
+				fp_ = fopen(path.c_str(), "wb");
+				if (!fp_) {
+					spdlog::error("Cannot create NumPy archive {}: {}", path, strerror(errno));
+					return false;
+				}
+				setvbuf(fp_, nullptr, _IONBF, 0);
+				path_ = path;
+				offset_ = 0;
+				members_.clear();
+				name_counts_.clear();
+
+				// all members get the time the archive was opened, in MS-DOS format.
+				time_t now = time(nullptr);
+				struct tm tm {};
+#if defined(_WIN32)
+				localtime_s(&tm, &now);
+#else
+				localtime_r(&now, &tm);
+#endif
+				dos_time_ = uint16_t((tm.tm_hour << 11) | (tm.tm_min << 5) | (tm.tm_sec / 2));
+				dos_date_ = uint16_t((std::max(tm.tm_year - 80, 0) << 9) | ((tm.tm_mon + 1) << 5) | tm.tm_mday);
+				return true;
+			}
+
+			npz_writer::prepared_member npz_writer::prepare(const npy_array &a) {
+				prepared_member rv;
+				rv.header = npy_header(a);
+				rv.size = rv.header.size() + a.size_bytes();
+				rv.crc = crc_of(0, bytes_of(rv.header));
+				for (const auto &chunk : a.chunks)
+					rv.crc = crc_of(rv.crc, chunk);
+				return rv;
+			}
+
+			std::string npz_writer::append(std::string_view name, const npy_array &a) {
+				if (!fp_ || !a.validate(name))
+					return {};
+				return append(name, a, prepare(a));
+			}
+
+			std::string npz_writer::append(std::string_view name, const npy_array &a, const prepared_member &prepared) {
+				if (!fp_)
+					return {};
+
+				// the member names are the keys in Python: no directories, and unique.
+				std::string key(name.empty() ? std::string_view("array") : name);
+				for (char &ch : key) {
+					if (ch == '/' || ch == '\\')
+						ch = '_';
+				}
+				int n = ++name_counts_[key];
+				if (n > 1)
+					key += fmt::format("#{}", n);
+				const std::string file_name = key + ".npy";
+
+				const std::string &header = prepared.header;
+				const uint64_t size = prepared.size;
+				const uint32_t crc = prepared.crc;
+
+				// the local header, plus the zip64 sizes of large members, plus padding which puts the member at a
+				// multiple of 64 bytes: the `.npy` header keeps the elements aligned as well. A member beyond 4 GiB
+				// only has its offset in the central directory, but needs the zip64 version all the same.
+				const bool zip64 = size >= 0xFFFFFFFFu;
+				const bool far = offset_ >= 0xFFFFFFFFu;
+				const size_t zip64_extra = zip64 ? 20 : 0;
+				size_t padding = size_t((64 - (offset_ + 30 + file_name.size() + zip64_extra) % 64) % 64);
+				if (padding && padding < 6)
+					padding += 64;
+
+				std::string local;
+				put32(local, zip_local_signature);
+				put16(local, zip64 || far ? 45 : 20);
+				put16(local, zip_utf8_names);
+				put16(local, 0);                        // stored
+				put16(local, dos_time_);
+				put16(local, dos_date_);
+				put32(local, crc);
+				put32(local, zip64 ? 0xFFFFFFFFu : size);
+				put32(local, zip64 ? 0xFFFFFFFFu : size);
+				put16(local, file_name.size());
+				put16(local, zip64_extra + padding);
+				local += file_name;
+				if (zip64) {
+					put16(local, 1);
+					put16(local, 16);
+					put64(local, size);
+					put64(local, size);
+				}
+				if (padding) {
+					put16(local, zip_align_extra);
+					put16(local, padding - 4);
+					put16(local, 64);
+					local.append(padding - 6, '\0');
+				}
+
+				std::vector<std::span<const std::byte>> pieces;
+				pieces.reserve(a.chunks.size() + 2);
+				pieces.push_back(bytes_of(local));
+				pieces.push_back(bytes_of(header));
+				pieces.insert(pieces.end(), a.chunks.begin(), a.chunks.end());
+				if (!write_pieces(fp_, pieces)) {
+					spdlog::error("Failed to write NumPy archive {}: {}", path_, strerror(errno));
+					// drop the partial member: the central directory goes where it started.
+					if (!rewind_to(fp_, offset_)) {
+						fclose(fp_);
+						fp_ = nullptr;
+					}
+					return {};
+				}
+				members_.push_back({key, crc, size, offset_});
+				offset_ += local.size() + size;
+				return key;
+			}
+
+			bool npz_writer::close() {
+				if (!fp_)
+					return true;
+
+				std::string dir;
+				for (const auto &m : members_) {
+					const std::string file_name = m.name + ".npy";
+					const bool large = m.size >= 0xFFFFFFFFu;
+					const bool far = m.offset >= 0xFFFFFFFFu;
+					const size_t extra = large || far ? 4 + (large ? 16 : 0) + (far ? 8 : 0) : 0;
+					put32(dir, zip_central_signature);
+					put16(dir, 45);                     // made by: zip64-aware
+					put16(dir, large || far ? 45 : 20);
+					put16(dir, zip_utf8_names);
+					put16(dir, 0);
+					put16(dir, dos_time_);
+					put16(dir, dos_date_);
+					put32(dir, m.crc);
+					put32(dir, large ? 0xFFFFFFFFu : m.size);
+					put32(dir, large ? 0xFFFFFFFFu : m.size);
+					put16(dir, file_name.size());
+					put16(dir, extra);
+					put16(dir, 0);                      // comment
+					put16(dir, 0);                      // disk
+					put16(dir, 0);                      // internal attributes
+					put32(dir, 0);                      // external attributes
+					put32(dir, far ? 0xFFFFFFFFu : m.offset);
+					dir += file_name;
+					if (extra) {
+						put16(dir, 1);
+						put16(dir, extra - 4);
+						if (large) {
+							put64(dir, m.size);
+							put64(dir, m.size);
+						}
+						if (far)
+							put64(dir, m.offset);
+					}
+				}
+
+				const uint64_t count = members_.size();
+				const uint64_t dir_offset = offset_;
+				const uint64_t dir_size = dir.size();
+				if (count >= 0xFFFF || dir_offset >= 0xFFFFFFFFu || dir_size >= 0xFFFFFFFFu) {
+					put32(dir, zip64_end_signature);
+					put64(dir, 44);
+					put16(dir, 45);
+					put16(dir, 45);
+					put32(dir, 0);
+					put32(dir, 0);
+					put64(dir, count);
+					put64(dir, count);
+					put64(dir, dir_size);
+					put64(dir, dir_offset);
+					put32(dir, zip64_locator_signature);
+					put32(dir, 0);
+					put64(dir, dir_offset + dir_size);
+					put32(dir, 1);
+				}
+				put32(dir, zip_end_signature);
+				put16(dir, 0);
+				put16(dir, 0);
+				put16(dir, std::min<uint64_t>(count, 0xFFFF));
+				put16(dir, std::min<uint64_t>(count, 0xFFFF));
+				put32(dir, std::min<uint64_t>(dir_size, 0xFFFFFFFFu));
+				put32(dir, std::min<uint64_t>(dir_offset, 0xFFFFFFFFu));
+				put16(dir, 0);
+
+				// the directory goes where a failed append left off, in front of the rest of its partial member.
+				bool ok = write_pieces(fp_, {bytes_of(dir)}) && truncate_to(fp_, offset_ + dir.size());
+				ok = fclose(fp_) == 0 && ok;
+				fp_ = nullptr;
+				if (!ok)
+					spdlog::error("Failed to write NumPy archive {}", path_);
+				return ok;
+			}
+
+		} // namespace blob
+
+	} // namespace driver
 
+}
@@ -4,7 +4,167 @@
 #include <spdlog/spdlog.h>
 #include <fmt/format.h>
 
+#if defined(HAVE_OPENCV)
 
+#include <opencv2/core.hpp>
+#include <opencv2/imgcodecs.hpp>
+
+#include <cerrno>
+#include <cstring>
+
+
+namespace diagnostics {
+
+	namespace driver {
+
+		namespace image {
+
+			// Scales any depth to 8 bits, keeping the channels; 8-bit images are passed through as-is.
+			static cv::Mat mat_to_8bit(const cv::Mat &mat) {
+				if (mat.depth() == CV_8U)
+					return mat;
+
+				const int c = mat.channels();
+				cv::Mat src = mat;
+				// our kernels take 16-bit unsigned and float; everything else is rare enough to go through float.
+				if (mat.depth() != CV_16U && mat.depth() != CV_32F)
+					mat.convertTo(src, CV_MAKETYPE(CV_32F, c));
+
+				// all channels share one scale, so the colors stay in proportion.
+				const size_t n = size_t(src.cols) * c;
+				value_range range;
+				for (int y = 0; y < src.rows; y++) {
+					if (src.depth() == CV_16U)
+						range.merge(find_value_range(src.ptr<uint16_t>(y), n));
+					else
+						range.merge(find_value_range(src.ptr<float>(y), n));
+				}
+				float offset, scale;
+				scale_for_range(range, offset, scale);
+
+				cv::Mat out(src.rows, src.cols, CV_MAKETYPE(CV_8U, c));
+				for (int y = 0; y < src.rows; y++) {
+					if (src.depth() == CV_16U)
+						scale_to_8bit(src.ptr<uint16_t>(y), n, out.ptr<uint8_t>(y), offset, scale);
+					else
+						scale_to_8bit(src.ptr<float>(y), n, out.ptr<uint8_t>(y), offset, scale);
+				}
+				return out;
+			}
+
+			static bool write_file(const std::string &path, const std::vector<uchar> &data) {
+				FILE *fp = fopen(path.c_str(), "wb");
+				if (!fp) {
+					spdlog::error("Cannot create image file {}: {}", path, strerror(errno));
+					return false;
+				}
+				bool ok = fwrite(data.data(), 1, data.size(), fp) == data.size();
+				if (fclose(fp) != 0)
+					ok = false;
+				if (!ok)
+					spdlog::error("Failed to write image file {}", path);
+				return ok;
+			}
+
+			// The rows of an 8-bit image, converted from BGR(A) to RGB(A) one at a time, into `row`.
+			static scanline_source rgb_scanlines(const raster &view, std::vector<uint8_t> &row) {
+				const int c = view.channels;
+				if (c == 1)
+					return view;
+				row.resize(size_t(view.width) * c);
+				return scanline_source(view.width, view.height, c, [view, &row, c](int y) {
+					const uint8_t *src = view.row(y);
+					for (size_t i = 0; i < row.size(); i += c) {
+						row[i + 0] = src[i + 2];
+						row[i + 1] = src[i + 1];
+						row[i + 2] = src[i + 0];
+						if (c == 4)
+							row[i + 3] = src[i + 3];
+					}
+					return static_cast<const uint8_t *>(row.data());
+				});
+			}
+
+			// Runs on a worker thread.
+			static bool encode_mat(session &s, const cv::Mat &mat, const std::string &path, const std::function<void(const scanline_source &)> &make_thumbnail) {
+				cv::Mat img = mat_to_8bit(mat);
+				const int c = img.channels();
+				raster view{img.data, img.cols, img.rows, c, size_t(img.step)};
+
+				if (c == 1 && is_bilevel_mask(view.data, view.stride, view.width, view.height)) {
+					bilevel_encode_stats stats;
+					if (!write_bilevel_png(path, view.width, view.height, mask_bilevel_rows(view.data, view.stride, view.width), &stats))
+						return false;
+					s.note_bilevel_encode(stats);
+					spdlog::debug("Bilevel PNG {}: {}x{}, {} strips, {:.1f} MB/s", path, view.width, view.height, stats.strips, stats.megabytes_per_second());
+				} else {
+					std::vector<uchar> png;
+					try {
+						if (!cv::imencode(".png", img, png, {cv::IMWRITE_PNG_COMPRESSION, 1})) {
+							spdlog::error("OpenCV failed to encode image {}", path);
+							return false;
+						}
+					} catch (const std::exception &ex) {
+						spdlog::error("OpenCV failed to encode image {}: {}", path, ex.what());
+						return false;
+					}
+					if (!write_file(path, png))
+						return false;
+				}
+
+				std::vector<uint8_t> row;
+				make_thumbnail(rgb_scanlines(view, row));
+				return true;
+			}
+
+			void log_mat(session &s, std::string_view caption, const cv::Mat &mat, mat_snapshot snapshot) {
+				const int c = mat.channels();
+				if (mat.empty() || mat.dims != 2 || !(c == 1 || c == 3 || c == 4)) {
+					spdlog::error("Cannot log image {}: a {}x{} matrix with {} channels is not an image", caption, mat.cols, mat.rows, c);
+					return;
+				}
+
+				// an unchanged image is not even copied.
+				content_hash hash;
+				if (s.options().deduplicate_images) {
+					hash = hash_image_rows(mat.data, size_t(mat.cols) * mat.elemSize(), mat.rows, ptrdiff_t(size_t(mat.step)), {uint64_t(mat.cols), uint64_t(mat.rows), uint64_t(mat.type())});
+					if (s.log_duplicate_image(caption, hash))
+						return;
+				}
+
+				// this is all the work done on the caller's thread (plus queueing the job): a reference count
+				// increment for a shared header, a memcpy for a copy.
+				cv::Mat held = (snapshot == mat_snapshot::copy) ? mat.clone() : mat;
+
+				s.log_image(caption, "png", held.cols, held.rows, [&s, held = std::move(held)](const std::string &path, const std::function<void(const scanline_source &)> &make_thumbnail) {
+					return encode_mat(s, held, path, make_thumbnail);
+				}, false, 256, hash);
+			}
+
+			void log_mat_frame(session &s, std::string_view sequence, std::string_view caption, const cv::Mat &mat) {
+				const int c = mat.channels();
+				if (mat.empty() || mat.dims != 2 || !(c == 1 || c == 3 || c == 4)) {
+					spdlog::error("Cannot log frame {}: a {}x{} matrix with {} channels is not an image", caption, mat.cols, mat.rows, c);
+					return;
+				}
+				cv::Mat img = mat_to_8bit(mat);
+				std::vector<uint8_t> row;
+				s.log_frame(sequence, caption, rgb_scanlines(raster{img.data, img.cols, img.rows, c, size_t(img.step)}, row));
+			}
+
+		} // namespace image
+
+	} // namespace driver
+
+}
+
+#endif
+
+
+// ---------------------------------------------------------------------------------------------------------------
+// Notes on saving OpenCV images.
+
+/*
 
 // -------------------------------------------------
 // https://stackoverflow.com/questions/851679/saving-an-image-in-opencv
@@ -217,13 +377,4 @@ int main()
 	imwrite("test.jpg", save_img);
 }
 
-
-
-
-
-
-
-
-
-
-
+*/
@@ -4,53 +4,259 @@
 #include <spdlog/spdlog.h>
 #include <fmt/format.h>
 
+#if defined(HAVE_OPENIMAGEIO)
 
+#include <OpenImageIO/imageio.h>
 
+#include <algorithm>
+
+
+namespace diagnostics {
+
+	namespace driver {
+
+		namespace image {
+
+			static OIIO::TypeDesc type_desc(pixel_type type) {
+				switch (type) {
+				case pixel_type::uint8:
+					return OIIO::TypeDesc::UINT8;
+				case pixel_type::uint16:
+					return OIIO::TypeDesc::UINT16;
+				case pixel_type::half:
+					return OIIO::TypeDesc::HALF;
+				default:
+					return OIIO::TypeDesc::FLOAT;
+				}
+			}
+
+			static bool is_float(pixel_type type) {
+				return type == pixel_type::half || type == pixel_type::float32;
+			}
+
+			static OIIO::stride_t stride_or_auto(ptrdiff_t stride) {
+				return stride ? OIIO::stride_t(stride) : OIIO::AutoStride;
+			}
+
+			// Lossless, and cheap to compress: ZIP over single scanlines for EXR (the fastest of the EXR codecs
+			// which does something for float data), deflate for TIFF.
+			static const char *fast_lossless_compression(const std::string &format) {
+				if (format == "openexr")
+					return "zips";
+				if (format == "tiff")
+					return "zip";
+				return nullptr;
+			}
+
+			static OIIO::ImageSpec make_spec(const OIIO::ImageOutput &out, const strided_image &img, const oiio_write_options &opts) {
+				OIIO::ImageSpec spec(img.width, img.height, img.channels, type_desc(img.type));
+				if (is_float(img.type) && int64_t(img.width) * img.height >= opts.tile_threshold && out.supports("tiles")) {
+					spec.tile_width = opts.tile_size;
+					spec.tile_height = opts.tile_size;
+				}
+				if (!opts.compression.empty())
+					spec.attribute("compression", opts.compression);
+				else if (const char *compression = fast_lossless_compression(out.format_name()))
+					spec.attribute("compression", compression);
+				return spec;
+			}
+
+			// One call for the whole (sub)image: OIIO converts from the strided layout as it goes, per scanline or tile.
+			static bool write_pixels(OIIO::ImageOutput &out, const std::string &path, const strided_image &img) {
+				if (out.write_image(type_desc(img.type), img.data, stride_or_auto(img.x_stride), stride_or_auto(img.y_stride), OIIO::AutoStride))
+					return true;
+				spdlog::error("OpenImageIO failed to write {}: {}", path, out.geterror());
+				return false;
+			}
+
+			bool oiio_write(const std::string &path, const strided_image &img, const oiio_write_options &opts) {
+				if (!img.data || img.width <= 0 || img.height <= 0 || img.channels <= 0) {
+					spdlog::error("Cannot write a {}x{} image with {} channels to {}", img.width, img.height, img.channels, path);
+					return false;
+				}
+				auto out = OIIO::ImageOutput::create(path);
+				if (!out) {
+					spdlog::error("OpenImageIO cannot write {}: {}", path, OIIO::geterror());
+					return false;
+				}
+
+				if (!out->open(path, make_spec(*out, img, opts))) {
+					spdlog::error("OpenImageIO cannot create {}: {}", path, out->geterror());
+					return false;
+				}
+				bool ok = write_pixels(*out, path, img);
+				if (!out->close()) {
+					spdlog::error("OpenImageIO failed to close {}: {}", path, out->geterror());
+					ok = false;
+				}
+				return ok;
+			}
+
+			// Passes the image to `make_thumbnail` as 8-bit rows, converted one at a time. Integer images keep
+			// their full range; float images are scaled by the range of their finite values.
+			static bool thumbnail_oiio_image(const strided_image &img, const std::function<void(const scanline_source &)> &make_thumbnail) {
+				// gray, RGB or RGBA: 2 channels show the first one, more than 4 the first three.
+				const int c = img.channels == 2 ? 1 : std::min(img.channels, img.channels > 4 ? 3 : 4);
+				const OIIO::TypeDesc type = type_desc(img.type);
+				const OIIO::stride_t x_stride = img.x_stride ? OIIO::stride_t(img.x_stride) : OIIO::stride_t(type.size() * img.channels);
+				const OIIO::stride_t y_stride = img.y_stride ? OIIO::stride_t(img.y_stride) : x_stride * img.width;
+				const size_t n = size_t(img.width) * c;
+
+				std::vector<float> values(n);
+				auto convert_row = [&](int y) {
+					const char *row = static_cast<const char *>(img.data) + y * y_stride;
+					return OIIO::convert_image(c, img.width, 1, 1, row, type, x_stride, OIIO::AutoStride, OIIO::AutoStride, values.data(), OIIO::TypeDesc::FLOAT, OIIO::AutoStride, OIIO::AutoStride, OIIO::AutoStride);
+				};
+
+				value_range range;
+				if (is_float(img.type)) {
+					for (int y = 0; y < img.height; y++) {
+						if (!convert_row(y))
+							return false;
+						range.merge(find_value_range(values.data(), n));
+					}
+				} else {
+					// OIIO converts integers to float as 0..1
+					range.min = 0;
+					range.max = 1;
+					range.count = 1;
+				}
+				float offset, scale;
+				scale_for_range(range, offset, scale);
+
+				// a row which fails to convert leaves no thumbnail, rather than one made of stale values.
+				std::vector<uint8_t> row(n);
+				bool ok = true;
+				make_thumbnail(scanline_source(img.width, img.height, c, [&](int y) -> const uint8_t * {
+					if (!convert_row(y)) {
+						ok = false;
+						return nullptr;
+					}
+					scale_to_8bit(values.data(), n, row.data(), offset, scale);
+					return row.data();
+				}));
+				if (!ok)
+					spdlog::error("OpenImageIO cannot convert the pixels of a {}x{} image for its thumbnail: {}", img.width, img.height, OIIO::geterror());
+				return ok;
+			}
+
+			void log_oiio_image(session &s, std::string_view caption, const strided_image &img, std::shared_ptr<const void> owner, std::string_view extension, const oiio_write_options &opts) {
+				if (!img.data || img.width <= 0 || img.height <= 0 || img.channels <= 0) {
+					spdlog::error("Cannot log image {}: a {}x{} image with {} channels", caption, img.width, img.height, img.channels);
+					return;
+				}
+				content_hash hash;
+				if (s.options().deduplicate_images) {
+					hash = hash_strided_image(img);
+					if (s.log_duplicate_image(caption, hash))
+						return;
+				}
+				s.log_image(caption, extension, img.width, img.height, [img, owner = std::move(owner), opts](const std::string &path, const std::function<void(const scanline_source &)> &make_thumbnail) {
+					return oiio_write(path, img, opts) && thumbnail_oiio_image(img, make_thumbnail);
+				}, false, 256, hash);
+			}
+
+
+			// --- oiio_multipart_archive -----------------------------------------------------------------------
+
+			oiio_multipart_archive::oiio_multipart_archive(session &s, std::string_view caption, std::string_view extension, const oiio_write_options &opts) :
+				session_(s), caption_(caption), extension_(extension), opts_(opts) {
+			}
+
+			oiio_multipart_archive::~oiio_multipart_archive() {
+				close();
+			}
+
+			void oiio_multipart_archive::append(std::string_view name, const strided_image &img, std::shared_ptr<const void> owner) {
+				if (!img.data || img.width <= 0 || img.height <= 0 || img.channels <= 0) {
+					spdlog::error("Cannot add part {} to {}: a {}x{} image with {} channels", name, caption_, img.width, img.height, img.channels);
+					return;
+				}
+				part p;
+				p.section = session_.section_path();
+				p.caption = name;
+				p.name = p.section.empty() ? std::string(name) : fmt::format("{}/{}", p.section, name);
+				// part names must be unique within an EXR file.
+				int seen = name_counts_[p.name]++;
+				if (seen)
+					p.name += fmt::format("#{}", seen + 1);
+				p.img = img;
+				p.owner = std::move(owner);
+				parts_.push_back(std::move(p));
+			}
+
+			void oiio_multipart_archive::close() {
+				if (parts_.empty())
+					return;
+				auto parts = std::make_shared<std::vector<part>>(std::move(parts_));
+				parts_.clear();
+				name_counts_.clear();
+
+				std::string names;
+				for (const auto &p : *parts)
+					names += fmt::format("{}{}", names.empty() ? "" : ", ", p.name);
+				const strided_image &first = parts->front().img;
+
+				// the thumbnail shows the first part.
+				session_.log_image(caption_, extension_, first.width, first.height, [parts, opts = opts_](const std::string &path, const std::function<void(const scanline_source &)> &make_thumbnail) {
+					auto out = OIIO::ImageOutput::create(path);
+					if (!out) {
+						spdlog::error("OpenImageIO cannot write {}: {}", path, OIIO::geterror());
+						return false;
+					}
+					if (parts->size() > 1 && !out->supports("multiimage")) {
+						spdlog::error("OpenImageIO cannot write {}: the {} format does not take multiple images", path, out->format_name());
+						return false;
+					}
+
+					std::vector<OIIO::ImageSpec> specs;
+					specs.reserve(parts->size());
+					for (const auto &p : *parts) {
+						OIIO::ImageSpec spec = make_spec(*out, p.img, opts);
+						spec.attribute("oiio:subimagename", p.name);
+						spec.attribute("ImageDescription", p.caption);
+						spec.attribute("diagnostics:section", p.section);
+						specs.push_back(std::move(spec));
+					}
+
+					if (!out->open(path, int(specs.size()), specs.data())) {
+						spdlog::error("OpenImageIO cannot create {}: {}", path, out->geterror());
+						return false;
+					}
+					bool ok = true;
+					for (size_t i = 0; i < parts->size() && ok; i++) {
+						if (i > 0 && !out->open(path, specs[i], OIIO::ImageOutput::AppendSubimage)) {
+							spdlog::error("OpenImageIO cannot add part {} to {}: {}", (*parts)[i].name, path, out->geterror());
+							ok = false;
+							break;
+						}
+						ok = write_pixels(*out, path, (*parts)[i].img);
+					}
+					if (!out->close()) {
+						spdlog::error("OpenImageIO failed to close {}: {}", path, out->geterror());
+						ok = false;
+					}
+					return ok && thumbnail_oiio_image(parts->front().img, make_thumbnail);
+				});
+				session_.log(spdlog::level::info, "{}: {} parts: {}", caption_, parts->size(), names);
+			}
+
+		} // namespace image
+
+	} // namespace driver
 
-// --------------------------------------------------
-// https://openimageio.readthedocs.io/en/latest/imageoutput.html
-
-
-
-void diagnostics::driver::image::OpenImageIO::run()
-{
-	spdlog::info("Running OpenImageIO diagnostics...");
-	// Check if OpenImageIO is available
-	if (!OpenImageIO::exists()) {
-		spdlog::error("OpenImageIO is not available.");
-		return;
-	}
-	// Create an image output object
-	auto output = OpenImageIO::create_output("test_image.exr");
-	if (!output) {
-		spdlog::error("Failed to create image output.");
-		return;
-	}
-	// Set image parameters
-	OpenImageIO::ImageSpec spec(800, 600, 3, OpenImageIO::TypeDesc::FLOAT);
-	output->open("test_image.exr", spec);
-	// Write a simple gradient image
-	for (int y = 0; y < 600; ++y) {
-		for (int x = 0; x < 800; ++x) {
-			float r = static_cast<float>(x) / 800.0f;
-			float g = static_cast<float>(y) / 600.0f;
-			float b = 0.5f; // Constant blue channel
-			output->write_scanline(y, 0, OpenImageIO::TypeDesc::FLOAT, &r);
-			output->write_scanline(y, 1, OpenImageIO::TypeDesc::FLOAT, &g);
-			output->write_scanline(y, 2, OpenImageIO::TypeDesc::FLOAT, &b);
-		}
-	}
-	// Close the image output
-	output->close();
-	
-	spdlog::info("OpenImageIO diagnostics completed successfully.");
 }
 
+#endif
 
 
+// ---------------------------------------------------------------------------------------------------------------
+// Notes on writing images with OpenImageIO.
 
+/*
 
-
+// --------------------------------------------------
+// https://openimageio.readthedocs.io/en/latest/imageoutput.html
 
 
 
@@ -76,7 +282,6 @@ simple_write()
 
 
 
-/*
 
 What happens when the file format doesn’t support the spec?
 
@@ -104,7 +309,6 @@ If the file format does not support arbitrarily-named channels, the channel name
 Any other metadata in the ImageSpec may be summarily dropped if not supported by the file format.
 
 
-*/
 
 
 
@@ -182,7 +386,6 @@ out->write_rectangle (xbegin, xend, ybegin, yend, zbegin, zend,
 
 
 
-/*
 Converting pixel data types
 The code examples of the previous sections all assumed that your internal pixel data is stored as unsigned 8-bit integers (i.e., 0-255 range). But OpenImageIO is significantly more flexible.
 
@@ -190,7 +393,6 @@ You may request that the output image pixels be stored in any of several data ty
 
 ImageSpec spec (xres, yres, channels, TypeDesc::UINT16);
 
-*/
 
 
 ImageSpec spec(...);
@@ -252,10 +454,4 @@ out->write_image (TypeDesc::UINT8,
 				  AutoStride);                  // default z stride
 ...
 
-
-
-
-
-
-
-
+*/
@@ -4,6 +4,162 @@
 #include <spdlog/spdlog.h>
 #include <fmt/format.h>
 
+#if defined(HAVE_LEPTONICA)
+
+#include <leptonica/allheaders.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+
+
+namespace diagnostics {
+
+	namespace driver {
+
+		namespace image {
+
+			struct pix_deleter {
+				void operator()(PIX *pix) const {
+					pixDestroy(&pix);
+				}
+			};
+
+			// Describes the PIX memory layout, for the shared conversion code; `colormap` receives the colormap,
+			// if any, as 0xRRGGBBAA words.
+			static pix_raster describe_pix(PIX *pix, uint32_t (&colormap)[256]) {
+				pix_raster raster;
+				raster.width = pixGetWidth(pix);
+				raster.height = pixGetHeight(pix);
+				raster.depth = pixGetDepth(pix);
+				raster.wpl = pixGetWpl(pix);
+				raster.spp = pixGetSpp(pix);
+				raster.data = pixGetData(pix);
+				if (PIXCMAP *cmap = pixGetColormap(pix)) {
+					int n = std::min(pixcmapGetCount(cmap), 256);
+					for (int i = 0; i < n; i++) {
+						l_uint32 rgba = 0;
+						pixcmapGetRGBA32(cmap, i, &rgba);
+						colormap[i] = rgba;
+					}
+					raster.colormap = colormap;
+					raster.colormap_size = n;
+				}
+				return raster;
+			}
+
+			// Raw capture: the raster goes straight into the cycle's pack file, to be encoded later, if ever.
+			static void capture_pix(session &s, std::string_view caption, PIX *pix) {
+				uint32_t colormap[256];
+				s.log_pix_raster(caption, describe_pix(pix, colormap));
+			}
+
+			// Takes the snapshot of `pix` and returns the function which encodes it; an empty function on failure.
+			static encode_function pix_encoder(session &s, std::string_view caption, PIX *pix, pix_snapshot snapshot, pix_format format, const char *&extension) {
+				// this is all the work done on the caller's thread (plus queueing the job): a reference count
+				// increment for a clone, a memcpy for a copy.
+				PIX *snap = (snapshot == pix_snapshot::copy) ? pixCopy(nullptr, pix) : pixClone(pix);
+				if (!snap) {
+					spdlog::error("Cannot log image {}: leptonica failed to take a snapshot", caption);
+					return {};
+				}
+				std::shared_ptr<PIX> held(snap, pix_deleter());
+
+				int iff;
+				if (format == pix_format::tiff) {
+					iff = pixGetDepth(snap) == 1 ? IFF_TIFF_G4 : IFF_TIFF_ZIP;
+					extension = "tif";
+				} else {
+					iff = IFF_PNG;
+					extension = "png";
+				}
+
+				return [&s, held = std::move(held), iff](const std::string &path, const std::function<void(const scanline_source &)> &make_thumbnail) {
+					uint32_t colormap[256];
+					pix_raster raster = describe_pix(held.get(), colormap);
+					if (iff == IFF_PNG && is_bilevel_pix(raster)) {
+						// binarized pages and masks: our 1-bit encoder, which also beats leptonica's PNG output on size.
+						bilevel_encode_stats stats;
+						if (!write_bilevel_png(path, raster.width, raster.height, pix_bilevel_rows(raster), &stats))
+							return false;
+						s.note_bilevel_encode(stats);
+						spdlog::debug("Bilevel PNG {}: {}x{}, {} strips, {:.1f} MB/s", path, raster.width, raster.height, stats.strips, stats.megabytes_per_second());
+					} else if (pixWrite(path.c_str(), held.get(), iff) != 0) {
+						spdlog::error("leptonica failed to write image file {}", path);
+						return false;
+					}
+					// the thumbnail is made from rows converted on the fly, straight from the PIX raster.
+					pix_row_converter converter(raster);
+					if (!converter.valid())
+						return false;
+					make_thumbnail(converter.scanlines());
+					return true;
+				};
+			}
+
+			void log_pix(session &s, std::string_view caption, PIX *pix, pix_snapshot snapshot, pix_format format) {
+				if (!pix) {
+					spdlog::error("Cannot log image {}: no PIX", caption);
+					return;
+				}
+
+				if (s.options().raw_image_capture) {
+					capture_pix(s, caption, pix);
+					return;
+				}
+
+				// an unchanged image is not even snapshot.
+				content_hash hash;
+				if (s.options().deduplicate_images) {
+					uint32_t colormap[256];
+					hash = hash_pix_raster(describe_pix(pix, colormap));
+					if (s.log_duplicate_image(caption, hash))
+						return;
+				}
+
+				const char *extension = nullptr;
+				if (encode_function encode = pix_encoder(s, caption, pix, snapshot, format, extension))
+					s.log_image(caption, extension, pixGetWidth(pix), pixGetHeight(pix), std::move(encode), false, 256, hash);
+			}
+
+			void log_pix_overlay_background(session &s, std::string_view caption, PIX *pix, pix_snapshot snapshot) {
+				if (!pix) {
+					spdlog::error("Cannot log overlay background {}: no PIX", caption);
+					return;
+				}
+				const char *extension = nullptr;
+				if (encode_function encode = pix_encoder(s, caption, pix, snapshot, pix_format::png, extension))
+					s.log_overlay_background(caption, extension, pixGetWidth(pix), pixGetHeight(pix), std::move(encode));
+			}
+
+			void log_pix_frame(session &s, std::string_view sequence, std::string_view caption, PIX *pix) {
+				if (!pix) {
+					spdlog::error("Cannot log frame {}: no PIX", caption);
+					return;
+				}
+				uint32_t colormap[256];
+				pix_row_converter converter(describe_pix(pix, colormap));
+				if (!converter.valid()) {
+					spdlog::error("Cannot log frame {}: unsupported {} bpp PIX", caption, pixGetDepth(pix));
+					return;
+				}
+				s.log_frame(sequence, caption, converter.scanlines());
+			}
+
+		} // namespace image
+
+	} // namespace driver
+
+}
+
+#endif
+
+
+// ---------------------------------------------------------------------------------------------------------------
+// Notes on moving images between leptonica and Qt.
+
+/*
+
 
 
 
@@ -134,4 +290,4 @@ QImage TessTools::PIX2QImage(PIX *pixImage) {
 	return result.rgbSwapped();
 }
 
-
+*/
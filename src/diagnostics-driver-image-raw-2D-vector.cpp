@@ -4,6 +4,208 @@
 #include <spdlog/spdlog.h>
 #include <fmt/format.h>
 
+#include <algorithm>
+#include <cmath>
 
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#define LIBDIAG_COLORMAP_X86 1
+#if defined(__GNUC__) || defined(__clang__)
+#define LIBDIAG_TARGET_AVX2 __attribute__((target("avx2")))
+#else
+#define LIBDIAG_TARGET_AVX2
+#endif
+#endif
 
 
+// Heatmaps of raw 2D arrays: the templates in the header turn the values into 8-bit colormap indices on the
+// caller's thread; here the indices are colored, on the image pool, and encoded as PNG.
+//
+// Coloring is a lookup of one 4-byte RGBA table entry per pixel: with AVX2, a VPGATHERDD fetches 8 entries at
+// once, and a PSHUFB drops the alpha bytes, leaving 24 bytes of RGB.
+
+namespace diagnostics {
+
+	namespace driver {
+
+		namespace image {
+
+			// --- colormaps ------------------------------------------------------------------------------------
+
+			// 256 RGBA entries, alpha unused; 4 bytes per entry, so a gather can fetch them as 32-bit words.
+			struct colormap_table {
+				alignas(32) uint8_t rgba[256][4];
+			};
+
+			// The maps are interpolated from 11 evenly spaced colors of the matplotlib originals.
+			static colormap_table interpolate(const uint32_t (&anchors)[11]) {
+				colormap_table t{};
+				for (int i = 0; i < 256; i++) {
+					double pos = i * 10.0 / 255;
+					int k = std::min(int(pos), 9);
+					double f = pos - k;
+					for (int c = 0; c < 3; c++) {
+						int shift = 16 - 8 * c;
+						double a = (anchors[k] >> shift) & 0xFF;
+						double b = (anchors[k + 1] >> shift) & 0xFF;
+						t.rgba[i][c] = uint8_t(std::lrint(a + (b - a) * f));
+					}
+					t.rgba[i][3] = 0xFF;
+				}
+				return t;
+			}
+
+			static const colormap_table &table_of(colormap map) {
+				static const colormap_table gray = [] {
+					colormap_table t{};
+					for (int i = 0; i < 256; i++)
+						t.rgba[i][0] = t.rgba[i][1] = t.rgba[i][2] = t.rgba[i][3] = uint8_t(i);
+					return t;
+				}();
+				static const colormap_table viridis = interpolate({0x440154, 0x482475, 0x414487, 0x355F8D, 0x2A788E, 0x21918C, 0x22A884, 0x44BF70, 0x7AD151, 0xBDDF26, 0xFDE725});
+				static const colormap_table inferno = interpolate({0x000004, 0x160B39, 0x420A68, 0x6A176E, 0x932667, 0xBC3754, 0xDD513A, 0xF37819, 0xFCA50A, 0xF6D746, 0xFCFFA4});
+				// RdBu, reversed: blue for the low values.
+				static const colormap_table diverging = interpolate({0x053061, 0x2166AC, 0x4393C3, 0x92C5DE, 0xD1E5F0, 0xF7F7F7, 0xFDDBC7, 0xF4A582, 0xD6604D, 0xB2182B, 0x67001F});
+				switch (map) {
+				case colormap::gray:
+					return gray;
+				case colormap::inferno:
+					return inferno;
+				case colormap::diverging:
+					return diverging;
+				default:
+					return viridis;
+				}
+			}
+
+			static void apply_colormap_0(const uint8_t *idx, size_t n, const colormap_table &table, uint8_t *rgb) {
+				for (size_t i = 0; i < n; i++)
+					memcpy(rgb + 3 * i, table.rgba[idx[i]], 3);
+			}
+
+#if defined(LIBDIAG_COLORMAP_X86)
+			LIBDIAG_TARGET_AVX2
+			static void apply_colormap_avx2(const uint8_t *idx, size_t n, const colormap_table &table, uint8_t *rgb) {
+				// within each 128-bit lane: the RGB bytes of its 4 pixels first.
+				const __m256i drop_alpha = _mm256_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1, 0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+				const int *entries = reinterpret_cast<const int *>(table.rgba);
+				size_t i = 0;
+				// each iteration stores 4 bytes beyond its 8 pixels, which the next pixels overwrite: stop 2 pixels early.
+				for (; i + 10 <= n; i += 8) {
+					__m256i v = _mm256_cvtepu8_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i *>(idx + i)));
+					__m256i c = _mm256_shuffle_epi8(_mm256_i32gather_epi32(entries, v, 4), drop_alpha);
+					_mm_storeu_si128(reinterpret_cast<__m128i *>(rgb + 3 * i), _mm256_castsi256_si128(c));
+					_mm_storeu_si128(reinterpret_cast<__m128i *>(rgb + 3 * i + 12), _mm256_extracti128_si256(c, 1));
+				}
+				apply_colormap_0(idx + i, n - i, table, rgb + 3 * i);
+			}
+#endif
+
+			using apply_colormap_function = void (*)(const uint8_t *idx, size_t n, const colormap_table &table, uint8_t *rgb);
+
+			static apply_colormap_function select_apply_colormap() {
+#if defined(LIBDIAG_COLORMAP_X86)
+#if defined(_MSC_VER)
+				// AVX2 needs both the CPU and the OS, which must save the YMM registers.
+				int info[4];
+				__cpuid(info, 1);
+				bool avx2 = (info[2] & (1 << 27)) != 0 && (info[2] & (1 << 28)) != 0 && (_xgetbv(0) & 6) == 6;
+				if (avx2) {
+					__cpuidex(info, 7, 0);
+					avx2 = (info[1] & (1 << 5)) != 0;
+				}
+#else
+				__builtin_cpu_init();
+				bool avx2 = __builtin_cpu_supports("avx2");
+#endif
+				if (avx2)
+					return apply_colormap_avx2;
+#endif
+				return apply_colormap_0;
+			}
+
+			static void apply_colormap(const uint8_t *idx, size_t n, const colormap_table &table, uint8_t *rgb) {
+				static const apply_colormap_function f = select_apply_colormap();
+				f(idx, n, table, rgb);
+			}
+
+
+			// --- log_heatmap ----------------------------------------------------------------------------------
+
+			value_range heatmap_mapped_range(const value_range &values, const heatmap_options &opts) {
+				value_range rv = values;
+				if (opts.min < opts.max) {
+					rv.min = opts.min;
+					rv.max = opts.max;
+					rv.count = std::max<size_t>(rv.count, 1);
+				} else if (opts.map == colormap::diverging && rv.count) {
+					// zero in the middle, on white.
+					double m = std::max(std::abs(rv.min), std::abs(rv.max));
+					rv.min = -m;
+					rv.max = m;
+				}
+				return rv;
+			}
+
+			bool clip_heatmap_range(const uint64_t (&histogram)[256], double percent, value_range &mapped, bool &exact) {
+				uint64_t total = 0;
+				for (uint64_t count : histogram)
+					total += count;
+				const double clipped = total * percent / 100;
+				int lo = 0;
+				int hi = 255;
+				for (uint64_t sum = 0; lo < 255 && (sum += histogram[lo]) <= clipped; lo++)
+					;
+				for (uint64_t sum = 0; hi > 0 && (sum += histogram[hi]) <= clipped; hi--)
+					;
+				if (lo >= hi || (lo == 0 && hi == 255))
+					return false;
+
+				// bin k holds the values in [first + (k - 0.5) * step, first + (k + 0.5) * step).
+				const double step = (mapped.max - mapped.min) / 255;
+				const double first = mapped.min;
+				exact = hi - lo >= 64;
+				mapped.min = first + (exact ? lo : lo - 0.5) * step;
+				mapped.max = first + (exact ? hi : hi + 0.5) * step;
+				return true;
+			}
+
+			void log_heatmap_indices(session &s, std::string_view caption, std::shared_ptr<heatmap_indices> img, const heatmap_options &opts) {
+				const int width = img->indices.width;
+				const int height = img->indices.height;
+				// a map which did not change since the last stage has the same indices; the colormap and a tag
+				// ("HMAP") tell them apart from a plain raster with the same bytes.
+				content_hash hash;
+				if (s.options().deduplicate_images)
+					hash = hash_image_rows(img->indices.pixels.data(), size_t(width), height, width, {uint64_t(width), uint64_t(height), uint64_t(opts.map), 0x484D4150u});
+				if (!s.log_duplicate_image(caption, hash))
+					s.log_image(caption, "png", width, height, [img, table = &table_of(opts.map), gray = opts.map == colormap::gray](const std::string &path, const std::function<void(const scanline_source &)> &make_thumbnail) {
+						const raster_buffer &indices = img->indices;
+						const int channels = gray ? 1 : 3;
+						std::vector<uint8_t> row(size_t(indices.width) * channels);
+						scanline_source src(indices.width, indices.height, channels, [&](int y) {
+							const uint8_t *idx = indices.pixels.data() + size_t(y) * indices.width;
+							if (gray)
+								return idx;
+							apply_colormap(idx, size_t(indices.width), *table, row.data());
+							return static_cast<const uint8_t *>(row.data());
+						});
+						if (!write_png(path, src))
+							return false;
+						make_thumbnail(src);
+						return true;
+					}, false, 256, hash);
+				if (img->range.count)
+					s.log(spdlog::level::info, "{}: {}x{}, colored from {:g} to {:g}; the values span {:g} .. {:g}", caption, width, height, img->first, img->last, img->range.min, img->range.max);
+				else
+					s.log(spdlog::level::warn, "{}: {}x{}, without a single finite value", caption, width, height);
+			}
+
+		} // namespace image
+
+	} // namespace driver
+
+}
@@ -1,13 +1,117 @@
-
 #include <diagnostics/diagnostics.h>
 
 #include <spdlog/spdlog.h>
 #include <fmt/format.h>
 
+#include <algorithm>
 
+#if defined(HAVE_TESSERACT)
+#if !defined(HAVE_LEPTONICA)
+#error "tesseract images are leptonica PIX images: define HAVE_LEPTONICA as well"
+#endif
+#include <tesseract/baseapi.h>
+#include <tesseract/pageiterator.h>
+#include <tesseract/resultiterator.h>
+#include <leptonica/allheaders.h>
+#endif
 
 
 // https://github.com/tesseract-ocr/tesseract/issues/263
 // (tesseract with OpenMP is very slow) ... *gosh*  ;-)
 
 
+namespace diagnostics {
+
+	namespace driver {
+
+		namespace image {
+
+#if defined(HAVE_TESSERACT)
+
+			// --- tesseract layouts ----------------------------------------------------------------------------
+
+			// `Iterator` is a copy of the caller's iterator: iterating does not move theirs.
+			template <typename Iterator>
+			static void add_layout(overlay &ov, Iterator it, tesseract::PageIteratorLevel level, bool baselines) {
+				constexpr bool has_text = std::is_base_of_v<tesseract::ResultIterator, Iterator>;
+				it.Begin();
+				do {
+					int left, top, right, bottom;
+					if (it.Empty(level) || !it.BoundingBox(level, &left, &top, &right, &bottom))
+						continue;
+
+					PTA *polygon = level == tesseract::RIL_BLOCK ? it.BlockPolygon() : nullptr;
+					if (polygon && ptaGetCount(polygon) > 2) {
+						std::vector<float> xy;
+						for (int i = 0; i < ptaGetCount(polygon); i++) {
+							l_int32 x, y;
+							ptaGetIPt(polygon, i, &x, &y);
+							xy.push_back(float(x));
+							xy.push_back(float(y));
+						}
+						ov.polyline(xy, true);
+					} else {
+						ov.box(float(left), float(top), float(right), float(bottom));
+					}
+					ptaDestroy(&polygon);
+
+					int x1, y1, x2, y2;
+					if (baselines && (level == tesseract::RIL_TEXTLINE || level == tesseract::RIL_WORD) && it.Baseline(level, &x1, &y1, &x2, &y2))
+						ov.line(float(x1), float(y1), float(x2), float(y2));
+
+					if constexpr (has_text) {
+						if (level == tesseract::RIL_WORD || level == tesseract::RIL_SYMBOL) {
+							std::unique_ptr<char[]> text(it.GetUTF8Text(level));
+							if (text) {
+								std::string_view label(text.get());
+								while (!label.empty() && (label.back() == '\n' || label.back() == ' '))
+									label.remove_suffix(1);
+								// just above the box, at half the box height: readable when zoomed in.
+								ov.text(float(left), float(top - 1), label, std::clamp((bottom - top) * 0.5f, 6.0f, 32.0f));
+							}
+						}
+					}
+				} while (it.Next(level));
+			}
+
+			void add_tesseract_layout(overlay &ov, const tesseract::PageIterator &it, int level, bool baselines) {
+				const auto ril = tesseract::PageIteratorLevel(level);
+				if (const auto *results = dynamic_cast<const tesseract::ResultIterator *>(&it))
+					add_layout(ov, *results, ril, baselines);
+				else
+					add_layout(ov, it, ril, baselines);
+			}
+
+			void log_tesseract_page(session &s, std::string_view caption, tesseract::TessBaseAPI &api) {
+				PIX *pix = api.GetThresholdedImage();
+				if (!pix) {
+					spdlog::error("Cannot log page {}: tesseract has no image", caption);
+					return;
+				}
+				// the snapshot is a clone: our reference keeps the image alive after the call.
+				log_pix_overlay_background(s, caption, pix);
+				pixDestroy(&pix);
+			}
+
+			void log_tesseract_layout(session &s, std::string_view caption, tesseract::TessBaseAPI &api) {
+				std::unique_ptr<tesseract::PageIterator> it(api.GetIterator());
+				if (!it)
+					it.reset(api.AnalyseLayout());
+				if (!it) {
+					spdlog::error("Cannot log layout {}: tesseract found no layout", caption);
+					return;
+				}
+				overlay ov;
+				add_tesseract_layout(ov.pen("#06f", 2), *it, tesseract::RIL_BLOCK, false);
+				add_tesseract_layout(ov.pen("#0a0"), *it, tesseract::RIL_TEXTLINE);
+				add_tesseract_layout(ov.pen("#e00"), *it, tesseract::RIL_WORD, false);
+				s.log_overlay(caption, ov);
+			}
+
+#endif
+
+		} // namespace image
+
+	} // namespace driver
+
+}
@@ -4,6 +4,363 @@
 #include <spdlog/spdlog.h>
 #include <fmt/format.h>
 
+#if defined(HAVE_LIBVIPS)
+
+#include <vips/vips.h>
+
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+
+
+namespace diagnostics {
+
+	namespace driver {
+
+		namespace image {
+
+			// libvips must be started once per process, before the first image.
+			static bool start_vips() {
+				static const bool started = [] {
+					if (VIPS_INIT("diagnostics")) {
+						spdlog::error("Cannot start libvips: {}", vips_error_buffer());
+						vips_error_clear();
+						return false;
+					}
+					return true;
+				}();
+				return started;
+			}
+
+			static void report_vips_error(std::string_view what, const std::string &path) {
+				spdlog::error("libvips failed to {} {}: {}", what, path, vips_error_buffer());
+				vips_error_clear();
+			}
+
+			// Owns one reference to a VipsImage.
+			class vips_image_ref {
+			public:
+				vips_image_ref() = default;
+				explicit vips_image_ref(VipsImage *im) :
+					im_(im) {
+				}
+				~vips_image_ref() {
+					if (im_)
+						g_object_unref(im_);
+				}
+				vips_image_ref(const vips_image_ref &) = delete;
+				vips_image_ref &operator=(const vips_image_ref &) = delete;
+
+				void swap(vips_image_ref &other) {
+					std::swap(im_, other.im_);
+				}
+				VipsImage *get() const {
+					return im_;
+				}
+				// for the output arguments of the vips operations.
+				VipsImage **out() {
+					if (im_)
+						g_object_unref(im_);
+					im_ = nullptr;
+					return &im_;
+				}
+
+			private:
+				VipsImage *im_ = nullptr;
+			};
+
+			static VipsBandFormat band_format(pixel_type type) {
+				switch (type) {
+				case pixel_type::uint8:
+					return VIPS_FORMAT_UCHAR;
+				case pixel_type::uint16:
+					return VIPS_FORMAT_USHORT;
+				case pixel_type::float32:
+					return VIPS_FORMAT_FLOAT;
+				default:
+					return VIPS_FORMAT_NOTSET;          // libvips has no half floats
+				}
+			}
+
+			static size_t sample_size(pixel_type type) {
+				switch (type) {
+				case pixel_type::uint8:
+					return 1;
+				case pixel_type::uint16:
+				case pixel_type::half:
+					return 2;
+				default:
+					return 4;
+				}
+			}
+
+			// Wraps the caller's pixels without copying them. Padded rows are wrapped as a wider image, of which
+			// only the real pixels are extracted: libvips never reads the padding.
+			static bool wrap_pixels(const strided_image &img, const std::string &path, vips_image_ref &out) {
+				const VipsBandFormat format = band_format(img.type);
+				if (format == VIPS_FORMAT_NOTSET) {
+					spdlog::error("Cannot write {} with libvips: it has no half float images", path);
+					return false;
+				}
+				const size_t pixel = sample_size(img.type) * img.channels;
+				const size_t row_bytes = pixel * img.width;
+				const size_t y_stride = img.y_stride ? size_t(img.y_stride) : row_bytes;
+				if ((img.x_stride && size_t(img.x_stride) != pixel) || img.y_stride < 0 || y_stride < row_bytes || y_stride % pixel) {
+					spdlog::error("Cannot write {} with libvips: it needs interleaved pixels and rows a whole number of pixels apart", path);
+					return false;
+				}
+
+				const int wrapped_width = int(y_stride / pixel);
+				vips_image_ref wrapped(vips_image_new_from_memory(img.data, y_stride * img.height, wrapped_width, img.height, img.channels, format));
+				if (!wrapped.get()) {
+					report_vips_error("wrap the pixels of", path);
+					return false;
+				}
+				if (wrapped_width == img.width) {
+					out.swap(wrapped);
+					return true;
+				}
+				if (vips_extract_area(wrapped.get(), out.out(), 0, 0, img.width, img.height, nullptr)) {
+					report_vips_error("crop the pixels of", path);
+					return false;
+				}
+				return true;
+			}
+
+			static std::string lowercase_extension(const std::string &path) {
+				size_t dot = path.find_last_of("./\\");
+				if (dot == std::string::npos || path[dot] != '.')
+					return {};
+				std::string ext = path.substr(dot + 1);
+				std::transform(ext.begin(), ext.end(), ext.begin(), [](unsigned char c) {
+					return char(std::tolower(c));
+				});
+				return ext;
+			}
+
+			static bool save(VipsImage *in, const std::string &path, const strided_image &img, const vips_write_options &opts) {
+				const std::string ext = lowercase_extension(path);
+				int failed;
+				if (ext == "png") {
+					if (img.type == pixel_type::float32) {
+						spdlog::error("Cannot write {}: PNG takes 8 and 16-bit images only, write float images as TIFF", path);
+						return false;
+					}
+					failed = vips_pngsave(in, path.c_str(), "compression", opts.compression_level, nullptr);
+				} else if (ext == "tif" || ext == "tiff") {
+					const int64_t pixels = int64_t(img.width) * img.height;
+					const bool tiled = pixels >= opts.tile_threshold;
+					const bool big = uint64_t(pixels) * sample_size(img.type) * img.channels >= (uint64_t(1) << 32) - (uint64_t(1) << 24);
+					failed = vips_tiffsave(in, path.c_str(), "compression", VIPS_FOREIGN_TIFF_COMPRESSION_DEFLATE, "level", opts.compression_level, "tile", int(tiled), "tile_width", opts.tile_size, "tile_height", opts.tile_size, "bigtiff", int(big), nullptr);
+				} else {
+					failed = vips_image_write_to_file(in, path.c_str(), nullptr);
+				}
+				if (failed) {
+					report_vips_error("write", path);
+					return false;
+				}
+				return true;
+			}
+
+			// Shrinks the wrapped image into an 8-bit thumbnail. The shrunk pixels are small, so they are fetched
+			// into memory and scaled here: 16-bit images keep their full range, float images are scaled by the
+			// range of their finite values.
+			static bool make_vips_thumbnail(VipsImage *in, const std::string &path, int size, raster_buffer &thumbnail) {
+				vips_image_ref thumb;
+				if (vips_thumbnail_image(in, thumb.out(), size, "height", size, "size", VIPS_SIZE_DOWN, nullptr)) {
+					report_vips_error("make a thumbnail of", path);
+					return false;
+				}
+				// gray, gray + alpha, RGB or RGBA: more than 4 bands show the first three.
+				if (vips_image_get_bands(thumb.get()) > 4) {
+					vips_image_ref rgb;
+					if (vips_extract_band(thumb.get(), rgb.out(), 0, "n", 3, nullptr)) {
+						report_vips_error("make a thumbnail of", path);
+						return false;
+					}
+					thumb.swap(rgb);
+				}
+				VipsBandFormat format = vips_image_get_format(thumb.get());
+				if (format != VIPS_FORMAT_UCHAR && format != VIPS_FORMAT_USHORT && format != VIPS_FORMAT_FLOAT) {
+					vips_image_ref cast;
+					if (vips_cast(thumb.get(), cast.out(), VIPS_FORMAT_FLOAT, nullptr)) {
+						report_vips_error("make a thumbnail of", path);
+						return false;
+					}
+					thumb.swap(cast);
+					format = VIPS_FORMAT_FLOAT;
+				}
+
+				size_t bytes = 0;
+				void *pixels = vips_image_write_to_memory(thumb.get(), &bytes);
+				if (!pixels) {
+					report_vips_error("make a thumbnail of", path);
+					return false;
+				}
+				thumbnail = raster_buffer(vips_image_get_width(thumb.get()), vips_image_get_height(thumb.get()), vips_image_get_bands(thumb.get()));
+				const size_t n = thumbnail.pixels.size();
+				if (format == VIPS_FORMAT_UCHAR) {
+					memcpy(thumbnail.pixels.data(), pixels, n);
+				} else if (format == VIPS_FORMAT_USHORT) {
+					scale_to_8bit(static_cast<const uint16_t *>(pixels), n, thumbnail.pixels.data(), 0, 255.0f / 65535);
+				} else {
+					const float *values = static_cast<const float *>(pixels);
+					float offset, scale;
+					scale_for_range(find_value_range(values, n), offset, scale);
+					scale_to_8bit(values, n, thumbnail.pixels.data(), offset, scale);
+				}
+				g_free(pixels);
+				return true;
+			}
+
+			bool vips_write(const std::string &path, const strided_image &img, const vips_write_options &opts, int thumbnail_size, raster_buffer *thumbnail) {
+				if (!img.data || img.width <= 0 || img.height <= 0 || img.channels <= 0) {
+					spdlog::error("Cannot write a {}x{} image with {} channels to {}", img.width, img.height, img.channels, path);
+					return false;
+				}
+				if (!start_vips())
+					return false;
+				vips_image_ref in;
+				if (!wrap_pixels(img, path, in))
+					return false;
+				// two demand-driven pipelines over the same wrapped pixels: each pulls strips through its own
+				// worker threads, and neither copies the image.
+				if (!save(in.get(), path, img, opts))
+					return false;
+				return !thumbnail_size || !thumbnail || make_vips_thumbnail(in.get(), path, thumbnail_size, *thumbnail);
+			}
+
+			// Tiles are 8-bit: 16-bit images are scaled from their full range, float images from the range of
+			// their finite values, which is found on the caller's pixels before libvips reads them.
+			static bool to_8bit(VipsImage *in, const strided_image &img, const std::string &path, vips_image_ref &out) {
+				double scale = 1, offset = 0;
+				if (img.type == pixel_type::uint16) {
+					scale = 255.0 / 65535;
+				} else if (img.type == pixel_type::float32) {
+					const size_t n = size_t(img.width) * img.channels;
+					const size_t y_stride = img.y_stride ? size_t(img.y_stride) : n * sizeof(float);
+					value_range range;
+					for (int y = 0; y < img.height; y++)
+						range.merge(find_value_range(reinterpret_cast<const float *>(static_cast<const char *>(img.data) + y * y_stride), n));
+					float o, sc;
+					scale_for_range(range, o, sc);
+					scale = sc;
+					offset = -double(o) * sc;
+				}
+				if (vips_linear1(in, out.out(), scale, offset, "uchar", int(true), nullptr)) {
+					report_vips_error("scale the pixels of", path);
+					return false;
+				}
+				return true;
+			}
+
+			bool vips_write_tile_pyramid(const std::string &base, const strided_image &img, const vips_write_options &opts) {
+				if (!img.data || img.width <= 0 || img.height <= 0 || img.channels <= 0) {
+					spdlog::error("Cannot write a tile pyramid of a {}x{} image with {} channels to {}", img.width, img.height, img.channels, base);
+					return false;
+				}
+				if (!start_vips())
+					return false;
+				vips_image_ref in;
+				if (!wrap_pixels(img, base, in))
+					return false;
+				if (img.type != pixel_type::uint8) {
+					vips_image_ref scaled;
+					if (!to_8bit(in.get(), img, base, scaled))
+						return false;
+					in.swap(scaled);
+				}
+				if (img.channels > 4) {
+					vips_image_ref rgb;
+					if (vips_extract_band(in.get(), rgb.out(), 0, "n", 3, nullptr)) {
+						report_vips_error("write the tile pyramid", base);
+						return false;
+					}
+					in.swap(rgb);
+				}
+
+				// no overlap keeps the viewer simple; the levels are shrunk from each other, in one pass over the image.
+				const std::string suffix = fmt::format(".png[compression={}]", opts.compression_level);
+				if (vips_dzsave(in.get(), base.c_str(), "layout", VIPS_FOREIGN_DZ_LAYOUT_DZ, "tile_size", opts.tile_size, "overlap", 0, "suffix", suffix.c_str(), nullptr)) {
+					report_vips_error("write the tile pyramid", base);
+					return false;
+				}
+				return true;
+			}
+
+			void log_vips_image(session &s, std::string_view caption, const strided_image &img, std::shared_ptr<const void> owner, std::string_view extension, const vips_write_options &opts) {
+				if (!img.data || img.width <= 0 || img.height <= 0 || img.channels <= 0) {
+					spdlog::error("Cannot log image {}: a {}x{} image with {} channels", caption, img.width, img.height, img.channels);
+					return;
+				}
+				content_hash hash;
+				if (s.options().deduplicate_images) {
+					hash = hash_strided_image(img);
+					if (s.log_duplicate_image(caption, hash))
+						return;
+				}
+				const int thumbnail_size = s.options().thumbnail_size;
+				// the section path is only built for the page-size images, and only when the filter can match.
+				const section_filter &filter = s.options().tile_pyramids;
+				const bool tile_pyramid = std::max(img.width, img.height) >= opts.tile_pyramid_min_size && !filter.matches_nothing() && filter.matches(s.section_path());
+				s.log_image(caption, extension, img.width, img.height, [img, owner = std::move(owner), opts, thumbnail_size, tile_pyramid](const std::string &path, const std::function<void(const scanline_source &)> &make_thumbnail) {
+					raster_buffer thumbnail;
+					if (!vips_write(path, img, opts, thumbnail_size, &thumbnail))
+						return false;
+					// already small enough: the store's box filter passes it through.
+					make_thumbnail(thumbnail.view());
+					return !tile_pyramid || vips_write_tile_pyramid(tile_pyramid_base(path), img, opts);
+				}, tile_pyramid, opts.tile_size, hash);
+			}
+
+			void log_vips_frame(session &s, std::string_view sequence, std::string_view caption, const strided_image &img) {
+				const size_t pixel = sample_size(img.type) * img.channels;
+				if (!img.data || img.width <= 0 || img.height <= 0 || !(img.channels == 1 || img.channels == 3 || img.channels == 4) || img.type == pixel_type::half || (img.x_stride && size_t(img.x_stride) != pixel)) {
+					spdlog::error("Cannot log frame {}: a {}x{} image with {} channels, or not interleaved", caption, img.width, img.height, img.channels);
+					return;
+				}
+				const size_t n = size_t(img.width) * img.channels;
+				const ptrdiff_t y_stride = img.y_stride ? img.y_stride : ptrdiff_t(pixel * img.width);
+				auto row_of = [&](int y) {
+					return static_cast<const char *>(img.data) + y * y_stride;
+				};
+
+				// like the tiles: 16-bit frames from their full range, float frames from the range of their finite values.
+				float offset = 0, scale = 255.0f / 65535;
+				if (img.type == pixel_type::float32) {
+					value_range range;
+					for (int y = 0; y < img.height; y++)
+						range.merge(find_value_range(reinterpret_cast<const float *>(row_of(y)), n));
+					scale_for_range(range, offset, scale);
+				}
+				std::vector<uint8_t> row(n);
+				s.log_frame(sequence, caption, scanline_source(img.width, img.height, img.channels, [&](int y) {
+					if (img.type == pixel_type::uint8)
+						return reinterpret_cast<const uint8_t *>(row_of(y));
+					if (img.type == pixel_type::uint16)
+						scale_to_8bit(reinterpret_cast<const uint16_t *>(row_of(y)), n, row.data(), 0, scale);
+					else
+						scale_to_8bit(reinterpret_cast<const float *>(row_of(y)), n, row.data(), offset, scale);
+					return static_cast<const uint8_t *>(row.data());
+				}));
+			}
+
+		} // namespace image
+
+	} // namespace driver
+
+}
+
+#endif
+
+
+// ---------------------------------------------------------------------------------------------------------------
+// Notes on the libvips C and C++ APIs.
+
+/*
+
+#include <fmt/format.h>
+
 
 
 
@@ -43,31 +400,26 @@ main(int argc, char **argv)
 		exit(1);
 	}
 
-	/* Use the C API to decode to a VipsImage.
-	 */
+	// Use the C API to decode to a VipsImage.
 	VipsImage *c_im;
 
-	/* You can put load options before the NULL as name/value pairs, eg.
-	 * ("shrink", 2,") to shrink by x2 during load.
-	 */
+	// You can put load options before the NULL as name/value pairs, eg.
+	// ("shrink", 2,") to shrink by x2 during load.
 	if (vips_jpegload_buffer(contents, length, &c_im, NULL))
 		vips_error_exit("unable to decode jpeg");
 
-	/* Now wrap the C VipsImage up as a C++ VImage.
-	 */
+	// Now wrap the C VipsImage up as a C++ VImage.
 	vips::VImage cpp_im(c_im);
 
-	/* The C++ API does NOT assume responsibility for the C image, you
-	 * will need to unref that yourself.
-	 *
-	 * Don't unref it while the C++ image that wraps it is still active
-	 * (obviously).
-	 */
+	// The C++ API does NOT assume responsibility for the C image, you
+	// will need to unref that yourself.
+	//
+	// Don't unref it while the C++ image that wraps it is still active
+	// (obviously).
 
 	printf("image average is: %g\n", cpp_im.avg());
 
-	/* Unref the C image.
-	 */
+	// Unref the C image.
 	g_object_unref(c_im);
 
 	return 0;
@@ -77,5 +429,4 @@ main(int argc, char **argv)
 
 // see also: https://github.com/jcupitt/libvips/blob/master/tools/vipsthumbnail.c
 
-
-
+*/
@@ -0,0 +1,116 @@
+
+// The SQLite output channel: one database (shard) per session cycle.
+
+#if defined(HAVE_SQLITE)
+
+#include <diagnostics/diagnostics.h>
+
+#include <spdlog/spdlog.h>
+
+#include <sqlite3.h>
+
+#include <chrono>
+
+namespace diagnostics {
+
+	namespace driver {
+
+		// a transaction per this many inserts, or per this much time, whichever comes first.
+		static constexpr int commit_rows = 4096;
+		static constexpr std::chrono::milliseconds commit_interval{500};
+
+		sqlite_shard::~sqlite_shard() {
+			close();
+		}
+
+		bool sqlite_shard::open(const std::string &path) {
+			close();
+
+			path_ = path;
+			if (sqlite3_open(path.c_str(), &db_) != SQLITE_OK) {
+				spdlog::error("Cannot open SQLite diagnostics shard {}: {}", path, sqlite3_errmsg(db_));
+				sqlite3_close(db_);
+				db_ = nullptr;
+				return false;
+			}
+
+			// WAL: a commit is an append to the log, which is only synced at checkpoints; the cycle's files are
+			// synced when it is finalized.
+			const char *zSql =
+				"PRAGMA journal_mode=WAL;"
+				"PRAGMA synchronous=NORMAL;"
+				"CREATE TABLE IF NOT EXISTS log(timestamp_ns INTEGER, level INTEGER, section TEXT, message TEXT);"
+				"BEGIN;";
+			if (sqlite3_exec(db_, zSql, 0, 0, 0) != SQLITE_OK || sqlite3_prepare_v2(db_, "INSERT INTO log(timestamp_ns, level, section, message) VALUES(?, ?, ?, ?)", -1, &insert_, 0) != SQLITE_OK) {
+				spdlog::error("Cannot set up SQLite diagnostics shard {}: {}", path, sqlite3_errmsg(db_));
+				close();
+				return false;
+			}
+			uncommitted_ = 0;
+			last_commit_ = std::chrono::steady_clock::now();
+			return true;
+		}
+
+		bool sqlite_shard::close() {
+			if (!db_)
+				return true;
+
+			bool ok = true;
+			if (insert_) {
+				sqlite3_finalize(insert_);
+				insert_ = nullptr;
+				ok = sqlite3_exec(db_, "COMMIT;", 0, 0, 0) == SQLITE_OK;
+			}
+			if (!ok)
+				spdlog::error("Failed to commit SQLite diagnostics shard {}: {}", path_, sqlite3_errmsg(db_));
+			// the last connection checkpoints the log into the database, and removes it.
+			sqlite3_close(db_);
+			db_ = nullptr;
+			return ok;
+		}
+
+		bool sqlite_shard::commit() {
+			uncommitted_ = 0;
+			last_commit_ = std::chrono::steady_clock::now();
+			if (sqlite3_exec(db_, "COMMIT; BEGIN;", 0, 0, 0) != SQLITE_OK) {
+				spdlog::error("Failed to commit SQLite diagnostics shard {}: {}", path_, sqlite3_errmsg(db_));
+				return false;
+			}
+			return true;
+		}
+
+		bool sqlite_shard::write_line(spdlog::level::level_enum level, std::string_view section, std::string_view text) {
+			log_record record;
+			record.level = level;
+			record.time = std::chrono::system_clock::now();
+			record.section = section;
+			record.text = text;
+			return write_record(record);
+		}
+
+		bool sqlite_shard::write_record(const log_record &record) {
+			if (!insert_)
+				return false;
+
+			int64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(record.time.time_since_epoch()).count();
+			sqlite3_bind_int64(insert_, 1, ns);
+			sqlite3_bind_int(insert_, 2, static_cast<int>(record.level));
+			sqlite3_bind_text(insert_, 3, record.section.data(), static_cast<int>(record.section.size()), SQLITE_STATIC);
+			sqlite3_bind_text(insert_, 4, record.text.data(), static_cast<int>(record.text.size()), SQLITE_STATIC);
+			int rc = sqlite3_step(insert_);
+			sqlite3_reset(insert_);
+			if (rc != SQLITE_DONE)
+				return false;
+
+			// the transaction is kept short, so that a crash loses at most the last fraction of a second, and
+			// readers see the messages while the cycle runs.
+			if (++uncommitted_ >= commit_rows || std::chrono::steady_clock::now() - last_commit_ >= commit_interval)
+				return commit();
+			return true;
+		}
+
+	} // namespace driver
+
+}
+
+#endif
@@ -3,7 +3,1155 @@
 
 #include <spdlog/spdlog.h>
 #include <fmt/format.h>
+#include <fmt/chrono.h>
 
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <filesystem>
+#include <map>
 
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#endif
 
 
+namespace diagnostics {
+
+	namespace driver {
+
+		static const char html_header_start[] =
+			"<!DOCTYPE html>\n"
+			"<html>\n"
+			"<head>\n"
+			"<meta charset=\"utf-8\">\n"
+			"<title>";
+
+		static const char html_header_end[] =
+			"</title>\n"
+			"<style>\n"
+			"body { font-family: monospace; }\n"
+			"details { margin-left: 1.5em; border-left: 1px solid #ccc; padding-left: 0.5em; }\n"
+			"summary { cursor: pointer; font-weight: bold; }\n"
+			"p { margin: 0; white-space: pre-wrap; }\n"
+			"p.trace, p.debug { color: #888; }\n"
+			"p.warning { color: #b60; }\n"
+			"p.error, p.critical { color: #c00; font-weight: bold; }\n"
+			"figure { display: inline-block; margin: 0.5em; vertical-align: top; }\n"
+			"figure img { border: 1px solid #ccc; }\n"
+			"p.file { margin: 0.25em 0.5em; }\n"
+			"span.overlay { position: relative; display: inline-block; }\n"
+			"span.overlay img + img { position: absolute; left: 0; top: 0; }\n"
+			"</style>\n"
+			"</head>\n"
+			"<body>\n";
+
+		static const char html_footer[] =
+			"</body>\n"
+			"</html>\n";
+
+		static const char section_end[] = "</details>\n";
+
+
+		static bool seek_to(FILE *fp, uint64_t offset) {
+#if defined(_WIN32)
+			return _fseeki64(fp, static_cast<__int64>(offset), SEEK_SET) == 0;
+#else
+			return fseeko(fp, static_cast<off_t>(offset), SEEK_SET) == 0;
+#endif
+		}
+
+
+		html_writer::html_writer(size_t buffer_size) :
+			buffer_(new char[buffer_size]), buffer_size_(buffer_size) {
+		}
+
+		html_writer::~html_writer() {
+			close();
+		}
+
+		bool html_writer::open(const std::string &path, std::string_view title) {
+			close();
+
+			fp_ = fopen(path.c_str(), "wb");
+			if (!fp_) {
+				spdlog::error("Cannot create HTML diagnostics file {}: {}", path, strerror(errno));
+				return false;
+			}
+			path_ = path;
+			fill_ = 0;
+			depth_ = 0;
+			committed_ = 0;
+			failed_ = false;
+
+			append(html_header_start);
+			append_escaped(title);
+			append(html_header_end);
+			return flush();
+		}
+
+		bool html_writer::close(std::string_view epilogue) {
+			if (!fp_)
+				return true;
+
+			while (depth_ > 0)
+				pop_section();
+			append(epilogue);
+			append(html_footer);
+
+			// the footer now is regular content, hence no trailer is needed any more:
+			bool ok = seek_to(fp_, committed_) && fwrite(buffer_.get(), 1, fill_, fp_) == fill_;
+			committed_ += fill_;
+			fill_ = 0;
+			if (fclose(fp_) != 0)
+				ok = false;
+			fp_ = nullptr;
+
+			if (!ok || failed_) {
+				spdlog::error("Failed to write HTML diagnostics file {}", path_);
+				return false;
+			}
+			return true;
+		}
+
+		bool html_writer::push_section(std::string_view title, std::string_view id) {
+			depth_++;
+			if (id.empty())
+				return append("<details open>\n<summary>") && append_escaped(title) && append("</summary>\n");
+			return append("<details open id=\"") && append_escaped(id) && append("\">\n<summary>") && append_escaped(title) && append("</summary>\n");
+		}
+
+		bool html_writer::push_linked_section(std::string_view title, std::string_view href) {
+			depth_++;
+			return append("<details open>\n<summary><a href=\"") && append_escaped(href) && append("\">") && append_escaped(title) && append("</a></summary>\n");
+		}
+
+		bool html_writer::pop_section() {
+			if (depth_ == 0)
+				return false;
+			depth_--;
+			return append(section_end);
+		}
+
+		bool html_writer::write_line(spdlog::level::level_enum level, std::string_view text) {
+			auto lvl = spdlog::level::to_string_view(level);
+			return append("<p class=\"") && append(std::string_view(lvl.data(), lvl.size())) && append("\">") && append_escaped(text) && append("</p>\n");
+		}
+
+		bool html_writer::write_record(const log_record &record, std::string_view id) {
+			if (id.empty())
+				return write_line(record.level, record.text);
+			auto lvl = spdlog::level::to_string_view(record.level);
+			return append("<p id=\"") && append(id) && append("\" class=\"") && append(std::string_view(lvl.data(), lvl.size())) && append("\">") && append_escaped(record.text) && append("</p>\n");
+		}
+
+		bool html_writer::write_html(std::string_view html) {
+			return append(html);
+		}
+
+		bool html_writer::write_line_fragment(std::string_view text) {
+			return append_escaped(text);
+		}
+
+		bool html_writer::append(std::string_view s) {
+			if (!fp_)
+				return false;
+			if (fill_ + s.size() > buffer_size_) {
+				if (!flush())
+					return false;
+				// chunks which would not fit in the buffer are written straight through:
+				if (s.size() > buffer_size_) {
+					if (!seek_to(fp_, committed_) || fwrite(s.data(), 1, s.size(), fp_) != s.size()) {
+						failed_ = true;
+						return false;
+					}
+					committed_ += s.size();
+					return write_trailer();
+				}
+			}
+			memcpy(buffer_.get() + fill_, s.data(), s.size());
+			fill_ += s.size();
+			return true;
+		}
+
+		// Escapes straight into the output buffer, flushing whenever it runs full: no temporary strings, and any
+		// amount of text can be written through a buffer of any (reasonable) size. Clean runs of text (nearly all
+		// of it, in practice) are found by the SIMD scanner and copied in one go.
+		bool html_writer::append_escaped(std::string_view s) {
+			// the longest entity is "&quot;": with more room than that left, every pass makes progress.
+			constexpr size_t max_entity_size = 6;
+
+			if (!fp_)
+				return false;
+			while (!s.empty()) {
+				if (buffer_size_ - fill_ <= max_entity_size && !flush())
+					return false;
+
+				size_t room = buffer_size_ - fill_ - max_entity_size;
+				size_t clean = html_clean_prefix(s.substr(0, room));
+				memcpy(buffer_.get() + fill_, s.data(), clean);
+				fill_ += clean;
+				s.remove_prefix(clean);
+				if (s.empty() || clean == room)
+					continue;
+
+				// an entity, a UTF-8 sequence which was cut off by the `room` limit, or invalid UTF-8:
+				std::string_view out = html_entity(s[0]);
+				size_t consumed = 1;
+				if (out.empty()) {
+					consumed = utf8_sequence_length(s);
+					if (consumed > 0) {
+						out = s.substr(0, consumed);
+					} else {
+						out = utf8_replacement_character;
+						consumed = 1;
+					}
+				}
+				memcpy(buffer_.get() + fill_, out.data(), out.size());
+				fill_ += out.size();
+				s.remove_prefix(consumed);
+			}
+			return true;
+		}
+
+		bool html_writer::write_trailer() {
+			for (size_t i = 0; i < depth_; i++) {
+				if (fwrite(section_end, 1, sizeof(section_end) - 1, fp_) != sizeof(section_end) - 1) {
+					failed_ = true;
+					return false;
+				}
+			}
+			if (fwrite(html_footer, 1, sizeof(html_footer) - 1, fp_) != sizeof(html_footer) - 1 || fflush(fp_) != 0) {
+				failed_ = true;
+				return false;
+			}
+			return true;
+		}
+
+		bool html_writer::flush() {
+			if (!fp_)
+				return false;
+
+			// overwrite the previous trailer with the new content, then append a fresh trailer.
+			if (!seek_to(fp_, committed_) || fwrite(buffer_.get(), 1, fill_, fp_) != fill_) {
+				spdlog::error("Failed to write HTML diagnostics file {}: {}", path_, strerror(errno));
+				failed_ = true;
+				return false;
+			}
+			committed_ += fill_;
+			fill_ = 0;
+			return write_trailer();
+		}
+
+
+
+		// --- html_channel ---------------------------------------------------------------------------------
+
+		static std::string_view file_name_of(std::string_view path) {
+			size_t pos = path.find_last_of("/\\");
+			return pos == std::string_view::npos ? path : path.substr(pos + 1);
+		}
+
+		html_channel::~html_channel() {
+			close();
+		}
+
+		std::string html_channel::page_path(uint32_t index) const {
+			return fmt::format("{}.p{:05}.html", base_path_, index);
+		}
+
+		bool html_channel::open(const std::string &base_path, std::string_view title, const html_channel_options &options, worker_pool *pool) {
+			close();
+
+			options_ = options;
+			base_path_ = base_path;
+			title_ = title;
+			index_path_ = base_path + ".html";
+			page_index_ = 0;
+			section_seq_ = 0;
+			record_count_ = 0;
+			open_sections_.clear();
+			page_first_records_.clear();
+			total_counts_ = {};
+
+			if (!index_.open(index_path_, title))
+				return false;
+			if (options_.search_index && pool) {
+				std::string viewer_path = search_viewer_path();
+				if (write_search_viewer(viewer_path, title, file_name_of(search_index_path()), file_name_of(index_path_))) {
+					search_ = std::make_unique<search_index_builder>(*pool);
+					index_.write_html(fmt::format("<p><a href=\"{}\">search</a></p>\n", file_name_of(viewer_path)));
+				}
+			}
+			return start_page();
+		}
+
+		bool html_channel::close() {
+			if (!page_.is_open())
+				return true;
+
+			bool ok = finish_page(false);
+			while (index_.depth() > 0)
+				index_.pop_section();
+			ok = index_.write_html(fmt::format("<hr>\n<p>Session total: {}</p>\n", level_summary(total_counts_))) && ok;
+			ok = index_.close() && ok;
+			open_sections_.clear();
+
+			if (search_) {
+				search_->finish();
+				ok = search_->write(search_index_path(), title_, page_first_records_, record_count_) && ok;
+				search_.reset();
+			}
+			return ok;
+		}
+
+		std::string html_channel::level_summary(const level_counts &counts) const {
+			std::string rv;
+			for (int lvl = 0; lvl < spdlog::level::off; lvl++) {
+				if (!counts[lvl])
+					continue;
+				auto name = spdlog::level::to_string_view(static_cast<spdlog::level::level_enum>(lvl));
+				if (!rv.empty())
+					rv += ", ";
+				rv += fmt::format("{} {}", counts[lvl], std::string_view(name.data(), name.size()));
+			}
+			return rv.empty() ? "no messages" : rv;
+		}
+
+		bool html_channel::start_page() {
+			std::string path = page_path(page_index_);
+			std::string page_title = fmt::format("{} - page {}", title_, page_index_ + 1);
+			if (!page_.open(path, page_title))
+				return false;
+			page_counts_ = {};
+			page_first_records_.emplace_back(file_name_of(path), record_count_);
+
+			std::string nav = fmt::format("<p><a href=\"{}\">index</a>", file_name_of(index_path_));
+			if (page_index_ > 0)
+				nav += fmt::format(" | <a href=\"{}\">previous page</a>", file_name_of(page_path(page_index_ - 1)));
+			nav += "</p>\n";
+			bool ok = page_.write_html(nav);
+
+			// re-open the sections which were left open at the end of the previous page:
+			for (const auto &title : open_sections_)
+				ok = page_.push_section(fmt::format("{} (continued)", title)) && ok;
+			return ok;
+		}
+
+		bool html_channel::finish_page(bool next_page) {
+			for (size_t i = 0; i < spdlog::level::n_levels; i++)
+				total_counts_[i] += page_counts_[i];
+
+			// only now do we know whether there is a next page: the last page of a cycle does not link to one.
+			std::string epilogue;
+			if (next_page)
+				epilogue = fmt::format("<p><a href=\"{}\">index</a> | <a href=\"{}\">next page</a></p>\n", file_name_of(index_path_), file_name_of(page_path(page_index_ + 1)));
+			std::string page_name(file_name_of(page_path(page_index_)));
+			bool ok = page_.close(epilogue);
+			ok = index_.write_html(fmt::format("<p class=\"info\">&#8627; <a href=\"{}\">page {}</a>: {}</p>\n", page_name, page_index_ + 1, level_summary(page_counts_))) && ok;
+			ok = index_.flush() && ok;
+			return ok;
+		}
+
+		bool html_channel::maybe_break_page(bool at_boundary) {
+			uint64_t size = page_.size();
+			if (size < options_.page_size || (!at_boundary && size < options_.max_page_size))
+				return true;
+
+			bool ok = finish_page(true);
+			page_index_++;
+			return start_page() && ok;
+		}
+
+		bool html_channel::push_section(std::string_view title) {
+			if (!maybe_break_page(true))
+				return false;
+
+			std::string id = fmt::format("s{}", ++section_seq_);
+			open_sections_.emplace_back(title);
+			if (open_sections_.size() <= options_.index_depth) {
+				// keep the index tree in sync with the section stack: sections which are too deep are not listed.
+				std::string href = fmt::format("{}#{}", file_name_of(page_path(page_index_)), id);
+				index_.push_linked_section(title, href);
+			}
+			return page_.push_section(title, id);
+		}
+
+		bool html_channel::pop_section() {
+			if (open_sections_.empty())
+				return false;
+			if (open_sections_.size() <= options_.index_depth)
+				index_.pop_section();
+			open_sections_.pop_back();
+			bool ok = page_.pop_section();
+			return maybe_break_page(true) && ok;
+		}
+
+		bool html_channel::write_line(spdlog::level::level_enum level, std::string_view text) {
+			log_record record;
+			record.level = level;
+			record.time = std::chrono::system_clock::now();
+			record.text = text;
+			return write_record(record);
+		}
+
+		bool html_channel::write_record(const log_record &record) {
+			if (!maybe_break_page(false))
+				return false;
+			page_counts_[record.level]++;
+
+			uint64_t seq = record_count_++;
+			if (!search_)
+				return page_.write_record(record);
+
+			// each message gets an id, so the search results can link to it.
+			search_->add(seq, record.text);
+			char id[24];
+			auto end = fmt::format_to_n(id, sizeof(id), "r{}", seq).out;
+			return page_.write_record(record, std::string_view(id, static_cast<size_t>(end - id)));
+		}
+
+		bool html_channel::write_html(std::string_view html) {
+			if (!maybe_break_page(false))
+				return false;
+			return page_.write_html(html);
+		}
+
+		bool html_channel::write_image(std::string_view caption, const image::stored_image &img) {
+			if (!maybe_break_page(false))
+				return false;
+
+			// the width/height attributes let the browser lay out the page before any thumbnail is loaded.
+			// with a tile pyramid, the thumbnail opens the deep-zoom viewer, and the caption links the full image.
+			std::string html = fmt::format("<figure><a href=\"{}\"><img src=\"{}\" loading=\"lazy\" width=\"{}\" height=\"{}\" title=\"{}x{}\"></a><figcaption>", img.viewer_url.empty() ? img.url : img.viewer_url, img.thumbnail_url, img.thumbnail_width, img.thumbnail_height, img.width, img.height);
+			if (!page_.write_html(html) || !page_.write_line_fragment(caption))
+				return false;
+			if (!img.viewer_url.empty() && !page_.write_html(fmt::format(" <a href=\"{}\">(full image)</a>", img.url)))
+				return false;
+			return page_.write_html("</figcaption></figure>\n");
+		}
+
+		bool html_channel::write_file_link(std::string_view caption, std::string_view url, std::string_view note) {
+			if (!maybe_break_page(false))
+				return false;
+			if (!page_.write_html(fmt::format("<p class=\"file\"><a href=\"{}\">", url)) || !page_.write_line_fragment(caption) || !page_.write_html("</a> "))
+				return false;
+			return page_.write_line_fragment(note) && page_.write_html("</p>\n");
+		}
+
+		bool html_channel::write_overlay(std::string_view caption, const image::stored_image &img) {
+			if (!maybe_break_page(false))
+				return false;
+
+			std::string html = fmt::format("<figure><a href=\"{}\"><span class=\"overlay\">", img.url);
+			if (!img.thumbnail_url.empty())
+				html += fmt::format("<img src=\"{}\" loading=\"lazy\" width=\"{}\" height=\"{}\">", img.thumbnail_url, img.thumbnail_width, img.thumbnail_height);
+			html += fmt::format("<img src=\"{}\" loading=\"lazy\" width=\"{}\" height=\"{}\" title=\"{}x{}\"></span></a><figcaption>", img.url, img.thumbnail_width, img.thumbnail_height, img.width, img.height);
+			if (!page_.write_html(html) || !page_.write_line_fragment(caption))
+				return false;
+			return page_.write_html("</figcaption></figure>\n");
+		}
+
+		bool html_channel::flush() {
+			bool ok = page_.flush();
+			return index_.flush() && ok;
+		}
+
+
+
+		// --- text_writer ----------------------------------------------------------------------------------
+
+		text_writer::text_writer(size_t buffer_size) :
+			buffer_(new char[buffer_size]), buffer_size_(buffer_size) {
+		}
+
+		text_writer::~text_writer() {
+			close();
+		}
+
+		bool text_writer::open(const std::string &path) {
+			close();
+
+			fp_ = fopen(path.c_str(), "wb");
+			if (!fp_) {
+				spdlog::error("Cannot create text diagnostics file {}: {}", path, strerror(errno));
+				return false;
+			}
+			path_ = path;
+			fill_ = 0;
+			depth_ = 0;
+			failed_ = false;
+			clock_second_ = -1;
+			return true;
+		}
+
+		bool text_writer::close() {
+			if (!fp_)
+				return true;
+
+			bool ok = flush();
+			if (fclose(fp_) != 0)
+				ok = false;
+			fp_ = nullptr;
+			if (!ok)
+				spdlog::error("Failed to write text diagnostics file {}", path_);
+			return ok;
+		}
+
+		bool text_writer::append(std::string_view s) {
+			if (!fp_)
+				return false;
+			if (fill_ + s.size() > buffer_size_) {
+				if (!flush())
+					return false;
+				if (s.size() > buffer_size_) {
+					if (fwrite(s.data(), 1, s.size(), fp_) != s.size()) {
+						failed_ = true;
+						return false;
+					}
+					return true;
+				}
+			}
+			memcpy(buffer_.get() + fill_, s.data(), s.size());
+			fill_ += s.size();
+			return true;
+		}
+
+		bool text_writer::flush() {
+			if (!fp_)
+				return false;
+			if (fill_ > 0) {
+				if (fwrite(buffer_.get(), 1, fill_, fp_) != fill_)
+					failed_ = true;
+				fill_ = 0;
+			}
+			if (fflush(fp_) != 0)
+				failed_ = true;
+			return !failed_;
+		}
+
+		bool text_writer::append_indent(size_t depth) {
+			static const char spaces[] = "                                                                ";
+			for (size_t n = depth * 2; n > 0;) {
+				size_t chunk = std::min(n, sizeof(spaces) - 1);
+				if (!append(std::string_view(spaces, chunk)))
+					return false;
+				n -= chunk;
+			}
+			return true;
+		}
+
+		bool text_writer::push_section(std::string_view title) {
+			depth_++;
+			return append_indent(depth_ - 1) && append(">>> ") && append(title) && append("\n");
+		}
+
+		bool text_writer::pop_section() {
+			if (depth_ == 0)
+				return false;
+			depth_--;
+			return append_indent(depth_) && append("<<<\n");
+		}
+
+		bool text_writer::write_line(spdlog::level::level_enum level, std::string_view text) {
+			log_record record;
+			record.level = level;
+			record.time = std::chrono::system_clock::now();
+			record.text = text;
+			return write_record(record);
+		}
+
+		bool text_writer::write_record(const log_record &record) {
+			auto ms = std::chrono::floor<std::chrono::milliseconds>(record.time).time_since_epoch().count();
+			int64_t second = ms >= 0 ? ms / 1000 : (ms - 999) / 1000;
+			if (second != clock_second_) {
+				auto t = std::chrono::system_clock::time_point(std::chrono::seconds(second));
+				fmt::format_to_n(clock_, sizeof(clock_), "{:%H:%M:%S}", std::chrono::floor<std::chrono::seconds>(t));
+				clock_second_ = second;
+			}
+			int millis = static_cast<int>(ms - second * 1000);
+
+			// "HH:MM:SS.mmm [L] "
+			char prefix[20];
+			memcpy(prefix, clock_, 8);
+			prefix[8] = '.';
+			prefix[9] = char('0' + millis / 100);
+			prefix[10] = char('0' + millis / 10 % 10);
+			prefix[11] = char('0' + millis % 10);
+			prefix[12] = ' ';
+			prefix[13] = '[';
+			prefix[14] = *spdlog::level::to_short_c_str(record.level);
+			prefix[15] = ']';
+			prefix[16] = ' ';
+			return append(std::string_view(prefix, 17)) && append_indent(depth_) && append(record.text) && append("\n");
+		}
+
+	} // namespace driver
+
+
+	// --- session --------------------------------------------------------------------------------------------
+
+	// Flushes the file's data to stable storage.
+	static bool sync_file(const std::filesystem::path &path) {
+#if defined(_WIN32)
+		HANDLE fh = CreateFileW(path.c_str(), GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+		if (fh == INVALID_HANDLE_VALUE)
+			return false;
+		bool ok = FlushFileBuffers(fh) != 0;
+		CloseHandle(fh);
+		return ok;
+#else
+		int fd = ::open(path.c_str(), O_RDONLY);
+		if (fd < 0)
+			return false;
+		bool ok = fsync(fd) == 0;
+		::close(fd);
+		return ok;
+#endif
+	}
+
+	struct session::channel_state {
+		uint32_t index = 0;
+		std::string base_path;
+		driver::html_channel html;
+		driver::text_writer text;
+		std::unique_ptr<driver::image::image_store> images;
+		driver::image::pix_pack_writer pack;    // opened on first use
+		driver::blob::npz_writer npz;           // of the current section; opened on first use
+		std::string npz_url;
+		driver::image::stored_image overlay_background;
+		// the image sequences of the current section, by name
+		std::map<std::string, std::unique_ptr<driver::image::queued_sequence>, std::less<>> sequences;
+		// the same, collected for an animated PNG; see `session_options::sequence_format`
+		struct animation {
+			std::shared_ptr<driver::image::frame_store> frames;
+			driver::image::stored_image img;
+			std::string file_name;
+			std::string thumbnail_file_name;
+			int delay = 0;
+		};
+		std::map<std::string, animation, std::less<>> animations;
+#if defined(HAVE_SQLITE)
+		driver::sqlite_shard sqlite;
+#endif
+
+		// Hands the frames to the image pool, which writes the animated PNG under the names handed out with the
+		// first frame, plus a thumbnail of the last frame.
+		void close_animation(std::string_view name, animation &a) {
+			std::shared_ptr<driver::image::frame_store> frames = std::move(a.frames);
+			if (!frames || frames->size() == 0)
+				return;
+			if (text.is_open())
+				text.write_line(spdlog::level::info, fmt::format("{}: {} frames, animated in {}", name, frames->size(), a.img.url));
+			images->submit_reserved(a.file_name, a.thumbnail_file_name, [frames, delay = a.delay](const std::string &path, const std::function<void(const driver::image::scanline_source &)> &make_thumbnail) {
+				bool ok = driver::image::write_apng(path, frames->width(), frames->height(), frames->channels(), frames->size(), [&](size_t i) {
+					return frames->frame(i);
+				}, delay);
+				if (ok)
+					make_thumbnail(frames->frame(frames->size() - 1));
+				// the spill file goes now, before the cycle is finalized.
+				frames->clear();
+				return ok;
+			});
+		}
+
+		// Closes the files which last for one run of a section.
+		bool close_section_files() {
+			bool ok = npz.close();
+			// the sequences are closed behind their queued frames.
+			sequences.clear();
+			for (auto &entry : animations)
+				close_animation(entry.first, entry.second);
+			animations.clear();
+			return ok;
+		}
+
+		void write_record(const driver::log_record &record) {
+			html.write_record(record);
+			if (text.is_open())
+				text.write_record(record);
+#if defined(HAVE_SQLITE)
+			if (sqlite.is_open())
+				sqlite.write_record(record);
+#endif
+		}
+	};
+
+	session::session() = default;
+
+	session::~session() {
+		finish();
+	}
+
+	std::string session::cycle_base_path(uint32_t index) const {
+		return (std::filesystem::path(options_.directory) / fmt::format("{}.{:04}", options_.name, index)).string();
+	}
+
+	std::unique_ptr<session::channel_state> session::create_state(uint32_t index) const {
+		auto state = std::make_unique<channel_state>();
+		state->index = index;
+		state->base_path = cycle_base_path(index);
+
+		std::string title = fmt::format("{} #{}", options_.title, index);
+		state->html.open(state->base_path, title, options_.html, pool_.get());
+		if (options_.text_output)
+			state->text.open(state->base_path + ".log");
+		std::string image_dir = state->base_path + ".images";
+		state->images = std::make_unique<driver::image::image_store>(*image_pool_, image_dir, std::filesystem::path(image_dir).filename().string(), options_.thumbnail_size);
+#if defined(HAVE_SQLITE)
+		if (options_.sqlite_output)
+			state->sqlite.open(state->base_path + ".sqlite");
+#endif
+		return state;
+	}
+
+	bool session::init(const session_options &options) {
+		finish();
+
+		options_ = options;
+		std::error_code ec;
+		std::filesystem::create_directories(options_.directory, ec);
+		if (ec) {
+			spdlog::error("Cannot create diagnostics output directory {}: {}", options_.directory, ec.message());
+			return false;
+		}
+
+		pool_ = std::make_unique<worker_pool>(options_.worker_threads, options_.worker_queue_depth);
+		image_pool_ = std::make_unique<worker_pool>(options_.image_threads, options_.image_queue_depth);
+		cycle_index_ = 0;
+		sections_.clear();
+		finalized_cycles_.clear();
+		retention_newest_ = 0;
+		state_ = create_state(0);
+		bool ok = state_->html.is_open();
+		prepare_standby(1);
+		return ok;
+	}
+
+	void session::prepare_standby(uint32_t index) {
+		{
+			std::lock_guard<std::mutex> lock(standby_mutex_);
+			standby_pending_ = true;
+		}
+		pool_->submit([this, index]() {
+			auto state = create_state(index);
+			{
+				std::lock_guard<std::mutex> lock(standby_mutex_);
+				standby_ = std::move(state);
+				standby_pending_ = false;
+			}
+			standby_ready_.notify_all();
+		});
+	}
+
+	bool session::cycle() {
+		if (!pool_)
+			return false;
+
+		std::shared_ptr<channel_state> old;
+		uint32_t next_index;
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+
+			std::unique_ptr<channel_state> next;
+			{
+				// the standby state has generally been prepared long ago; when we cycle in rapid succession,
+				// we may have to wait for it a little.
+				std::unique_lock<std::mutex> standby_lock(standby_mutex_);
+				standby_ready_.wait(standby_lock, [this] {
+					return !standby_pending_;
+				});
+				next = std::move(standby_);
+			}
+			if (!next)
+				return false;
+
+			// carry the open sections over into the new cycle:
+			for (const auto &title : sections_) {
+				next->html.push_section(title);
+				next->text.push_section(title);
+			}
+
+			old = std::move(state_);
+			state_ = std::move(next);
+			cycle_index_ = state_->index;
+			next_index = cycle_index_ + 1;
+		}
+
+		// the standby state goes first: finalizing occupies its worker until the cycle's images are encoded.
+		prepare_standby(next_index);
+		pool_->submit([this, old, newest = next_index - 1]() {
+			finalize_state(*old);
+			expire_cycles(old->index, newest);
+		});
+		return true;
+	}
+
+	void session::expire_cycles(uint32_t finalized, uint32_t newest) {
+		if (options_.keep_cycles == 0)
+			return;
+
+		// The finalize jobs of successive cycles may run concurrently, and complete in any order: a cycle is
+		// only removed once its own finalize job is done, either by that job, or by a later one.
+		std::lock_guard<std::mutex> lock(retention_mutex_);
+		finalized_cycles_.insert(finalized);
+		retention_newest_ = std::max(retention_newest_, newest);
+		// retention policy: keep the N most recent cycles, including the one which has just started.
+		while (!finalized_cycles_.empty() && *finalized_cycles_.begin() + options_.keep_cycles <= retention_newest_) {
+			remove_cycle(*finalized_cycles_.begin());
+			finalized_cycles_.erase(finalized_cycles_.begin());
+		}
+	}
+
+	void session::finalize_state(channel_state &state) {
+		// the animations of the open sections are only queued now.
+		bool ok = state.close_section_files();
+		// the image jobs were queued before us, but may still be running on other workers:
+		state.images->wait_idle();
+
+		// the bilevel PNG throughput since the previous cycle was finalized: the images of this cycle, and perhaps
+		// a few of the next one's, which were encoded in the meantime.
+		if (uint64_t images = bilevel_images_.exchange(0)) {
+			const uint64_t input = bilevel_input_bytes_.exchange(0);
+			const uint64_t output = bilevel_output_bytes_.exchange(0);
+			const uint64_t strips = bilevel_strips_.exchange(0);
+			const uint64_t us = bilevel_microseconds_.exchange(0);
+			driver::log_record record;
+			record.level = spdlog::level::info;
+			record.time = std::chrono::system_clock::now();
+			const std::string text = fmt::format("Bilevel PNG: {} images in {} strips, {:.1f} MB packed to {:.1f} MB, {:.1f} MB/s", images, strips, input / 1e6, output / 1e6, us ? input / double(us) : 0.0);
+			record.text = text;
+			state.write_record(record);
+		}
+
+		ok = state.html.close() && ok;
+		ok = state.text.close() && ok;
+		ok = state.pack.close() && ok;
+#if defined(HAVE_SQLITE)
+		ok = state.sqlite.close() && ok;
+#endif
+
+		// fsync every file produced by this cycle:
+		std::filesystem::path base(state.base_path);
+		std::string prefix = base.filename().string() + ".";
+		std::error_code ec;
+		for (auto it = std::filesystem::recursive_directory_iterator(base.parent_path(), ec); !ec && it != std::filesystem::recursive_directory_iterator(); it.increment(ec)) {
+			if (it.depth() == 0 && !it->path().filename().string().starts_with(prefix)) {
+				it.disable_recursion_pending();
+				continue;
+			}
+			if (it->is_regular_file())
+				sync_file(it->path());
+		}
+		if (!ok)
+			spdlog::error("Failed to finalize diagnostics output cycle {}", state.base_path);
+	}
+
+	void session::remove_cycle(uint32_t index) const {
+		std::filesystem::path base(cycle_base_path(index));
+		std::string prefix = base.filename().string() + ".";
+		std::error_code ec;
+		std::vector<std::filesystem::path> doomed;
+		for (const auto &entry : std::filesystem::directory_iterator(base.parent_path(), ec)) {
+			if (entry.path().filename().string().starts_with(prefix))
+				doomed.push_back(entry.path());
+		}
+		for (const auto &path : doomed) {
+			std::filesystem::remove_all(path, ec);
+			if (ec)
+				spdlog::warn("Cannot remove expired diagnostics output {}: {}", path.string(), ec.message());
+		}
+	}
+
+	bool session::finish() {
+		if (!pool_)
+			return true;
+
+		std::unique_ptr<channel_state> state;
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			state = std::move(state_);
+		}
+		if (state)
+			finalize_state(*state);
+		pool_->wait_idle();
+
+		// discard the standby state: it was never used.
+		std::unique_ptr<channel_state> standby;
+		{
+			std::lock_guard<std::mutex> lock(standby_mutex_);
+			standby = std::move(standby_);
+		}
+		if (standby) {
+			standby->html.close();
+			standby->text.close();
+			standby->pack.close();
+#if defined(HAVE_SQLITE)
+			standby->sqlite.close();
+#endif
+			remove_cycle(standby->index);
+		}
+
+		pool_.reset();
+		image_pool_.reset();
+		return true;
+	}
+
+	void session::push_section(std::string_view title) {
+		std::lock_guard<std::mutex> lock(mutex_);
+		if (!state_)
+			return;
+		sections_.emplace_back(title);
+		state_->close_section_files();
+		state_->html.push_section(title);
+		if (state_->text.is_open())
+			state_->text.push_section(title);
+	}
+
+	void session::pop_section() {
+		std::lock_guard<std::mutex> lock(mutex_);
+		if (!state_ || sections_.empty())
+			return;
+		sections_.pop_back();
+		state_->close_section_files();
+		state_->html.pop_section();
+		if (state_->text.is_open())
+			state_->text.pop_section();
+	}
+
+	std::string session::section_path(std::string_view separator) {
+		std::lock_guard<std::mutex> lock(mutex_);
+		std::string rv;
+		for (const auto &title : sections_) {
+			if (!rv.empty())
+				rv += separator;
+			rv += title;
+		}
+		return rv;
+	}
+
+	void session::log(spdlog::level::level_enum level, std::string_view text) {
+		std::lock_guard<std::mutex> lock(mutex_);
+		emit(level, text);
+	}
+
+	void session::emit(spdlog::level::level_enum level, std::string_view text) {
+		if (!state_)
+			return;
+
+		driver::log_record record;
+		record.level = level;
+		record.time = std::chrono::system_clock::now();
+		record.section = sections_.empty() ? std::string_view() : std::string_view(sections_.back());
+		record.text = text;
+		state_->write_record(record);
+	}
+
+	void session::note_bilevel_encode(const driver::image::bilevel_encode_stats &stats) {
+		bilevel_images_++;
+		bilevel_input_bytes_ += stats.input_bytes;
+		bilevel_output_bytes_ += stats.output_bytes;
+		bilevel_strips_ += stats.strips;
+		bilevel_microseconds_ += uint64_t(stats.seconds * 1e6);
+	}
+
+	bool session::link_duplicate(std::string_view caption, const driver::image::content_hash &hash, bool count_miss) {
+		if (!state_ || hash.empty() || !options_.deduplicate_images)
+			return false;
+		driver::image::stored_image img;
+		if (!state_->images->find(hash, img)) {
+			if (count_miss)
+				dedup_misses_++;
+			return false;
+		}
+		dedup_hits_++;
+		state_->html.write_image(fmt::format("{} (unchanged)", caption), img);
+		if (state_->text.is_open())
+			state_->text.write_line(spdlog::level::info, fmt::format("{}: unchanged image, see {}", caption, img.url));
+		return true;
+	}
+
+	bool session::log_duplicate_image(std::string_view caption, const driver::image::content_hash &hash) {
+		std::lock_guard<std::mutex> lock(mutex_);
+		// a miss is counted by `log_image()`, which checks again.
+		return link_duplicate(caption, hash, false);
+	}
+
+	void session::log_image(std::string_view caption, std::shared_ptr<const driver::image::raster_buffer> img) {
+		driver::image::content_hash hash;
+		if (options_.deduplicate_images) {
+			const size_t row_bytes = size_t(img->width) * img->channels;
+			hash = driver::image::hash_image_rows(img->pixels.data(), row_bytes, img->height, ptrdiff_t(row_bytes), {uint64_t(img->width), uint64_t(img->height), uint64_t(img->channels)});
+		}
+		std::lock_guard<std::mutex> lock(mutex_);
+		if (!state_ || link_duplicate(caption, hash))
+			return;
+		driver::image::stored_image stored = state_->images->submit(caption, std::move(img));
+		if (!hash.empty())
+			state_->images->remember(hash, stored);
+		state_->html.write_image(caption, stored);
+	}
+
+	void session::log_image(std::string_view caption, std::string_view extension, int width, int height, driver::image::encode_function encode, bool tile_pyramid, int tile_size, const driver::image::content_hash &hash) {
+		std::lock_guard<std::mutex> lock(mutex_);
+		// another thread may have logged the same image since the driver's `log_duplicate_image()`: the check
+		// which counts is the one under the lock which remembers the hash.
+		if (!state_ || link_duplicate(caption, hash))
+			return;
+		driver::image::stored_image stored = state_->images->submit(caption, extension, width, height, std::move(encode), tile_pyramid, tile_size);
+		if (!hash.empty() && options_.deduplicate_images)
+			state_->images->remember(hash, stored);
+		state_->html.write_image(caption, stored);
+	}
+
+	void session::log_pix_raster(std::string_view caption, const driver::image::pix_raster &pix) {
+		driver::image::content_hash hash;
+		if (options_.deduplicate_images && pix.data)
+			hash = driver::image::hash_pix_raster(pix);
+		std::lock_guard<std::mutex> lock(mutex_);
+		if (!state_ || link_duplicate(caption, hash))
+			return;
+		if (!state_->pack.is_open() && !state_->pack.open((std::filesystem::path(state_->images->directory()) / "capture.pixpack").string()))
+			return;
+
+		std::string file_name, thumbnail_file_name;
+		auto img = state_->images->reserve(caption, "png", pix.width, pix.height, file_name, thumbnail_file_name);
+		if (state_->pack.append(pix, file_name, thumbnail_file_name)) {
+			if (!hash.empty())
+				state_->images->remember(hash, img);
+			state_->html.write_image(caption, img);
+		}
+	}
+
+	void session::log_overlay_background(std::string_view caption, std::shared_ptr<const driver::image::raster_buffer> img) {
+		std::lock_guard<std::mutex> lock(mutex_);
+		if (!state_)
+			return;
+		state_->overlay_background = state_->images->submit(caption, std::move(img));
+	}
+
+	void session::log_overlay_background(std::string_view caption, std::string_view extension, int width, int height, driver::image::encode_function encode) {
+		std::lock_guard<std::mutex> lock(mutex_);
+		if (!state_)
+			return;
+		state_->overlay_background = state_->images->submit(caption, extension, width, height, std::move(encode));
+	}
+
+	void session::log_overlay(std::string_view caption, const driver::image::overlay &ov) {
+		std::lock_guard<std::mutex> lock(mutex_);
+		if (!state_)
+			return;
+		// without a background, the overlay is as large as its contents.
+		const driver::image::stored_image &background = state_->overlay_background;
+		driver::image::stored_image img;
+		img.width = background.url.empty() ? std::max(1, int(std::ceil(ov.right()))) : background.width;
+		img.height = background.url.empty() ? std::max(1, int(std::ceil(ov.bottom()))) : background.height;
+		img.thumbnail_url = background.thumbnail_url;
+		driver::image::thumbnail_dimensions(img.width, img.height, options_.thumbnail_size, img.thumbnail_width, img.thumbnail_height);
+
+		// both files are in the image directory.
+		std::string href = background.url.substr(background.url.rfind('/') + 1);
+		if (ov.write(state_->images->reserve_file(caption, "svg", img.url), img.width, img.height, href))
+			state_->html.write_overlay(caption, img);
+	}
+
+	void session::log_frame(std::string_view sequence, std::string_view caption, const driver::image::scanline_source &frame) {
+		if (frame.empty())
+			return;
+		if (options_.sequence_format == driver::image::sequence_format::apng) {
+			std::lock_guard<std::mutex> lock(mutex_);
+			if (state_)
+				add_animation_frame(sequence, caption, frame);
+			return;
+		}
+
+		// the copy is all the work done on the caller's thread: the delta is found on the image pool.
+		driver::image::raster_buffer copy = driver::image::copy_frame(frame);
+
+		std::lock_guard<std::mutex> lock(mutex_);
+		if (!state_)
+			return;
+		auto it = state_->sequences.find(sequence);
+		if (it == state_->sequences.end())
+			it = state_->sequences.try_emplace(std::string(sequence)).first;
+		std::unique_ptr<driver::image::queued_sequence> &seq = it->second;
+
+		// a frame of another size starts over, in a new file; the old one is closed behind its frames.
+		if (!seq || !seq->accepts(frame)) {
+			std::string path, thumbnail_path;
+			driver::image::stored_image img = state_->images->reserve_sequence(sequence, frame.width, frame.height, path, thumbnail_path);
+			seq = std::make_unique<driver::image::queued_sequence>(*state_->images, std::move(path), std::move(thumbnail_path), options_.thumbnail_size, frame.width, frame.height, frame.channels);
+			state_->html.write_image(fmt::format("{}: {}", sequence, caption), img);
+		}
+		if (seq->append(caption, std::move(copy)) && state_->text.is_open())
+			state_->text.write_line(spdlog::level::info, fmt::format("{}: frame {} of sequence {}", caption, seq->frames(), sequence));
+	}
+
+	void session::add_animation_frame(std::string_view sequence, std::string_view caption, const driver::image::scanline_source &frame) {
+		auto it = state_->animations.find(sequence);
+		if (it == state_->animations.end())
+			it = state_->animations.try_emplace(std::string(sequence)).first;
+		channel_state::animation &a = it->second;
+
+		// a frame of another size ends the animation, and starts a new one.
+		if (!a.frames || !a.frames->accepts(frame)) {
+			state_->close_animation(sequence, a);
+			std::string spill_url;
+			std::string spill_path = state_->images->reserve_file(sequence, "frames", spill_url);
+			a.img = state_->images->reserve(sequence, "png", frame.width, frame.height, a.file_name, a.thumbnail_file_name);
+			a.frames = std::make_shared<driver::image::frame_store>(frame.width, frame.height, frame.channels, options_.sequence_frames_in_memory, std::move(spill_path));
+			a.delay = options_.sequence_frame_delay;
+			state_->html.write_image(fmt::format("{} (animated)", sequence), a.img);
+		}
+		if (a.frames->add(frame) && state_->text.is_open())
+			state_->text.write_line(spdlog::level::info, fmt::format("{}: frame {} of animation {}", caption, a.frames->size(), sequence));
+	}
+
+	void session::log_array(std::string_view caption, const driver::blob::npy_array &array, driver::blob::array_export where) {
+		if (where == driver::blob::array_export::none || !array.validate(caption))
+			return;
+		std::string note = fmt::format("{} (", array.descr);
+		for (size_t i = 0; i < array.shape.size(); i++)
+			note += fmt::format("{}{}", i ? ", " : "", array.shape[i]);
+		note += array.shape.size() == 1 ? ",)" : ")";
+
+		if (where == driver::blob::array_export::npz) {
+			// the CRC reads the entire array: only the append to the section's archive needs the lock.
+			auto prepared = driver::blob::npz_writer::prepare(array);
+			std::lock_guard<std::mutex> lock(mutex_);
+			if (!state_)
+				return;
+			if (!state_->npz.is_open() && !state_->npz.open(state_->images->reserve_file(sections_.empty() ? "session" : sections_.back(), "npz", state_->npz_url)))
+				return;
+			std::string key = state_->npz.append(caption, array, prepared);
+			if (!key.empty())
+				state_->html.write_file_link(caption, state_->npz_url, fmt::format("['{}'] {}", key, note));
+			return;
+		}
+
+		// the `.npy` file is a file of its own: it's written without the lock, but counts as pending image work,
+		// so its cycle is not finalized (and its HTML not closed) before the link is written, even when the
+		// session cycles meanwhile.
+		channel_state *state;
+		std::string path, url;
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			if (!state_)
+				return;
+			state = state_.get();
+			path = state->images->reserve_file(caption, "npy", url);
+			state->images->begin_write();
+		}
+		bool ok = driver::blob::write_npy(path, array);
+		if (ok) {
+			std::lock_guard<std::mutex> lock(mutex_);
+			state->html.write_file_link(caption, url, note);
+		}
+		state->images->end_write();
+	}
+
+}
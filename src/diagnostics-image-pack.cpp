@@ -0,0 +1,284 @@
+
+#include <diagnostics/diagnostics.h>
+
+#include <cerrno>
+#include <cstring>
+#include <filesystem>
+
+
+namespace diagnostics {
+
+	namespace driver {
+
+		namespace image {
+
+			static const char pack_signature[8] = {'L', 'D', 'I', 'A', 'G', 'P', 'I', 'X'};
+			static constexpr uint32_t entry_magic = 0x50584950u;    // "PIXP"
+			static constexpr uint32_t byte_order_mark = 0x01020304u;
+
+			// the entry header; all fields in the byte order of the producer, as flagged by `byte_order`.
+			struct pack_entry_header {
+				uint32_t magic;
+				uint32_t byte_order;
+				uint32_t header_size;
+				uint32_t width;
+				uint32_t height;
+				uint32_t depth;
+				uint32_t wpl;
+				uint32_t spp;
+				uint32_t colormap_size;
+				uint32_t file_name_len;
+				uint32_t thumbnail_name_len;
+				uint32_t reserved;
+				uint64_t sequence;
+				uint64_t data_size;     // bytes of raster data: wpl * height * 4
+			};
+			static_assert(sizeof(pack_entry_header) == 64, "the pack entry header layout is part of the file format");
+
+
+			// --- pix_pack_writer ------------------------------------------------------------------------------
+
+			pix_pack_writer::~pix_pack_writer() {
+				close();
+			}
+
+			bool pix_pack_writer::open(const std::string &path) {
+				close();
+
+				fp_ = fopen(path.c_str(), "wb");
+				if (!fp_) {
+					spdlog::error("Cannot create image pack file {}: {}", path, strerror(errno));
+					return false;
+				}
+				// the rasters are large: a big buffer saves nothing on those, but batches the small header writes.
+				setvbuf(fp_, nullptr, _IOFBF, 1u << 20);
+				path_ = path;
+				sequence_ = 0;
+				size_ = sizeof(pack_signature);
+				if (fwrite(pack_signature, 1, sizeof(pack_signature), fp_) != sizeof(pack_signature)) {
+					spdlog::error("Failed to write image pack file {}", path_);
+					close();
+					return false;
+				}
+				return true;
+			}
+
+			bool pix_pack_writer::close() {
+				if (!fp_)
+					return true;
+				bool ok = fclose(fp_) == 0;
+				fp_ = nullptr;
+				if (!ok)
+					spdlog::error("Failed to write image pack file {}", path_);
+				return ok;
+			}
+
+			bool pix_pack_writer::append(const pix_raster &pix, std::string_view file_name, std::string_view thumbnail_file_name) {
+				if (!fp_)
+					return false;
+				if (!pix.data || pix.width <= 0 || pix.height <= 0 || pix.wpl <= 0) {
+					spdlog::error("Cannot capture a {}x{} PIX raster: no pixel data", pix.width, pix.height);
+					return false;
+				}
+
+				pack_entry_header hdr{};
+				hdr.magic = entry_magic;
+				hdr.byte_order = byte_order_mark;
+				hdr.header_size = sizeof(hdr);
+				hdr.width = uint32_t(pix.width);
+				hdr.height = uint32_t(pix.height);
+				hdr.depth = uint32_t(pix.depth);
+				hdr.wpl = uint32_t(pix.wpl);
+				hdr.spp = uint32_t(pix.spp);
+				hdr.colormap_size = pix.colormap ? uint32_t(pix.colormap_size) : 0;
+				hdr.file_name_len = uint32_t(file_name.size());
+				hdr.thumbnail_name_len = uint32_t(thumbnail_file_name.size());
+				hdr.sequence = sequence_++;
+				hdr.data_size = uint64_t(pix.wpl) * pix.height * 4;
+
+				bool ok = fwrite(&hdr, sizeof(hdr), 1, fp_) == 1;
+				ok = ok && fwrite(file_name.data(), 1, file_name.size(), fp_) == file_name.size();
+				ok = ok && fwrite(thumbnail_file_name.data(), 1, thumbnail_file_name.size(), fp_) == thumbnail_file_name.size();
+				ok = ok && (hdr.colormap_size == 0 || fwrite(pix.colormap, 4, hdr.colormap_size, fp_) == hdr.colormap_size);
+				ok = ok && fwrite(pix.data, 1, hdr.data_size, fp_) == hdr.data_size;
+				if (!ok) {
+					spdlog::error("Failed to write image pack file {}: {}", path_, strerror(errno));
+					return false;
+				}
+				size_ += sizeof(hdr) + file_name.size() + thumbnail_file_name.size() + hdr.colormap_size * 4ull + hdr.data_size;
+				return true;
+			}
+
+
+			// --- render_pix_pack ------------------------------------------------------------------------------
+
+			static inline uint32_t byte_swap(uint32_t v) {
+				return (v >> 24) | ((v >> 8) & 0xFF00u) | ((v << 8) & 0xFF0000u) | (v << 24);
+			}
+
+			static void byte_swap_header(pack_entry_header &hdr) {
+				uint32_t *fields[] = {&hdr.magic, &hdr.byte_order, &hdr.header_size, &hdr.width, &hdr.height, &hdr.depth, &hdr.wpl, &hdr.spp, &hdr.colormap_size, &hdr.file_name_len, &hdr.thumbnail_name_len};
+				for (uint32_t *f : fields)
+					*f = byte_swap(*f);
+				for (uint64_t *f : {&hdr.sequence, &hdr.data_size})
+					*f = (uint64_t(byte_swap(uint32_t(*f))) << 32) | byte_swap(uint32_t(*f >> 32));
+			}
+
+			// The names in the pack were made by `image_store`; refuse anything which could point outside the directory.
+			static bool is_plain_file_name(std::string_view name) {
+				return !name.empty() && name[0] != '.' && name.find_first_of("/\\:") == std::string_view::npos;
+			}
+
+			struct pack_entry {
+				pack_entry_header hdr;
+				std::string file_name;
+				std::string thumbnail_name;
+				std::vector<uint32_t> colormap;
+				std::vector<uint32_t> data;
+			};
+
+			// The depths of a PIX.
+			static bool is_pix_depth(uint32_t depth) {
+				switch (depth) {
+				case 1:
+				case 2:
+				case 4:
+				case 8:
+				case 16:
+				case 24:
+				case 32:
+					return true;
+				default:
+					return false;
+				}
+			}
+
+			// Reads the next entry, at `offset` in a file of `file_size` bytes, and moves `offset` past it; returns
+			// false at the end of the file, setting `truncated` when that end is not at an entry boundary (or the
+			// entry is garbage). Nothing is allocated for an entry which the rest of the file cannot hold.
+			static bool read_entry(FILE *fp, uint64_t file_size, uint64_t &offset, pack_entry &e, bool &truncated) {
+				size_t got = fread(&e.hdr, 1, sizeof(e.hdr), fp);
+				if (got == 0)
+					return false;
+				truncated = true;
+				if (got != sizeof(e.hdr))
+					return false;
+
+				bool swapped = e.hdr.byte_order != byte_order_mark;
+				if (swapped)
+					byte_swap_header(e.hdr);
+				if (e.hdr.magic != entry_magic || e.hdr.byte_order != byte_order_mark || e.hdr.header_size != sizeof(e.hdr))
+					return false;
+				// the sizes go into the `int` fields of a `pix_raster`.
+				if (e.hdr.width == 0 || e.hdr.height == 0 || e.hdr.width > INT32_MAX || e.hdr.height > INT32_MAX || e.hdr.wpl > INT32_MAX || e.hdr.colormap_size > 256 || e.hdr.file_name_len > 4096 || e.hdr.thumbnail_name_len > 4096)
+					return false;
+				if (!is_pix_depth(e.hdr.depth) || e.hdr.wpl == 0 || e.hdr.data_size != uint64_t(e.hdr.wpl) * e.hdr.height * 4 || uint64_t(e.hdr.wpl) * 32 < uint64_t(e.hdr.width) * e.hdr.depth)
+					return false;
+				// below 2^31 each, the width, height and words per line cannot make the sum wrap.
+				const uint64_t body_size = uint64_t(e.hdr.file_name_len) + e.hdr.thumbnail_name_len + uint64_t(e.hdr.colormap_size) * 4 + e.hdr.data_size;
+				if (offset > file_size || file_size - offset < sizeof(e.hdr) || file_size - offset - sizeof(e.hdr) < body_size)
+					return false;
+
+				e.file_name.resize(e.hdr.file_name_len);
+				e.thumbnail_name.resize(e.hdr.thumbnail_name_len);
+				e.colormap.resize(e.hdr.colormap_size);
+				e.data.resize(e.hdr.data_size / 4);
+				if (fread(e.file_name.data(), 1, e.file_name.size(), fp) != e.file_name.size() ||
+					fread(e.thumbnail_name.data(), 1, e.thumbnail_name.size(), fp) != e.thumbnail_name.size() ||
+					fread(e.colormap.data(), 4, e.colormap.size(), fp) != e.colormap.size() ||
+					fread(e.data.data(), 4, e.data.size(), fp) != e.data.size())
+					return false;
+
+				if (swapped) {
+					for (auto &v : e.colormap)
+						v = byte_swap(v);
+					for (auto &v : e.data)
+						v = byte_swap(v);
+				}
+				offset += sizeof(e.hdr) + body_size;
+				truncated = false;
+				return true;
+			}
+
+			pix_pack_render_stats render_pix_pack(const std::string &pack_path, int thumbnail_size, unsigned int threads) {
+				pix_pack_render_stats stats;
+
+				FILE *fp = fopen(pack_path.c_str(), "rb");
+				if (!fp) {
+					spdlog::error("Cannot open image pack file {}: {}", pack_path, strerror(errno));
+					return stats;
+				}
+				char signature[sizeof(pack_signature)];
+				if (fread(signature, 1, sizeof(signature), fp) != sizeof(signature) || memcmp(signature, pack_signature, sizeof(signature)) != 0) {
+					spdlog::error("{} is not an image pack file", pack_path);
+					fclose(fp);
+					return stats;
+				}
+
+				// the entry sizes are checked against the file size before anything is allocated for them.
+				std::error_code ec;
+				const uint64_t file_size = std::filesystem::file_size(pack_path, ec);
+				if (ec) {
+					spdlog::error("Cannot read image pack file {}: {}", pack_path, ec.message());
+					fclose(fp);
+					return stats;
+				}
+				uint64_t offset = sizeof(pack_signature);
+
+				const std::filesystem::path dir = std::filesystem::path(pack_path).parent_path();
+				std::atomic<uint64_t> rendered{0};
+				std::atomic<uint64_t> failed{0};
+				{
+					// the queue depth bounds the number of rasters held in memory.
+					worker_pool pool(threads, 2);
+					for (;;) {
+						auto e = std::make_shared<pack_entry>();
+						if (!read_entry(fp, file_size, offset, *e, stats.truncated))
+							break;
+						if (!is_plain_file_name(e->file_name) || !is_plain_file_name(e->thumbnail_name)) {
+							spdlog::error("Image pack file {}: entry {} has an invalid file name", pack_path, e->hdr.sequence);
+							failed++;
+							continue;
+						}
+
+						pool.submit([e, &dir, &rendered, &failed, thumbnail_size]() {
+							pix_raster pix;
+							pix.width = int(e->hdr.width);
+							pix.height = int(e->hdr.height);
+							pix.depth = int(e->hdr.depth);
+							pix.wpl = int(e->hdr.wpl);
+							pix.spp = int(e->hdr.spp);
+							pix.data = e->data.data();
+							pix.colormap = e->colormap.empty() ? nullptr : e->colormap.data();
+							pix.colormap_size = int(e->colormap.size());
+
+							// both passes convert the rows on the fly: converting is cheaper than holding another copy.
+							pix_row_converter converter(pix);
+							bool ok = converter.valid();
+							// one strip per image: the pool already keeps all cores busy with whole images.
+							if (ok && is_bilevel_pix(pix))
+								ok = write_bilevel_png((dir / e->file_name).string(), pix.width, pix.height, pix_bilevel_rows(pix), nullptr, 1);
+							else
+								ok = ok && write_png((dir / e->file_name).string(), converter.scanlines());
+							ok = ok && write_png((dir / e->thumbnail_name).string(), make_thumbnail(converter.scanlines(), thumbnail_size).view());
+							if (ok)
+								rendered++;
+							else
+								failed++;
+						});
+					}
+				}
+				fclose(fp);
+
+				stats.rendered = rendered;
+				stats.failed = failed;
+				if (stats.truncated)
+					spdlog::warn("Image pack file {} ends in a partial entry: rendered the {} complete images", pack_path, stats.rendered + stats.failed);
+				return stats;
+			}
+
+		} // namespace image
+
+	} // namespace driver
+
+}
@@ -0,0 +1,623 @@
+
+#include <diagnostics/diagnostics.h>
+
+#include <spdlog/spdlog.h>
+#include <fmt/format.h>
+
+#include <algorithm>
+#include <bit>
+#include <cerrno>
+#include <cstring>
+#include <deque>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define LIBDIAG_HAVE_SSE2 1
+#endif
+
+
+// Image sequences: the delta of a frame is found in two passes of very different cost. The unchanged bytes are
+// skipped 64 bytes per iteration, by comparing against the previous frame; only the runs of changed bytes are
+// looked at byte by byte, to split them into literal and fill runs.
+
+namespace diagnostics {
+
+	namespace driver {
+
+		namespace image {
+
+			// A run of changed bytes ends at this many unchanged ones: a shorter gap costs less as part of the
+			// literal than as a skip token plus another literal token.
+			static constexpr size_t min_gap = 8;
+			// A fill token (2 .. 3 bytes) pays off from this many equal XOR bytes on.
+			static constexpr size_t min_fill = 4;
+
+			enum : unsigned {
+				token_skip = 0,
+				token_literal = 1,
+				token_fill = 2,
+			};
+
+			static void put_token(std::vector<uint8_t> &out, uint64_t n, unsigned kind) {
+				uint64_t v = (n << 2) | kind;
+				while (v >= 0x80) {
+					out.push_back(uint8_t((v & 0x7F) | 0x80));
+					v >>= 7;
+				}
+				out.push_back(uint8_t(v));
+			}
+
+			// The offset of the first byte where `a` and `b` differ; `n` when they are equal.
+			static size_t first_difference(const uint8_t *a, const uint8_t *b, size_t n) {
+				size_t i = 0;
+#if defined(LIBDIAG_HAVE_SSE2)
+				for (; i + 64 <= n; i += 64) {
+					const __m128i *pa = reinterpret_cast<const __m128i *>(a + i);
+					const __m128i *pb = reinterpret_cast<const __m128i *>(b + i);
+					__m128i eq = _mm_and_si128(
+						_mm_and_si128(_mm_cmpeq_epi8(_mm_loadu_si128(pa + 0), _mm_loadu_si128(pb + 0)), _mm_cmpeq_epi8(_mm_loadu_si128(pa + 1), _mm_loadu_si128(pb + 1))),
+						_mm_and_si128(_mm_cmpeq_epi8(_mm_loadu_si128(pa + 2), _mm_loadu_si128(pb + 2)), _mm_cmpeq_epi8(_mm_loadu_si128(pa + 3), _mm_loadu_si128(pb + 3))));
+					if (_mm_movemask_epi8(eq) != 0xFFFF)
+						break;
+				}
+				for (; i + 16 <= n; i += 16) {
+					unsigned int mask = unsigned(_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i *>(a + i)), _mm_loadu_si128(reinterpret_cast<const __m128i *>(b + i)))));
+					if (mask != 0xFFFF)
+						return i + std::countr_zero(~mask);
+				}
+#else
+				for (; i + 8 <= n; i += 8) {
+					uint64_t wa, wb;
+					memcpy(&wa, a + i, 8);
+					memcpy(&wb, b + i, 8);
+					if (wa != wb)
+						break;
+				}
+#endif
+				for (; i < n && a[i] == b[i]; i++)
+					;
+				return i;
+			}
+
+			size_t encode_frame_delta(uint8_t *previous, const uint8_t *current, size_t size, size_t &skip, std::vector<uint8_t> &out) {
+				size_t changed = 0;
+				size_t i = 0;
+				while (i < size) {
+					size_t start = i + first_difference(previous + i, current + i, size - i);
+					skip += start - i;
+					if (start == size)
+						break;
+
+					// the run of changed bytes, up to the last one before a gap of `min_gap`.
+					size_t end = start;
+					for (size_t k = start, gap = 0; k < size; k++) {
+						if (previous[k] == current[k]) {
+							if (++gap == min_gap)
+								break;
+						} else {
+							gap = 0;
+							changed++;
+							end = k + 1;
+						}
+					}
+
+					if (skip)
+						put_token(out, skip, token_skip);
+					skip = 0;
+					// literals, interrupted by fills where the XOR repeats: a mask which flips pixels from 0 to 255
+					// comes out as fills only.
+					size_t literal = start;
+					auto flush_literal = [&](size_t to) {
+						if (to == literal)
+							return;
+						put_token(out, to - literal, token_literal);
+						for (size_t k = literal; k < to; k++)
+							out.push_back(previous[k] ^ current[k]);
+					};
+					for (size_t k = start; k < end;) {
+						const uint8_t x = previous[k] ^ current[k];
+						size_t r = k + 1;
+						while (r < end && uint8_t(previous[r] ^ current[r]) == x)
+							r++;
+						if (r - k >= min_fill) {
+							flush_literal(k);
+							put_token(out, r - k, token_fill);
+							out.push_back(x);
+							literal = r;
+						}
+						k = r;
+					}
+					flush_literal(end);
+
+					memcpy(previous + start, current + start, end - start);
+					i = end;
+				}
+				return changed;
+			}
+
+			bool apply_frame_delta(const uint8_t *delta, size_t delta_size, uint8_t *frame, size_t size) {
+				size_t p = 0;
+				size_t pos = 0;
+				while (p < delta_size) {
+					uint64_t v = 0;
+					for (int shift = 0;; shift += 7) {
+						if (p == delta_size || shift > 63)
+							return false;
+						uint8_t b = delta[p++];
+						v |= uint64_t(b & 0x7F) << shift;
+						if (!(b & 0x80))
+							break;
+					}
+					const uint64_t n = v >> 2;
+					if (n > size - pos)
+						return false;
+					switch (v & 3) {
+					case token_skip:
+						break;
+					case token_literal:
+						if (n > delta_size - p)
+							return false;
+						for (uint64_t k = 0; k < n; k++)
+							frame[pos + k] ^= delta[p + k];
+						p += n;
+						break;
+					case token_fill:
+						if (p == delta_size)
+							return false;
+						for (uint64_t k = 0; k < n; k++)
+							frame[pos + k] ^= delta[p];
+						p++;
+						break;
+					default:
+						return false;
+					}
+					pos += n;
+				}
+				return true;
+			}
+
+
+			// --- sequence_writer ------------------------------------------------------------------------------
+
+			sequence_writer::~sequence_writer() {
+				close();
+			}
+
+			bool sequence_writer::open(const std::string &path, int width, int height, int channels) {
+				close();
+
+				if (width <= 0 || height <= 0 || !(channels == 1 || channels == 3 || channels == 4)) {
+					spdlog::error("Cannot create image sequence {}: {}x{} frames with {} channels", path, width, height, channels);
+					return false;
+				}
+				fp_ = fopen(path.c_str(), "wb");
+				if (!fp_) {
+					spdlog::error("Cannot create image sequence {}: {}", path, strerror(errno));
+					return false;
+				}
+				path_ = path;
+				width_ = width;
+				height_ = height;
+				channels_ = channels;
+				frames_ = 0;
+				// the first frame is the delta against black.
+				previous_.assign(size_t(width) * height * channels, 0);
+
+				line_ = fmt::format("diagnostics_sequence({{\"version\": 1, \"width\": {}, \"height\": {}, \"channels\": {}}});\n", width, height, channels);
+				size_ = line_.size();
+				if (fwrite(line_.data(), 1, line_.size(), fp_) != line_.size()) {
+					spdlog::error("Failed to write image sequence {}", path_);
+					close();
+					return false;
+				}
+				return true;
+			}
+
+			bool sequence_writer::close() {
+				if (!fp_)
+					return true;
+				bool ok = fclose(fp_) == 0;
+				fp_ = nullptr;
+				// the frames are large: don't hold on to them.
+				std::vector<uint8_t>().swap(previous_);
+				std::vector<uint8_t>().swap(delta_);
+				std::string().swap(line_);
+				if (!ok)
+					spdlog::error("Failed to write image sequence {}", path_);
+				return ok;
+			}
+
+			bool sequence_writer::append(std::string_view caption, const scanline_source &frame, size_t &changed) {
+				changed = 0;
+				if (!fp_)
+					return false;
+				if (!accepts(frame) || frame.empty()) {
+					spdlog::error("Cannot add a {}x{} frame with {} channels to the {}x{} image sequence {}", frame.width, frame.height, frame.channels, width_, height_, path_);
+					return false;
+				}
+
+				const size_t row_bytes = size_t(width_) * channels_;
+				size_t skip = 0;
+				delta_.clear();
+				for (int y = 0; y < height_; y++)
+					changed += encode_frame_delta(previous_.data() + size_t(y) * row_bytes, frame.row(y), row_bytes, skip, delta_);
+
+				line_ = "diagnostics_frame(";
+				append_json_string(line_, caption);
+				fmt::format_to(std::back_inserter(line_), ", {}, \"", changed);
+				append_base64(line_, std::string_view(reinterpret_cast<const char *>(delta_.data()), delta_.size()));
+				line_ += "\");\n";
+				if (fwrite(line_.data(), 1, line_.size(), fp_) != line_.size()) {
+					spdlog::error("Failed to write image sequence {}", path_);
+					return false;
+				}
+				size_ += line_.size();
+				frames_++;
+				return true;
+			}
+
+
+			// --- queued_sequence ------------------------------------------------------------------------------
+
+			// Shared by the sequence and its job, which may still run when the sequence is gone.
+			struct queued_sequence::queue {
+				image_store *images = nullptr;
+				std::string path;
+				std::string thumbnail_path;
+				int thumbnail_size = 0;
+				int width = 0;
+				int height = 0;
+				int channels = 0;
+				size_t max_queued = 0;
+
+				sequence_writer writer;             // used by the job only
+				bool failed = false;                // the same
+
+				std::mutex mutex;
+				std::condition_variable drained;
+				std::deque<std::pair<std::string, raster_buffer>> frames;
+				bool closing = false;
+				bool running = false;
+
+				// Queues the job, unless it is running already. Expects `mutex` to be held.
+				void start(const std::shared_ptr<queue> &self) {
+					if (running)
+						return;
+					running = true;
+					images->submit_job([self]() {
+						self->run();
+					});
+				}
+
+				// Writes the queued frames; stops when the queue is empty, after closing the writer if so asked.
+				void run() {
+					for (;;) {
+						std::pair<std::string, raster_buffer> frame;
+						{
+							std::unique_lock<std::mutex> lock(mutex);
+							if (frames.empty()) {
+								if (closing)
+									writer.close();
+								running = false;
+								drained.notify_all();
+								return;
+							}
+							frame = std::move(frames.front());
+							frames.pop_front();
+							drained.notify_all();
+						}
+						write(frame.first, frame.second);
+					}
+				}
+
+				void write(const std::string &caption, const raster_buffer &frame) {
+					if (failed)
+						return;
+					if (!writer.is_open() && !writer.open(path, width, height, channels)) {
+						failed = true;
+						return;
+					}
+					size_t changed = 0;
+					if (!writer.append(caption, frame.view(), changed))
+						return;
+					if (writer.frames() == 1) {
+						raster_buffer thumb = make_thumbnail(writer.last_frame(), thumbnail_size);
+						if (!thumb.pixels.empty())
+							write_png(thumbnail_path, thumb.view());
+					}
+				}
+			};
+
+			queued_sequence::queued_sequence(image_store &images, std::string path, std::string thumbnail_path, int thumbnail_size, int width, int height, int channels, size_t max_queued) :
+				queue_(std::make_shared<queue>()), width_(width), height_(height), channels_(channels) {
+				queue_->images = &images;
+				queue_->path = std::move(path);
+				queue_->thumbnail_path = std::move(thumbnail_path);
+				queue_->thumbnail_size = thumbnail_size;
+				queue_->width = width;
+				queue_->height = height;
+				queue_->channels = channels;
+				queue_->max_queued = std::max<size_t>(1, max_queued);
+			}
+
+			queued_sequence::~queued_sequence() {
+				close();
+			}
+
+			bool queued_sequence::append(std::string_view caption, raster_buffer frame) {
+				if (frame.width != width_ || frame.height != height_ || frame.channels != channels_ || frame.pixels.empty()) {
+					spdlog::error("Cannot add a {}x{} frame with {} channels to the {}x{} image sequence {}", frame.width, frame.height, frame.channels, width_, height_, queue_->path);
+					return false;
+				}
+				std::unique_lock<std::mutex> lock(queue_->mutex);
+				if (queue_->closing)
+					return false;
+				// back-pressure: the job is behind, and each frame in the queue is a full copy.
+				queue_->drained.wait(lock, [this] {
+					return queue_->frames.size() < queue_->max_queued;
+				});
+				queue_->frames.emplace_back(std::string(caption), std::move(frame));
+				queue_->start(queue_);
+				frames_++;
+				return true;
+			}
+
+			void queued_sequence::close() {
+				std::lock_guard<std::mutex> lock(queue_->mutex);
+				if (queue_->closing)
+					return;
+				queue_->closing = true;
+				// nothing to close when no frame was ever queued: the writer is opened by the first one.
+				if (frames_)
+					queue_->start(queue_);
+			}
+
+			raster_buffer copy_frame(const scanline_source &frame) {
+				if (frame.empty())
+					return {};
+				raster_buffer copy(frame.width, frame.height, frame.channels);
+				const size_t row_bytes = size_t(frame.width) * frame.channels;
+				for (int y = 0; y < frame.height; y++)
+					memcpy(copy.row(y), frame.row(y), row_bytes);
+				return copy;
+			}
+
+
+			// --- frame_store ----------------------------------------------------------------------------------
+
+			static bool seek_to(FILE *fp, uint64_t offset) {
+#if defined(_WIN32)
+				return _fseeki64(fp, static_cast<__int64>(offset), SEEK_SET) == 0;
+#else
+				return fseeko(fp, static_cast<off_t>(offset), SEEK_SET) == 0;
+#endif
+			}
+
+			frame_store::frame_store(int width, int height, int channels, size_t max_in_memory, std::string spill_path) :
+				width_(width), height_(height), channels_(channels), max_in_memory_(max_in_memory), spill_path_(std::move(spill_path)) {
+			}
+
+			frame_store::~frame_store() {
+				clear();
+			}
+
+			bool frame_store::add(const scanline_source &frame) {
+				if (!accepts(frame) || frame.empty()) {
+					spdlog::error("Cannot add a {}x{} frame with {} channels to a {}x{} animation", frame.width, frame.height, frame.channels, width_, height_);
+					return false;
+				}
+				const size_t row_bytes = size_t(width_) * channels_;
+				if (memory_.size() < max_in_memory_) {
+					raster_buffer &copy = memory_.emplace_back(width_, height_, channels_);
+					for (int y = 0; y < height_; y++)
+						memcpy(copy.row(y), frame.row(y), row_bytes);
+					return true;
+				}
+
+				// the spill file is written and read back in whole frames, always at the end while frames are added.
+				if (!spill_) {
+					spill_ = fopen(spill_path_.c_str(), "w+b");
+					if (!spill_) {
+						spdlog::error("Cannot create frame spill file {}: {}", spill_path_, strerror(errno));
+						return false;
+					}
+				}
+				bool ok = seek_to(spill_, uint64_t(spilled_) * row_bytes * height_);
+				for (int y = 0; y < height_ && ok; y++)
+					ok = fwrite(frame.row(y), 1, row_bytes, spill_) == row_bytes;
+				if (!ok) {
+					spdlog::error("Failed to write frame spill file {}", spill_path_);
+					return false;
+				}
+				spilled_++;
+				return true;
+			}
+
+			raster frame_store::frame(size_t i) {
+				if (i < memory_.size())
+					return memory_[i].view();
+				if (i >= size())
+					return {};
+				const size_t frame_bytes = size_t(width_) * channels_ * height_;
+				if (buffer_.pixels.size() != frame_bytes)
+					buffer_ = raster_buffer(width_, height_, channels_);
+				if (!seek_to(spill_, uint64_t(i - memory_.size()) * frame_bytes) || fread(buffer_.pixels.data(), 1, frame_bytes, spill_) != frame_bytes) {
+					spdlog::error("Failed to read frame {} back from spill file {}", i, spill_path_);
+					return {};
+				}
+				return buffer_.view();
+			}
+
+			void frame_store::clear() {
+				std::vector<raster_buffer>().swap(memory_);
+				buffer_ = raster_buffer();
+				if (spill_) {
+					fclose(spill_);
+					spill_ = nullptr;
+					if (remove(spill_path_.c_str()) != 0)
+						spdlog::warn("Cannot remove frame spill file {}: {}", spill_path_, strerror(errno));
+				}
+				spilled_ = 0;
+			}
+
+
+			// --- viewer ---------------------------------------------------------------------------------------
+
+			// The frames stay base64 until they are shown; the canvas holds one frame, which scrubbing moves forward
+			// or backward one delta at a time. The sequence file comes from the URL fragment, so one copy of the page
+			// serves all sequences in the directory. The fragment is loaded as a script, so it must be a plain file
+			// name next to the page, by the rule of the image pack reader, ending in `.seq.js`: anything else could
+			// run a script from anywhere.
+			static const char sequence_viewer_html[] =
+				"<!DOCTYPE html>\n"
+				"<html>\n"
+				"<head>\n"
+				"<meta charset=\"utf-8\">\n"
+				"<title>Sequence viewer</title>\n"
+				"<style>\n"
+				"body { margin: 0; font: 12px monospace; background: #404040; color: #fff; }\n"
+				"#bar { position: sticky; top: 0; display: flex; gap: 8px; align-items: center; padding: 4px 8px; background: #202020; }\n"
+				"#scrub { flex: 1; }\n"
+				"#view { display: block; margin: 8px; image-rendering: pixelated; background: #000; }\n"
+				"</style>\n"
+				"</head>\n"
+				"<body>\n"
+				"<div id=\"bar\"><button id=\"play\">play</button><input id=\"scrub\" type=\"range\" min=\"0\" max=\"0\" value=\"0\"><span id=\"info\">Loading...</span></div>\n"
+				"<canvas id=\"view\"></canvas>\n"
+				"<script>\n"
+				"var canvas = document.getElementById('view'), ctx = canvas.getContext('2d');\n"
+				"var scrub = document.getElementById('scrub'), info = document.getElementById('info'), play = document.getElementById('play');\n"
+				"var W = 0, H = 0, C = 0, pixels = null, image = null, frames = [], current = -1, wanted = 0, zoom = 1, timer = null, queued = false;\n"
+				"function diagnostics_sequence(s) {\n"
+				"  W = s.width; H = s.height; C = s.channels;\n"
+				"  pixels = new Uint8Array(W * H * C);\n"
+				"  canvas.width = W; canvas.height = H;\n"
+				"  image = ctx.createImageData(W, H);\n"
+				"}\n"
+				"function diagnostics_frame(caption, changed, delta) {\n"
+				"  frames.push({ caption: caption, changed: changed, delta: delta, bytes: null });\n"
+				"}\n"
+				"// XORs the delta in: applied once, it moves from the frame before to this one; applied again, back.\n"
+				"function apply(f) {\n"
+				"  if (!f.bytes) {\n"
+				"    var bin = atob(f.delta);\n"
+				"    f.bytes = new Uint8Array(bin.length);\n"
+				"    for (var i = 0; i < bin.length; i++) f.bytes[i] = bin.charCodeAt(i);\n"
+				"    f.delta = null;\n"
+				"  }\n"
+				"  var d = f.bytes, p = 0, pos = 0;\n"
+				"  while (p < d.length) {\n"
+				"    var v = 0, mul = 1, b;\n"
+				"    do { b = d[p++]; v += (b & 0x7f) * mul; mul *= 128; } while (b & 0x80);\n"
+				"    var kind = v % 4, n = (v - kind) / 4, end = pos + n;\n"
+				"    if (kind == 1) {\n"
+				"      while (pos < end) pixels[pos++] ^= d[p++];\n"
+				"    } else if (kind == 2) {\n"
+				"      var x = d[p++];\n"
+				"      while (pos < end) pixels[pos++] ^= x;\n"
+				"    }\n"
+				"    pos = end;\n"
+				"  }\n"
+				"}\n"
+				"function draw() {\n"
+				"  queued = false;\n"
+				"  if (!frames.length) return;\n"
+				"  while (current < wanted) apply(frames[++current]);\n"
+				"  while (current > wanted) apply(frames[current--]);\n"
+				"  var rgba = image.data, n = W * H;\n"
+				"  if (C == 1) {\n"
+				"    for (var i = 0, o = 0; i < n; i++, o += 4) { rgba[o] = rgba[o + 1] = rgba[o + 2] = pixels[i]; rgba[o + 3] = 255; }\n"
+				"  } else {\n"
+				"    for (var i = 0, s = 0, o = 0; i < n; i++, s += C, o += 4) { rgba[o] = pixels[s]; rgba[o + 1] = pixels[s + 1]; rgba[o + 2] = pixels[s + 2]; rgba[o + 3] = C == 4 ? pixels[s + 3] : 255; }\n"
+				"  }\n"
+				"  ctx.putImageData(image, 0, 0);\n"
+				"  var f = frames[current];\n"
+				"  info.textContent = (current + 1) + '/' + frames.length + '  ' + f.caption + '  ' + (f.changed * 100 / (W * H * C)).toFixed(2) + '% changed  ' + W + 'x' + H + '  ' + Math.round(zoom * 100) + '%';\n"
+				"  scrub.value = current;\n"
+				"}\n"
+				"function show(k) {\n"
+				"  wanted = Math.min(Math.max(k, 0), frames.length - 1);\n"
+				"  if (!queued) {\n"
+				"    queued = true;\n"
+				"    requestAnimationFrame(draw);\n"
+				"  }\n"
+				"}\n"
+				"function setZoom(z) {\n"
+				"  zoom = Math.min(Math.max(z, 1 / 16), 32);\n"
+				"  canvas.style.width = W * zoom + 'px';\n"
+				"  canvas.style.height = H * zoom + 'px';\n"
+				"  show(wanted);\n"
+				"}\n"
+				"function fit() {\n"
+				"  setZoom(Math.min((innerWidth - 16) / W, (innerHeight - 56) / H, 1));\n"
+				"}\n"
+				"function toggle() {\n"
+				"  if (timer) {\n"
+				"    clearInterval(timer);\n"
+				"    timer = null;\n"
+				"  } else {\n"
+				"    if (wanted == frames.length - 1) show(0);\n"
+				"    timer = setInterval(function() {\n"
+				"      if (wanted >= frames.length - 1) toggle(); else show(wanted + 1);\n"
+				"    }, 200);\n"
+				"  }\n"
+				"  play.textContent = timer ? 'pause' : 'play';\n"
+				"}\n"
+				"scrub.addEventListener('input', function() { show(+scrub.value); });\n"
+				"play.addEventListener('click', toggle);\n"
+				"addEventListener('keydown', function(e) {\n"
+				"  if (e.key == 'ArrowRight') show(wanted + 1);\n"
+				"  else if (e.key == 'ArrowLeft') show(wanted - 1);\n"
+				"  else if (e.key == 'Home') show(0);\n"
+				"  else if (e.key == 'End') show(frames.length - 1);\n"
+				"  else if (e.key == ' ') toggle();\n"
+				"  else if (e.key == '+' || e.key == '=') setZoom(zoom * 2);\n"
+				"  else if (e.key == '-') setZoom(zoom / 2);\n"
+				"  else if (e.key == '0') fit();\n"
+				"  else if (e.key == '1') setZoom(1);\n"
+				"  else return;\n"
+				"  e.preventDefault();\n"
+				"});\n"
+				"function plainName(f) {\n"
+				"  return f.charAt(0) != '.' && !/[\\/\\\\:]/.test(f) && /\\.seq\\.js$/.test(f);\n"
+				"}\n"
+				"var file = '';\n"
+				"try { file = decodeURIComponent(location.hash.slice(1)); } catch (e) {}\n"
+				"if (!plainName(file)) {\n"
+				"  info.textContent = 'No image sequence: the page URL must end in #<file>.seq.js, a file next to this page';\n"
+				"} else {\n"
+				"  var script = document.createElement('script');\n"
+				"  script.src = file;\n"
+				"  script.onload = function() {\n"
+				"    if (!frames.length) { info.textContent = 'No frames in ' + file; return; }\n"
+				"    scrub.max = frames.length - 1;\n"
+				"    fit();\n"
+				"    show(0);\n"
+				"  };\n"
+				"  script.onerror = function() { info.textContent = 'Cannot load ' + file; };\n"
+				"  document.body.appendChild(script);\n"
+				"}\n"
+				"</script>\n"
+				"</body>\n"
+				"</html>\n";
+
+			bool write_sequence_viewer(const std::string &path) {
+				FILE *fp = fopen(path.c_str(), "wb");
+				if (!fp) {
+					spdlog::error("Cannot create sequence viewer page {}: {}", path, strerror(errno));
+					return false;
+				}
+				const size_t size = sizeof(sequence_viewer_html) - 1;
+				bool ok = fwrite(sequence_viewer_html, 1, size, fp) == size;
+				if (fclose(fp) != 0)
+					ok = false;
+				if (!ok)
+					spdlog::error("Failed to write sequence viewer page {}", path);
+				return ok;
+			}
+
+		} // namespace image
+
+	} // namespace driver
+
+}
@@ -0,0 +1,265 @@
+
+#include <diagnostics/diagnostics.h>
+
+#include <algorithm>
+#include <filesystem>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define LIBDIAG_HAVE_SSE2 1
+#endif
+
+
+namespace diagnostics {
+
+	namespace driver {
+
+		namespace image {
+
+			// --- thumbnails -----------------------------------------------------------------------------------
+
+			void thumbnail_dimensions(int width, int height, int max_size, int &thumb_width, int &thumb_height) {
+				int factor = std::max(1, (std::max(width, height) + max_size - 1) / max_size);
+				thumb_width = std::max(1, (width + factor - 1) / factor);
+				thumb_height = std::max(1, (height + factor - 1) / factor);
+			}
+
+			// acc[i] += src[i] for n bytes: the vertical pass of the box filter, where nearly all the work is done.
+			static void accumulate_row(uint32_t *acc, const uint8_t *src, size_t n) {
+				size_t i = 0;
+#if defined(LIBDIAG_HAVE_SSE2)
+				const __m128i zero = _mm_setzero_si128();
+				for (; i + 16 <= n; i += 16) {
+					__m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + i));
+					__m128i lo = _mm_unpacklo_epi8(v, zero);
+					__m128i hi = _mm_unpackhi_epi8(v, zero);
+					__m128i *a = reinterpret_cast<__m128i *>(acc + i);
+					_mm_storeu_si128(a + 0, _mm_add_epi32(_mm_loadu_si128(a + 0), _mm_unpacklo_epi16(lo, zero)));
+					_mm_storeu_si128(a + 1, _mm_add_epi32(_mm_loadu_si128(a + 1), _mm_unpackhi_epi16(lo, zero)));
+					_mm_storeu_si128(a + 2, _mm_add_epi32(_mm_loadu_si128(a + 2), _mm_unpacklo_epi16(hi, zero)));
+					_mm_storeu_si128(a + 3, _mm_add_epi32(_mm_loadu_si128(a + 3), _mm_unpackhi_epi16(hi, zero)));
+				}
+#endif
+				for (; i < n; i++)
+					acc[i] += src[i];
+			}
+
+			raster_buffer make_thumbnail(const scanline_source &src, int max_size) {
+				int tw, th;
+				if (src.empty())
+					return {};
+				thumbnail_dimensions(src.width, src.height, max_size, tw, th);
+				const int factor = std::max(1, (std::max(src.width, src.height) + max_size - 1) / max_size);
+				const int c = src.channels;
+
+				raster_buffer dst(tw, th, c);
+				std::vector<uint32_t> acc(size_t(src.width) * c);
+
+				for (int ty = 0; ty < th; ty++) {
+					std::fill(acc.begin(), acc.end(), 0);
+					int y0 = ty * factor;
+					int y1 = std::min(src.height, y0 + factor);
+					for (int y = y0; y < y1; y++) {
+						const uint8_t *row = src.row(y);
+						if (!row)
+							return {};
+						accumulate_row(acc.data(), row, acc.size());
+					}
+
+					// horizontal pass: the edge boxes may be narrower / shorter than `factor`.
+					uint8_t *out = dst.row(ty);
+					for (int tx = 0; tx < tw; tx++) {
+						int x0 = tx * factor;
+						int x1 = std::min(src.width, x0 + factor);
+						uint32_t area = uint32_t(x1 - x0) * uint32_t(y1 - y0);
+						for (int ch = 0; ch < c; ch++) {
+							uint32_t sum = 0;
+							for (int x = x0; x < x1; x++)
+								sum += acc[size_t(x) * c + ch];
+							out[size_t(tx) * c + ch] = static_cast<uint8_t>((sum + area / 2) / area);
+						}
+					}
+				}
+				return dst;
+			}
+
+
+			// --- image_store ----------------------------------------------------------------------------------
+
+			image_store::image_store(worker_pool &pool, const std::string &directory, const std::string &url_prefix, int thumbnail_size) :
+				pool_(pool), directory_(directory), url_prefix_(url_prefix), thumbnail_size_(thumbnail_size) {
+				std::error_code ec;
+				std::filesystem::create_directories(directory_, ec);
+				if (ec)
+					spdlog::error("Cannot create diagnostics image directory {}: {}", directory_, ec.message());
+				if (!url_prefix_.empty() && url_prefix_.back() != '/')
+					url_prefix_ += '/';
+			}
+
+			std::string image_store::file_name(std::string_view name, std::string_view suffix, std::string_view extension, uint64_t seq) const {
+				std::string rv = fmt::format("{:06}-", seq);
+				// keep the names portable and URL-safe:
+				for (char ch : name.substr(0, 64)) {
+					bool safe = (ch >= 'a' && ch <= 'z') || (ch >= 'A' && ch <= 'Z') || (ch >= '0' && ch <= '9') || ch == '-' || ch == '_';
+					rv += safe ? ch : '_';
+				}
+				return fmt::format("{}{}.{}", rv, suffix, extension);
+			}
+
+			stored_image image_store::reserve(std::string_view name, std::string_view extension, int width, int height, std::string &full_name, std::string &thumb_name) {
+				uint64_t seq = sequence_++;
+				full_name = file_name(name, "", extension, seq);
+				thumb_name = file_name(name, ".thumb", "png", seq);
+
+				stored_image rv;
+				rv.url = url_prefix_ + full_name;
+				rv.thumbnail_url = url_prefix_ + thumb_name;
+				rv.width = width;
+				rv.height = height;
+				thumbnail_dimensions(width, height, thumbnail_size_, rv.thumbnail_width, rv.thumbnail_height);
+				return rv;
+			}
+
+			std::string image_store::reserve_file(std::string_view name, std::string_view extension, std::string &url) {
+				std::string full_name = file_name(name, "", extension, sequence_++);
+				url = url_prefix_ + full_name;
+				return (std::filesystem::path(directory_) / full_name).string();
+			}
+
+			void image_store::begin_write() {
+				std::lock_guard<std::mutex> lock(mutex_);
+				pending_++;
+			}
+
+			void image_store::end_write() {
+				job_done();
+			}
+
+			stored_image image_store::reserve_sequence(std::string_view name, int width, int height, std::string &path, std::string &thumbnail_path) {
+				std::string full_name, thumb_name;
+				stored_image rv = reserve(name, "seq.js", width, height, full_name, thumb_name);
+				path = (std::filesystem::path(directory_) / full_name).string();
+				thumbnail_path = (std::filesystem::path(directory_) / thumb_name).string();
+				// the viewer loads the sequence named in the fragment, which is relative to it.
+				rv.url = fmt::format("{}sequence-viewer.html#{}", url_prefix_, full_name);
+
+				bool write_viewer = false;
+				{
+					std::lock_guard<std::mutex> lock(mutex_);
+					write_viewer = !sequence_viewer_written_;
+					sequence_viewer_written_ = true;
+				}
+				if (write_viewer)
+					write_sequence_viewer((std::filesystem::path(directory_) / "sequence-viewer.html").string());
+				return rv;
+			}
+
+			bool image_store::find(const content_hash &hash, stored_image &img) {
+				std::lock_guard<std::mutex> lock(mutex_);
+				auto it = stored_.find(hash);
+				if (it == stored_.end())
+					return false;
+				img = it->second;
+				return true;
+			}
+
+			void image_store::remember(const content_hash &hash, const stored_image &img) {
+				std::lock_guard<std::mutex> lock(mutex_);
+				stored_.emplace(hash, img);
+			}
+
+			stored_image image_store::submit(std::string_view name, std::string_view extension, int width, int height, encode_function encode, bool tile_pyramid, int tile_size) {
+				std::string full_name, thumb_name;
+				stored_image rv = reserve(name, extension, width, height, full_name, thumb_name);
+
+				bool write_viewer = false;
+				{
+					std::lock_guard<std::mutex> lock(mutex_);
+					write_viewer = tile_pyramid && !viewer_written_;
+					viewer_written_ = viewer_written_ || tile_pyramid;
+				}
+				if (tile_pyramid) {
+					// the viewer reads the pyramid's location and geometry from the fragment; tiles are relative to it.
+					rv.viewer_url = fmt::format("{}tile-viewer.html#files={}_files&w={}&h={}&tile={}", url_prefix_, tile_pyramid_base(full_name), width, height, tile_size);
+					if (write_viewer)
+						write_tile_viewer((std::filesystem::path(directory_) / "tile-viewer.html").string());
+				}
+				submit_reserved(full_name, thumb_name, std::move(encode));
+				return rv;
+			}
+
+			void image_store::submit_reserved(const std::string &file_name, const std::string &thumbnail_file_name, encode_function encode) {
+				std::string full_path = (std::filesystem::path(directory_) / file_name).string();
+				std::string thumb_path = (std::filesystem::path(directory_) / thumbnail_file_name).string();
+				int thumbnail_size = thumbnail_size_;
+				{
+					std::lock_guard<std::mutex> lock(mutex_);
+					pending_++;
+				}
+				pool_.submit([this, encode = std::move(encode), full_path = std::move(full_path), thumb_path = std::move(thumb_path), thumbnail_size]() {
+					// `pending_` must drop, even when the encoder throws:
+					struct done_guard {
+						image_store *store;
+						~done_guard() {
+							store->job_done();
+						}
+					} guard{this};
+
+					bool thumb_ok = false;
+					bool ok = encode(full_path, [&](const scanline_source &img) {
+						raster_buffer thumb = make_thumbnail(img, thumbnail_size);
+						thumb_ok = !thumb.pixels.empty() && write_png(thumb_path, thumb.view());
+					});
+					if (ok && thumb_ok)
+						written_++;
+					else
+						failed_++;
+				});
+			}
+
+			void image_store::submit_job(std::function<void()> job) {
+				{
+					std::lock_guard<std::mutex> lock(mutex_);
+					pending_++;
+				}
+				pool_.submit([this, job = std::move(job)]() {
+					struct done_guard {
+						image_store *store;
+						~done_guard() {
+							store->job_done();
+						}
+					} guard{this};
+					job();
+				});
+			}
+
+			void image_store::job_done() {
+				std::lock_guard<std::mutex> lock(mutex_);
+				if (--pending_ == 0)
+					idle_.notify_all();
+			}
+
+			void image_store::wait_idle() {
+				std::unique_lock<std::mutex> lock(mutex_);
+				idle_.wait(lock, [this] {
+					return pending_ == 0;
+				});
+			}
+
+			stored_image image_store::submit(std::string_view name, std::shared_ptr<const raster_buffer> img) {
+				int w = img->width;
+				int h = img->height;
+				return submit(name, "png", w, h, [img = std::move(img)](const std::string &path, const std::function<void(const scanline_source &)> &make_thumbnail) {
+					raster view = img->view();
+					if (!write_png(path, view))
+						return false;
+					make_thumbnail(view);
+					return true;
+				});
+			}
+
+		} // namespace image
+
+	} // namespace driver
+
+}
@@ -0,0 +1,122 @@
+#include <diagnostics/diagnostics.h>
+
+#include <spdlog/spdlog.h>
+#include <fmt/format.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+
+
+// Overlays: the primitives are kept as SVG path data right away, one path per pen, so producing the SVG
+// document is a matter of concatenating the paths.
+
+namespace diagnostics {
+
+	namespace driver {
+
+		namespace image {
+
+			overlay &overlay::pen(std::string_view color, float width) {
+				for (size_t i = 0; i < pens_.size(); i++) {
+					if (pens_[i].color == color && pens_[i].width == width) {
+						pen_ = uint32_t(i);
+						return *this;
+					}
+				}
+				pens_.push_back({std::string(color), width, -1});
+				pen_ = uint32_t(pens_.size() - 1);
+				return *this;
+			}
+
+			std::string &overlay::path() {
+				pen_style &p = pens_[pen_];
+				if (p.path < 0) {
+					p.path = int(items_.size());
+					items_.push_back({kind::path, pen_, 0, 0, 0, {}});
+				}
+				return items_[p.path].data;
+			}
+
+			void overlay::extend(float x, float y) {
+				right_ = std::max(right_, x);
+				bottom_ = std::max(bottom_, y);
+			}
+
+			overlay &overlay::box(float left, float top, float right, float bottom) {
+				fmt::format_to(std::back_inserter(path()), "M{:g} {:g}h{:g}v{:g}h{:g}z", left, top, right - left, bottom - top, left - right);
+				extend(std::max(left, right), std::max(top, bottom));
+				return *this;
+			}
+
+			overlay &overlay::line(float x1, float y1, float x2, float y2) {
+				fmt::format_to(std::back_inserter(path()), "M{:g} {:g}L{:g} {:g}", x1, y1, x2, y2);
+				extend(std::max(x1, x2), std::max(y1, y2));
+				return *this;
+			}
+
+			overlay &overlay::polyline(std::span<const float> xy, bool closed) {
+				if (xy.size() < 4)
+					return *this;
+				std::string &d = path();
+				for (size_t i = 0; i + 1 < xy.size(); i += 2) {
+					fmt::format_to(std::back_inserter(d), "{}{:g} {:g}", i == 0 ? "M" : i == 2 ? "L" : " ", xy[i], xy[i + 1]);
+					extend(xy[i], xy[i + 1]);
+				}
+				if (closed)
+					d += 'z';
+				return *this;
+			}
+
+			overlay &overlay::text(float x, float y, std::string_view text, float height) {
+				if (text.empty())
+					return *this;
+				items_.push_back({kind::text, pen_, x, y, height, std::string(text)});
+				extend(x, y);
+				return *this;
+			}
+
+			std::string overlay::svg(int width, int height, std::string_view background_href) const {
+				std::string rv = fmt::format("<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+					"<svg xmlns=\"http://www.w3.org/2000/svg\" xmlns:xlink=\"http://www.w3.org/1999/xlink\" width=\"{0}\" height=\"{1}\" viewBox=\"0 0 {0} {1}\">\n", width, height);
+				if (!background_href.empty()) {
+					std::string href;
+					escape_html(background_href, href);
+					fmt::format_to(std::back_inserter(rv), "<image href=\"{0}\" xlink:href=\"{0}\" width=\"{1}\" height=\"{2}\"/>\n", href, width, height);
+				}
+				for (const item &it : items_) {
+					const pen_style &p = pens_[it.pen];
+					std::string color;
+					escape_html(p.color, color);
+					if (it.type == kind::path) {
+						fmt::format_to(std::back_inserter(rv), "<path fill=\"none\" stroke=\"{}\" stroke-width=\"{:g}\" vector-effect=\"non-scaling-stroke\" d=\"{}\"/>\n", color, p.width, it.data);
+					} else {
+						fmt::format_to(std::back_inserter(rv), "<text x=\"{:g}\" y=\"{:g}\" font-size=\"{:g}\" font-family=\"sans-serif\" fill=\"{}\">", it.x, it.y, it.height, color);
+						escape_html(it.data, rv);
+						rv += "</text>\n";
+					}
+				}
+				rv += "</svg>\n";
+				return rv;
+			}
+
+			bool overlay::write(const std::string &path, int width, int height, std::string_view background_href) const {
+				FILE *fp = fopen(path.c_str(), "wb");
+				if (!fp) {
+					spdlog::error("Cannot create overlay {}: {}", path, strerror(errno));
+					return false;
+				}
+				const std::string doc = svg(width, height, background_href);
+				bool ok = fwrite(doc.data(), 1, doc.size(), fp) == doc.size();
+				if (fclose(fp) != 0)
+					ok = false;
+				if (!ok)
+					spdlog::error("Failed to write overlay {}", path);
+				return ok;
+			}
+
+		} // namespace image
+
+	} // namespace driver
+
+}
@@ -0,0 +1,355 @@
+
+#include <diagnostics/diagnostics.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+
+
+namespace diagnostics {
+
+	namespace driver {
+
+		// --- search_index_builder -------------------------------------------------------------------------
+
+		search_index_builder::search_index_builder(worker_pool &pool) :
+			pool_(pool) {
+		}
+
+		search_index_builder::~search_index_builder() {
+			finish();
+		}
+
+		void search_index_builder::add(uint64_t record, std::string_view text) {
+			if (!current_) {
+				current_ = std::make_unique<batch>();
+				current_->text.reserve(batch_size + 4096);
+			}
+			current_->records.push_back(record);
+			current_->text.append(text.data(), text.size());
+			current_->ends.push_back(current_->text.size());
+			if (current_->text.size() >= batch_size)
+				submit_current();
+		}
+
+		void search_index_builder::submit_current() {
+			if (!current_)
+				return;
+			bool start_job;
+			{
+				std::lock_guard<std::mutex> lock(mutex_);
+				queue_.push_back(std::move(current_));
+				start_job = !draining_;
+				draining_ = true;
+			}
+			// only one drain job is active at any time, so the batches are indexed in order, without locking
+			// the postings.
+			if (start_job) {
+				pool_.submit([this]() {
+					drain();
+				});
+			}
+		}
+
+		void search_index_builder::drain() {
+			for (;;) {
+				std::unique_ptr<batch> b;
+				{
+					std::lock_guard<std::mutex> lock(mutex_);
+					if (queue_.empty()) {
+						draining_ = false;
+						idle_.notify_all();
+						return;
+					}
+					b = std::move(queue_.front());
+					queue_.pop_front();
+				}
+				try {
+					index(*b);
+				} catch (const std::exception &ex) {
+					spdlog::error("Failed to index diagnostics messages: {}", ex.what());
+				}
+			}
+		}
+
+		void search_index_builder::finish() {
+			// the drain job was submitted before this call, so it is ahead of us in the pool's queue: waiting for
+			// it cannot deadlock, even when we're running on a pool thread ourselves.
+			{
+				std::unique_lock<std::mutex> lock(mutex_);
+				idle_.wait(lock, [this] {
+					return !draining_;
+				});
+			}
+			if (current_) {
+				index(*current_);
+				current_.reset();
+			}
+		}
+
+		static inline bool is_token_byte(unsigned char ch) {
+			return (ch >= 'a' && ch <= 'z') || (ch >= 'A' && ch <= 'Z') || (ch >= '0' && ch <= '9') || ch == '_';
+		}
+
+		void search_index_builder::index(const batch &b) {
+			// tokens shorter than this are too common to be of any use; longer ones are dropped, not truncated.
+			constexpr size_t min_token_size = 2;
+			constexpr size_t max_token_size = 64;
+
+			std::string token;
+			size_t start = 0;
+			for (size_t r = 0; r < b.records.size(); r++) {
+				std::string_view text(b.text.data() + start, b.ends[r] - start);
+				start = b.ends[r];
+
+				token.clear();
+				size_t i = 0;
+				while (i <= text.size()) {
+					size_t len = 0;
+					if (i < text.size()) {
+						unsigned char ch = static_cast<unsigned char>(text[i]);
+						if (is_token_byte(ch))
+							len = 1;
+						else if (ch >= 0x80)
+							len = utf8_sequence_length(text.substr(i));
+					}
+					if (len == 0) {
+						if (token.size() >= min_token_size && token.size() <= max_token_size)
+							add_token(token, b.records[r]);
+						token.clear();
+						i++;
+						continue;
+					}
+					for (size_t k = 0; k < len; k++) {
+						char ch = text[i + k];
+						token += (ch >= 'A' && ch <= 'Z') ? char(ch - 'A' + 'a') : ch;
+					}
+					i += len;
+				}
+			}
+		}
+
+		void search_index_builder::add_token(const std::string &token, uint64_t record) {
+			auto it = tokens_.find(token);
+			if (it == tokens_.end())
+				it = tokens_.emplace(token, postings()).first;
+			postings &p = it->second;
+			if (p.count > 0 && p.last == record)
+				return;
+
+			// LEB128: 7 bits per byte, least significant group first; the high bit flags continuation.
+			uint64_t delta = record - p.last;
+			while (delta >= 0x80) {
+				p.deltas += char((delta & 0x7F) | 0x80);
+				delta >>= 7;
+			}
+			p.deltas += char(delta);
+			p.last = record;
+			p.count++;
+		}
+
+
+		// --- sidecar output -------------------------------------------------------------------------------
+
+		bool search_index_builder::write(const std::string &path, std::string_view title, const std::vector<std::pair<std::string, uint64_t>> &pages, uint64_t record_count) {
+			FILE *fp = fopen(path.c_str(), "wb");
+			if (!fp) {
+				spdlog::error("Cannot create search index file {}: {}", path, strerror(errno));
+				return false;
+			}
+
+			std::vector<const std::pair<const std::string, postings> *> sorted;
+			sorted.reserve(tokens_.size());
+			for (const auto &entry : tokens_)
+				sorted.push_back(&entry);
+			std::sort(sorted.begin(), sorted.end(), [](const auto *a, const auto *b) {
+				return a->first < b->first;
+			});
+
+			// written in chunks, as the index of a large session easily runs into the hundreds of MBytes.
+			bool ok = true;
+			std::string out;
+			auto spill = [&](bool force) {
+				if (out.size() >= (1u << 20) || force) {
+					ok = fwrite(out.data(), 1, out.size(), fp) == out.size() && ok;
+					out.clear();
+				}
+			};
+
+			out += "diagnostics_search_index({\n\"version\": 1,\n\"title\": ";
+			append_json_string(out, title);
+			out += fmt::format(",\n\"records\": {},\n\"pages\": [", record_count);
+			for (size_t i = 0; i < pages.size(); i++) {
+				out += i ? ",\n" : "\n";
+				out += "{\"file\": ";
+				append_json_string(out, pages[i].first);
+				out += fmt::format(", \"first\": {}}}", pages[i].second);
+			}
+			out += "\n],\n\"tokens\": [";
+			for (size_t i = 0; i < sorted.size(); i++) {
+				out += i ? (i % 16 ? "," : ",\n") : "\n";
+				append_json_string(out, sorted[i]->first);
+				spill(false);
+			}
+			// postings: base64 of the LEB128-encoded deltas between successive message numbers.
+			out += "\n],\n\"postings\": [";
+			for (size_t i = 0; i < sorted.size(); i++) {
+				out += i ? ",\n\"" : "\n\"";
+				append_base64(out, sorted[i]->second.deltas);
+				out += '"';
+				spill(false);
+			}
+			out += "\n]\n});\n";
+			spill(true);
+
+			if (fclose(fp) != 0)
+				ok = false;
+			if (!ok)
+				spdlog::error("Failed to write search index file {}", path);
+			return ok;
+		}
+
+
+		// --- viewer ---------------------------------------------------------------------------------------
+
+		static const char search_viewer_head[] =
+			"<!DOCTYPE html>\n"
+			"<html>\n"
+			"<head>\n"
+			"<meta charset=\"utf-8\">\n"
+			"<title>";
+
+		// The viewer decodes the postings of the query tokens only, on demand, so it's ready as soon as the
+		// sidecar has been parsed. The last query token also matches as a prefix.
+		static const char search_viewer_body[] =
+			"</title>\n"
+			"<style>\n"
+			"body { font-family: monospace; }\n"
+			"#query { width: 40em; font-family: monospace; }\n"
+			"#status { color: #888; margin: 0.5em 0; }\n"
+			"#results p { margin: 0; }\n"
+			"</style>\n"
+			"</head>\n"
+			"<body>\n"
+			"<p><a href=\"@INDEX@\">index</a></p>\n"
+			"<p><input id=\"query\" type=\"search\" placeholder=\"search...\" autofocus disabled></p>\n"
+			"<div id=\"status\">Loading the search index...</div>\n"
+			"<div id=\"results\"></div>\n"
+			"<script>\n"
+			"var idx = null, tokenMap = null, decoded = new Map();\n"
+			"function diagnostics_search_index(data) {\n"
+			"  idx = data;\n"
+			"  tokenMap = new Map();\n"
+			"  for (var i = 0; i < data.tokens.length; i++) tokenMap.set(data.tokens[i], i);\n"
+			"}\n"
+			"function postings(i) {\n"
+			"  if (decoded.has(i)) return decoded.get(i);\n"
+			"  var bin = atob(idx.postings[i]), out = [], acc = 0, v = 0, shift = 0;\n"
+			"  for (var k = 0; k < bin.length; k++) {\n"
+			"    var b = bin.charCodeAt(k);\n"
+			"    v += (b & 0x7f) * Math.pow(2, shift);\n"
+			"    if (b & 0x80) { shift += 7; continue; }\n"
+			"    acc += v; out.push(acc); v = 0; shift = 0;\n"
+			"  }\n"
+			"  decoded.set(i, out);\n"
+			"  return out;\n"
+			"}\n"
+			"function tokenize(text) {\n"
+			"  var tokens = [], cur = '', enc = new TextEncoder();\n"
+			"  function push() { var n = enc.encode(cur).length; if (n >= 2 && n <= 64) tokens.push(cur); cur = ''; }\n"
+			"  for (var ch of text) {\n"
+			"    if (/[A-Za-z0-9_]/.test(ch) || ch.codePointAt(0) >= 0x80) cur += /[A-Z]/.test(ch) ? ch.toLowerCase() : ch; else push();\n"
+			"  }\n"
+			"  push();\n"
+			"  return tokens;\n"
+			"}\n"
+			"function union(lists) {\n"
+			"  var set = new Set();\n"
+			"  for (var l of lists) for (var r of l) set.add(r);\n"
+			"  return Array.from(set).sort(function(a, b) { return a - b; });\n"
+			"}\n"
+			"function intersect(a, b) {\n"
+			"  var out = [], i = 0, j = 0;\n"
+			"  while (i < a.length && j < b.length) {\n"
+			"    if (a[i] < b[j]) i++; else if (a[i] > b[j]) j++; else { out.push(a[i]); i++; j++; }\n"
+			"  }\n"
+			"  return out;\n"
+			"}\n"
+			"function pageOf(record) {\n"
+			"  var lo = 0, hi = idx.pages.length - 1;\n"
+			"  while (lo < hi) { var mid = (lo + hi + 1) >> 1; if (idx.pages[mid].first <= record) lo = mid; else hi = mid - 1; }\n"
+			"  return lo;\n"
+			"}\n"
+			"function search() {\n"
+			"  var tokens = tokenize(document.getElementById('query').value);\n"
+			"  var results = document.getElementById('results'), status = document.getElementById('status');\n"
+			"  results.textContent = '';\n"
+			"  if (!tokens.length) { status.textContent = idx.records + ' messages indexed'; return; }\n"
+			"  var hits = null;\n"
+			"  for (var t = 0; t < tokens.length; t++) {\n"
+			"    var list;\n"
+			"    if (t == tokens.length - 1 && tokens[t].length >= 3) {\n"
+			"      var lists = [];\n"
+			"      for (var i = 0; i < idx.tokens.length && lists.length < 256; i++)\n"
+			"        if (idx.tokens[i].startsWith(tokens[t])) lists.push(postings(i));\n"
+			"      list = union(lists);\n"
+			"    } else {\n"
+			"      list = tokenMap.has(tokens[t]) ? postings(tokenMap.get(tokens[t])) : [];\n"
+			"    }\n"
+			"    hits = hits === null ? list : intersect(hits, list);\n"
+			"  }\n"
+			"  status.textContent = hits.length + ' matching messages' + (hits.length > 1000 ? ', showing the first 1000' : '');\n"
+			"  var frag = document.createDocumentFragment();\n"
+			"  for (var h = 0; h < hits.length && h < 1000; h++) {\n"
+			"    var page = pageOf(hits[h]), p = document.createElement('p'), a = document.createElement('a');\n"
+			"    a.href = idx.pages[page].file + '#r' + hits[h];\n"
+			"    a.textContent = 'page ' + (page + 1) + ', message ' + hits[h];\n"
+			"    p.appendChild(a);\n"
+			"    frag.appendChild(p);\n"
+			"  }\n"
+			"  results.appendChild(frag);\n"
+			"}\n"
+			"</script>\n"
+			"<script src=\"@SIDECAR@\"></script>\n"
+			"<script>\n"
+			"var q = document.getElementById('query');\n"
+			"if (idx) {\n"
+			"  q.disabled = false;\n"
+			"  q.addEventListener('input', search);\n"
+			"  search();\n"
+			"} else {\n"
+			"  document.getElementById('status').textContent = 'The search index is not available: it is written when the session is finished.';\n"
+			"}\n"
+			"</script>\n"
+			"</body>\n"
+			"</html>\n";
+
+		bool write_search_viewer(const std::string &path, std::string_view title, std::string_view index_file_name, std::string_view session_index_file_name) {
+			std::string html = search_viewer_head;
+			escape_html(title, html);
+			html += " - search";
+
+			std::string body = search_viewer_body;
+			std::string index_link, sidecar_link;
+			escape_html(session_index_file_name, index_link);
+			escape_html(index_file_name, sidecar_link);
+			body.replace(body.find("@INDEX@"), 7, index_link);
+			body.replace(body.find("@SIDECAR@"), 9, sidecar_link);
+			html += body;
+
+			FILE *fp = fopen(path.c_str(), "wb");
+			if (!fp) {
+				spdlog::error("Cannot create search page {}: {}", path, strerror(errno));
+				return false;
+			}
+			bool ok = fwrite(html.data(), 1, html.size(), fp) == html.size();
+			if (fclose(fp) != 0)
+				ok = false;
+			if (!ok)
+				spdlog::error("Failed to write search page {}", path);
+			return ok;
+		}
+
+	} // namespace driver
+
+}
@@ -0,0 +1,187 @@
+
+#include <diagnostics/diagnostics.h>
+
+#include <cerrno>
+#include <cstring>
+
+
+namespace diagnostics {
+
+	namespace driver {
+
+		namespace image {
+
+			std::string tile_pyramid_base(const std::string &image_path) {
+				size_t dot = image_path.find_last_of("./\\");
+				if (dot == std::string::npos || image_path[dot] != '.')
+					return image_path;
+				return image_path.substr(0, dot);
+			}
+
+			// A canvas which draws the tiles of the level with at least one tile pixel per screen pixel, over the
+			// tiles of a much coarser level, which stand in while the others load. The pyramid's location and
+			// geometry come from the URL fragment, so one copy of the page serves all images in the directory,
+			// and nothing is fetched which a `file://` URL would not allow: the tiles are plain images.
+			static const char tile_viewer_html[] =
+				"<!DOCTYPE html>\n"
+				"<html>\n"
+				"<head>\n"
+				"<meta charset=\"utf-8\">\n"
+				"<title>Tile viewer</title>\n"
+				"<style>\n"
+				"html, body { margin: 0; height: 100%; overflow: hidden; background: #404040; }\n"
+				"canvas { display: block; cursor: grab; }\n"
+				"#info { position: fixed; left: 8px; bottom: 8px; padding: 2px 6px; background: rgba(0, 0, 0, 0.6); color: #fff; font: 12px monospace; }\n"
+				"</style>\n"
+				"</head>\n"
+				"<body>\n"
+				"<canvas id=\"view\"></canvas>\n"
+				"<div id=\"info\"></div>\n"
+				"<script>\n"
+				"var canvas = document.getElementById('view'), ctx = canvas.getContext('2d'), info = document.getElementById('info');\n"
+				"var files, W, H, T, maxLevel;\n"
+				"// `scale`: screen pixels per image pixel; (x0, y0): the image coordinates of the top left corner.\n"
+				"var scale = 1, x0 = 0, y0 = 0, minScale = 1, cursor = null, drag = null, queued = false;\n"
+				"var tiles = new Map();\n"
+				"function load() {\n"
+				"  var p = new URLSearchParams(location.hash.slice(1));\n"
+				"  files = p.get('files'); W = +p.get('w'); H = +p.get('h'); T = +p.get('tile') || 256;\n"
+				"  maxLevel = Math.ceil(Math.log2(Math.max(W, H, 1)));\n"
+				"  tiles.clear();\n"
+				"  fit();\n"
+				"}\n"
+				"function fit() {\n"
+				"  minScale = Math.min(canvas.width / W, canvas.height / H, 1) / 4;\n"
+				"  scale = Math.min(canvas.width / W, canvas.height / H);\n"
+				"  x0 = (W - canvas.width / scale) / 2;\n"
+				"  y0 = (H - canvas.height / scale) / 2;\n"
+				"  redraw();\n"
+				"}\n"
+				"function zoom(factor, sx, sy) {\n"
+				"  var s = Math.min(Math.max(scale * factor, minScale), 64);\n"
+				"  x0 += sx / scale - sx / s;\n"
+				"  y0 += sy / scale - sy / s;\n"
+				"  scale = s;\n"
+				"  redraw();\n"
+				"}\n"
+				"// Tiles are kept in least recently used order, and the oldest dropped beyond a few screens' worth.\n"
+				"function tile(key) {\n"
+				"  var img = tiles.get(key);\n"
+				"  if (img) {\n"
+				"    tiles.delete(key);\n"
+				"  } else {\n"
+				"    img = new Image();\n"
+				"    img.onload = redraw;\n"
+				"    img.src = files + '/' + key + '.png';\n"
+				"    if (tiles.size >= 1000) tiles.delete(tiles.keys().next().value);\n"
+				"  }\n"
+				"  tiles.set(key, img);\n"
+				"  return img;\n"
+				"}\n"
+				"function drawLevel(level) {\n"
+				"  var f = Math.pow(2, maxLevel - level), lw = Math.ceil(W / f), lh = Math.ceil(H / f), span = T * f;\n"
+				"  var c0 = Math.max(0, Math.floor(x0 / span)), c1 = Math.min(Math.ceil(lw / T), Math.ceil((x0 + canvas.width / scale) / span));\n"
+				"  var r0 = Math.max(0, Math.floor(y0 / span)), r1 = Math.min(Math.ceil(lh / T), Math.ceil((y0 + canvas.height / scale) / span));\n"
+				"  for (var r = r0; r < r1; r++) {\n"
+				"    for (var c = c0; c < c1; c++) {\n"
+				"      var img = tile(level + '/' + c + '_' + r);\n"
+				"      if (!img.complete || !img.naturalWidth) continue;\n"
+				"      // whole screen pixels on both edges, so neighbouring tiles neither overlap nor leave seams.\n"
+				"      var sx = Math.round((c * span - x0) * scale), sy = Math.round((r * span - y0) * scale);\n"
+				"      var ex = Math.round((c * span + img.naturalWidth * f - x0) * scale), ey = Math.round((r * span + img.naturalHeight * f - y0) * scale);\n"
+				"      ctx.drawImage(img, sx, sy, ex - sx, ey - sy);\n"
+				"    }\n"
+				"  }\n"
+				"}\n"
+				"function draw() {\n"
+				"  queued = false;\n"
+				"  ctx.fillStyle = '#404040';\n"
+				"  ctx.fillRect(0, 0, canvas.width, canvas.height);\n"
+				"  if (!files || !W || !H) {\n"
+				"    info.textContent = 'No tile pyramid: the page URL must end in #files=...&w=...&h=...';\n"
+				"    return;\n"
+				"  }\n"
+				"  // the level with at least one pixel per screen pixel; zoomed in, the pixels are shown as sharp squares.\n"
+				"  var level = Math.min(maxLevel, Math.max(0, Math.ceil(maxLevel + Math.log2(scale) - 1e-9)));\n"
+				"  ctx.imageSmoothingEnabled = scale < 1;\n"
+				"  // a coarse level first, which is covered by a few tiles, shows something while the others load.\n"
+				"  if (level > 4) drawLevel(level - 4);\n"
+				"  drawLevel(level);\n"
+				"  var text = W + 'x' + H + '  ' + Math.round(scale * 1000) / 10 + '%';\n"
+				"  if (cursor) {\n"
+				"    var x = Math.floor(x0 + cursor[0] / scale), y = Math.floor(y0 + cursor[1] / scale);\n"
+				"    if (x >= 0 && y >= 0 && x < W && y < H) text += '  x ' + x + ' y ' + y;\n"
+				"  }\n"
+				"  info.textContent = text;\n"
+				"}\n"
+				"function redraw() {\n"
+				"  if (!queued) {\n"
+				"    queued = true;\n"
+				"    requestAnimationFrame(draw);\n"
+				"  }\n"
+				"}\n"
+				"function resize() {\n"
+				"  canvas.width = innerWidth;\n"
+				"  canvas.height = innerHeight;\n"
+				"  redraw();\n"
+				"}\n"
+				"canvas.addEventListener('wheel', function(e) {\n"
+				"  e.preventDefault();\n"
+				"  zoom(Math.pow(1.002, -e.deltaY), e.clientX, e.clientY);\n"
+				"}, { passive: false });\n"
+				"canvas.addEventListener('pointerdown', function(e) {\n"
+				"  drag = [e.clientX, e.clientY];\n"
+				"  canvas.setPointerCapture(e.pointerId);\n"
+				"  canvas.style.cursor = 'grabbing';\n"
+				"});\n"
+				"canvas.addEventListener('pointermove', function(e) {\n"
+				"  cursor = [e.clientX, e.clientY];\n"
+				"  if (drag) {\n"
+				"    x0 -= (e.clientX - drag[0]) / scale;\n"
+				"    y0 -= (e.clientY - drag[1]) / scale;\n"
+				"    drag = cursor;\n"
+				"  }\n"
+				"  redraw();\n"
+				"});\n"
+				"canvas.addEventListener('pointerup', function() {\n"
+				"  drag = null;\n"
+				"  canvas.style.cursor = '';\n"
+				"});\n"
+				"canvas.addEventListener('dblclick', function(e) {\n"
+				"  zoom(2, e.clientX, e.clientY);\n"
+				"});\n"
+				"addEventListener('keydown', function(e) {\n"
+				"  if (e.key == '+' || e.key == '=') zoom(2, canvas.width / 2, canvas.height / 2);\n"
+				"  else if (e.key == '-') zoom(0.5, canvas.width / 2, canvas.height / 2);\n"
+				"  else if (e.key == '0') fit();\n"
+				"  else if (e.key == '1') zoom(1 / scale, canvas.width / 2, canvas.height / 2);\n"
+				"});\n"
+				"addEventListener('resize', resize);\n"
+				"addEventListener('hashchange', load);\n"
+				"canvas.width = innerWidth;\n"
+				"canvas.height = innerHeight;\n"
+				"load();\n"
+				"</script>\n"
+				"</body>\n"
+				"</html>\n";
+
+			bool write_tile_viewer(const std::string &path) {
+				FILE *fp = fopen(path.c_str(), "wb");
+				if (!fp) {
+					spdlog::error("Cannot create tile viewer page {}: {}", path, strerror(errno));
+					return false;
+				}
+				const size_t size = sizeof(tile_viewer_html) - 1;
+				bool ok = fwrite(tile_viewer_html, 1, size, fp) == size;
+				if (fclose(fp) != 0)
+					ok = false;
+				if (!ok)
+					spdlog::error("Failed to write tile viewer page {}", path);
+				return ok;
+			}
+
+		} // namespace image
+
+	} // namespace driver
+
+}
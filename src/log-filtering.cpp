@@ -1,5 +1,73 @@
 
-#pragma once
-
 #include <diagnostics/logging.h>
 
+
+namespace diagnostics {
+
+	// `*` stops at '/', `**` does not. Backtracks on the stars: the patterns and paths are short.
+	static bool glob_match(std::string_view pattern, std::string_view text) {
+		while (!pattern.empty()) {
+			// "a/**" also matches "a" itself.
+			if (text.empty() && pattern == "/**")
+				return true;
+			if (pattern[0] == '*') {
+				bool deep = pattern.size() > 1 && pattern[1] == '*';
+				pattern.remove_prefix(deep ? 2 : 1);
+				for (size_t i = 0;; i++) {
+					if (glob_match(pattern, text.substr(i)))
+						return true;
+					if (i == text.size() || (!deep && text[i] == '/'))
+						return false;
+				}
+			}
+			if (text.empty())
+				return false;
+			if (pattern[0] == '?' ? text[0] == '/' : pattern[0] != text[0])
+				return false;
+			pattern.remove_prefix(1);
+			text.remove_prefix(1);
+		}
+		return text.empty();
+	}
+
+	section_filter section_filter::parse(std::string_view spec, bool default_match) {
+		section_filter rv(default_match);
+		while (!spec.empty()) {
+			size_t comma = spec.find(',');
+			std::string_view item = spec.substr(0, comma);
+			spec = comma == std::string_view::npos ? std::string_view() : spec.substr(comma + 1);
+
+			while (!item.empty() && item.front() == ' ')
+				item.remove_prefix(1);
+			while (!item.empty() && item.back() == ' ')
+				item.remove_suffix(1);
+			if (item.empty())
+				continue;
+			if (item[0] == '-')
+				rv.exclude(item.substr(1));
+			else
+				rv.include(item[0] == '+' ? item.substr(1) : item);
+		}
+		return rv;
+	}
+
+	section_filter &section_filter::include(std::string_view pattern) {
+		rules_.push_back({std::string(pattern), true});
+		has_include_ = true;
+		return *this;
+	}
+
+	section_filter &section_filter::exclude(std::string_view pattern) {
+		rules_.push_back({std::string(pattern), false});
+		return *this;
+	}
+
+	bool section_filter::matches(std::string_view section_path) const {
+		for (auto it = rules_.rbegin(); it != rules_.rend(); ++it) {
+			if (glob_match(it->pattern, section_path))
+				return it->include;
+		}
+		return default_;
+	}
+
+}
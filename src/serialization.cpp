@@ -3,3 +3,319 @@
 
 #include <diagnostics/telemetry.h>
 
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstddef>
+#include <cstring>
+#include <functional>
+#include <thread>
+
+#if defined(__x86_64__) || defined(_M_X64)
+#include <nmmintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#define LIBDIAG_CRC32C_X86 1
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#define LIBDIAG_CRC32C_ARM 1
+#endif
+
+
+namespace diagnostics {
+
+	namespace binlog {
+
+		static constexpr size_t write_buffer_size = 1u << 20;
+
+		static uint64_t now_ns() {
+			return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+		}
+
+		static uint32_t current_thread_id() {
+			static thread_local uint32_t id = static_cast<uint32_t>(std::hash<std::thread::id>()(std::this_thread::get_id()));
+			return id;
+		}
+
+		static constexpr size_t padded_size(size_t size) {
+			return (size + record_alignment - 1) & ~(record_alignment - 1);
+		}
+
+
+		// --- CRC32C ---------------------------------------------------------------------------------------
+
+		// slicing-by-8 tables for the software fallback; generated at compile time.
+		struct crc32c_tables {
+			uint32_t t[8][256];
+
+			constexpr crc32c_tables() : t{} {
+				for (uint32_t i = 0; i < 256; i++) {
+					uint32_t c = i;
+					for (int k = 0; k < 8; k++)
+						c = (c & 1) ? (c >> 1) ^ 0x82F63B78u : (c >> 1);
+					t[0][i] = c;
+				}
+				for (uint32_t i = 0; i < 256; i++) {
+					for (int k = 1; k < 8; k++)
+						t[k][i] = (t[k - 1][i] >> 8) ^ t[0][t[k - 1][i] & 0xFF];
+				}
+			}
+		};
+		static constexpr crc32c_tables crc_tables;
+
+		static uint32_t crc32c_software(uint32_t crc, const uint8_t *p, size_t size) {
+			while (size >= 8) {
+				uint64_t v;
+				memcpy(&v, p, 8);
+				v ^= crc;
+				crc = crc_tables.t[7][v & 0xFF] ^ crc_tables.t[6][(v >> 8) & 0xFF] ^ crc_tables.t[5][(v >> 16) & 0xFF] ^ crc_tables.t[4][(v >> 24) & 0xFF] ^
+					  crc_tables.t[3][(v >> 32) & 0xFF] ^ crc_tables.t[2][(v >> 40) & 0xFF] ^ crc_tables.t[1][(v >> 48) & 0xFF] ^ crc_tables.t[0][v >> 56];
+				p += 8;
+				size -= 8;
+			}
+			while (size--) {
+				crc = (crc >> 8) ^ crc_tables.t[0][(crc ^ *p++) & 0xFF];
+			}
+			return crc;
+		}
+
+#if defined(LIBDIAG_CRC32C_X86)
+
+#if defined(__GNUC__) || defined(__clang__)
+		__attribute__((target("sse4.2")))
+#endif
+		static uint32_t crc32c_hardware(uint32_t crc, const uint8_t *p, size_t size) {
+			uint64_t c = crc;
+			while (size >= 8) {
+				uint64_t v;
+				memcpy(&v, p, 8);
+				c = _mm_crc32_u64(c, v);
+				p += 8;
+				size -= 8;
+			}
+			uint32_t c32 = static_cast<uint32_t>(c);
+			while (size--) {
+				c32 = _mm_crc32_u8(c32, *p++);
+			}
+			return c32;
+		}
+
+		static bool cpu_has_crc32c() {
+#if defined(_MSC_VER)
+			int info[4];
+			__cpuid(info, 1);
+			return (info[2] & (1 << 20)) != 0;
+#else
+			return __builtin_cpu_supports("sse4.2");
+#endif
+		}
+
+#elif defined(LIBDIAG_CRC32C_ARM)
+
+		static uint32_t crc32c_hardware(uint32_t crc, const uint8_t *p, size_t size) {
+			while (size >= 8) {
+				uint64_t v;
+				memcpy(&v, p, 8);
+				crc = __crc32cd(crc, v);
+				p += 8;
+				size -= 8;
+			}
+			while (size--) {
+				crc = __crc32cb(crc, *p++);
+			}
+			return crc;
+		}
+
+		static bool cpu_has_crc32c() {
+			return true;
+		}
+
+#endif
+
+		uint32_t crc32c(uint32_t crc, const void *data, size_t size) {
+			const uint8_t *p = static_cast<const uint8_t *>(data);
+			crc = ~crc;
+#if defined(LIBDIAG_CRC32C_X86) || defined(LIBDIAG_CRC32C_ARM)
+			static const bool has_hardware = cpu_has_crc32c();
+			if (has_hardware)
+				return ~crc32c_hardware(crc, p, size);
+#endif
+			return ~crc32c_software(crc, p, size);
+		}
+
+		uint32_t crc32c_portable(uint32_t crc, const void *data, size_t size) {
+			return ~crc32c_software(~crc, static_cast<const uint8_t *>(data), size);
+		}
+
+		// checksum of the record content, as defined at `record_header`; `payload` is everything which follows the header.
+		static uint32_t record_checksum(const record_header &hdr, const void *payload, size_t payload_size) {
+			constexpr size_t covered_offset = offsetof(record_header, crc32c) + sizeof(hdr.crc32c);
+			uint32_t crc = crc32c(0, &hdr.size, sizeof(hdr.size));
+			crc = crc32c(crc, reinterpret_cast<const char *>(&hdr) + covered_offset, sizeof(hdr) - covered_offset);
+			return crc32c(crc, payload, payload_size);
+		}
+
+		bool verify_record_checksum(const record_header *hdr) {
+			return record_checksum(*hdr, hdr + 1, hdr->size - sizeof(record_header)) == hdr->crc32c;
+		}
+
+
+		// --- segment writer -------------------------------------------------------------------------------
+
+		std::string segment_path(std::string_view base_path, uint32_t index) {
+			return fmt::format("{}.{:05}.ldseg", base_path, index);
+		}
+
+
+		segment_writer::~segment_writer() {
+			close();
+		}
+
+		bool segment_writer::open(std::string_view base_path, uint64_t session_id, uint64_t max_segment_size, uint32_t flush_interval_ms) {
+			close();
+
+			base_path_ = base_path;
+			session_id_ = session_id;
+			max_segment_size_ = max_segment_size;
+			flush_interval_ns_ = uint64_t(flush_interval_ms) * 1000000;
+			segment_index_ = 0;
+			buffer_.reserve(write_buffer_size);
+
+			return open_segment();
+		}
+
+		bool segment_writer::open_segment() {
+			std::string path = segment_path(base_path_, segment_index_);
+			fp_ = fopen(path.c_str(), "wb");
+			if (!fp_) {
+				spdlog::error("Cannot create binary diagnostics segment {}: {}", path, strerror(errno));
+				return false;
+			}
+
+			segment_file_header hdr{};
+			hdr.magic = segment_magic;
+			hdr.version = segment_version;
+			hdr.segment_index = segment_index_;
+			hdr.session_id = session_id_;
+			hdr.created_ns = now_ns();
+
+			buffer_.clear();
+			sequence_ = 0;
+			segment_size_ = 0;
+			last_flush_ns_ = hdr.created_ns;
+			return write_out(&hdr, sizeof(hdr));
+		}
+
+		bool segment_writer::close_segment() {
+			if (!fp_)
+				return true;
+
+			bool ok = flush();
+			if (fclose(fp_) != 0)
+				ok = false;
+			fp_ = nullptr;
+			return ok;
+		}
+
+		void segment_writer::close() {
+			close_segment();
+			buffer_.clear();
+			buffer_.shrink_to_fit();
+		}
+
+		bool segment_writer::write_out(const void *data, size_t size) {
+			segment_size_ += size;
+
+			// oversized records bypass the buffer entirely:
+			if (size >= write_buffer_size) {
+				if (!flush())
+					return false;
+				return fwrite(data, 1, size, fp_) == size;
+			}
+			if (buffer_.size() + size > write_buffer_size) {
+				if (!flush())
+					return false;
+			}
+			const char *p = static_cast<const char *>(data);
+			buffer_.insert(buffer_.end(), p, p + size);
+			return true;
+		}
+
+		bool segment_writer::flush() {
+			if (!fp_)
+				return false;
+			if (!buffer_.empty()) {
+				size_t len = buffer_.size();
+				size_t written = fwrite(buffer_.data(), 1, len, fp_);
+				buffer_.clear();
+				if (written != len) {
+					spdlog::error("Failed to write binary diagnostics segment {}: {}", segment_path(base_path_, segment_index_), strerror(errno));
+					return false;
+				}
+			}
+			return fflush(fp_) == 0;
+		}
+
+		bool segment_writer::append(record_kind kind, int level, std::string_view message, std::string_view section, std::span<const double> args, const std::source_location &where) {
+			if (!fp_)
+				return false;
+
+			if (max_segment_size_ > 0 && segment_size_ >= max_segment_size_) {
+				close_segment();
+				segment_index_++;
+				if (!open_segment())
+					return false;
+			}
+
+			std::string_view file = where.file_name();
+			std::string_view function = where.function_name();
+
+			record_header hdr{};
+			hdr.marker = record_marker;
+			hdr.kind = static_cast<uint16_t>(kind);
+			hdr.level = static_cast<uint8_t>(level);
+			hdr.arg_count = static_cast<uint8_t>(std::min<size_t>(args.size(), UINT8_MAX));
+			hdr.timestamp_ns = now_ns();
+			hdr.sequence = sequence_++;
+			hdr.thread_id = current_thread_id();
+			hdr.line = where.line();
+			hdr.message_len = static_cast<uint32_t>(message.size());
+			hdr.file_len = static_cast<uint16_t>(std::min<size_t>(file.size(), UINT16_MAX));
+			hdr.function_len = static_cast<uint16_t>(std::min<size_t>(function.size(), UINT16_MAX));
+			hdr.section_len = static_cast<uint16_t>(std::min<size_t>(section.size(), UINT16_MAX));
+
+			size_t payload = hdr.arg_count * sizeof(double) + hdr.file_len + hdr.function_len + hdr.section_len + hdr.message_len;
+			size_t total = padded_size(sizeof(hdr) + payload);
+			hdr.size = static_cast<uint32_t>(total);
+
+			static const char padding[record_alignment] = {0};
+			const size_t padding_len = total - sizeof(hdr) - payload;
+
+			// the payload is scattered across the caller's arguments: checksum the pieces in writing order.
+			uint32_t crc = record_checksum(hdr, args.data(), hdr.arg_count * sizeof(double));
+			crc = crc32c(crc, file.data(), hdr.file_len);
+			crc = crc32c(crc, function.data(), hdr.function_len);
+			crc = crc32c(crc, section.data(), hdr.section_len);
+			crc = crc32c(crc, message.data(), hdr.message_len);
+			hdr.crc32c = crc32c(crc, padding, padding_len);
+
+			bool ok = write_out(&hdr, sizeof(hdr));
+			ok = ok && write_out(args.data(), hdr.arg_count * sizeof(double));
+			ok = ok && write_out(file.data(), hdr.file_len);
+			ok = ok && write_out(function.data(), hdr.function_len);
+			ok = ok && write_out(section.data(), hdr.section_len);
+			ok = ok && write_out(message.data(), hdr.message_len);
+			ok = ok && write_out(padding, padding_len);
+
+			// bound the amount of buffered data we stand to lose when the application crashes:
+			if (ok && flush_interval_ns_ > 0 && hdr.timestamp_ns - last_flush_ns_ >= flush_interval_ns_) {
+				last_flush_ns_ = hdr.timestamp_ns;
+				ok = flush();
+			}
+			return ok;
+		}
+
+	} // namespace binlog
+
+}
@@ -0,0 +1,90 @@
+
+#include <diagnostics/diagnostics.h>
+
+#include <spdlog/spdlog.h>
+#include <fmt/format.h>
+
+#include <chrono>
+#include <filesystem>
+
+
+// Measures the cost of the HTML + text dual-channel output against HTML-only and text-only output, for the
+// same stream of messages: as each message is formatted only once and rendered straight into the channel
+// buffers, the dual-channel run should cost (roughly) the sum of the channel costs, not more.
+
+using namespace diagnostics;
+
+static constexpr int message_count = 1000000;
+
+static double run(const std::string &directory, bool html, bool text) {
+	driver::html_channel html_out;
+	driver::text_writer text_out;
+	if (html)
+		html_out.open((std::filesystem::path(directory) / "bench").string(), "fan-out benchmark");
+	if (text)
+		text_out.open((std::filesystem::path(directory) / "bench.log").string());
+
+	fmt::memory_buffer buf;
+	auto t0 = std::chrono::steady_clock::now();
+	for (int i = 0; i < message_count; i++) {
+		if (i % 10000 == 0) {
+			if (i > 0) {
+				if (html)
+					html_out.pop_section();
+				if (text)
+					text_out.pop_section();
+			}
+			if (html)
+				html_out.push_section("block");
+			if (text)
+				text_out.push_section("block");
+		}
+
+		// format once...
+		buf.clear();
+		fmt::format_to(std::back_inserter(buf), "iteration {}: x = {:.3f} <{}> & \"done\"", i, i * 0.001, i % 7);
+		driver::log_record record;
+		record.level = (i % 5 == 0) ? spdlog::level::debug : spdlog::level::info;
+		record.time = std::chrono::system_clock::now();
+		record.text = std::string_view(buf.data(), buf.size());
+
+		// ... emit many.
+		if (html)
+			html_out.write_record(record);
+		if (text)
+			text_out.write_record(record);
+	}
+	if (html)
+		html_out.close();
+	if (text)
+		text_out.close();
+	auto t1 = std::chrono::steady_clock::now();
+	return std::chrono::duration<double>(t1 - t0).count();
+}
+
+
+#if defined(BUILD_MONOLITHIC)
+#define main diagnostics_bench_fanout_main
+#endif
+
+int main(int argc, const char **argv) {
+	std::string directory = argc > 1 ? argv[1] : "bench-fanout-output";
+	std::filesystem::create_directories(directory);
+
+	struct {
+		const char *name;
+		bool html;
+		bool text;
+	} configs[] = {
+		{"format only", false, false},
+		{"text only", false, true},
+		{"html only", true, false},
+		{"html + text", true, true},
+	};
+
+	for (const auto &cfg : configs) {
+		double secs = run(directory, cfg.html, cfg.text);
+		fmt::print("{:<12} {:8.1f} ms  {:6.0f} ns/message\n", cfg.name, secs * 1e3, secs * 1e9 / message_count);
+	}
+	return 0;
+}
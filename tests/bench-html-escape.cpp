@@ -0,0 +1,108 @@
+
+#include <diagnostics/diagnostics.h>
+
+#include <fmt/format.h>
+
+#include <chrono>
+#include <random>
+
+
+// Compares `escape_html()` (SIMD scanning for characters to escape plus UTF-8 validation, bulk copies of
+// the clean runs) with a naive loop which looks at every character in turn, on tesseract-like debug output:
+// box coordinates and comparisons, mostly ASCII with some valid multi-byte UTF-8 and the occasional invalid
+// byte sequence. Both must produce identical output.
+
+using namespace diagnostics;
+
+static void escape_html_naive(std::string_view text, std::string &out) {
+	size_t i = 0;
+	while (i < text.size()) {
+		char ch = text[i];
+		switch (ch) {
+		case '<':
+			out += "&lt;";
+			i++;
+			continue;
+		case '>':
+			out += "&gt;";
+			i++;
+			continue;
+		case '&':
+			out += "&amp;";
+			i++;
+			continue;
+		case '"':
+			out += "&quot;";
+			i++;
+			continue;
+		default:
+			break;
+		}
+		size_t len = driver::utf8_sequence_length(text.substr(i));
+		if (len == 0) {
+			out += driver::utf8_replacement_character;
+			i++;
+		} else {
+			out.append(text.data() + i, len);
+			i += len;
+		}
+	}
+}
+
+static std::vector<std::string> make_corpus(size_t lines) {
+	static const char *const words[] = {"Blob", "box", "conf", "word", "\xC3\xA9t\xC3\xA9", "\xE2\x80\x9Cquoted\xE2\x80\x9D", "\xE6\x96\x87\xE5\xAD\x97", "baseline", "x-height", "\xF0\x9F\x93\x84"};
+	std::mt19937 rng(42);
+	std::vector<std::string> corpus;
+	corpus.reserve(lines);
+	for (size_t i = 0; i < lines; i++) {
+		std::string line = fmt::format("{} ({},{})->({},{}) {} {} ", words[rng() % 10], rng() % 2000, rng() % 3000, rng() % 2000, rng() % 3000, rng() % 2 ? "conf<0.75" : "conf>=0.75", rng() % 3 ? "&& kept" : "rejected");
+		for (int w = 0; w < 4; w++)
+			line += fmt::format("{}:{:.2f} ", words[rng() % 10], (rng() % 10000) / 100.0);
+		if (rng() % 50 == 0)
+			line += "\xC3(\xFF\xE2\x82";      // invalid UTF-8, as recognized text occasionally has
+		corpus.push_back(std::move(line));
+	}
+	return corpus;
+}
+
+template <typename Escape>
+static double run(const std::vector<std::string> &corpus, int rounds, std::string &out, Escape escape) {
+	auto t0 = std::chrono::steady_clock::now();
+	for (int r = 0; r < rounds; r++) {
+		out.clear();
+		for (const auto &line : corpus)
+			escape(line, out);
+	}
+	auto t1 = std::chrono::steady_clock::now();
+	return std::chrono::duration<double>(t1 - t0).count();
+}
+
+
+#if defined(BUILD_MONOLITHIC)
+#define main diagnostics_bench_html_escape_main
+#endif
+
+int main(void) {
+	const auto corpus = make_corpus(100000);
+	size_t bytes = 0;
+	for (const auto &line : corpus)
+		bytes += line.size();
+	const int rounds = 20;
+
+	std::string naive, simd;
+	naive.reserve(bytes * 2);
+	simd.reserve(bytes * 2);
+	double t_naive = run(corpus, rounds, naive, escape_html_naive);
+	double t_simd = run(corpus, rounds, simd, driver::escape_html);
+
+	if (naive != simd) {
+		fmt::print("MISMATCH: the SIMD and naive escapers disagree\n");
+		return 1;
+	}
+
+	double mb = double(bytes) * rounds / 1e6;
+	fmt::print("input: {} lines, {:.1f} MB\n", corpus.size(), bytes / 1e6);
+	fmt::print("naive: {:8.1f} MB/s\n", mb / t_naive);
+	fmt::print("simd:  {:8.1f} MB/s  ({:.1f}x)\n", mb / t_simd, t_naive / t_simd);
+	return 0;
+}
@@ -0,0 +1,133 @@
+
+#include <diagnostics/diagnostics.h>
+
+#include <OpenImageIO/imageio.h>
+#include <fmt/format.h>
+
+#include <algorithm>
+#include <chrono>
+#include <filesystem>
+
+
+// Compares the ways of writing a float RGB diagnostics image with OpenImageIO: the per-pixel loop of the
+// original OpenImageIO driver (three `write_scanline()` calls per pixel, here with a valid row buffer so it
+// is at least memory-safe), one `write_scanline()` per row from a row copy, and `oiio_write()`: a single
+// `write_image()` call straight from the caller's buffer, as scanlines and as tiles, plus one channel of
+// the interleaved buffer described by strides.
+//
+// The per-pixel loop is timed on a small image only: on a page-size image it would take hours. As it
+// writes every scanline over and over, the file formats which insist on sequential scanlines may report
+// it as FAILED: the original loop never produced a valid file either.
+
+using namespace diagnostics;
+using namespace diagnostics::driver::image;
+
+template <typename Write>
+static void run(const char *name, size_t bytes, Write write) {
+	auto t0 = std::chrono::steady_clock::now();
+	bool ok = write();
+	auto t1 = std::chrono::steady_clock::now();
+	double secs = std::chrono::duration<double>(t1 - t0).count();
+	fmt::print("{:<28} {:8.1f} ms  {:8.1f} MB/s{}\n", name, secs * 1e3, bytes / secs / 1e6, ok ? "" : "  (FAILED)");
+}
+
+static bool per_pixel_loop(const std::string &path, int width, int height, const std::vector<float> &row) {
+	auto out = OIIO::ImageOutput::create(path);
+	if (!out)
+		return false;
+	OIIO::ImageSpec spec(width, height, 3, OIIO::TypeDesc::FLOAT);
+	if (!out->open(path, spec))
+		return false;
+	bool ok = true;
+	for (int y = 0; y < height; ++y) {
+		for (int x = 0; x < width; ++x) {
+			ok &= out->write_scanline(y, 0, OIIO::TypeDesc::FLOAT, row.data());
+			ok &= out->write_scanline(y, 0, OIIO::TypeDesc::FLOAT, row.data());
+			ok &= out->write_scanline(y, 0, OIIO::TypeDesc::FLOAT, row.data());
+		}
+	}
+	return out->close() && ok;
+}
+
+static bool per_scanline(const std::string &path, int width, int height, const std::vector<float> &pixels) {
+	auto out = OIIO::ImageOutput::create(path);
+	if (!out)
+		return false;
+	OIIO::ImageSpec spec(width, height, 3, OIIO::TypeDesc::FLOAT);
+	spec.attribute("compression", "zips");
+	if (!out->open(path, spec))
+		return false;
+	std::vector<float> row(size_t(width) * 3);
+	bool ok = true;
+	for (int y = 0; y < height && ok; ++y) {
+		std::copy_n(pixels.begin() + size_t(y) * row.size(), row.size(), row.begin());
+		ok = out->write_scanline(y, 0, OIIO::TypeDesc::FLOAT, row.data());
+	}
+	return out->close() && ok;
+}
+
+static std::vector<float> make_pixels(int width, int height) {
+	std::vector<float> pixels(size_t(width) * height * 3);
+	for (int y = 0; y < height; y++) {
+		for (int x = 0; x < width; x++) {
+			float *px = &pixels[(size_t(y) * width + x) * 3];
+			px[0] = float(x) / width;
+			px[1] = float(y) / height;
+			px[2] = 0.5f + 0.25f * float((x * 7 + y * 13) % 17) / 17;
+		}
+	}
+	return pixels;
+}
+
+
+#if defined(BUILD_MONOLITHIC)
+#define main diagnostics_bench_oiio_write_main
+#endif
+
+int main(int argc, const char **argv) {
+	const std::filesystem::path directory = argc > 1 ? argv[1] : "bench-oiio-output";
+	std::filesystem::create_directories(directory);
+
+	{
+		const int width = 200, height = 150;
+		std::vector<float> row(size_t(width) * 3, 0.5f);
+		run("per-pixel loop (200x150)", size_t(width) * height * 3 * sizeof(float), [&] {
+			return per_pixel_loop((directory / "per-pixel.exr").string(), width, height, row);
+		});
+	}
+
+	const int width = 4096, height = 4096;
+	const std::vector<float> pixels = make_pixels(width, height);
+	const size_t bytes = pixels.size() * sizeof(float);
+	fmt::print("{}x{} float RGB, {:.1f} MB\n", width, height, bytes / 1e6);
+
+	run("per-scanline copy", bytes, [&] {
+		return per_scanline((directory / "per-scanline.exr").string(), width, height, pixels);
+	});
+
+	strided_image rgb;
+	rgb.data = pixels.data();
+	rgb.width = width;
+	rgb.height = height;
+	rgb.channels = 3;
+	rgb.type = pixel_type::float32;
+	oiio_write_options untiled;
+	untiled.tile_threshold = INT64_MAX;
+	run("write_image", bytes, [&] {
+		return oiio_write((directory / "write-image.exr").string(), rgb, untiled);
+	});
+	run("write_image, tiled", bytes, [&] {
+		return oiio_write((directory / "write-image-tiled.exr").string(), rgb);
+	});
+
+	// the green channel alone, straight out of the interleaved buffer:
+	strided_image green = rgb;
+	green.data = pixels.data() + 1;
+	green.channels = 1;
+	green.x_stride = 3 * sizeof(float);
+	green.y_stride = ptrdiff_t(width) * 3 * sizeof(float);
+	run("write_image, one channel", bytes / 3, [&] {
+		return oiio_write((directory / "write-image-green.exr").string(), green, untiled);
+	});
+	return 0;
+}
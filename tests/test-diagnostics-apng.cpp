@@ -0,0 +1,261 @@
+
+#include <diagnostics/diagnostics.h>
+
+#include "test-harness.h"
+
+#include <zlib.h>
+
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <random>
+
+
+// Animated PNG: frames collected in a frame store, part of them spilled to disk, and written as an APNG, which
+// is decoded here again: the chunk CRCs, the sequence numbers of fcTL and fdAT, and the frame rectangles,
+// composited over the frame before, which must give back every frame exactly. Returns the number of failed
+// checks.
+
+using namespace diagnostics::driver::image;
+
+static uint32_t get32(const uint8_t *p) {
+	return uint32_t(p[0]) << 24 | uint32_t(p[1]) << 16 | uint32_t(p[2]) << 8 | p[3];
+}
+
+static uint32_t get16(const uint8_t *p) {
+	return uint32_t(p[0]) << 8 | p[1];
+}
+
+static bool inflate_all(const std::vector<uint8_t> &in, std::vector<uint8_t> &out, size_t expected) {
+	out.resize(expected);
+	uLongf size = uLongf(expected);
+	return uncompress(out.data(), &size, in.data(), uLong(in.size())) == Z_OK && size == expected;
+}
+
+static uint8_t paeth(int a, int b, int c) {
+	int p = a + b - c;
+	int pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+	return uint8_t(pa <= pb && pa <= pc ? a : pb <= pc ? b : c);
+}
+
+// Undoes the filters of `rows` rows of `row_bytes` each, in place; false on an unknown filter type.
+static bool unfilter(std::vector<uint8_t> &data, int rows, size_t row_bytes, int bpp) {
+	std::vector<uint8_t> zero(row_bytes, 0);
+	const uint8_t *prev = zero.data();
+	for (int y = 0; y < rows; y++) {
+		uint8_t *p = data.data() + y * (row_bytes + 1);
+		uint8_t *row = p + 1;
+		for (size_t i = 0; i < row_bytes; i++) {
+			const int a = i >= size_t(bpp) ? row[i - bpp] : 0;
+			const int b = prev[i];
+			const int c = i >= size_t(bpp) ? prev[i - bpp] : 0;
+			switch (p[0]) {
+			case 0:
+				break;
+			case 1:
+				row[i] = uint8_t(row[i] + a);
+				break;
+			case 2:
+				row[i] = uint8_t(row[i] + b);
+				break;
+			case 3:
+				row[i] = uint8_t(row[i] + (a + b) / 2);
+				break;
+			case 4:
+				row[i] = uint8_t(row[i] + paeth(a, b, c));
+				break;
+			default:
+				return false;
+			}
+		}
+		prev = row;
+	}
+	return true;
+}
+
+struct apng_frame {
+	uint32_t width = 0, height = 0, x = 0, y = 0;
+	uint32_t delay_num = 0, delay_den = 0;
+	uint8_t dispose = 0, blend = 0;
+	std::vector<uint8_t> data;      // the deflated rows
+};
+
+struct apng {
+	uint32_t width = 0, height = 0;
+	uint8_t color_type = 0;
+	uint32_t frame_count = 0, plays = 0;
+	std::vector<apng_frame> frames;
+	bool ok = false;
+};
+
+// Splits the file into its chunks, and checks their order, CRCs and sequence numbers on the way.
+static apng parse(const std::string &file) {
+	apng rv;
+	const uint8_t *p = reinterpret_cast<const uint8_t *>(file.data());
+	const uint8_t *end = p + file.size();
+	if (file.size() < 8 || memcmp(p, "\x89PNG\r\n\x1A\n", 8) != 0)
+		return rv;
+	p += 8;
+	uint32_t sequence = 0;
+	bool idat_seen = false, iend_seen = false;
+	while (p + 12 <= end && !iend_seen) {
+		const uint32_t size = get32(p);
+		if (size > size_t(end - p) - 12)
+			return rv;
+		const std::string type(reinterpret_cast<const char *>(p + 4), 4);
+		const uint8_t *data = p + 8;
+		if (crc32(0, p + 4, uInt(size + 4)) != get32(data + size))
+			return rv;
+		p += size + 12;
+
+		if (type == "IHDR") {
+			if (size != 13 || data[8] != 8)
+				return rv;
+			rv.width = get32(data);
+			rv.height = get32(data + 4);
+			rv.color_type = data[9];
+		} else if (type == "acTL") {
+			if (size != 8 || !rv.frames.empty())
+				return rv;
+			rv.frame_count = get32(data);
+			rv.plays = get32(data + 4);
+		} else if (type == "fcTL") {
+			if (size != 26 || get32(data) != sequence++)
+				return rv;
+			apng_frame f;
+			f.width = get32(data + 4);
+			f.height = get32(data + 8);
+			f.x = get32(data + 12);
+			f.y = get32(data + 16);
+			f.delay_num = get16(data + 20);
+			f.delay_den = get16(data + 22);
+			f.dispose = data[24];
+			f.blend = data[25];
+			rv.frames.push_back(std::move(f));
+		} else if (type == "IDAT") {
+			// the first frame is the default image.
+			if (rv.frames.size() != 1)
+				return rv;
+			idat_seen = true;
+			rv.frames.back().data.insert(rv.frames.back().data.end(), data, data + size);
+		} else if (type == "fdAT") {
+			if (size < 4 || rv.frames.size() < 2 || get32(data) != sequence++)
+				return rv;
+			rv.frames.back().data.insert(rv.frames.back().data.end(), data + 4, data + size);
+		} else if (type == "IEND") {
+			iend_seen = size == 0;
+		} else {
+			return rv;
+		}
+	}
+	rv.ok = iend_seen && p == end && idat_seen && rv.frame_count == rv.frames.size();
+	return rv;
+}
+
+// Composites the frames in order, and compares the canvas with the expected frame after each.
+static bool plays_back(const apng &a, const std::vector<std::vector<uint8_t>> &expected, int channels) {
+	if (!a.ok || a.frames.size() != expected.size())
+		return false;
+	std::vector<uint8_t> canvas(size_t(a.width) * a.height * channels, 0);
+	for (size_t i = 0; i < a.frames.size(); i++) {
+		const apng_frame &f = a.frames[i];
+		if (f.dispose != 0 || f.blend != 0 || f.width == 0 || f.height == 0 || f.x + f.width > a.width || f.y + f.height > a.height)
+			return false;
+		if (i == 0 && (f.x != 0 || f.y != 0 || f.width != a.width || f.height != a.height))
+			return false;
+		const size_t row_bytes = size_t(f.width) * channels;
+		std::vector<uint8_t> rows;
+		if (!inflate_all(f.data, rows, (row_bytes + 1) * f.height) || !unfilter(rows, int(f.height), row_bytes, channels))
+			return false;
+		for (uint32_t y = 0; y < f.height; y++)
+			memcpy(canvas.data() + (size_t(f.y + y) * a.width + f.x) * channels, rows.data() + y * (row_bytes + 1) + 1, row_bytes);
+		if (canvas != expected[i])
+			return false;
+	}
+	return true;
+}
+
+
+#if defined(BUILD_MONOLITHIC)
+#define main diagnostics_test_apng_main
+#endif
+
+int main(void) {
+	std::filesystem::path dir = std::filesystem::temp_directory_path() / "libdiag-test-apng";
+	std::filesystem::remove_all(dir);
+	std::filesystem::create_directories(dir);
+
+	std::mt19937 rng(5);
+	for (int channels : {1, 3, 4}) {
+		const int w = 53, h = 29;
+		const size_t frame_bytes = size_t(w) * h * channels;
+
+		// noise, then small edits: a block, nothing at all, a single pixel in a corner, everything.
+		std::vector<std::vector<uint8_t>> expected;
+		std::vector<uint8_t> pixels(frame_bytes);
+		for (auto &v : pixels)
+			v = uint8_t(rng());
+		for (int i = 0; i < 9; i++) {
+			switch (i % 4) {
+			case 1:
+				for (int y = 3; y < 11; y++)
+					memset(pixels.data() + (size_t(y) * w + 20) * channels, i * 17, size_t(9) * channels);
+				break;
+			case 2:
+				break;
+			case 3:
+				pixels[frame_bytes - 1] ^= 0x40;
+				break;
+			default:
+				if (i)
+					for (auto &v : pixels)
+						v = uint8_t(v + 1);
+				break;
+			}
+			expected.push_back(pixels);
+		}
+
+		// all but three frames go to the spill file.
+		frame_store frames(w, h, channels, 3, (dir / "frames.spill").string());
+		for (const auto &f : expected)
+			CHECK(frames.add(raster{f.data(), w, h, channels, size_t(w) * channels}));
+		CHECK(frames.size() == expected.size() && frames.spilled() == expected.size() - 3);
+		CHECK(std::filesystem::exists(dir / "frames.spill"));
+
+		const std::string path = (dir / "a.png").string();
+		CHECK(write_apng(path, w, h, channels, frames.size(), [&](size_t i) {
+			return frames.frame(i);
+		}, 100));
+		apng a = parse(read_file(path));
+		CHECK(a.ok);
+		CHECK(a.width == uint32_t(w) && a.height == uint32_t(h) && a.plays == 0);
+		CHECK(a.color_type == (channels == 1 ? 0 : channels == 3 ? 2 : 6));
+		CHECK(plays_back(a, expected, channels));
+		if (a.ok) {
+			// only the block changed, and the unchanged frame is a single pixel.
+			CHECK(a.frames[1].x == 20 && a.frames[1].y == 3 && a.frames[1].width == 9 && a.frames[1].height == 8);
+			CHECK(a.frames[2].width == 1 && a.frames[2].height == 1);
+			CHECK(a.frames[3].x == uint32_t(w - 1) && a.frames[3].y == uint32_t(h - 1) && a.frames[3].width == 1);
+			CHECK(a.frames[0].delay_num == 100 && a.frames[0].delay_den == 1000 && a.frames.back().delay_num == 1000);
+		}
+
+		frames.clear();
+		CHECK(!std::filesystem::exists(dir / "frames.spill"));
+	}
+
+	// a frame which does not match the animation is refused.
+	{
+		std::vector<uint8_t> pixels(16 * 16, 0);
+		const std::string path = (dir / "b.png").string();
+		CHECK(!write_apng(path, 16, 16, 1, 2, [&](size_t i) {
+			return raster{pixels.data(), 16, i ? 8 : 16, 1, 16};
+		}, 100));
+		CHECK(!write_apng(path, 16, 16, 5, 1, [&](size_t) {
+			return raster{pixels.data(), 16, 16, 1, 16};
+		}, 100));
+	}
+
+	std::filesystem::remove_all(dir);
+
+	return test_result();
+}
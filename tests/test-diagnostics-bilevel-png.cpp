@@ -0,0 +1,189 @@
+
+#include <diagnostics/diagnostics.h>
+
+#include "test-harness.h"
+
+#include <zlib.h>
+
+#include <cstring>
+#include <random>
+#include <thread>
+
+
+// Bilevel PNG: the strips which are deflated in parallel join into one zlib stream, which must inflate to the
+// same filtered rows as the single-strip encoding, and those rows to the pixels of the mask; also with several
+// callers sharing the strip pool at once. Returns the number of failed checks.
+
+using namespace diagnostics::driver::image;
+
+static uint32_t get32(const uint8_t *p) {
+	return uint32_t(p[0]) << 24 | uint32_t(p[1]) << 16 | uint32_t(p[2]) << 8 | p[3];
+}
+
+// The concatenated IDAT data of a PNG file, after checking the chunk CRCs; empty on failure.
+static std::vector<uint8_t> idat_data(const std::vector<uint8_t> &png, uint32_t &width, uint32_t &height) {
+	std::vector<uint8_t> rv;
+	if (png.size() < 8 || memcmp(png.data(), "\x89PNG\r\n\x1A\n", 8) != 0)
+		return {};
+	for (size_t p = 8; p + 12 <= png.size();) {
+		const uint32_t size = get32(&png[p]);
+		if (size > png.size() - p - 12 || crc32(0, &png[p + 4], uInt(size + 4)) != get32(&png[p + 8 + size]))
+			return {};
+		const uint8_t *data = &png[p + 8];
+		if (memcmp(&png[p + 4], "IHDR", 4) == 0) {
+			// 1 bit gray, no interlacing.
+			if (data[8] != 1 || data[9] != 0 || data[12] != 0)
+				return {};
+			width = get32(data);
+			height = get32(data + 4);
+		} else if (memcmp(&png[p + 4], "IDAT", 4) == 0) {
+			rv.insert(rv.end(), data, data + size);
+		} else if (memcmp(&png[p + 4], "IEND", 4) == 0) {
+			return p + 12 == png.size() ? rv : std::vector<uint8_t>();
+		}
+		p += size + 12;
+	}
+	return {};
+}
+
+// Inflates the image data, which must be complete and end exactly: the Adler-32 of the joined strips included.
+static bool inflate_all(const std::vector<uint8_t> &in, std::vector<uint8_t> &out, size_t expected) {
+	out.resize(expected);
+	uLongf size = uLongf(expected);
+	return !in.empty() && uncompress(out.data(), &size, in.data(), uLong(in.size())) == Z_OK && size == expected;
+}
+
+// The packed rows, with the None and Up filters undone; false on any other filter type.
+static bool unfilter(const std::vector<uint8_t> &filtered, size_t row_bytes, int height, std::vector<uint8_t> &rows) {
+	rows.assign(row_bytes * height, 0);
+	for (int y = 0; y < height; y++) {
+		const uint8_t *f = filtered.data() + y * (row_bytes + 1);
+		uint8_t *row = rows.data() + y * row_bytes;
+		if (f[0] > 2 || f[0] == 1)
+			return false;
+		for (size_t i = 0; i < row_bytes; i++)
+			row[i] = uint8_t(f[i + 1] + (f[0] == 2 && y > 0 ? row[i - row_bytes] : 0));
+	}
+	return true;
+}
+
+// The mask packed the PNG way: MSB-first, nonzero is 1, zero padding.
+static std::vector<uint8_t> pack(const std::vector<uint8_t> &mask, int width, int height) {
+	const size_t row_bytes = (size_t(width) + 7) / 8;
+	std::vector<uint8_t> rv(row_bytes * height, 0);
+	for (int y = 0; y < height; y++)
+		for (int x = 0; x < width; x++)
+			if (mask[size_t(y) * width + x])
+				rv[y * row_bytes + x / 8] |= uint8_t(0x80 >> (x % 8));
+	return rv;
+}
+
+// A page-like mask: blocks of "text" with random noise, white margins, and some rows which repeat.
+static std::vector<uint8_t> make_mask(int width, int height, std::mt19937 &rng) {
+	std::vector<uint8_t> mask(size_t(width) * height, 0);
+	for (int y = 0; y < height; y++) {
+		uint8_t *row = mask.data() + size_t(y) * width;
+		if (y % 97 < 20)
+			continue;
+		if (y > 0 && y % 13 == 0) {
+			memcpy(row, row - width, width);
+			continue;
+		}
+		for (int x = 0; x < width; x++)
+			row[x] = (x > width / 10 && x < width - width / 10 && rng() % 5 == 0) ? 255 : 0;
+	}
+	return mask;
+}
+
+struct decoded {
+	std::vector<uint8_t> filtered;
+	std::vector<uint8_t> rows;
+	bool ok = false;
+};
+
+static decoded decode(const std::vector<uint8_t> &png, int width, int height) {
+	decoded rv;
+	uint32_t w = 0, h = 0;
+	const std::vector<uint8_t> data = idat_data(png, w, h);
+	const size_t row_bytes = (size_t(width) + 7) / 8;
+	rv.ok = w == uint32_t(width) && h == uint32_t(height) && inflate_all(data, rv.filtered, (row_bytes + 1) * height) && unfilter(rv.filtered, row_bytes, height, rv.rows);
+	return rv;
+}
+
+
+#if defined(BUILD_MONOLITHIC)
+#define main diagnostics_test_bilevel_png_main
+#endif
+
+int main(void) {
+	std::mt19937 rng(3);
+
+	// one strip against several, at widths with and without padding bits.
+	for (int width : {1203, 1600, 7}) {
+		const int height = 2100;
+		const std::vector<uint8_t> mask = make_mask(width, height, rng);
+		const bilevel_row_function rows = mask_bilevel_rows(mask.data(), width, width);
+		const std::vector<uint8_t> expected = pack(mask, width, height);
+
+		std::vector<uint8_t> single, multi;
+		bilevel_encode_stats one, many;
+		CHECK(encode_bilevel_png(width, height, rows, single, &one, 1));
+		CHECK(encode_bilevel_png(width, height, rows, multi, &many, 8));
+		CHECK(one.strips == 1 && many.strips == 8);
+		CHECK(one.input_bytes == expected.size() && many.input_bytes == expected.size());
+		CHECK(many.output_bytes == multi.size());
+
+		const decoded a = decode(single, width, height);
+		const decoded b = decode(multi, width, height);
+		CHECK(a.ok && b.ok);
+		// the rows are filtered the same, whichever strip they are in.
+		CHECK(a.filtered == b.filtered);
+		CHECK(a.rows == expected && b.rows == expected);
+	}
+
+	// a small image is one strip, whatever is asked for.
+	{
+		const int width = 100, height = 300;
+		const std::vector<uint8_t> mask = make_mask(width, height, rng);
+		std::vector<uint8_t> png;
+		bilevel_encode_stats stats;
+		CHECK(encode_bilevel_png(width, height, mask_bilevel_rows(mask.data(), width, width), png, &stats, 0));
+		CHECK(stats.strips == 1);
+		CHECK(decode(png, width, height).rows == pack(mask, width, height));
+	}
+
+	// several callers at once, as from the workers of an image pool, share the strip pool.
+	{
+		const int width = 2000, height = 3000;
+		const std::vector<uint8_t> mask = make_mask(width, height, rng);
+		const std::vector<uint8_t> expected = pack(mask, width, height);
+		std::vector<uint8_t> reference;
+		CHECK(encode_bilevel_png(width, height, mask_bilevel_rows(mask.data(), width, width), reference, nullptr, 1));
+
+		std::vector<std::vector<uint8_t>> out(6);
+		std::vector<std::thread> callers;
+		for (auto &png : out)
+			callers.emplace_back([&] {
+				encode_bilevel_png(width, height, mask_bilevel_rows(mask.data(), width, width), png, nullptr, 4);
+			});
+		for (auto &t : callers)
+			t.join();
+		const decoded ref = decode(reference, width, height);
+		bool ok = ref.ok && ref.rows == expected;
+		for (const auto &png : out) {
+			const decoded d = decode(png, width, height);
+			ok = ok && d.ok && d.filtered == ref.filtered;
+		}
+		CHECK(ok);
+	}
+
+	// the mask detector.
+	{
+		std::vector<uint8_t> mask = {0, 255, 255, 0, 0, 255};
+		CHECK(is_bilevel_mask(mask.data(), 3, 3, 2));
+		mask[4] = 1;
+		CHECK(!is_bilevel_mask(mask.data(), 3, 3, 2));
+	}
+
+	return test_result();
+}
@@ -0,0 +1,65 @@
+
+#include <diagnostics/diagnostics.h>
+
+#include "test-harness.h"
+
+#include <random>
+
+
+// Content hashes: the AVX2, SSE2 and portable accumulators give the same hash, for data at every alignment and
+// with every length of tail, and across the scrambling of the accumulators; the data may come in pieces of any
+// size. Returns the number of failed checks.
+
+using namespace diagnostics::driver::image;
+
+static content_hash hash_of(content_hash_path path, const uint8_t *data, size_t size, size_t piece) {
+	content_hasher h(path);
+	for (size_t at = 0; at < size; at += piece)
+		h.update(data + at, std::min(piece, size - at));
+	return h.finish();
+}
+
+
+#if defined(BUILD_MONOLITHIC)
+#define main diagnostics_test_content_hash_main
+#endif
+
+int main(void) {
+	std::mt19937 rng(11);
+	// past 16 stripes, where the accumulators are scrambled for the first time.
+	std::vector<uint8_t> data(3000);
+	for (auto &v : data)
+		v = uint8_t(rng());
+
+	const content_hash_path paths[] = {content_hash_path::avx2, content_hash_path::sse2, content_hash_path::portable};
+	bool same = true, pieces = true, distinct = true;
+	content_hash previous;
+	for (size_t at = 0; at < 32; at += 3) {
+		for (size_t size = 0; at + size <= data.size(); size += 1 + size / 5) {
+			const content_hash reference = hash_of(content_hash_path::best, data.data() + at, size, size + 1);
+			for (content_hash_path path : paths)
+				same = same && hash_of(path, data.data() + at, size, size + 1) == reference;
+			pieces = pieces && hash_of(content_hash_path::portable, data.data() + at, size, 1 + size % 97) == reference;
+			distinct = distinct && !reference.empty() && reference != previous;
+			previous = reference;
+		}
+	}
+	CHECK(same);
+	CHECK(pieces);
+	CHECK(distinct);
+
+	// the same bytes, at two alignments.
+	{
+		std::vector<uint8_t> shifted(data.size() + 5);
+		std::copy(data.begin(), data.end(), shifted.begin() + 5);
+		for (content_hash_path path : paths)
+			CHECK(hash_of(path, shifted.data() + 5, data.size(), data.size()) == hash_of(content_hash_path::best, data.data(), data.size(), 1000));
+	}
+
+	CHECK(content_hash_path_available(content_hash_path::best) && content_hash_path_available(content_hash_path::portable));
+#if defined(__SSE2__) || defined(_M_X64)
+	CHECK(content_hash_path_available(content_hash_path::sse2));
+#endif
+
+	return test_result();
+}
@@ -0,0 +1,176 @@
+
+#include <diagnostics/diagnostics.h>
+
+#include "test-harness.h"
+
+#include <cstring>
+#include <filesystem>
+#include <random>
+
+
+// Image sequences: the frame deltas, encoded in pieces of any size and applied to the frame before, must give
+// back the frame exactly; malformed deltas, and deltas which run past the frame, are refused. A sequence fed
+// through the image pool writes the same file. Returns the number of failed checks.
+
+using namespace diagnostics::driver::image;
+
+// The delta from `previous` to `current`, encoded in pieces of random size; `previous` becomes `current`.
+static std::vector<uint8_t> encode(std::vector<uint8_t> &previous, const std::vector<uint8_t> &current, std::mt19937 &rng, size_t &changed) {
+	std::vector<uint8_t> out;
+	size_t skip = 0;
+	changed = 0;
+	for (size_t at = 0; at < current.size();) {
+		size_t n = std::min<size_t>(current.size() - at, rng() % 300);
+		changed += encode_frame_delta(previous.data() + at, current.data() + at, n, skip, out);
+		at += n;
+	}
+	return out;
+}
+
+static size_t differences(const std::vector<uint8_t> &a, const std::vector<uint8_t> &b) {
+	size_t n = 0;
+	for (size_t i = 0; i < a.size(); i++)
+		n += a[i] != b[i];
+	return n;
+}
+
+
+#if defined(BUILD_MONOLITHIC)
+#define main diagnostics_test_frame_delta_main
+#endif
+
+int main(void) {
+	std::mt19937 rng(11);
+
+	// random edits of a frame: scattered bytes, runs of one value and runs of noise, near the ends too.
+	{
+		const size_t size = 5000;
+		std::vector<uint8_t> shown(size, 0), previous(size, 0), current(size, 0);
+		bool ok = true;
+		for (int frame = 0; frame < 200; frame++) {
+			switch (frame % 4) {
+			case 0:
+				for (int k = 0; k < 20; k++)
+					current[rng() % size] = uint8_t(rng());
+				break;
+			case 1: {
+				size_t at = rng() % size, n = std::min<size_t>(size - at, rng() % 200);
+				memset(current.data() + at, int(rng() & 0xFF), n);
+				break;
+			}
+			case 2: {
+				size_t at = rng() % size, n = std::min<size_t>(size - at, rng() % 200);
+				for (size_t i = 0; i < n; i++)
+					current[at + i] = uint8_t(rng());
+				break;
+			}
+			default:
+				current.front() ^= 1;
+				current.back() ^= 0x80;
+				break;
+			}
+			const size_t expected = differences(previous, current);
+			size_t changed;
+			std::vector<uint8_t> delta = encode(previous, current, rng, changed);
+			ok = ok && changed == expected && previous == current;
+			ok = ok && apply_frame_delta(delta.data(), delta.size(), shown.data(), size) && shown == current;
+		}
+		CHECK(ok);
+
+		// applied twice, a delta cancels out.
+		std::vector<uint8_t> before = previous;
+		for (int k = 0; k < 300; k++)
+			current[rng() % size] = uint8_t(rng());
+		size_t changed;
+		std::vector<uint8_t> delta = encode(previous, current, rng, changed);
+		CHECK(apply_frame_delta(delta.data(), delta.size(), shown.data(), size) && shown == current);
+		CHECK(apply_frame_delta(delta.data(), delta.size(), shown.data(), size) && shown == before);
+	}
+
+	// an unchanged frame has an empty delta, however it is cut into pieces.
+	{
+		std::vector<uint8_t> previous(1000, 9), current(1000, 9);
+		size_t changed;
+		CHECK(encode(previous, current, rng, changed).empty() && changed == 0);
+		CHECK(apply_frame_delta(nullptr, 0, previous.data(), previous.size()));
+	}
+
+	// a run of one value is a fill token.
+	{
+		std::vector<uint8_t> previous(100, 0), current(100, 0);
+		memset(current.data() + 10, 0x55, 40);
+		size_t skip = 0;
+		std::vector<uint8_t> delta;
+		CHECK(encode_frame_delta(previous.data(), current.data(), 100, skip, delta) == 40);
+		// 40 << 2 | 2 takes two LEB128 bytes.
+		CHECK(delta == std::vector<uint8_t>({10 << 2 | 0, 0xA2, 0x01, 0x55}));
+	}
+
+	// malformed deltas.
+	{
+		std::vector<uint8_t> frame(16, 0);
+		const uint8_t past_end[] = {17 << 2 | 0};
+		CHECK(!apply_frame_delta(past_end, sizeof(past_end), frame.data(), frame.size()));
+		const uint8_t short_literal[] = {4 << 2 | 1, 1, 2, 3};
+		CHECK(!apply_frame_delta(short_literal, sizeof(short_literal), frame.data(), frame.size()));
+		const uint8_t no_fill_byte[] = {4 << 2 | 2};
+		CHECK(!apply_frame_delta(no_fill_byte, sizeof(no_fill_byte), frame.data(), frame.size()));
+		const uint8_t bad_kind[] = {1 << 2 | 3};
+		CHECK(!apply_frame_delta(bad_kind, sizeof(bad_kind), frame.data(), frame.size()));
+		const uint8_t truncated[] = {0x80};
+		CHECK(!apply_frame_delta(truncated, sizeof(truncated), frame.data(), frame.size()));
+		const uint8_t too_long[] = {0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0};
+		CHECK(!apply_frame_delta(too_long, sizeof(too_long), frame.data(), frame.size()));
+		const uint8_t fits[] = {8 << 2 | 0, 8 << 2 | 2, 0xFF};
+		CHECK(apply_frame_delta(fits, sizeof(fits), frame.data(), frame.size()));
+		CHECK(frame[7] == 0 && frame[8] == 0xFF && frame[15] == 0xFF);
+	}
+
+	// a sequence file: the frames go in, row by row, and the last one is kept.
+	{
+		std::filesystem::path dir = std::filesystem::temp_directory_path() / "libdiag-test-frame-delta";
+		std::filesystem::remove_all(dir);
+		std::filesystem::create_directories(dir);
+
+		const int w = 37, h = 11;
+		std::vector<uint8_t> pixels(size_t(w) * h * 3, 0);
+		raster img{pixels.data(), w, h, 3, size_t(w) * 3};
+		sequence_writer seq;
+		CHECK(seq.open((dir / "a.seq.js").string(), w, h, 3));
+		size_t changed;
+		CHECK(seq.append("black", img, changed) && changed == 0);
+		pixels[5] = 1;
+		pixels[pixels.size() - 1] = 2;
+		CHECK(seq.append("two \"dots\"", img, changed) && changed == 2);
+		CHECK(!seq.append("wrong size", raster{pixels.data(), w, h - 1, 3, size_t(w) * 3}, changed));
+		CHECK(seq.frames() == 2);
+		raster last = seq.last_frame();
+		CHECK(memcmp(last.row(0), pixels.data(), pixels.size()) == 0);
+		CHECK(seq.close());
+		CHECK(std::filesystem::file_size(dir / "a.seq.js") == seq.size());
+
+		// the same frames, queued to the image pool with little room: the same file, plus the thumbnail.
+		{
+			diagnostics::worker_pool pool(2, 4);
+			image_store images(pool, dir.string(), "");
+			std::fill(pixels.begin(), pixels.end(), 0);
+			{
+				queued_sequence queued(images, (dir / "b.seq.js").string(), (dir / "b.thumb.png").string(), 16, w, h, 3, 1);
+				CHECK(queued.accepts(img));
+				CHECK(queued.append("black", copy_frame(img)));
+				pixels[5] = 1;
+				pixels[pixels.size() - 1] = 2;
+				CHECK(queued.append("two \"dots\"", copy_frame(img)));
+				CHECK(!queued.append("wrong size", copy_frame(raster{pixels.data(), w, h - 1, 3, size_t(w) * 3})));
+				CHECK(queued.frames() == 2);
+			}
+			images.wait_idle();
+			CHECK(read_file(dir / "b.seq.js") == read_file(dir / "a.seq.js"));
+			CHECK(std::filesystem::exists(dir / "b.thumb.png"));
+		}
+
+		std::filesystem::remove_all(dir);
+	}
+
+	return test_result();
+}
@@ -0,0 +1,111 @@
+
+#include <diagnostics/diagnostics.h>
+
+#include "test-harness.h"
+
+#include <filesystem>
+
+
+// Streaming HTML output: after every flush, mid-section or not, the file is the document so far plus the closing
+// tags of the open sections and the footer, and it never shrinks; once closed, it is the complete document. Also
+// with a buffer so small that it runs full all the time, and with chunks larger than the buffer. Returns the
+// number of failed checks.
+
+using namespace diagnostics::driver;
+
+static const std::string section_end = "</details>\n";
+static const std::string footer = "</body>\n</html>\n";
+
+static size_t count(const std::string &s, const std::string &what) {
+	size_t n = 0;
+	for (size_t at = s.find(what); at != std::string::npos; at = s.find(what, at + 1))
+		n++;
+	return n;
+}
+
+struct snapshot {
+	std::string file;
+	uint64_t committed;
+	size_t depth;
+	bool flushed;           // by `flush()`: nothing is buffered
+};
+
+// Writes a session with nested sections to `path`, taking a snapshot of the file after every step.
+static std::vector<snapshot> write_session(const std::string &path, size_t buffer_size) {
+	std::vector<snapshot> rv;
+	html_writer html(buffer_size);
+	auto take = [&](bool flushed) {
+		rv.push_back({read_file(path), html.committed_size(), html.depth(), flushed});
+	};
+	CHECK(html.open(path, "trailer <test>"));
+	take(true);
+	for (int round = 0; round < 6; round++) {
+		CHECK(html.push_section(fmt::format("section {}", round)));
+		CHECK(html.write_line(spdlog::level::info, fmt::format("line {} & more", round)));
+		take(false);
+		CHECK(html.flush());
+		take(true);
+		CHECK(html.push_section("inner", fmt::format("inner-{}", round)));
+		CHECK(html.write_line(spdlog::level::warn, std::string(round * 40, 'w')));
+		// a chunk larger than a small buffer is written straight through.
+		CHECK(html.write_html("<p>" + std::string(300, 'h') + "</p>\n"));
+		take(false);
+		CHECK(html.flush());
+		take(true);
+		// popping two levels at once: the trailer gets shorter, but the content grows by more.
+		CHECK(html.pop_section());
+		if (round % 2)
+			CHECK(html.pop_section());
+		CHECK(html.flush());
+		take(true);
+	}
+	CHECK(html.close("<p>epilogue</p>\n"));
+	take(true);
+	return rv;
+}
+
+
+#if defined(BUILD_MONOLITHIC)
+#define main diagnostics_test_html_writer_main
+#endif
+
+int main(void) {
+	std::filesystem::path dir = std::filesystem::temp_directory_path() / "libdiag-test-html-writer";
+	std::filesystem::remove_all(dir);
+	std::filesystem::create_directories(dir);
+
+	for (size_t buffer_size : {size_t(64) << 10, size_t(64)}) {
+		const std::string path = (dir / "a.html").string();
+		const std::vector<snapshot> snapshots = write_session(path, buffer_size);
+		const std::string &document = snapshots.back().file;
+
+		// the complete document: three sections still open at the end are closed by `close()`.
+		CHECK(document.starts_with("<!DOCTYPE html>") && document.ends_with("<p>epilogue</p>\n" + footer));
+		CHECK(document.find("trailer &lt;test&gt;") != std::string::npos && document.find("line 5 &amp; more") != std::string::npos);
+		CHECK(count(document, "<details") == 12 && count(document, section_end) == 12 && count(document, footer) == 1);
+
+		bool prefix = true, trailer = true, balanced = true, grows = true;
+		for (size_t i = 0; i + 1 < snapshots.size(); i++) {
+			const snapshot &s = snapshots[i];
+			// everything committed is final.
+			prefix = prefix && s.file.size() >= s.committed && document.compare(0, s.committed, s.file, 0, s.committed) == 0;
+			// the rest is the trailer: closing tags and the footer, after an explicit flush for the current depth.
+			const std::string tail = s.file.substr(std::min<size_t>(s.committed, s.file.size()));
+			size_t closings = 0;
+			while (tail.compare(closings * section_end.size(), section_end.size(), section_end) == 0)
+				closings++;
+			trailer = trailer && tail.size() == closings * section_end.size() + footer.size() && tail.ends_with(footer) && (!s.flushed || closings == s.depth);
+			balanced = balanced && count(s.file, "<details") == count(s.file, section_end);
+			grows = grows && (i == 0 || s.file.size() >= snapshots[i - 1].file.size());
+		}
+		CHECK(prefix);
+		CHECK(trailer);
+		CHECK(balanced);
+		CHECK(grows);
+		CHECK(document.size() >= snapshots[snapshots.size() - 2].file.size());
+	}
+
+	std::filesystem::remove_all(dir);
+
+	return test_result();
+}
@@ -0,0 +1,115 @@
+
+#include <diagnostics/diagnostics.h>
+
+#include "test-harness.h"
+
+#include <cstring>
+#include <filesystem>
+
+
+// Image pack files: the captured rasters render to PNG files; an entry whose sizes the rest of the file cannot
+// hold, or with a depth a PIX cannot have, ends the pack as truncated, after the entries before it. Returns the
+// number of failed checks.
+
+using namespace diagnostics::driver::image;
+
+// Offsets of the fields in the 64-byte entry header.
+static constexpr size_t height_field = 16;
+static constexpr size_t depth_field = 20;
+static constexpr size_t wpl_field = 24;
+static constexpr size_t data_size_field = 56;
+
+static void put32(std::string &file, size_t at, uint32_t v) {
+	memcpy(&file[at], &v, 4);
+}
+
+static void put64(std::string &file, size_t at, uint64_t v) {
+	memcpy(&file[at], &v, 8);
+}
+
+static void write_file(const std::filesystem::path &path, const std::string &data) {
+	std::ofstream out(path, std::ios::binary);
+	out.write(data.data(), std::streamsize(data.size()));
+}
+
+
+#if defined(BUILD_MONOLITHIC)
+#define main diagnostics_test_image_pack_main
+#endif
+
+int main(void) {
+	std::filesystem::path dir = std::filesystem::temp_directory_path() / "libdiag-test-image-pack";
+	std::filesystem::remove_all(dir);
+	std::filesystem::create_directories(dir);
+
+	// two 8 bpp gray images of 20x10: 5 words per line.
+	std::vector<uint32_t> words(5 * 10);
+	for (size_t i = 0; i < words.size(); i++)
+		words[i] = uint32_t(i * 0x01030507u);
+	pix_raster pix;
+	pix.width = 20;
+	pix.height = 10;
+	pix.depth = 8;
+	pix.wpl = 5;
+	pix.data = words.data();
+
+	const std::filesystem::path pack = dir / "a.pack";
+	uint64_t first_entry = 0;
+	{
+		pix_pack_writer writer;
+		CHECK(writer.open(pack.string()));
+		CHECK(writer.append(pix, "a.png", "a.thumb.png"));
+		first_entry = writer.size();
+		CHECK(writer.append(pix, "b.png", "b.thumb.png"));
+		CHECK(writer.close());
+	}
+	const std::string good = read_file(pack);
+	CHECK(good.size() == first_entry + (first_entry - 8));
+
+	pix_pack_render_stats stats = render_pix_pack(pack.string(), 16, 2);
+	CHECK(stats.rendered == 2 && stats.failed == 0 && !stats.truncated);
+	CHECK(std::filesystem::exists(dir / "a.png") && std::filesystem::exists(dir / "b.thumb.png"));
+
+	// the second entry claims a raster of 2^31 - 1 rows: consistent, but far more than the file holds.
+	{
+		std::filesystem::remove(dir / "a.png");
+		std::string bad = good;
+		put32(bad, first_entry + height_field, INT32_MAX);
+		put64(bad, first_entry + data_size_field, uint64_t(INT32_MAX) * 5 * 4);
+		write_file(pack, bad);
+		stats = render_pix_pack(pack.string(), 16, 2);
+		CHECK(stats.rendered == 1 && stats.failed == 0 && stats.truncated);
+		CHECK(std::filesystem::exists(dir / "a.png"));
+	}
+
+	// the same with a line size which would wrap the data size.
+	{
+		std::string bad = good;
+		put32(bad, first_entry + wpl_field, 0x80000000u);
+		put32(bad, first_entry + height_field, 0x80000000u);
+		put64(bad, first_entry + data_size_field, 0);
+		write_file(pack, bad);
+		stats = render_pix_pack(pack.string(), 16, 2);
+		CHECK(stats.rendered == 1 && stats.truncated);
+	}
+
+	// a depth which a PIX cannot have.
+	{
+		std::string bad = good;
+		put32(bad, first_entry + depth_field, 12);
+		write_file(pack, bad);
+		stats = render_pix_pack(pack.string(), 16, 2);
+		CHECK(stats.rendered == 1 && stats.truncated);
+	}
+
+	// the file cut short in the raster of the second entry.
+	{
+		write_file(pack, good.substr(0, good.size() - 7));
+		stats = render_pix_pack(pack.string(), 16, 2);
+		CHECK(stats.rendered == 1 && stats.truncated);
+	}
+
+	std::filesystem::remove_all(dir);
+
+	return test_result();
+}
@@ -0,0 +1,231 @@
+
+#include <diagnostics/diagnostics.h>
+
+#include "test-harness.h"
+
+#include <zlib.h>
+
+#include <cstring>
+#include <filesystem>
+
+#if !defined(_WIN32)
+#include <sys/resource.h>
+#include <csignal>
+#endif
+
+
+// NumPy export: the `.npy` headers, `.npy` files, and `.npz` archives, read back with a minimal zip reader of
+// our own, which checks the central directory against the local headers and the CRCs against the data; also
+// after an append which failed half-way. Returns the number of failed checks.
+
+using namespace diagnostics::driver::blob;
+
+static uint32_t get16(const std::string &s, size_t at) {
+	return uint8_t(s[at]) | uint8_t(s[at + 1]) << 8;
+}
+
+static uint32_t get32(const std::string &s, size_t at) {
+	return get16(s, at) | get16(s, at + 2) << 16;
+}
+
+// The dictionary of a version 1.0 header, and whether the header is well-formed.
+static bool parse_header(const std::string &header, std::string &dict) {
+	if (header.size() < 10 || header.compare(0, 6, "\x93NUMPY") != 0 || header[6] != 1 || header[7] != 0)
+		return false;
+	size_t len = get16(header, 8);
+	if (10 + len != header.size() || header.size() % 64 != 0 || header.back() != '\n')
+		return false;
+	dict = header.substr(10, len);
+	while (!dict.empty() && (dict.back() == '\n' || dict.back() == ' '))
+		dict.pop_back();
+	return true;
+}
+
+struct zip_member {
+	std::string name;
+	std::string data;
+	bool ok = false;
+};
+
+// The members of a zip archive without compression, in the order of its central directory.
+static std::vector<zip_member> read_zip(const std::string &zip) {
+	std::vector<zip_member> rv;
+	if (zip.size() < 22 || get32(zip, zip.size() - 22) != 0x06054b50u)
+		return rv;
+	const size_t end = zip.size() - 22;
+	const uint32_t count = get16(zip, end + 10);
+	size_t p = get32(zip, end + 16);
+	if (p + get32(zip, end + 12) != end)
+		return rv;
+	for (uint32_t i = 0; i < count; i++) {
+		zip_member m;
+		if (get32(zip, p) != 0x02014b50u)
+			return rv;
+		const uint32_t version_needed = get16(zip, p + 6);
+		const uint32_t method = get16(zip, p + 10);
+		const uint32_t crc = get32(zip, p + 16);
+		const uint32_t size = get32(zip, p + 20);
+		const uint32_t name_size = get16(zip, p + 28);
+		const uint32_t extra_size = get16(zip, p + 30);
+		const uint32_t comment_size = get16(zip, p + 32);
+		const uint32_t offset = get32(zip, p + 42);
+		m.name = zip.substr(p + 46, name_size);
+		p += 46 + name_size + extra_size + comment_size;
+
+		// the local header repeats what the central directory says.
+		const size_t local = offset;
+		const size_t data = local + 30 + get16(zip, local + 26) + get16(zip, local + 28);
+		m.ok = get32(zip, local) == 0x04034b50u && get16(zip, local + 4) == version_needed && version_needed == 20 && method == 0 && get32(zip, local + 14) == crc && get32(zip, local + 18) == size && get32(zip, local + 22) == size && zip.compare(local + 30, name_size, m.name) == 0 && data + size <= end;
+		if (m.ok) {
+			m.data = zip.substr(data, size);
+			m.ok = crc32(0, reinterpret_cast<const Bytef *>(m.data.data()), uInt(size)) == crc && data % 64 == 0;
+		}
+		rv.push_back(std::move(m));
+	}
+	return rv;
+}
+
+
+#if defined(BUILD_MONOLITHIC)
+#define main diagnostics_test_npy_export_main
+#endif
+
+int main(void) {
+	// headers: padded to 64 bytes, a trailing comma for a single dimension, no dimensions for a scalar.
+	{
+		const float values[6] = {};
+		std::string dict;
+		CHECK(parse_header(npy_header(make_npy_array(std::span<const float>(values), {2, 3})), dict));
+		CHECK(dict == std::string("{'descr': '") + npy_descr<float>() + "', 'fortran_order': False, 'shape': (2, 3), }");
+		CHECK(parse_header(npy_header(make_npy_array(std::span<const float>(values))), dict));
+		CHECK(dict.find("'shape': (6,), }") != std::string::npos);
+		npy_array scalar = make_npy_array(std::span<const float>(values, 1));
+		scalar.shape.clear();
+		CHECK(parse_header(npy_header(scalar), dict));
+		CHECK(dict.find("'shape': (), }") != std::string::npos);
+	}
+
+	// the element types, in the byte order of this machine.
+	{
+		const char order = std::endian::native == std::endian::little ? '<' : '>';
+		CHECK(npy_descr<uint8_t>() == "|u1");
+		CHECK(npy_descr<bool>() == "|b1");
+		CHECK(npy_descr<int8_t>() == "|i1");
+		CHECK(npy_descr<uint16_t>() == std::string(1, order) + "u2");
+		CHECK(npy_descr<int32_t>() == std::string(1, order) + "i4");
+		CHECK(npy_descr<int64_t>() == std::string(1, order) + "i8");
+		CHECK(npy_descr<float>() == std::string(1, order) + "f4");
+		CHECK(npy_descr<double>() == std::string(1, order) + "f8");
+	}
+
+	// the chunks must hold the elements of the shape exactly.
+	{
+		const int16_t values[12] = {};
+		CHECK(make_npy_array(std::span<const int16_t>(values), {3, 4}).validate("ok"));
+		CHECK(!make_npy_array(std::span<const int16_t>(values), {5, 4}).validate("too few"));
+		CHECK(!make_npy_array(std::span<const int16_t>(values), {2, 4}).validate("too many"));
+		npy_array odd = make_npy_array(std::span<const int16_t>(values), {12});
+		odd.chunks[0] = odd.chunks[0].first(23);
+		CHECK(!odd.validate("half an element"));
+	}
+
+	std::filesystem::path dir = std::filesystem::temp_directory_path() / "libdiag-test-npy-export";
+	std::filesystem::remove_all(dir);
+	std::filesystem::create_directories(dir);
+
+	// a `.npy` file is the header, then the elements.
+	{
+		std::vector<double> values(100);
+		for (size_t i = 0; i < values.size(); i++)
+			values[i] = i * 0.5;
+		npy_array a = make_npy_array(std::span<const double>(values), {10, 10});
+		CHECK(write_npy((dir / "a.npy").string(), a));
+		std::string file = read_file(dir / "a.npy");
+		std::string header = npy_header(a);
+		CHECK(file.size() == header.size() + values.size() * sizeof(double));
+		CHECK(file.compare(0, header.size(), header) == 0);
+		CHECK(memcmp(file.data() + header.size(), values.data(), values.size() * sizeof(double)) == 0);
+	}
+
+	// `.npz`: unique member names without directories, each member a `.npy` file, aligned to 64 bytes.
+	{
+		std::vector<int32_t> image(7 * 5);
+		for (size_t i = 0; i < image.size(); i++)
+			image[i] = int32_t(i * 1000003);
+		// the rows of a region, as one chunk each:
+		npy_array region;
+		region.descr = npy_descr<int32_t>();
+		region.shape = {3, 2};
+		for (int y = 1; y < 4; y++)
+			region.chunks.push_back(std::as_bytes(std::span<const int32_t>(image.data() + y * 5 + 1, 2)));
+		std::vector<uint8_t> mask(33, 1);
+
+		npz_writer npz;
+		CHECK(npz.open((dir / "b.npz").string()));
+		CHECK(npz.append("image", make_npy_array(std::span<const int32_t>(image), {7, 5})) == "image");
+		CHECK(npz.append("image", region) == "image#2");
+		npy_array m = make_npy_array(std::span<const uint8_t>(mask));
+		CHECK(npz.append("page/1\\mask", m, npz_writer::prepare(m)) == "page_1_mask");
+		CHECK(npz.append("", m) == "array");
+		CHECK(npz.close());
+
+		std::vector<zip_member> members = read_zip(read_file(dir / "b.npz"));
+		CHECK(members.size() == 4);
+		if (members.size() == 4) {
+			CHECK(members[0].name == "image.npy" && members[1].name == "image#2.npy" && members[2].name == "page_1_mask.npy" && members[3].name == "array.npy");
+			for (const auto &member : members)
+				CHECK(member.ok);
+
+			std::string dict;
+			const std::string &full = members[0].data;
+			CHECK(parse_header(full.substr(0, 10 + get16(full, 8)), dict) && dict.find("(7, 5)") != std::string::npos);
+			CHECK(full.size() == 10 + get16(full, 8) + image.size() * 4 && memcmp(full.data() + full.size() - image.size() * 4, image.data(), image.size() * 4) == 0);
+
+			const std::string &part = members[1].data;
+			const int32_t expected[6] = {image[6], image[7], image[11], image[12], image[16], image[17]};
+			CHECK(part.size() == 10 + get16(part, 8) + sizeof(expected) && memcmp(part.data() + part.size() - sizeof(expected), expected, sizeof(expected)) == 0);
+			CHECK(members[2].data == members[3].data);
+		}
+
+		// a member which does not validate is not added.
+		npz_writer bad;
+		CHECK(bad.open((dir / "c.npz").string()));
+		CHECK(bad.append("bad", make_npy_array(std::span<const int32_t>(image), {100})).empty());
+		CHECK(bad.close());
+		// just the end of central directory record:
+		CHECK(std::filesystem::file_size(dir / "c.npz") == 22);
+	}
+
+#if !defined(_WIN32)
+	// a member which does not fit under the file size limit fails half-way: the archive is cut back to the
+	// members before and after it.
+	{
+		std::vector<int32_t> big(64 * 1024), small(100);
+		for (size_t i = 0; i < small.size(); i++)
+			small[i] = int32_t(i);
+		rlimit saved{};
+		getrlimit(RLIMIT_FSIZE, &saved);
+		rlimit limit = saved;
+		limit.rlim_cur = 128 * 1024;
+		signal(SIGXFSZ, SIG_IGN);
+		CHECK(setrlimit(RLIMIT_FSIZE, &limit) == 0);
+
+		npz_writer npz;
+		CHECK(npz.open((dir / "d.npz").string()));
+		CHECK(npz.append("first", make_npy_array(std::span<const int32_t>(small))) == "first");
+		CHECK(npz.append("too big", make_npy_array(std::span<const int32_t>(big))).empty());
+		CHECK(npz.append("last", make_npy_array(std::span<const int32_t>(small))) == "last");
+		CHECK(npz.close());
+		setrlimit(RLIMIT_FSIZE, &saved);
+		signal(SIGXFSZ, SIG_DFL);
+
+		std::vector<zip_member> members = read_zip(read_file(dir / "d.npz"));
+		CHECK(members.size() == 2 && members[0].ok && members[1].ok && members[1].name == "last.npy");
+		CHECK(std::filesystem::file_size(dir / "d.npz") < 4096);
+	}
+#endif
+
+	std::filesystem::remove_all(dir);
+
+	return test_result();
+}
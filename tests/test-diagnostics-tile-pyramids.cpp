@@ -0,0 +1,102 @@
+
+#include <diagnostics/diagnostics.h>
+
+#include "test-harness.h"
+
+#include <filesystem>
+
+
+// Deep-zoom tile pyramids, short of libvips itself: the `section_filter` which selects the sections whose
+// page-size images get a pyramid (see `session_options::tile_pyramids`), the pyramid's location next to the
+// image, and the viewer link which `image_store` hands out. Returns the number of failed checks.
+
+using namespace diagnostics;
+using namespace diagnostics::driver::image;
+
+static bool matches(std::string_view pattern, std::string_view path) {
+	return section_filter(false).include(pattern).matches(path);
+}
+
+
+#if defined(BUILD_MONOLITHIC)
+#define main diagnostics_test_tile_pyramids_main
+#endif
+
+int main(void) {
+	// `*` stays within one title, `**` does not.
+	CHECK(matches("page/*", "page/1"));
+	CHECK(!matches("page/*", "page/1/ocr"));
+	CHECK(matches("page/**", "page/1/ocr"));
+	CHECK(matches("*/ocr", "page/ocr"));
+	CHECK(!matches("*/ocr", "book/page/ocr"));
+	CHECK(matches("**/ocr", "book/page/ocr"));
+	CHECK(matches("page*", "pages"));
+	CHECK(!matches("page*", "page/1"));
+
+	// a trailing `/**` also matches the section itself, but not a title it prefixes.
+	CHECK(matches("page/**", "page"));
+	CHECK(!matches("page/**", "pages"));
+
+	// `?` is a single character, other than '/'.
+	CHECK(matches("page/?", "page/7"));
+	CHECK(!matches("page/?", "page/12"));
+	CHECK(!matches("page?1", "page/1"));
+
+	// everything else matches literally, and entirely.
+	CHECK(matches("page/1", "page/1"));
+	CHECK(!matches("page/1", "page/10"));
+	CHECK(!matches("page/1", "page"));
+	CHECK(matches("", ""));
+	CHECK(!matches("", "page"));
+	CHECK(matches("**", ""));
+	CHECK(matches("**", "a/b/c"));
+
+	// the last matching pattern decides; no match: the default.
+	section_filter f = section_filter::parse("page/**,-page/*/ocr/**,+page/*/ocr/final");
+	CHECK(f.matches("page/1"));
+	CHECK(f.matches("page/1/layout"));
+	CHECK(!f.matches("page/1/ocr"));
+	CHECK(!f.matches("page/1/ocr/pass1"));
+	CHECK(f.matches("page/1/ocr/final"));
+	CHECK(!f.matches("book"));
+	CHECK(section_filter::parse("-page/**", true).matches("book"));
+	CHECK(!section_filter::parse("-page/**", true).matches("page/2"));
+
+	// an empty list selects nothing, or everything.
+	CHECK(section_filter(false).matches_nothing());
+	CHECK(!section_filter(true).matches_nothing());
+	CHECK(section_filter::parse("").matches_nothing());
+	CHECK(section_filter::parse("-page/**").matches_nothing());
+	CHECK(!section_filter::parse("page/**").matches_nothing());
+
+	// the pyramid goes next to the image, named after it.
+	CHECK(tile_pyramid_base("dir/000001-page.png") == "dir/000001-page");
+	CHECK(tile_pyramid_base("dir.v2/page") == "dir.v2/page");
+	CHECK(tile_pyramid_base("page") == "page");
+
+	// the image store links the thumbnail to the viewer, which it writes once per directory.
+	std::filesystem::path dir = std::filesystem::temp_directory_path() / "libdiag-test-tile-pyramids";
+	std::filesystem::remove_all(dir);
+	{
+		worker_pool pool(1);
+		image_store store(pool, dir.string(), "images/");
+		auto encode = [](const std::string &path, const std::function<void(const scanline_source &)> &make_thumbnail) {
+			raster_buffer img(4, 4, 1);
+			make_thumbnail(img.view());
+			return write_png(path, img.view());
+		};
+		stored_image plain = store.submit("plain", "png", 4, 4, encode);
+		stored_image page = store.submit("page 1", "png", 6000, 8000, encode, true, 512);
+		store.wait_idle();
+
+		CHECK(plain.viewer_url.empty());
+		CHECK(page.url == "images/000001-page_1.png");
+		CHECK(page.viewer_url == "images/tile-viewer.html#files=000001-page_1_files&w=6000&h=8000&tile=512");
+		CHECK(std::filesystem::is_regular_file(dir / "tile-viewer.html"));
+		CHECK(std::filesystem::is_regular_file(dir / "000001-page_1.thumb.png"));
+		CHECK(store.written() == 2 && store.failed() == 0);
+	}
+	std::filesystem::remove_all(dir);
+
+	return test_result();
+}
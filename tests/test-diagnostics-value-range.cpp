@@ -0,0 +1,190 @@
+
+#include <diagnostics/diagnostics.h>
+
+#include "test-harness.h"
+
+#include <cmath>
+#include <limits>
+#include <random>
+
+
+// Display scaling of images which are not 8-bit, and of the heatmaps of raw 2D arrays: the range of the
+// finite values, and the mapping of that range onto 0..255, at the edges of the ranges of all element types.
+// The SIMD kernels must agree with a scalar reference, also in the tails which do not fill a vector. Returns
+// the number of failed checks.
+
+using namespace diagnostics::driver::image;
+
+// rounds half to even, like the kernels.
+template <typename T>
+static uint8_t reference(T x, double offset, double scale) {
+	double v = (double(x) - offset) * scale;
+	return !(v > 0) ? 0 : !(v < 255) ? 255 : uint8_t(std::nearbyint(v));
+}
+
+template <typename T>
+static std::vector<uint8_t> scaled(const std::vector<T> &values) {
+	value_range range = value_kernels<T>::range(values.data(), values.size());
+	double offset, scale;
+	scale_for_range(range, offset, scale);
+	std::vector<uint8_t> out(values.size());
+	value_kernels<T>::to_8bit(values.data(), values.size(), out.data(), offset, scale);
+	return out;
+}
+
+// every value lands in its own bin: lo..lo+255 maps onto 0..255.
+template <typename T>
+static bool spreads(T lo) {
+	std::vector<T> values;
+	for (int i = 0; i < 256; i++)
+		values.push_back(T(lo + T(i)));
+	std::vector<uint8_t> out = scaled(values);
+	for (int i = 0; i < 256; i++) {
+		if (out[i] != i)
+			return false;
+	}
+	return true;
+}
+
+// the SIMD kernels against the scalar reference, for all lengths up to a few vectors.
+template <typename T, typename Gen>
+static bool matches_reference(Gen &&gen) {
+	std::mt19937 rng(7);
+	for (size_t n = 0; n < 40; n++) {
+		std::vector<T> values(n);
+		for (auto &v : values)
+			v = gen(rng);
+		value_range range = value_kernels<T>::range(values.data(), n);
+		double offset, scale;
+		scale_for_range(range, offset, scale);
+		std::vector<uint8_t> out(n);
+		value_kernels<T>::to_8bit(values.data(), n, out.data(), offset, scale);
+		for (size_t i = 0; i < n; i++) {
+			// float kernels round in float: allow for the difference at the halfway points.
+			int expected = reference(values[i], offset, scale);
+			if (std::abs(int(out[i]) - expected) > (sizeof(T) <= 2 || std::is_same_v<T, float> ? 1 : 0))
+				return false;
+		}
+	}
+	return true;
+}
+
+
+#if defined(BUILD_MONOLITHIC)
+#define main diagnostics_test_value_range_main
+#endif
+
+int main(void) {
+	const float nan = std::numeric_limits<float>::quiet_NaN();
+	const float inf = std::numeric_limits<float>::infinity();
+
+	// NaN and infinities do not take part in the range, in the vector loop nor in the tail.
+	{
+		std::vector<float> values = {nan, 3, inf, -inf, 1, 2, nan, 5, -inf, 4, nan};
+		value_range r = find_value_range(values.data(), values.size());
+		CHECK(r.count == 5 && r.min == 1 && r.max == 5);
+		std::vector<double> d = {-HUGE_VAL, 2.5, HUGE_VAL, std::nan("")};
+		r = find_value_range(d.data(), d.size());
+		CHECK(r.count == 1 && r.min == 2.5 && r.max == 2.5);
+		std::vector<float> none = {nan, inf, -inf};
+		CHECK(find_value_range(none.data(), none.size()).count == 0);
+		CHECK(find_value_range(none.data(), 0).count == 0);
+	}
+
+	// the extreme values of the integer types, across the SIMD lanes.
+	{
+		std::vector<int16_t> s16(19, 0);
+		s16[3] = INT16_MIN;
+		s16[17] = INT16_MAX;
+		value_range r = find_value_range(s16.data(), s16.size());
+		CHECK(r.min == INT16_MIN && r.max == INT16_MAX);
+		std::vector<uint16_t> u16(19, 1);
+		u16[9] = 0xFFFF;
+		r = find_value_range(u16.data(), u16.size());
+		CHECK(r.min == 1 && r.max == 0xFFFF);
+		std::vector<int32_t> s32(13, -5);
+		s32[0] = INT32_MIN;
+		s32[12] = INT32_MAX;
+		r = find_value_range(s32.data(), s32.size());
+		CHECK(r.min == INT32_MIN && r.max == INT32_MAX);
+		std::vector<uint8_t> u8(33, 7);
+		u8[31] = 255;
+		r = find_value_range(u8.data(), u8.size());
+		CHECK(r.min == 7 && r.max == 255);
+	}
+
+	// a constant image is black, or white when positive, like a mask; no finite values: black.
+	{
+		std::vector<float> zeros(10, 0.0f), ones(10, 1.0f), negatives(10, -3.0f), tiny(10, 1e-30f);
+		CHECK(scaled(zeros) == std::vector<uint8_t>(10, 0));
+		CHECK(scaled(ones) == std::vector<uint8_t>(10, 255));
+		CHECK(scaled(negatives) == std::vector<uint8_t>(10, 0));
+		CHECK(scaled(tiny) == std::vector<uint8_t>(10, 255));
+		std::vector<double> big(10, 1e300);
+		CHECK(scaled(big) == std::vector<uint8_t>(10, 255));
+		std::vector<float> none(10, nan);
+		CHECK(scaled(none) == std::vector<uint8_t>(10, 0));
+	}
+
+	// NaN comes out as 0, the infinities clamp.
+	{
+		std::vector<float> values = {0, 10, nan, inf, -inf, 5, 0, 10, nan, inf, -inf};
+		float offset, scale;
+		scale_for_range(find_value_range(values.data(), values.size()), offset, scale);
+		std::vector<uint8_t> out(values.size());
+		scale_to_8bit(values.data(), values.size(), out.data(), offset, scale);
+		CHECK(out == std::vector<uint8_t>({0, 255, 0, 255, 0, 128, 0, 255, 0, 255, 0}));
+		std::vector<double> d = {0, 10, std::nan(""), HUGE_VAL, -HUGE_VAL, 5, 0, 10, std::nan("")};
+		std::vector<uint8_t> dout = scaled(d);
+		CHECK(dout == std::vector<uint8_t>({0, 255, 0, 255, 0, 128, 0, 255, 0}));
+	}
+
+	// a narrow range far from zero keeps all its levels: float has only 24 bits of mantissa.
+	CHECK(spreads<int32_t>(1 << 30));
+	CHECK(spreads<int32_t>(INT32_MAX - 255));
+	CHECK(spreads<int32_t>(INT32_MIN));
+	CHECK(spreads<int64_t>(int64_t(1) << 50));
+	CHECK(spreads<uint32_t>(UINT32_MAX - 255));
+	CHECK(spreads<int16_t>(INT16_MIN));
+	CHECK(spreads<uint16_t>(0xFFFF - 255));
+	CHECK(spreads<uint8_t>(0));
+	{
+		std::vector<double> values;
+		for (int i = 0; i <= 20; i++)
+			values.push_back(1e9 + i / 20.0);
+		std::vector<uint8_t> out = scaled(values);
+		bool ok = out.front() == 0 && out.back() == 255;
+		for (size_t i = 1; i < out.size(); i++)
+			ok = ok && out[i] > out[i - 1];
+		CHECK(ok);
+	}
+
+	// the full range of the wide types.
+	{
+		std::vector<int32_t> values = {INT32_MIN, 0, INT32_MAX, -1, 1, INT32_MIN, INT32_MAX, 0, 0};
+		CHECK(scaled(values) == std::vector<uint8_t>({0, 128, 255, 128, 128, 0, 255, 128, 128}));
+		std::vector<double> d = {-1e308, 0, 1e308, -1e308, 1e308, 0, 0, 0, 0};
+		CHECK(scaled(d) == std::vector<uint8_t>({0, 128, 255, 0, 255, 128, 128, 128, 128}));
+	}
+
+	CHECK(matches_reference<float>([](std::mt19937 &rng) {
+		return std::uniform_real_distribution<float>(-1e3f, 1e3f)(rng);
+	}));
+	CHECK(matches_reference<double>([](std::mt19937 &rng) {
+		return 1e12 + std::uniform_real_distribution<double>(0, 1)(rng);
+	}));
+	CHECK(matches_reference<int32_t>([](std::mt19937 &rng) {
+		return int32_t(rng());
+	}));
+	CHECK(matches_reference<int16_t>([](std::mt19937 &rng) {
+		return int16_t(rng());
+	}));
+	CHECK(matches_reference<uint16_t>([](std::mt19937 &rng) {
+		return uint16_t(rng());
+	}));
+	CHECK(matches_reference<uint8_t>([](std::mt19937 &rng) {
+		return uint8_t(rng());
+	}));
+
+	return test_result();
+}
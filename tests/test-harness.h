@@ -0,0 +1,34 @@
+
+#pragma once
+
+// The checks of the test programs: each program counts its failed checks, prints the failed ones to stderr, and
+// returns the count from `main`.
+
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <string>
+
+static int failures = 0;
+
+static inline void check(bool ok, const char *what, int line) {
+	if (!ok) {
+		fprintf(stderr, "line %d: check failed: %s\n", line, what);
+		failures++;
+	}
+}
+
+#define CHECK(expr) check((expr), #expr, __LINE__)
+
+// The exit code of the test program.
+static inline int test_result() {
+	if (failures)
+		fprintf(stderr, "%d checks failed\n", failures);
+	return failures;
+}
+
+static inline std::string read_file(const std::filesystem::path &path) {
+	std::ifstream in(path, std::ios::binary);
+	return std::string(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+}
@@ -0,0 +1,172 @@
+
+#include <diagnostics/telemetry.h>
+
+#include "test-harness.h"
+
+#include <cstring>
+#include <filesystem>
+#include <random>
+
+
+// Record framing: the CRC32C check value, on the CPU instructions and on the slicing-by-8 tables; a segment cut
+// off in its last record, and segments with a record damaged in the middle, which `recover_records()` skips,
+// picking up again at the next record on the 8-byte grid. Returns the number of failed checks.
+
+using namespace diagnostics::binlog;
+
+struct frame {
+	size_t offset;
+	size_t size;
+};
+
+// Where the records of an intact segment are.
+static std::vector<frame> frames_of(const std::string &path) {
+	std::vector<frame> rv;
+	mapped_segment segment(path);
+	for (const record_view &record : segment) {
+		const std::byte *at = reinterpret_cast<const std::byte *>(&record.header());
+		rv.push_back({size_t(at - segment.bytes().data()), record.header().size});
+	}
+	return rv;
+}
+
+struct scan {
+	std::vector<uint32_t> iterated;         // sequence numbers, as the iterator sees them
+	std::vector<uint32_t> recovered;        // the same, as recovered
+	recovery_stats stats;
+};
+
+static scan scan_file(const std::filesystem::path &path, const std::string &bytes) {
+	{
+		std::ofstream out(path, std::ios::binary | std::ios::trunc);
+		out.write(bytes.data(), std::streamsize(bytes.size()));
+	}
+	scan rv;
+	mapped_segment segment(path.string());
+	for (const record_view &record : segment)
+		rv.iterated.push_back(record.sequence());
+	rv.stats = recover_records(segment, [&](const record_view &record) {
+		rv.recovered.push_back(record.sequence());
+	});
+	return rv;
+}
+
+// 0 .. count-1, without `skip`.
+static std::vector<uint32_t> sequence(uint32_t count, int64_t skip = -1) {
+	std::vector<uint32_t> rv;
+	for (uint32_t i = 0; i < count; i++)
+		if (int64_t(i) != skip)
+			rv.push_back(i);
+	return rv;
+}
+
+
+#if defined(BUILD_MONOLITHIC)
+#define main diagnostics_test_telemetry_record_framing_main
+#endif
+
+int main(void) {
+	// the CRC32C check value, both ways, and in pieces.
+	{
+		const char digits[] = "123456789";
+		CHECK(crc32c(0, digits, 9) == 0xE3069283u);
+		CHECK(crc32c_portable(0, digits, 9) == 0xE3069283u);
+		CHECK(crc32c(crc32c(0, digits, 4), digits + 4, 5) == 0xE3069283u);
+		CHECK(crc32c_portable(crc32c_portable(0, digits, 5), digits + 5, 4) == 0xE3069283u);
+		CHECK(crc32c(0, nullptr, 0) == 0 && crc32c_portable(0, nullptr, 0) == 0);
+
+		// the 8-byte loop and the byte tail, at every alignment.
+		std::mt19937 rng(7);
+		std::vector<uint8_t> data(300);
+		for (auto &v : data)
+			v = uint8_t(rng());
+		bool same = true;
+		for (size_t at = 0; at < 8; at++)
+			for (size_t size = 0; at + size <= data.size(); size += 1 + size / 8)
+				same = same && crc32c(0x1234u, data.data() + at, size) == crc32c_portable(0x1234u, data.data() + at, size);
+		CHECK(same);
+	}
+
+	std::filesystem::path dir = std::filesystem::temp_directory_path() / "libdiag-test-telemetry-record-framing";
+	std::filesystem::remove_all(dir);
+	std::filesystem::create_directories(dir);
+	const std::string base = (dir / "session").string();
+
+	const uint32_t count = 40;
+	{
+		segment_writer writer;
+		CHECK(writer.open(base, 1, 0));
+		for (uint32_t i = 0; i < count; i++) {
+			const double args[2] = {double(i), -1.5};
+			CHECK(writer.append(record_kind::text_line, 2, fmt::format("record {} {}", i, std::string(i % 11, '.')), "framing", std::span<const double>(args, i % 3)));
+		}
+		writer.close();
+	}
+	const std::string path = segment_path(base, 0);
+	const std::string intact = read_file(path);
+	const std::vector<frame> frames = frames_of(path);
+	CHECK(frames.size() == count);
+	if (frames.size() != count) {
+		std::filesystem::remove_all(dir);
+		return test_result();
+	}
+	const std::filesystem::path damaged = dir / "damaged.ldseg";
+
+	// intact: every record, no damage.
+	{
+		scan s = scan_file(damaged, intact);
+		CHECK(s.iterated == sequence(count) && s.recovered == sequence(count));
+		CHECK(s.stats.records == count && s.stats.damaged_regions == 0 && s.stats.skipped_bytes == 0);
+	}
+
+	// cut off in the middle of the last record: both stop before it, and the tail is one damaged region.
+	{
+		const frame &last = frames.back();
+		const size_t cut = last.offset + last.size / 2 + 3;
+		scan s = scan_file(damaged, intact.substr(0, cut));
+		CHECK(s.iterated == sequence(count - 1) && s.recovered == sequence(count - 1));
+		CHECK(s.stats.damaged_regions == 1 && s.stats.skipped_bytes == cut - last.offset);
+	}
+
+	// a flipped bit in the message of a middle record: the iterator does not check the CRC, recovery drops the
+	// record, and resynchronizes on the next one.
+	{
+		const uint32_t k = 17;
+		std::string bytes = intact;
+		bytes[frames[k].offset + frames[k].size - 3] ^= 0x10;
+		scan s = scan_file(damaged, bytes);
+		CHECK(s.iterated == sequence(count));
+		CHECK(s.recovered == sequence(count, k));
+		CHECK(s.stats.damaged_regions == 1 && s.stats.skipped_bytes == frames[k].size);
+	}
+
+	// a garbled size in a middle record, off the 8-byte grid: the iterator stops there, recovery walks the grid
+	// to the next marker; the markers in the damaged record's own payload do not fool it.
+	{
+		const uint32_t k = 9;
+		std::string bytes = intact;
+		uint32_t size = uint32_t(frames[k].size + 4);
+		memcpy(&bytes[frames[k].offset + offsetof(record_header, size)], &size, 4);
+		const size_t payload = frames[k].offset + sizeof(record_header);
+		for (size_t at = payload; at + 4 <= frames[k].offset + frames[k].size; at += record_alignment)
+			memcpy(&bytes[at], &record_marker, 4);
+		scan s = scan_file(damaged, bytes);
+		CHECK(s.iterated == sequence(k));
+		CHECK(s.recovered == sequence(count, k));
+		CHECK(s.stats.damaged_regions == 1 && s.stats.skipped_bytes == frames[k].size);
+	}
+
+	// two damaged records, apart: two regions.
+	{
+		std::string bytes = intact;
+		bytes[frames[3].offset] ^= 1;
+		bytes[frames[30].offset + sizeof(record_header)] ^= 1;
+		scan s = scan_file(damaged, bytes);
+		CHECK(s.iterated == sequence(3));
+		CHECK(s.recovered.size() == count - 2 && s.stats.damaged_regions == 2 && s.stats.skipped_bytes == frames[3].size + frames[30].size);
+	}
+
+	std::filesystem::remove_all(dir);
+
+	return test_result();
+}
@@ -0,0 +1,145 @@
+
+#include <diagnostics/telemetry.h>
+
+#include "test-harness.h"
+
+#include <atomic>
+#include <cstring>
+#include <filesystem>
+#include <mutex>
+
+
+// Binary session logs: what the segment writer appends, the memory-mapped reader gives back, field by field,
+// across segment boundaries; `scan_segments()` visits every segment exactly once, from several threads. Returns
+// the number of failed checks.
+
+using namespace diagnostics::binlog;
+
+struct expected_record {
+	record_kind kind;
+	int level;
+	std::string message;
+	std::string section;
+	std::vector<double> args;
+};
+
+static std::vector<expected_record> make_records(size_t count) {
+	std::vector<expected_record> rv;
+	for (size_t i = 0; i < count; i++) {
+		expected_record r;
+		r.kind = i % 5 == 0 ? record_kind::section_push : record_kind::text_line;
+		r.level = int(i % 6);
+		// messages of every length modulo the record alignment, and some empty ones.
+		r.message = i % 7 == 3 ? std::string() : fmt::format("message {} {}", i, std::string(i % 13, 'x'));
+		r.section = i % 3 ? fmt::format("section {}", i / 10) : std::string();
+		for (size_t k = 0; k < i % 4; k++)
+			r.args.push_back(double(i) + k / 8.0);
+		rv.push_back(std::move(r));
+	}
+	return rv;
+}
+
+static bool matches(const record_view &record, const expected_record &r) {
+	const std::span<const double> args = record.args();
+	return record.kind() == r.kind && record.level() == r.level && record.message() == r.message && record.section() == r.section &&
+		args.size() == r.args.size() && std::equal(args.begin(), args.end(), r.args.begin()) &&
+		record.file().ends_with("test-telemetry-segments.cpp") && record.line() > 0 && !record.function().empty() &&
+		reinterpret_cast<uintptr_t>(&record.header()) % record_alignment == 0;
+}
+
+
+#if defined(BUILD_MONOLITHIC)
+#define main diagnostics_test_telemetry_segments_main
+#endif
+
+int main(void) {
+	std::filesystem::path dir = std::filesystem::temp_directory_path() / "libdiag-test-telemetry-segments";
+	std::filesystem::remove_all(dir);
+	std::filesystem::create_directories(dir);
+	const std::string base = (dir / "session").string();
+
+	// segments of about 4 KB: the records spill over a dozen or so of them.
+	const std::vector<expected_record> records = make_records(600);
+	{
+		segment_writer writer;
+		CHECK(writer.open(base, 0x1234, 4096));
+		for (const auto &r : records)
+			CHECK(writer.append(r.kind, r.level, r.message, r.section, r.args));
+		CHECK(writer.segment_index() >= 4);
+		writer.close();
+	}
+	std::vector<std::string> paths;
+	for (uint32_t i = 0; std::filesystem::exists(segment_path(base, i)); i++)
+		paths.push_back(segment_path(base, i));
+	CHECK(paths.size() >= 5);
+
+	// the mapped segments, in order, give back the records in order; the sequence numbers restart per segment.
+	{
+		size_t next = 0;
+		bool ok = true;
+		for (size_t i = 0; i < paths.size(); i++) {
+			mapped_segment segment(paths[i]);
+			CHECK(segment.is_open());
+			if (!segment.is_open())
+				continue;
+			CHECK(segment.header().segment_index == i && segment.header().session_id == 0x1234);
+			uint32_t sequence = 0;
+			for (const record_view &record : segment) {
+				ok = ok && next < records.size() && matches(record, records[next]) && record.sequence() == sequence++ && verify_record_checksum(&record.header());
+				next++;
+			}
+			// a segment is only cut between records.
+			ok = ok && sequence > 0;
+		}
+		CHECK(ok);
+		CHECK(next == records.size());
+	}
+
+	// a segment moves with its mapping.
+	{
+		mapped_segment a(paths[0]);
+		mapped_segment b(std::move(a));
+		CHECK(!a.is_open() && b.is_open() && b.begin() != b.end());
+		a = std::move(b);
+		CHECK(a.is_open() && !b.is_open() && b.begin() == b.end());
+	}
+
+	// the scanning threads take the segments one at a time, until none are left: each is visited once, and a
+	// missing one is counted.
+	{
+		std::vector<std::string> scanned = paths;
+		scanned.insert(scanned.begin() + 2, (dir / "missing.ldseg").string());
+		std::vector<std::atomic<int>> visits(scanned.size());
+		std::vector<size_t> counts(scanned.size(), 0);
+		std::mutex mutex;
+		const size_t failures = scan_segments(scanned, [&](size_t i, const mapped_segment &segment) {
+			size_t n = 0;
+			for (auto it = segment.begin(); it != segment.end(); ++it)
+				n++;
+			visits[i]++;
+			std::lock_guard<std::mutex> lock(mutex);
+			counts[i] = n;
+		}, 4);
+		CHECK(failures == 1);
+		bool once = true;
+		size_t total = 0;
+		for (size_t i = 0; i < scanned.size(); i++) {
+			once = once && visits[i] == (i == 2 ? 0 : 1);
+			total += counts[i];
+		}
+		CHECK(once);
+		CHECK(total == records.size());
+
+		// a single thread does the same.
+		std::atomic<size_t> single{0};
+		CHECK(scan_segments(paths, [&](size_t, const mapped_segment &segment) {
+			for (const record_view &record : segment)
+				single += record.kind() == record_kind::text_line || record.kind() == record_kind::section_push;
+		}, 1) == 0);
+		CHECK(single == records.size());
+	}
+
+	std::filesystem::remove_all(dir);
+
+	return test_result();
+}